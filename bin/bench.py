@@ -0,0 +1,74 @@
+#!/usr/bin/python3
+
+# This script times the debugger on the test stories, feeding each one its
+# recorded transcript, and reports the CPU time of the fastest run. Pass more
+# than one dgdebug binary to compare them, e.g.
+#   bin/bench.py /tmp/dgdebug.before src/dgdebug
+
+import argparse
+import os
+import resource
+import subprocess
+import sys
+from pathlib import Path
+
+
+STORIES = [
+    ('gosling', ['gosling_complete_unicode.dg'], 'gosling.in', ['-s', '1234', '--no-warn-not-topic']),
+    ('impossible', ['ImpossibleStairs.dg', '../../stdlib.dg'], 'impossible.in', ['-s', '1234', '--no-warn-not-topic']),
+    ('cloak-win', ['cloak.dg', 'no-banner.dg', '../../stdlib.dg'], 'win.in', []),
+    ('cloak-lose', ['cloak.dg', 'no-banner.dg', '../../stdlib.dg'], 'lose.in', []),
+    ('unify', ['unify.dg'], None, ['-q']),
+]
+
+STORY_DIRS = {
+    'gosling': 'test/gosling',
+    'impossible': 'test/impossible',
+    'cloak-win': 'test/cloak',
+    'cloak-lose': 'test/cloak',
+    'unify': 'test/bench',
+}
+
+
+def run_once(dgdebug, story):
+    name, sources, transcript, flags = story
+    cwd = Path(STORY_DIRS[name])
+    with open(cwd / transcript if transcript else os.devnull, 'rb') as infile:
+        before = resource.getrusage(resource.RUSAGE_CHILDREN)
+        subprocess.run(
+            [dgdebug] + flags + sources,
+            cwd=cwd,
+            stdin=infile,
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+            check=False)
+        after = resource.getrusage(resource.RUSAGE_CHILDREN)
+        return (after.ru_utime + after.ru_stime) - (before.ru_utime + before.ru_stime)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Time dgdebug on the test stories.')
+    parser.add_argument('dgdebug', nargs='*', default=['src/dgdebug'], help='dgdebug binaries to compare')
+    parser.add_argument('-n', '--runs', type=int, default=10, help='number of runs per story (the fastest is reported)')
+    args = parser.parse_args()
+
+    binaries = [os.path.abspath(b) for b in args.dgdebug]
+    for b in binaries:
+        if not os.access(b, os.X_OK):
+            sys.exit(f'Not an executable: {b}')
+
+    width = max(16, max(len(b) for b in args.dgdebug) + 2)
+    print(f"{'story':<12}" + ''.join(f'{b:>{width}}' for b in args.dgdebug))
+    totals = [0.0] * len(binaries)
+    for story in STORIES:
+        row = f'{story[0]:<12}'
+        for i, b in enumerate(binaries):
+            best = min(run_once(b, story) for _ in range(args.runs))
+            totals[i] += best
+            row += f'{best:>{width - 1}.3f}s'
+        print(row)
+    print(f"{'total':<12}" + ''.join(f'{t:>{width - 1}.3f}s' for t in totals))
+
+
+if __name__ == '__main__':
+    main()
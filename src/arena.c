@@ -5,6 +5,8 @@
 
 #define DEBUG_ALLOCATIONS 0
 
+_Thread_local long arena_bytes_allocated; // for --timings, per thread
+
 void arena_free(struct arena *arena) {
 	struct arena_part *p, *nextp;
 
@@ -27,6 +29,8 @@ void *arena_alloc(struct arena *arena, int size) {
 	char *ptr;
 	struct arena_part *p;
 
+	arena_bytes_allocated += size;
+
 #if DEBUG_ALLOCATIONS
 	p = malloc(sizeof(struct arena_part) - 1 + size);
 	p->size = size;
@@ -10,6 +10,8 @@ struct arena {
 	int			nominal_size;
 };
 
+extern _Thread_local long arena_bytes_allocated;
+
 void arena_init(struct arena *arena, int nominal_size);
 void arena_free(struct arena *arena);
 void *arena_alloc(struct arena *arena, int size);
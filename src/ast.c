@@ -9,23 +9,43 @@
 #include "ast.h"
 #include "report.h"
 
-static unsigned int hashfunc(char *name) {
+static uint32_t hashfunc(char *name) {
+	uint32_t h = 2166136261u;
 	int i;
-	unsigned int h = 0;
 
 	for(i = 0; name[i]; i++) {
-		h += (unsigned) name[i] * (1 + i);
+		h = (h ^ (uint8_t) name[i]) * 16777619u;
 	}
-	h %= WORDBUCKETS;
 	return h;
 }
 
+static void grow_wordhash(struct program *prg) {
+	struct word *w;
+	int i, h;
+
+	free(prg->wordhash);
+	prg->nwordbucket = prg->nwordbucket? prg->nwordbucket * 2 : 1024;
+	prg->wordhash = calloc(prg->nwordbucket, sizeof(struct word *));
+	for(i = 0; i < prg->nword; i++) {
+		w = prg->allwords[i];
+		h = hashfunc(w->name) & (prg->nwordbucket - 1);
+		w->next_in_hash = prg->wordhash[h];
+		prg->wordhash[h] = w;
+	}
+}
+
 struct word *find_word(struct program *prg, char *name) {
-	unsigned int h = hashfunc(name);
+	uint32_t h = hashfunc(name);
 	struct word *w;
 
-	for(w = prg->wordhash[h]; w; w = w->next_in_hash) {
-		if(!strcmp(w->name, name)) return w;
+	if(prg->nwordbucket) {
+		for(w = prg->wordhash[h & (prg->nwordbucket - 1)]; w; w = w->next_in_hash) {
+			if(!strcmp(w->name, name)) return w;
+		}
+	}
+
+	if(prg->nword >= prg->nwordbucket) {
+		grow_wordhash(prg);
 	}
 
 	w = arena_calloc(&prg->arena, sizeof(*w));
@@ -36,6 +56,7 @@ struct word *find_word(struct program *prg, char *name) {
 		prg->allwords = realloc(prg->allwords, prg->nalloc_word * sizeof(struct word *));
 	}
 	prg->allwords[w->word_id] = w;
+	h &= prg->nwordbucket - 1;
 	w->next_in_hash = prg->wordhash[h];
 	prg->wordhash[h] = w;
 
@@ -43,11 +64,12 @@ struct word *find_word(struct program *prg, char *name) {
 }
 
 struct word *find_word_nocreate(struct program *prg, char *name) {
-	unsigned int h = hashfunc(name);
 	struct word *w;
 
-	for(w = prg->wordhash[h]; w; w = w->next_in_hash) {
-		if(!strcmp(w->name, name)) return w;
+	if(prg->nwordbucket) {
+		for(w = prg->wordhash[hashfunc(name) & (prg->nwordbucket - 1)]; w; w = w->next_in_hash) {
+			if(!strcmp(w->name, name)) return w;
+		}
 	}
 
 	return 0;
@@ -91,7 +113,6 @@ void pred_clear(struct predname *predname) {
 
 	predname->pred = calloc(1, sizeof(struct predicate));
 	predname->pred->refcount = 1;
-	predname->total_refcount++;
 	arena_init(&predname->pred->arena, 4096);
 
 	predname->pred->normal_entry = -1;
@@ -103,17 +124,45 @@ void pred_clear(struct predname *predname) {
 	predname->pred->predname = predname;
 }
 
+static uint32_t predhashfunc(int nword, struct word **words) {
+	uint32_t h = 2166136261u ^ nword;
+	int i;
+
+	for(i = 0; i < nword; i++) {
+		h = (h ^ (words[i]? words[i]->word_id : 0xfffffff)) * 16777619u;
+	}
+	return h;
+}
+
+static void grow_predhash(struct program *prg) {
+	struct predname *predname;
+	int i, h;
+
+	free(prg->predhash);
+	prg->npredbucket = prg->npredbucket? prg->npredbucket * 2 : 512;
+	prg->predhash = calloc(prg->npredbucket, sizeof(struct predname *));
+	for(i = 0; i < prg->npredicate; i++) {
+		predname = prg->predicates[i];
+		h = predhashfunc(predname->nword, predname->words) & (prg->npredbucket - 1);
+		predname->next_in_hash = prg->predhash[h];
+		prg->predhash[h] = predname;
+	}
+}
+
 struct predname *find_predicate(struct program *prg, int nword, struct word **words) {
 	int i, j, len;
+	uint32_t h = predhashfunc(nword, words);
 	struct predname *predname;
 
-	for(i = 0; i < prg->npredicate; i++) {
-		if(prg->predicates[i]->nword == nword) {
-			for(j = 0; j < nword; j++) {
-				if(prg->predicates[i]->words[j] != words[j]) break;
-			}
-			if(j == nword) {
-				return prg->predicates[i];
+	if(prg->npredbucket) {
+		for(predname = prg->predhash[h & (prg->npredbucket - 1)]; predname; predname = predname->next_in_hash) {
+			if(predname->nword == nword) {
+				for(j = 0; j < nword; j++) {
+					if(predname->words[j] != words[j]) break;
+				}
+				if(j == nword) {
+					return predname;
+				}
 			}
 		}
 	}
@@ -155,9 +204,20 @@ struct predname *find_predicate(struct program *prg, int nword, struct word **wo
 
 	pred_clear(predname);
 
-	prg->predicates = realloc(prg->predicates, (prg->npredicate + 1) * sizeof(struct predname *));
+	if(prg->npredicate >= prg->nalloc_predicate) {
+		prg->nalloc_predicate = prg->npredicate * 2 + 64;
+		prg->predicates = realloc(prg->predicates, prg->nalloc_predicate * sizeof(struct predname *));
+	}
 	prg->predicates[prg->npredicate++] = predname;
 
+	if(prg->npredicate > prg->npredbucket) {
+		grow_predhash(prg);
+	} else {
+		h &= prg->npredbucket - 1;
+		predname->next_in_hash = prg->predhash[h];
+		prg->predhash[h] = predname;
+	}
+
 	return predname;
 }
 
@@ -670,42 +730,82 @@ struct program *new_program() {
 	return prg;
 }
 
+static void pred_free(struct predicate *pred) {
+	arena_free(&pred->arena);
+	free(pred->dynamic);
+	free(pred->clauses);
+	free(pred->macrodefs);
+	free(pred->wordmaps);
+	free(pred);
+}
+
+// Only the predicate names hold counted references to their implementations.
+// The evaluator refers to predicates from its frames without counting, so an
+// implementation that is replaced (e.g. when the debugger recompiles the
+// program) is retired rather than freed, since the frames may still use it.
+
 void pred_claim(struct predicate *pred) {
 	if(pred) {
 		assert(pred->refcount);
 		pred->refcount++;
-		pred->predname->total_refcount++;
 	}
 }
 
 void pred_release(struct predicate *pred) {
-	if(pred) {
-		pred->predname->total_refcount--;
-		if(!--pred->refcount) {
-			arena_free(&pred->arena);
-			free(pred->dynamic);
-			free(pred->clauses);
-			free(pred->macrodefs);
-			free(pred->wordmaps);
-			free(pred);
+	if(pred && !--pred->refcount) {
+		pred->next_retired = pred->predname->retired;
+		pred->predname->retired = pred;
+	}
+}
+
+int pred_any_retired(struct program *prg) {
+	int i;
+
+	for(i = 0; i < prg->npredicate; i++) {
+		if(prg->predicates[i]->retired) return 1;
+	}
+
+	return 0;
+}
+
+// Retired predicates are reclaimed at a quiescent point, when no evaluator is
+// running. The caller advances prg->pred_epoch, stamps every predicate that is
+// still referenced from a surviving evaluator state with the new epoch (see
+// eval_mark_predicates), and then calls this function to free the rest.
+
+void pred_reclaim(struct program *prg) {
+	struct predicate *pred, **ptr;
+	int i;
+
+	for(i = 0; i < prg->npredicate; i++) {
+		ptr = &prg->predicates[i]->retired;
+		while((pred = *ptr)) {
+			if(pred->epoch == prg->pred_epoch) {
+				ptr = &pred->next_retired;
+			} else {
+				*ptr = pred->next_retired;
+				pred_free(pred);
+			}
 		}
 	}
 }
 
 void free_program(struct program *prg) {
+	struct predicate *pred;
 	int i;
 
 	for(i = 0; i < prg->npredicate; i++) {
 		pred_release(prg->predicates[i]->old_pred);
 		pred_release(prg->predicates[i]->pred);
-		if(prg->predicates[i]->total_refcount) {
-			report(LVL_WARN, 0, "Internal compiler error: %s has %d remaining reference(s)",
-				prg->predicates[i]->printed_name,
-				prg->predicates[i]->total_refcount);
+		while((pred = prg->predicates[i]->retired)) {
+			prg->predicates[i]->retired = pred->next_retired;
+			pred_free(pred);
 		}
 		free(prg->predicates[i]->fixedvalues);
 	}
 	free(prg->predicates);
+	free(prg->predhash);
+	free(prg->wordhash);
 	free(prg->allwords);
 	free(prg->worldobjnames);
 	free(prg->dictwordnames);
@@ -214,14 +214,16 @@ struct astnode {
 	struct predname		*predicate;
 
 	uint8_t			unbound;	// set if this expression can contain unbound variable(s) at runtime
+	uint8_t			closure;	// set on the pair that a closure expression evaluates to
 };
 
 struct clause_code {
 	struct clause_code	*next;
-	int16_t			ndrop_arg0;
+	int16_t			ndrop_arg;
 	int16_t			ndrop_body;
 	int			routine_id:31;
-	int			ignore_arg0:1;
+	int			ignore_arg:1;
+	uint8_t			argno;
 };
 
 struct clause {
@@ -243,6 +245,7 @@ struct clause {
 };
 
 struct predname {
+	struct predname		*next_in_hash;
 	uint16_t		pred_id;
 	uint16_t		arity;
 	uint16_t		nword;
@@ -257,7 +260,7 @@ struct predname {
 	uint16_t		builtin;
 	uint16_t		dyn_id;		// global flags, per-object flags, per-object variables
 	uint16_t		dyn_var_id;	// global variables
-	int			total_refcount;
+	struct predicate	*retired;	// old implementations, see pred_reclaim
 };
 
 #define DYN_NONE		0xffff
@@ -291,7 +294,9 @@ struct predicate {
 	struct predlist		*callers;
 	struct dynamic		*dynamic;
 	line_t			invoked_at_line;
-	int			refcount;
+	int			refcount;	// owners, i.e. predname->pred and old_pred
+	int			epoch;		// last epoch in which it was in use
+	struct predicate	*next_retired;
 	struct comp_routine	*routines;
 	struct arena		arena;
 	int			normal_entry;
@@ -300,6 +305,8 @@ struct predicate {
 	struct clause		*iface_decl;
 	uint16_t		iface_bound_in;
 	uint16_t		iface_bound_out;
+	struct predname		**variants;	// copies compiled for narrower unbound_in
+	uint16_t		nvariant;
 };
 
 #define PREDF_MACRO			0x00000001
@@ -324,6 +331,8 @@ struct predicate {
 #define PREDF_MIGHT_STOP		0x00100000
 #define PREDF_MAY_INLINE		0x00200000
 #define PREDF_MENTIONED_IN_QUERY	0x00400000
+#define PREDF_SEMIDET			0x00800000	// succeeds at most once, leaving no choice points
+#define PREDF_SEMIDET_BOUND		0x01000000	// likewise, when called with a bound first argument
 
 #define PREDF_INVOKED (PREDF_INVOKED_NORMALLY | PREDF_INVOKED_FOR_WORDS | PREDF_INVOKED_BY_PROGRAM | PREDF_INVOKED_BY_DEBUGGER)
 
@@ -393,13 +402,14 @@ struct extresource {
 	line_t			line;
 };
 
-#define WORDBUCKETS 1024
-
 typedef void (*program_ticker_t)();
 
 struct program {
 	struct arena		arena;
-	struct word		*wordhash[WORDBUCKETS];
+	struct word		**wordhash;
+	int			nwordbucket;	// power of two
+	struct predname		**predhash;	// keyed on the words of the name
+	int			npredbucket;	// power of two
 	int			nextfresh;
 	struct predname		**predicates;
 	struct word		**allwords;
@@ -418,6 +428,7 @@ struct program {
 	int			did_warn_about_repeat; // prevent multiple warnings
 	int			nword;
 	int			npredicate;
+	int			nalloc_predicate;
 	int			nworldobj;
 	int			ndictword;
 	int			nboxclass;
@@ -452,6 +463,9 @@ struct program {
 	uint16_t		max_temp;
 	uint8_t			reported_violations;
 	int				topic_warning_level; // WARN_*
+	char			*cachedir;	// for library images, or null
+	struct codecache	*codecache;	// kept by the debugger between compilations, or null
+	int			pred_epoch;
 };
 
 #define WARN_DEFAULT	0
@@ -466,6 +480,9 @@ struct program {
 #define OPTF_NO_LINKS		0x00000020
 #define OPTF_NO_LOG		0x00000040
 #define OPTF_INLINE		0x00000080
+#define OPTF_MODE_VARIANTS	0x00000100
+#define OPTF_JUMP_TABLES	0x00000200
+#define OPTF_FOLD_QUERIES	0x00000400
 
 typedef void (*word_visitor_t)(struct word *);
 
@@ -495,3 +512,5 @@ void free_program(struct program *prg);
 void create_worldobj(struct program *prg, struct word *w);
 void pred_claim(struct predicate *pred);
 void pred_release(struct predicate *pred);
+int pred_any_retired(struct program *prg);
+void pred_reclaim(struct program *prg);
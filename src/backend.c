@@ -15,6 +15,7 @@
 #include "report.h"
 #include "ifid.h"
 #include "output.h"
+#include "stats.h"
 
 static struct arena backend_arena;
 
@@ -84,6 +85,8 @@ void usage(char *prgname) {
 	fprintf(stderr, "--warn-not-topic        Always warn about objects not used as topics.\n");
 	fprintf(stderr, "--no-warn-not-topic     Never warn about objects not used as topics.\n");
 	fprintf(stderr, "--override-serial       Override serial number for reproducible builds.\n");
+	fprintf(stderr, "--cache           -C    Keep parsed source files in this directory, to load faster.\n");
+	stats_usage();
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Only for z5, z8, or zblorb format:\n");
 	fprintf(stderr, "\n");
@@ -128,6 +131,8 @@ int main(int argc, char **argv) {
 		{"no-warn-not-topic", 0, &topic_warning_level, WARN_NEVER},
 		{"optimize-alphabet", 0, &zmachine_optimize_alphabet, 1},
 		{"override-serial", 1, &serial_overridden, 2},
+		{"cache", 1, 0, 'C'},
+		STATS_LONGOPTS,
 		{0, 0, 0, 0}
 	};
 
@@ -138,6 +143,7 @@ int main(int argc, char **argv) {
 	char *coveralt = 0;
 	char *resdir = 0;
 	char *override_serial_with = 0;
+	char *cachedir = 0;
 	uint8_t *wordseps = 0;
 	int auxsize = 500, heapsize = 1000, ltssize = 500;
 	int strip = 0;
@@ -153,7 +159,7 @@ int main(int argc, char **argv) {
 	comp_init();
 
 	do {
-		opt = getopt_long(argc, argv, "?hVvo:t:r:c:a:W:H:A:L:s", longopts, 0);
+		opt = getopt_long(argc, argv, "?hVvo:t:r:c:a:W:H:A:L:sC:", longopts, 0);
 		switch(opt) {
 			case 0:
 				if(serial_overridden == 2) { // Long-only option with arg
@@ -213,8 +219,11 @@ int main(int argc, char **argv) {
 			case 's':
 				strip = 1;
 				break;
+			case 'C':
+				cachedir = strdup(optarg);
+				break;
 			default:
-				if(opt >= 0) {
+				if(opt >= 0 && !stats_option(opt, optarg)) {
 					report(LVL_ERR, 0, "Unimplemented option '%c'", opt);
 					exit(1);
 				}
@@ -265,11 +274,14 @@ int main(int argc, char **argv) {
 
 	prg = new_program();
 	prg->topic_warning_level = topic_warning_level;
+	prg->cachedir = cachedir;
 	frontend_add_builtins(prg);
 	prg->optflags |= OPTF_BOUND_PARAMS | OPTF_TAIL_CALLS | OPTF_ENV_FRAMES;
-	prg->optflags |= OPTF_SIMPLE_SELECT | OPTF_NO_LOG | OPTF_INLINE;
+	prg->optflags |= OPTF_SIMPLE_SELECT | OPTF_NO_LOG | OPTF_INLINE | OPTF_MODE_VARIANTS;
+	prg->optflags |= OPTF_FOLD_QUERIES;
 	if(!aamachine) {
 		prg->optflags |= OPTF_NO_LINKS;
+		prg->optflags |= OPTF_JUMP_TABLES;
 	}
 	prg->optflags |= OPTF_NO_TRACE; // This gets cleared by the frontend if (trace on) is reachable.
 	if(aamachine) {
@@ -368,11 +380,14 @@ int main(int argc, char **argv) {
 	prg->meta_serial = arena_strdup(&prg->arena, compiletime_buf);
 	prg->meta_reldate = arena_strdup(&prg->arena, reldate_buf);
 
+	stats_begin(aamachine? "backend_aa" : "backend_z");
 	if(aamachine) {
 		backend_aa(outname, format, coverfname, coveralt, heapsize, auxsize, ltssize, strip, prg, &backend_arena, resdir);
 	} else {
 		backend_z(outname, format, coverfname, coveralt, heapsize, auxsize, ltssize, strip, prg, &backend_arena);
 	}
+	stats_end(prg->npredicate);
+	stats_report(prg);
 
 	free_program(prg);
 	arena_free(&backend_arena);
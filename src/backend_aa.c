@@ -771,6 +771,30 @@ static aaoper_t encode_dest(value_t v, struct program *prg, int unify) {
 	}
 }
 
+static int is_register_value(value_t v) {
+	return
+		v.tag == OPER_VAR ||
+		v.tag == OPER_TEMP ||
+		v.tag == OPER_ARG ||
+		v.tag == VAL_NIL;
+}
+
+// The tail operand of AA_MAKE_PAIR_D is a destination, so a constant tail,
+// as in [1 | 2], is loaded into REG_TMP first.
+
+static aaoper_t encode_pair_tail(value_t v, struct program *prg) {
+	struct aainstr *ai;
+
+	if(is_register_value(v)) {
+		return encode_dest(v, prg, 1);
+	} else {
+		ai = add_instr(AA_ASSIGN);
+		ai->oper[0] = encode_value(v, prg);
+		ai->oper[1] = (aaoper_t) {AAO_STORE_REG, REG_TMP};
+		return (aaoper_t) {AAO_REG, REG_TMP};
+	}
+}
+
 static void end_segment() {
 	if(nsegment >= nalloc_segment) {
 		nalloc_segment = nalloc_segment * 2 + 8;
@@ -1802,9 +1826,10 @@ static void compile_routines(struct program *prg, struct predicate *pred, int fi
 				break;
 			case I_GET_PAIR_RV:
 			case I_MAKE_PAIR_RV:
+				aao = encode_pair_tail(ci->oper[2], prg);
 				ai = add_instr(AA_MAKE_PAIR_D);
 				ai->oper[0] = encode_dest(ci->oper[1], prg, 0);
-				ai->oper[1] = encode_dest(ci->oper[2], prg, 1);
+				ai->oper[1] = aao;
 				ai->oper[2] = encode_dest(ci->oper[0], prg, ci->op == I_GET_PAIR_RV);
 				break;
 			case I_GET_PAIR_VR:
@@ -1829,6 +1854,7 @@ static void compile_routines(struct program *prg, struct predicate *pred, int fi
 				break;
 			case I_GET_PAIR_VV:
 			case I_MAKE_PAIR_VV:
+				aao = encode_pair_tail(ci->oper[2], prg);
 				if(ci->oper[1].tag == OPER_VAR
 				|| ci->oper[1].tag == OPER_TEMP
 				|| ci->oper[1].tag == OPER_ARG
@@ -1844,7 +1870,7 @@ static void compile_routines(struct program *prg, struct predicate *pred, int fi
 						ai->oper[0] = (aaoper_t) {AAO_VWORD, tag_eval_value(ci->oper[1], prg)};
 					}
 				}
-				ai->oper[1] = encode_dest(ci->oper[2], prg, 1);
+				ai->oper[1] = aao;
 				ai->oper[2] = encode_dest(ci->oper[0], prg, ci->op == I_GET_PAIR_VV);
 				break;
 			case I_IF_BOUND:
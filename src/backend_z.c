@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +20,7 @@
 #include "blorb.h"
 #include "backend_z.h"
 #include "unicode.h"
+#include "pool.h"
 
 #include "abbrevs.inc" // This one is weird: it's definitions, not just declarations, but it's meant to be incorporated into this .c file
 // The only reason it gets its own file is because it's automatically generated by a tool at the moment
@@ -83,6 +86,54 @@ struct wordtable {
 	uint16_t		*words;
 };
 
+struct jumptable {
+	uint16_t		label;
+	uint16_t		length;
+	uint16_t		*entries;	// 0x8000 | routine number, or 0 for no match
+};
+
+// Code for the predicates is generated in parallel, with one context per
+// predicate. Global labels made in a context are provisional, numbered from
+// zgen_label0 and up, and the strings and tables they refer to are kept in
+// the context. Afterwards, the contexts are merged in predicate order, and
+// every provisional label is replaced by the label that a serial compilation
+// would have made. Hence the story file doesn't depend on the thread count.
+
+enum {
+	ZGEN_STRING,
+	ZGEN_DATATABLE,
+	ZGEN_WORDTABLE,
+	ZGEN_JUMPTABLE
+};
+
+struct zgen_label {
+	uint8_t			kind;
+	int			index;		// into the local table of that kind
+};
+
+struct zgen_context {
+	uint16_t		*rlabel;	// routine labels, made in advance
+	struct zgen_label	*labels;
+	int			nlabel;
+	int			nalloc_label;
+	struct global_string	**stringhash;
+	struct global_string	**strings;
+	int			nstring;
+	struct datatable	*datatable;
+	int			ndatatable;
+	struct wordtable	*wordtable;
+	int			nwordtable;
+	struct jumptable	*jumptable;
+	int			njumptable;
+	int			max_temp;
+	int			invisible_span;	// box class of the first invisible span, or -1
+	char			*fatal;		// error message
+	jmp_buf			fatal_jmp;
+};
+
+static int zgen_label0;
+static _Thread_local struct zgen_context *zctx;
+
 static int warned_about_invisible_spans = 0; // To avoid a flood of warnings
 
 static int preserve_zscii = ZSCII_EXTEND; // See backend_z.h for meanings: EXTEND, DONT_EXTEND, or REPLACE
@@ -134,7 +185,7 @@ static int next_global_label = G_FIRST_FREE, nalloc_global_label;
 
 static struct global_string *stringhash[BUCKETS];
 
-static int next_temp, max_temp = 0;
+static _Thread_local int next_temp, max_temp = 0;
 
 static int next_user_global = 0, user_global_base, user_flags_global, next_user_flag = 0;
 static int next_flag = 0;
@@ -155,6 +206,9 @@ static int ndatatable;
 static struct wordtable *wordtable;
 static int nwordtable;
 
+static struct jumptable *jumptable;
+static int njumptable;
+
 static struct backend_wobj *backendwobj;
 
 static uint8_t unicode_to_zscii(uint16_t, const char*);
@@ -198,6 +252,20 @@ uint16_t make_global_label() {
 	return lab;
 }
 
+static uint16_t make_local_label(int kind, int index) {
+	struct zgen_context *c = zctx;
+
+	assert(zgen_label0 + c->nlabel < 0x10000);
+	if(c->nlabel >= c->nalloc_label) {
+		c->nalloc_label = (c->nlabel * 2) + 8;
+		c->labels = realloc(c->labels, c->nalloc_label * sizeof(struct zgen_label));
+	}
+	c->labels[c->nlabel].kind = kind;
+	c->labels[c->nlabel].index = index;
+
+	return zgen_label0 + c->nlabel++;
+}
+
 uint16_t f_make_routine_labels(int n, int line) {
 	int i;
 
@@ -216,6 +284,31 @@ uint16_t f_make_routine_labels(int n, int line) {
 #define make_routine_label() f_make_routine_labels(1, __LINE__)
 #define make_routine_labels(n) f_make_routine_labels(n, __LINE__)
 
+// Reports an error and exits. In a worker thread, the message is kept in the
+// context instead, and reported when the contexts are merged.
+
+static void zgen_fatal(char *fmt, ...) {
+	va_list valist;
+	char *msg;
+	int n;
+
+	va_start(valist, fmt);
+	n = vsnprintf(0, 0, fmt, valist);
+	va_end(valist);
+	msg = malloc(n + 1);
+	va_start(valist, fmt);
+	vsnprintf(msg, n + 1, fmt, valist);
+	va_end(valist);
+
+	if(zctx) {
+		zctx->fatal = msg;
+		longjmp(zctx->fatal_jmp, 1);
+	}
+
+	report(LVL_ERR, 0, "%s", msg);
+	exit(1);
+}
+
 uint32_t hashbytes(uint8_t *data, int n) {
 	int i;
 	uint32_t h = 0;
@@ -380,8 +473,7 @@ static int utf8_to_zscii(uint8_t *dest, int ndest, char *src, uint32_t *special,
 			while(nbyte--) {
 				ch = src[inpos++];
 				if((ch & 0xc0) != 0x80) {
-					report(LVL_ERR, 0, "Invalid UTF-8 sequence in source code file. ('%s')", src);
-					exit(1);
+					zgen_fatal("Invalid UTF-8 sequence in source code file. ('%s')", src);
 				}
 				uchar <<= 6;
 				uchar |= ch & 0x3f;
@@ -394,10 +486,9 @@ static int utf8_to_zscii(uint8_t *dest, int ndest, char *src, uint32_t *special,
 				uchar += 129 - 16;
 			}
 			dest[outpos++] = uchar;
-			dict_frequencies[uchar] ++;
+			if(for_dictionary) dict_frequencies[uchar] ++;
 		} else if(uchar > 0xFFFF) {
-			report(LVL_ERR, 0, "Character U+%06x is outside the Basic Multilingual Plane, which the Z-machine does not support.", uchar);
-			exit(1);
+			zgen_fatal("Character U+%06x is outside the Basic Multilingual Plane, which the Z-machine does not support.", uchar);
 		} else {
 			for(i = 0; i < n_extended; i++) {
 				if(extended_zscii[i] == uchar) break;
@@ -412,7 +503,7 @@ static int utf8_to_zscii(uint8_t *dest, int ndest, char *src, uint32_t *special,
 				}
 			} else { // Already exists in the encoding
 				dest[outpos++] = EXTENDED_ZSCII_BASE + i;
-				dict_frequencies[EXTENDED_ZSCII_BASE + i] ++;
+				if(for_dictionary) dict_frequencies[EXTENDED_ZSCII_BASE + i] ++;
 			}
 		}
 	}
@@ -568,10 +659,21 @@ int pack_pentets(uint16_t *dest, uint8_t *pentets, int n) {
 	return count;
 }
 
+static struct global_string *lookup_string(struct global_string *gs, uint8_t *zscii, int nchar) {
+	for(; gs; gs = gs->next) {
+		if(gs->nchar == nchar
+		&& !memcmp(gs->zscii, zscii, nchar)) {
+			break;
+		}
+	}
+
+	return gs;
+}
+
 struct global_string *find_global_string(uint8_t *zscii) {
 	int i;
 	uint32_t h = 0;
-	struct global_string *gs;
+	struct global_string *gs, **hash = stringhash;
 
 	for(i = 0; zscii[i]; i++) {
 		if(h & 1) {
@@ -584,21 +686,34 @@ struct global_string *find_global_string(uint8_t *zscii) {
 
 	h &= BUCKETS - 1;
 
-	for(gs = stringhash[h]; gs; gs = gs->next) {
-		if(gs->nchar == i
-		&& !memcmp(gs->zscii, zscii, i)) {
+	if((gs = lookup_string(stringhash[h], zscii, i))) {
+		return gs;
+	}
+
+	if(zctx) {
+		if(!zctx->stringhash) {
+			zctx->stringhash = calloc(BUCKETS, sizeof(struct global_string *));
+		}
+		hash = zctx->stringhash;
+		if((gs = lookup_string(hash[h], zscii, i))) {
 			return gs;
 		}
 	}
 
 	gs = malloc(sizeof(*gs));
-	gs->next = stringhash[h];
-	stringhash[h] = gs;
+	gs->next = hash[h];
+	hash[h] = gs;
 	gs->nchar = i;
 	gs->zscii = malloc(i + 1);
 	memcpy(gs->zscii, zscii, i);
 	gs->zscii[i] = 0;
-	gs->global_label = make_global_label();
+	if(zctx) {
+		zctx->strings = realloc(zctx->strings, (zctx->nstring + 1) * sizeof(struct global_string *));
+		zctx->strings[zctx->nstring] = gs;
+		gs->global_label = make_local_label(ZGEN_STRING, zctx->nstring++);
+	} else {
+		gs->global_label = make_global_label();
+	}
 
 	return gs;
 }
@@ -1539,8 +1654,7 @@ void compile_trace_output(struct predname *predname, uint16_t label) {
 				buf[bufpos] = 0;
 				utf8_to_zscii(zbuf, sizeof(zbuf), buf, &uchar, 0);
 				if(uchar) {
-					report(LVL_ERR, 0, "Unsupported character U+%04x in part of predicate name %s", uchar, predname->printed_name);
-					exit(1);
+					zgen_fatal("Unsupported character U+%04x in part of predicate name %s", uchar, predname->printed_name);
 				}
 				lab = find_global_string(zbuf)->global_label;
 				zi = append_instr(r, Z_PRINTPADDR);
@@ -1561,8 +1675,7 @@ void compile_trace_output(struct predname *predname, uint16_t label) {
 		buf[bufpos] = 0;
 		utf8_to_zscii(zbuf, sizeof(zbuf), buf, &uchar, 0);
 		if(uchar) {
-			report(LVL_ERR, 0, "Unsupported character U+%04x in part of predicate name %s", uchar, predname->printed_name);
-			exit(1);
+			zgen_fatal("Unsupported character U+%04x in part of predicate name %s", uchar, predname->printed_name);
 		}
 		lab = find_global_string(zbuf)->global_label;
 		zi = append_instr(r, Z_PRINTPADDR);
@@ -1877,6 +1990,143 @@ static void generate_index(
 	binary_search(table, ninstr, r, endlab);
 }
 
+static int find_datatable(struct datatable *table, int ntable, uint8_t *data, int len) {
+	int i;
+
+	for(i = 0; i < ntable; i++) {
+		if(table[i].length == len
+		&& !memcmp(table[i].data, data, len)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int find_wordtable(struct wordtable *table, int ntable, uint16_t *words, int len) {
+	int i;
+
+	for(i = 0; i < ntable; i++) {
+		if(table[i].length == len
+		&& !memcmp(table[i].words, words, len * sizeof(uint16_t))) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// The add_ functions put a new table in the current context, or in the global
+// tables if there is none, and return its label.
+
+static uint16_t add_datatable(uint8_t *data, int len) {
+	struct datatable **table = zctx? &zctx->datatable : &datatable;
+	int *ntable = zctx? &zctx->ndatatable : &ndatatable;
+	int id = (*ntable)++;
+
+	*table = realloc(*table, *ntable * sizeof(struct datatable));
+	(*table)[id].label = zctx? make_local_label(ZGEN_DATATABLE, id) : make_global_label();
+	(*table)[id].length = len;
+	(*table)[id].data = malloc(len);
+	memcpy((*table)[id].data, data, len);
+
+	return (*table)[id].label;
+}
+
+static uint16_t add_wordtable(uint16_t *words, int len) {
+	struct wordtable **table = zctx? &zctx->wordtable : &wordtable;
+	int *ntable = zctx? &zctx->nwordtable : &nwordtable;
+	int id = (*ntable)++;
+
+	*table = realloc(*table, *ntable * sizeof(struct wordtable));
+	(*table)[id].label = zctx? make_local_label(ZGEN_WORDTABLE, id) : make_global_label();
+	(*table)[id].length = len;
+	(*table)[id].words = malloc(len * sizeof(uint16_t));
+	memcpy((*table)[id].words, words, len * sizeof(uint16_t));
+
+	return (*table)[id].label;
+}
+
+static uint16_t add_jumptable(uint16_t *entries, int len) {
+	struct jumptable **table = zctx? &zctx->jumptable : &jumptable;
+	int *ntable = zctx? &zctx->njumptable : &njumptable;
+	int id = (*ntable)++;
+
+	*table = realloc(*table, *ntable * sizeof(struct jumptable));
+	(*table)[id].label = zctx? make_local_label(ZGEN_JUMPTABLE, id) : make_global_label();
+	(*table)[id].length = len;
+	(*table)[id].entries = entries;
+
+	return (*table)[id].label;
+}
+
+// Dense indexes are dispatched through a table of routine addresses, indexed by
+// the key. The targets have been kept as separate routines by the compiler.
+static void generate_jumptable(
+	struct program *prg,
+	struct predicate *pred,
+	struct cinstr *instr,
+	int ninstr,
+	struct routine *r,
+	uint16_t *rlabel,
+	uint16_t endlab)
+{
+	uint16_t min, max, key, label;
+	uint16_t *entries;
+	int i;
+	struct zinstr *zi;
+
+	min = max = tag_eval_value(instr[0].oper[0], prg);
+	for(i = 1; i < ninstr; i++) {
+		key = tag_eval_value(instr[i].oper[0], prg);
+		if(min > key) min = key;
+		if(max < key) max = key;
+	}
+
+	entries = calloc(max - min + 1, sizeof(uint16_t));
+	for(i = 0; i < ninstr; i++) {
+		key = tag_eval_value(instr[i].oper[0], prg) - min;
+		if(!entries[key]) {
+			if(instr[i].oper[1].tag == OPER_FAIL) {
+				if(endlab != RFALSE) {
+					entries[key] = 0x8000 | R_FAIL_PRED;
+				}
+			} else {
+				assert(instr[i].oper[1].tag == OPER_RLAB);
+				assert(pred->routines[instr[i].oper[1].value].reftrack == instr[i].oper[1].value);
+				entries[key] = 0x8000 | rlabel[instr[i].oper[1].value];
+			}
+		}
+	}
+
+	label = add_jumptable(entries, max - min + 1);
+
+	// Tagged values with the high bit set are references or pairs, and fail the signed comparison.
+	zi = append_instr(r, Z_JL);
+	zi->oper[0] = VALUE(REG_IDX);
+	zi->oper[1] = SMALL_OR_LARGE(min);
+	zi->branch = endlab;
+	zi = append_instr(r, Z_JG);
+	zi->oper[0] = VALUE(REG_IDX);
+	zi->oper[1] = SMALL_OR_LARGE(max);
+	zi->branch = endlab;
+	zi = append_instr(r, Z_SUB);
+	zi->oper[0] = VALUE(REG_IDX);
+	zi->oper[1] = SMALL_OR_LARGE(min);
+	zi->store = REG_TEMP;
+	zi = append_instr(r, Z_LOADW);
+	zi->oper[0] = REF(label);
+	zi->oper[1] = VALUE(REG_TEMP);
+	zi->store = REG_TEMP;
+	if(endlab != RFALSE) {
+		zi = append_instr(r, Z_JZ);
+		zi->oper[0] = VALUE(REG_TEMP);
+		zi->branch = endlab;
+	}
+	zi = append_instr(r, Z_RET);
+	zi->oper[0] = VALUE(REG_TEMP);
+}
+
 static void generate_proceed(struct routine *r, int query_kind) {
 	uint16_t ll;
 	struct zinstr *zi;
@@ -1900,8 +2150,9 @@ static void generate_proceed(struct routine *r, int query_kind) {
 }
 
 // Take a wordmap from the compiler and encode it into our backend-specific wordtables and datatables
-static int generate_wordmap(struct wordmap *map, int *nptr) {
+static uint16_t generate_wordmap(struct wordmap *map, int *nptr) {
 	int n, j, k, id, len;
+	uint16_t label;
 	uint8_t data[1 + 2 * MAXWORDMAP];
 	uint16_t words[map->nmap * 2];
 
@@ -1928,36 +2179,35 @@ static int generate_wordmap(struct wordmap *map, int *nptr) {
 				}
 			}
 			data[0] = len - 1;
-			for(k = 0; k < ndatatable; k++) { // See if any datatable contains exactly this set of objects already (e.g. if there's a set of objects that has several shared synonyms)
-				if(datatable[k].length == len
-				&& !memcmp(datatable[k].data, data, len)) {
-					break;
-				}
+			// See if any datatable contains exactly this set of objects already (e.g. if there's a set of objects that has several shared synonyms)
+			if((k = find_datatable(datatable, ndatatable, data, len)) >= 0) {
+				label = datatable[k].label;
+			} else if(zctx && (k = find_datatable(zctx->datatable, zctx->ndatatable, data, len)) >= 0) {
+				label = zctx->datatable[k].label;
+			} else { // If not, make a new datatable to hold it
+				label = add_datatable(data, len);
 			}
-			if(k == ndatatable) { // If not, make a new datatable to hold it
-				datatable = realloc(datatable, ++ndatatable * sizeof(*datatable));
-				datatable[k].label = make_global_label();
-				datatable[k].length = len;
-				datatable[k].data = malloc(len);
-				memcpy(datatable[k].data, data, len);
-			}
-			words[2 * j + 1] = 0x8000 | datatable[k].label; // We set the high bit of the word to indicate that this is a pointer instead of a world object ID
+			words[2 * j + 1] = 0x8000 | label; // We set the high bit of the word to indicate that this is a pointer instead of a world object ID
 		}
 	}
-	for(j = 0; j < nwordtable; j++) { // See if any wordtable contains exactly this set of word-to-object mappings already - we call generate_wordmap every time we encounter an I_CHECK_WORDMAP instruction, which means it could happen several times under the same circumstances
-		if(wordtable[j].length == n * 2
-		&& !memcmp(wordtable[j].words, words, n * 2 * sizeof(uint16_t))) {
-			break;
-		}
+	// See if any wordtable contains exactly this set of word-to-object mappings already - we call generate_wordmap every time we encounter an I_CHECK_WORDMAP instruction, which means it could happen several times under the same circumstances
+	if((k = find_wordtable(wordtable, nwordtable, words, n * 2)) >= 0) {
+		return wordtable[k].label;
+	} else if(zctx && (k = find_wordtable(zctx->wordtable, zctx->nwordtable, words, n * 2)) >= 0) {
+		return zctx->wordtable[k].label;
+	} else { // If not, make a new wordtable to hold it
+		return add_wordtable(words, n * 2);
 	}
-	if(j == nwordtable) { // If not, make a new wordtable to hold it
-		wordtable = realloc(wordtable, ++nwordtable * sizeof(*wordtable));
-		wordtable[j].label = make_global_label();
-		wordtable[j].length = n * 2;
-		wordtable[j].words = malloc(n * 2 * sizeof(uint16_t));
-		memcpy(wordtable[j].words, words, n * 2 * sizeof(uint16_t));
+}
+
+static void warn_invisible_span(struct program *prg, int boxclass) {
+	if(zctx) {
+		if(zctx->invisible_span < 0) zctx->invisible_span = boxclass;
+	} else if(!warned_about_invisible_spans) {
+		report(LVL_WARN, 0, "(span @%s) makes an invisible span. This is legal, but can produce strange spacing.", prg->boxclasses[boxclass].class->name);
+		report(LVL_WARN, 0, "It is recommended to use invisible styles only for divs, not spans.");
+		warned_about_invisible_spans = 1;
 	}
-	return j;
 }
 
 static void generate_code(struct program *prg, struct routine *r, struct predicate *pred, int r_id, uint16_t *rlabel) {
@@ -1970,7 +2220,7 @@ static void generate_code(struct program *prg, struct routine *r, struct predica
 	struct zinstr *zi;
 	struct comp_routine *cr;
 	struct cinstr *ci;
-	uint16_t mask;
+	uint16_t mask, label;
 	uint16_t ll, ll2;
 	uint16_t llabel[pred->nroutine];
 	uint32_t o0, o1, o2, o3, oper[3] = {0};
@@ -2090,11 +2340,8 @@ static void generate_code(struct program *prg, struct routine *r, struct predica
 					zi = append_instr(r, Z_CALL1N);
 					zi->oper[0] = ROUTINE(R_BEGIN_SPAN);
 					
-					if(prg->boxclasses[ci->oper[0].value].style & STYLE_INVISIBLE
-						&& !warned_about_invisible_spans) {
-						report(LVL_WARN, 0, "(span @%s) makes an invisible span. This is legal, but can produce strange spacing.", prg->boxclasses[ci->oper[0].value].class->name);
-						report(LVL_WARN, 0, "It is recommended to use invisible styles only for divs, not spans.");
-						warned_about_invisible_spans = 1;
+					if(prg->boxclasses[ci->oper[0].value].style & STYLE_INVISIBLE) {
+						warn_invisible_span(prg, ci->oper[0].value);
 					}
 				} else {
 					zi = append_instr(r, Z_CALLVN);
@@ -2270,7 +2517,11 @@ static void generate_code(struct program *prg, struct routine *r, struct predica
 				} else {
 					ll = r->next_label++;
 				}
-				generate_index(prg, pred, &cr->instr[i], n, r, r_id, rlabel, llabel, encountered, rstack, &rsp, ll);
+				if((prg->optflags & OPTF_JUMP_TABLES) && comp_dense_index(&cr->instr[i], n)) {
+					generate_jumptable(prg, pred, &cr->instr[i], n, r, rlabel, ll);
+				} else {
+					generate_index(prg, pred, &cr->instr[i], n, r, r_id, rlabel, llabel, encountered, rstack, &rsp, ll);
+				}
 				if(ll == RFALSE) {
 					i++;
 				} else {
@@ -2283,10 +2534,10 @@ static void generate_code(struct program *prg, struct routine *r, struct predica
 				assert(ci->oper[2].tag == OPER_PRED);
 				assert(ci->oper[0].value < prg->predicates[ci->oper[2].value]->pred->nwordmap);
 				map = &prg->predicates[ci->oper[2].value]->pred->wordmaps[ci->oper[0].value];
-				id = generate_wordmap(map, &n);
+				label = generate_wordmap(map, &n);
 				zi = append_instr(r, Z_CALLVS);
 				zi->oper[0] = ROUTINE(R_WORDMAP);
-				zi->oper[1] = REF(wordtable[id].label);
+				zi->oper[1] = REF(label);
 				zi->oper[2] = SMALL_OR_LARGE(n);
 				zi->oper[3] = VALUE(REG_IDX);
 				zi->store = REG_TEMP;
@@ -4172,7 +4423,31 @@ static void straighten_jumps(struct routine *r) {
 	}
 }
 
-void compile_predicate(struct predname *predname, struct program *prg) {
+// Makes a label for every routine of the predicate that needs one. Returns
+// zero if the predicate isn't compiled.
+
+static uint16_t *make_predicate_labels(struct predicate *pred) {
+	struct backend_pred *bp = pred->backend;
+	uint16_t *rlabel;
+	int i;
+
+	if(!bp->global_label) return 0;
+
+	rlabel = calloc(pred->nroutine, sizeof(uint16_t));
+	for(i = 0; i < pred->nroutine; i++) {
+		if(pred->routines[i].reftrack == i) {
+			if(i == pred->normal_entry) {
+				rlabel[i] = bp->global_label;
+			} else {
+				rlabel[i] = make_routine_label();
+			}
+		}
+	}
+
+	return rlabel;
+}
+
+static void compile_predicate(struct predname *predname, struct program *prg, uint16_t *rlabel) {
 	struct predicate *pred = predname->pred;
 	struct backend_pred *bp = pred->backend;
 	struct routine *r;
@@ -4182,19 +4457,7 @@ void compile_predicate(struct predname *predname, struct program *prg) {
 		compile_trace_output(predname, bp->trace_output_label);
 	}
 
-	if(bp->global_label) {
-		uint16_t rlabel[pred->nroutine];
-
-		memset(rlabel, 0, pred->nroutine * sizeof(uint16_t));
-		for(i = 0; i < pred->nroutine; i++) {
-			if(pred->routines[i].reftrack == i) {
-				if(i == pred->normal_entry) {
-					rlabel[i] = bp->global_label;
-				} else {
-					rlabel[i] = make_routine_label();
-				}
-			}
-		}
+	if(rlabel) {
 		for(i = 0; i < pred->nroutine; i++) {
 			if(pred->routines[i].reftrack == i) {
 				r = make_routine(rlabel[i], 0);
@@ -4205,6 +4468,201 @@ void compile_predicate(struct predname *predname, struct program *prg) {
 	}
 }
 
+#define MIN_PRED_PER_THREAD	32
+#define MIN_ROUTINE_PER_THREAD	256
+
+struct zgen_pool {
+	struct program		*prg;
+	struct zgen_context	*contexts;
+};
+
+static void zgen_worker(struct pool *pool, void *arg) {
+	struct zgen_pool *zp = arg;
+	struct zgen_context *c;
+	int i, saved_max_temp = max_temp;
+
+	while((i = pool_next(pool)) >= 0) {
+		c = &zp->contexts[i];
+		zctx = c;
+		max_temp = 0;
+		if(!setjmp(c->fatal_jmp)) {
+			compile_predicate(zp->prg->predicates[i], zp->prg, c->rlabel);
+		}
+		c->max_temp = max_temp;
+		zctx = 0;
+	}
+	max_temp = saved_max_temp;
+}
+
+static void relocate_global_labels(struct routine *r, uint16_t *map, int nlabel) {
+	int i, j;
+	uint32_t oper;
+
+	for(i = 0; i < r->ninstr; i++) {
+		for(j = 0; j < 4; j++) {
+			oper = r->instr[i].oper[j];
+			if((oper & 0xf0000) == REF(0)
+			&& (oper & 0xffff) >= zgen_label0) {
+				assert((oper & 0xffff) - zgen_label0 < nlabel);
+				r->instr[i].oper[j] = REF(map[(oper & 0xffff) - zgen_label0]);
+			}
+		}
+	}
+}
+
+// Moves the strings and tables of a context into the global tables, in the
+// order their labels were made, reusing existing ones just like a serial
+// compilation would. Then the provisional labels in the code are replaced.
+
+static void zgen_merge(struct program *prg, struct predname *predname, struct zgen_context *c) {
+	struct predicate *pred = predname->pred;
+	struct backend_pred *bp = pred->backend;
+	uint16_t *map = malloc((c->nlabel + 1) * sizeof(uint16_t));
+	struct datatable *dt;
+	struct wordtable *wt;
+	struct jumptable *jt;
+	int i, j;
+
+	assert(!zctx);
+
+	if(c->invisible_span >= 0) {
+		warn_invisible_span(prg, c->invisible_span);
+	}
+	if(c->fatal) {
+		report(LVL_ERR, 0, "%s", c->fatal);
+		exit(1);
+	}
+
+	for(i = 0; i < c->nlabel; i++) {
+		j = c->labels[i].index;
+		switch(c->labels[i].kind) {
+		case ZGEN_STRING:
+			map[i] = find_global_string(c->strings[j]->zscii)->global_label;
+			free(c->strings[j]->zscii);
+			free(c->strings[j]);
+			break;
+		case ZGEN_DATATABLE:
+			dt = &c->datatable[j];
+			if((j = find_datatable(datatable, ndatatable, dt->data, dt->length)) >= 0) {
+				map[i] = datatable[j].label;
+			} else {
+				map[i] = add_datatable(dt->data, dt->length);
+			}
+			free(dt->data);
+			break;
+		case ZGEN_WORDTABLE:
+			wt = &c->wordtable[j];
+			for(j = 1; j < wt->length; j += 2) {
+				if((wt->words[j] & 0x8000)
+				&& (wt->words[j] & 0x7fff) >= zgen_label0) {
+					wt->words[j] = 0x8000 | map[(wt->words[j] & 0x7fff) - zgen_label0];
+				}
+			}
+			if((j = find_wordtable(wordtable, nwordtable, wt->words, wt->length)) >= 0) {
+				map[i] = wordtable[j].label;
+			} else {
+				map[i] = add_wordtable(wt->words, wt->length);
+			}
+			free(wt->words);
+			break;
+		case ZGEN_JUMPTABLE:
+			jt = &c->jumptable[j];
+			map[i] = add_jumptable(jt->entries, jt->length);
+			break;
+		default:
+			assert(0);
+		}
+	}
+
+	if(c->nlabel) {
+		if(bp->trace_output_label) {
+			relocate_global_labels(routines[bp->trace_output_label], map, c->nlabel);
+		}
+		if(c->rlabel) {
+			for(i = 0; i < pred->nroutine; i++) {
+				if(c->rlabel[i]) {
+					relocate_global_labels(routines[c->rlabel[i]], map, c->nlabel);
+				}
+			}
+		}
+	}
+
+	if(c->max_temp > max_temp) max_temp = c->max_temp;
+
+	free(map);
+	free(c->rlabel);
+	free(c->labels);
+	free(c->stringhash);
+	free(c->strings);
+	free(c->datatable);
+	free(c->wordtable);
+	free(c->jumptable);
+}
+
+// Routines are measured in parallel, as if they were placed at address zero,
+// and then moved to their final addresses.
+
+static void pass1_worker(struct pool *pool, void *arg) {
+	uint32_t *rsize = arg;
+	int i;
+
+	while((i = pool_next(pool)) >= 0) {
+		if(i == R_TERPTEST
+		|| (routines[i]->actual_routine == i && routines[i]->actual_routine != routines[R_FAIL_PRED]->actual_routine)) {
+			rsize[i] = pass1(routines[i], 0);
+		}
+	}
+}
+
+static void move_routine(struct routine *r, uint32_t org) {
+	int i;
+
+	for(i = 0; i < r->nalloc_lab; i++) {
+		if(r->local_labels[i] != 0xffffffff) {
+			r->local_labels[i] += org;
+		}
+	}
+}
+
+static void assemble_worker(struct pool *pool, void *arg) {
+	int packfactor = *(int *) arg;
+	uint32_t addr;
+	int i;
+
+	while((i = pool_next(pool)) >= 0) {
+		if(routines[i]->actual_routine == routines[R_FAIL_PRED]->actual_routine) {
+			/* skip */
+		} else if(routines[i]->actual_routine == i) {
+			addr = routines[i]->address * packfactor;
+			zcore[addr++] = routines[i]->nlocal;
+			assemble(addr, routines[i]);
+		}
+	}
+}
+
+// Generates code for all predicates on all available cores.
+
+static void compile_predicates(struct program *prg) {
+	struct zgen_pool zp = {prg};
+	int i, nthread;
+
+	zp.contexts = calloc(prg->npredicate, sizeof(struct zgen_context));
+	for(i = 0; i < prg->npredicate; i++) {
+		zp.contexts[i].rlabel = make_predicate_labels(prg->predicates[i]->pred);
+		zp.contexts[i].invisible_span = -1;
+	}
+	zgen_label0 = next_global_label;
+
+	nthread = pool_run(prg->npredicate, MIN_PRED_PER_THREAD, zgen_worker, &zp);
+
+	for(i = 0; i < prg->npredicate; i++) {
+		zgen_merge(prg, prg->predicates[i], &zp.contexts[i]);
+	}
+
+	report(LVL_DEBUG, 0, "Generated code for %d predicates using %d threads", prg->npredicate, nthread);
+	free(zp.contexts);
+}
+
 void compile_endings_check(struct routine *r, struct endings_point *pt, int level, int have_allocated) {
 	int i, j;
 	struct zinstr *zi;
@@ -4519,10 +4977,10 @@ void backend_z(
 	uint16_t addr_abbrevtable, addr_abbrevstr, addr_objtable, addr_globals, addr_static;
 	uint16_t addr_scratch, addr_heap, addr_heapend, addr_aux, addr_lts, addr_extheader;
 	uint16_t addr_unicode, addr_dictionary, addr_seltable, addr_alphabet, addr_casing;
-	uint16_t used_addressable, used_objects1, used_objects2, used_wordmaps, used_unicode, used_abbrevs, used_dictionary; // How much of the 64KiB of addressable memory have we used, for what purposes? We don't actually need this for compilation, but if we save it for the end, we can give better diagnostics.
+	uint16_t used_addressable, used_objects1, used_objects2, used_wordmaps, used_jumptables, used_unicode, used_abbrevs, used_dictionary; // How much of the 64KiB of addressable memory have we used, for what purposes? We don't actually need this for compilation, but if we save it for the end, we can give better diagnostics.
 	uint32_t used_routines, used_strings; // These ones need more than 16 bits to represent, since they're in high memory, not addressable memory
 	uint8_t used_attributes; // How many of the Z-machine's low-level object attributes have we used?
-	uint32_t org;
+	uint32_t org, *rsize;
 	uint32_t filesize;
 	uint16_t unichar;
 	uint8_t n_casing;
@@ -4749,9 +5207,7 @@ void backend_z(
 		}
 	}
 
-	for(i = 0; i < prg->npredicate; i++) {
-		compile_predicate(prg->predicates[i], prg);
-	}
+	compile_predicates(prg);
 
 #if 0
 	printf("predicates compiled\n");
@@ -4785,6 +5241,11 @@ void backend_z(
 	resolve_rnum(((struct backend_pred *) find_builtin(prg, BI_PROGRAM_ENTRY)->pred->backend)->global_label);
 	resolve_rnum(((struct backend_pred *) find_builtin(prg, BI_ERROR_ENTRY)->pred->backend)->global_label);
 	resolve_rnum(R_FAIL_PRED);
+	for(i = 0; i < njumptable; i++) {
+		for(j = 0; j < jumptable[i].length; j++) {
+			if(jumptable[i].entries[j]) resolve_rnum(jumptable[i].entries[j] & 0x7fff);
+		}
+	}
 
 #if 0
 	printf("routines traced\n");
@@ -4924,6 +5385,14 @@ void backend_z(
 	}
 	
 	used_wordmaps = org - used_wordmaps; // End of wordmaps
+	used_jumptables = org;
+
+	for(i = 0; i < njumptable; i++) {
+		set_global_label(jumptable[i].label, org);
+		org += jumptable[i].length * 2;
+	}
+
+	used_jumptables = org - used_jumptables;
 	used_dictionary = org;
 	
 	addr_dictionary = org;
@@ -4983,6 +5452,9 @@ void backend_z(
 	
 	used_routines = org; // Start of routines
 
+	rsize = malloc(next_routine_num * sizeof(uint32_t));
+	pool_run(next_routine_num, MIN_ROUTINE_PER_THREAD, pass1_worker, rsize);
+
 	org = entrypc - 1;
 	for(i = 0; i < next_routine_num; i++) {
 		if(i == R_TERPTEST) continue; // put a directly-called routine last, to help txd
@@ -4991,16 +5463,20 @@ void backend_z(
 		} else if(routines[i]->actual_routine == i) {
 			assert((org & (packfactor - 1)) == 0);
 			routines[i]->address = org / packfactor;
-			org += pass1(routines[i], org);
+			move_routine(routines[i], org);
+			org += rsize[i];
 			org = (org + packfactor - 1) & ~(packfactor - 1);
 		}
 	}
 
 	assert((org & (packfactor - 1)) == 0);
 	routines[R_TERPTEST]->address = org / packfactor;
-	org += pass1(routines[R_TERPTEST], org);
+	move_routine(routines[R_TERPTEST], org);
+	org += rsize[R_TERPTEST];
 	org = (org + packfactor - 1) & ~(packfactor - 1);
 
+	free(rsize);
+
 #if 0
 	printf("pass 1 complete\n");
 #endif
@@ -5182,6 +5658,16 @@ void backend_z(
 		}
 	}
 
+	for(i = 0; i < njumptable; i++) {
+		uint16_t addr = global_labels[jumptable[i].label];
+		for(j = 0; j < jumptable[i].length; j++) {
+			uint16_t value = jumptable[i].entries[j];
+			if(value) value = routines[resolve_rnum(value & 0x7fff)]->address;
+			zcore[addr++] = value >> 8;
+			zcore[addr++] = value & 0xff;
+		}
+	}
+
 	for(i = 0; i < nwordtable; i++) {
 		uint16_t addr = global_labels[wordtable[i].label];
 		if(verbose >= 4) printf("Wordtable #%d, length %d", i, wordtable[i].length);
@@ -5291,15 +5777,7 @@ void backend_z(
 		memcpy(zcore + addr_heap + 7 + 36, "//", 3);
 	}
 
-	for(i = 0; i < next_routine_num; i++) {
-		if(routines[i]->actual_routine == routines[R_FAIL_PRED]->actual_routine) {
-			/* skip */
-		} else if(routines[i]->actual_routine == i) {
-			uint32_t addr = routines[i]->address * packfactor;
-			zcore[addr++] = routines[i]->nlocal;
-			assemble(addr, routines[i]);
-		}
-	}
+	pool_run(next_routine_num, MIN_ROUTINE_PER_THREAD, assemble_worker, &packfactor);
 
 	for(i = 0; i < BUCKETS; i++) {
 		for(gs = stringhash[i]; gs; gs = gs->next) {
@@ -5346,6 +5824,7 @@ void backend_z(
 	report(LVL_DEBUG, 0, "        Unicode data:    %5d", used_unicode);
 	report(LVL_DEBUG, 0, "        Abbreviations:   %5d", used_abbrevs);
 	report(LVL_DEBUG, 0, "        Wordmaps:        %5d", used_wordmaps);
+	report(LVL_DEBUG, 0, "        Jump tables:     %5d", used_jumptables);
 	report(LVL_DEBUG, 0, "        Dictionary:      %5d", used_dictionary);
 	report(LVL_DEBUG, 0, "        Main heap:       %5d", heapsize*2);
 	report(LVL_DEBUG, 0, "        Auxiliary heap:  %5d", auxsize*2);
@@ -0,0 +1,749 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "arena.h"
+#include "ast.h"
+#include "compile.h"
+#include "codecache.h"
+
+// A predicate is fingerprinted on everything that comp_predicate looks at:
+// its clauses as they stand after analysis, the flags of the predicates that
+// it queries, and a few program-wide settings. When the fingerprint matches
+// the one recorded during the previous compilation, the old routines are
+// installed instead of compiling the predicate again. Thus a change to one
+// source file only causes the predicates defined there, and the ones whose
+// analysis was affected by the change, to be recompiled.
+//
+// Words, objects, predicates, dynamic flags and variables, and box classes
+// are numbered in program order, so their numbers shift when an unrelated
+// part of the program changes. Operands that hold such numbers are recorded
+// as references to named symbols, and translated back for the new program.
+
+#define FNV_OFFSET	14695981039346656037ull
+#define FNV_PRIME	1099511628211ull
+
+#define PREDF_TRANSIENT	(PREDF_VISITED | PREDF_IN_QUEUE | PREDF_NEEDS_LABEL)
+
+enum {
+	SYM_OBJ,
+	SYM_DICT,
+	SYM_WORD,
+	SYM_BOX,
+	SYM_PRED,
+	SYM_GFLAG,
+	SYM_GVAR,
+	SYM_OFLAG,
+	SYM_OVAR,
+	SYM_ANONFLAG,	// allocated by the predicate itself, for a (select)
+};
+
+struct cc_sym {
+	uint8_t			kind;
+	int			value;		// for SYM_ANONFLAG
+	char			*name;
+};
+
+struct cc_entry {
+	struct cc_entry		*next_in_hash;
+	struct arena		arena;
+	char			*name;
+	uint64_t		fingerprint;
+	struct comp_routine	*routines;	// operands refer to syms
+	struct cc_sym		*syms;
+	uint16_t		*nvar;		// per clause, after optimization
+	uint16_t		*next_temp;	// per clause
+	char			**labelled;	// queried predicates that need a label
+	char			**newwords;	// created while compiling
+	char			**newboxes;	// box classes created while compiling
+	int			nroutine;
+	int			nsym;
+	int			nclause;
+	int			nlabelled;
+	int			nnewword;
+	int			nnewbox;
+	int			nanonflag;
+	int			normal_entry;
+	int			initial_value_entry;
+};
+
+struct codecache {
+	struct cc_entry		**oldhash;	// from the previous compilation
+	int			noldbucket;
+	struct cc_entry		**newhash;	// from the current compilation
+	int			nnewbucket;
+	struct predname		**predhash;	// predicates of the current program
+	uint8_t			*predambiguous;	// set if two predicates print the same
+	int			npredbucket;
+
+	// Scratch space for the predicate being compiled.
+	struct predname		**callees;
+	uint8_t			*calleelabel;
+	int			ncallee;
+	int			nalloc_callee;
+	struct cc_sym		*syms;
+	int			nsym;
+	int			nalloc_sym;
+	uint32_t		*symkeys;	// 0 = free, otherwise key + 1
+	int			*symindex;
+	int			nsymbucket;
+	int			*symval;
+	int			nalloc_symval;
+	int			selectbase;
+};
+
+static uint32_t strhash(const char *str) {
+	uint32_t h = 2166136261u;
+
+	while(*str) {
+		h = (h ^ (uint8_t) *str++) * 16777619u;
+	}
+	return h;
+}
+
+static uint64_t mix(uint64_t h, uint32_t v) {
+	int i;
+
+	for(i = 0; i < 4; i++) {
+		h = (h ^ (v & 0xff)) * FNV_PRIME;
+		v >>= 8;
+	}
+	return h;
+}
+
+static uint64_t mix_str(uint64_t h, const char *str) {
+	while(*str) {
+		h = (h ^ (uint8_t) *str++) * FNV_PRIME;
+	}
+	return h * FNV_PRIME;
+}
+
+static struct predname *lookup_pred(struct codecache *cc, char *name) {
+	struct predname *predname;
+	uint32_t h = strhash(name);
+
+	for(;;) {
+		h &= cc->npredbucket - 1;
+		predname = cc->predhash[h];
+		if(!predname) return 0;
+		if(!strcmp(predname->printed_name, name)) {
+			return cc->predambiguous[h]? 0 : predname;
+		}
+		h++;
+	}
+}
+
+static uint64_t mix_pred(struct codecache *cc, uint64_t h, struct predname *predname) {
+	if(cc->ncallee >= cc->nalloc_callee) {
+		cc->nalloc_callee = cc->ncallee * 2 + 64;
+		cc->callees = realloc(cc->callees, cc->nalloc_callee * sizeof(struct predname *));
+		cc->calleelabel = realloc(cc->calleelabel, cc->nalloc_callee);
+	}
+	cc->callees[cc->ncallee++] = predname;
+
+	h = mix_str(h, predname->printed_name);
+	h = mix(h, predname->arity | predname->special << 16);
+	h = mix(h, predname->builtin | predname->nameflags << 16);
+	h = mix(h, predname->pred->flags & ~PREDF_TRANSIENT);
+	h = mix(h, (predname->dyn_id != DYN_NONE) | (predname->dyn_var_id != DYN_NONE) << 1);
+	return h;
+}
+
+static uint64_t mix_word(uint64_t h, struct clause *cl, struct word *w) {
+	int i;
+
+	if(!w) return mix(h, 0);
+
+	for(i = 0; i < cl->nvar; i++) {
+		if(cl->varnames[i] == w) {
+			return mix(mix(h, 1), i);
+		}
+	}
+
+	h = mix(h, 2);
+	return mix_str(h, w->name);
+}
+
+static uint64_t mix_chain(struct codecache *cc, uint64_t h, struct clause *cl, struct astnode *an) {
+	int i;
+
+	for(; an; an = an->next_in_body) {
+		h = mix(h, an->kind | an->subkind << 8 | an->nchild << 16);
+		h = mix(h, an->line);
+		h = mix(h, an->unbound | an->closure << 1);
+		h = mix(h, (an->kind == AN_SELECT)? an->value - cc->selectbase : an->value);
+		h = mix_word(h, cl, an->word);
+		if(an->predicate) {
+			h = mix_pred(cc, h, an->predicate);
+		} else {
+			h = mix(h, 0);
+		}
+		for(i = 0; i < an->nchild; i++) {
+			h = mix_chain(cc, h, cl, an->children[i]);
+		}
+	}
+
+	return mix(h, 0xffffffff);
+}
+
+static int find_selectbase(struct astnode *an, int base) {
+	int i;
+
+	for(; an; an = an->next_in_body) {
+		if(an->kind == AN_SELECT && an->value >= 0 && an->value < base) {
+			base = an->value;
+		}
+		for(i = 0; i < an->nchild; i++) {
+			base = find_selectbase(an->children[i], base);
+		}
+	}
+
+	return base;
+}
+
+static uint64_t fingerprint(struct codecache *cc, struct program *prg, struct predname *predname) {
+	struct predicate *pred = predname->pred;
+	struct clause *cl;
+	struct wordmap *map;
+	uint64_t h = FNV_OFFSET;
+	int i, j, k;
+
+	cc->ncallee = 0;
+	cc->selectbase = 0x7fffffff;
+	for(i = 0; i < pred->nclause; i++) {
+		cc->selectbase = find_selectbase(pred->clauses[i]->body, cc->selectbase);
+	}
+
+	h = mix(h, prg->optflags);
+	h = mix(h, prg->max_temp | !!prg->nworldobj << 16);
+
+	h = mix_pred(cc, h, predname);
+	h = mix(h, pred->unbound_in);
+	h = mix(h, pred->nwordmap);
+	for(i = 0; i < pred->nwordmap; i++) {
+		map = &pred->wordmaps[i];
+		h = mix(h, map->nmap);
+		for(j = 0; j < map->nmap; j++) {
+			if(map->map[j].key == 0xffff) {
+				h = mix(h, 0xffff);
+			} else {
+				h = mix_str(h, prg->dictwordnames[map->map[j].key]->name);
+			}
+			h = mix(h, map->map[j].count);
+			for(k = 0; k < map->map[j].count && k < MAXWORDMAP; k++) {
+				h = mix_str(h, prg->worldobjnames[map->map[j].onumtable[k]]->name);
+			}
+		}
+	}
+
+	h = mix(h, pred->nclause);
+	for(i = 0; i < pred->nclause; i++) {
+		cl = pred->clauses[i];
+		h = mix(h, cl->line);
+		h = mix(h, cl->nvar | cl->negated << 16);
+		for(j = 0; j < predname->arity; j++) {
+			h = mix_chain(cc, h, cl, cl->params[j]);
+		}
+		h = mix_chain(cc, h, cl, cl->body);
+	}
+
+	return h;
+}
+
+static int is_symbolic(int tag) {
+	switch(tag) {
+	case VAL_OBJ:
+	case VAL_DICT:
+	case OPER_WORD:
+	case OPER_BOX:
+	case OPER_PRED:
+	case OPER_GFLAG:
+	case OPER_GVAR:
+	case OPER_OFLAG:
+	case OPER_OVAR:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int is_select_id(struct cinstr *ci, int i) {
+	return ci->op == I_SELECT && i == 1 && ci->oper[1].tag == OPER_NUM;
+}
+
+static void free_entry(struct cc_entry *e) {
+	arena_free(&e->arena);
+	free(e);
+}
+
+static void add_entry(struct codecache *cc, struct cc_entry *e) {
+	uint32_t h = strhash(e->name) & (cc->nnewbucket - 1);
+
+	e->next_in_hash = cc->newhash[h];
+	cc->newhash[h] = e;
+}
+
+static char **copy_names(struct arena *arena, struct word **words, int n) {
+	char **names = arena_alloc(arena, n * sizeof(char *));
+	int i;
+
+	for(i = 0; i < n; i++) {
+		names[i] = arena_strdup(arena, words[i]->name);
+	}
+	return names;
+}
+
+static int record_sym(struct codecache *cc, struct program *prg, value_t v, int nflag0) {
+	struct cc_sym sym = {0};
+	uint32_t key, h;
+	int id = v.value;
+
+	switch(v.tag) {
+	case VAL_OBJ:
+		sym.kind = SYM_OBJ;
+		sym.name = prg->worldobjnames[id]->name;
+		break;
+	case VAL_DICT:
+		sym.kind = SYM_DICT;
+		sym.name = prg->dictwordnames[id]->name;
+		break;
+	case OPER_WORD:
+		sym.kind = SYM_WORD;
+		sym.name = prg->allwords[id]->name;
+		break;
+	case OPER_BOX:
+		sym.kind = SYM_BOX;
+		sym.name = prg->boxclasses[id].class->name;
+		break;
+	case OPER_PRED:
+		sym.kind = SYM_PRED;
+		sym.name = prg->predicates[id]->printed_name;
+		break;
+	case OPER_GFLAG:
+		if(id >= nflag0) {
+			sym.kind = SYM_ANONFLAG;
+			sym.value = id - nflag0;
+		} else {
+			assert(prg->globalflagpred[id]);
+			sym.kind = SYM_GFLAG;
+			sym.name = prg->globalflagpred[id]->printed_name;
+		}
+		break;
+	case OPER_GVAR:
+		sym.kind = SYM_GVAR;
+		sym.name = prg->globalvarpred[id]->printed_name;
+		break;
+	case OPER_OFLAG:
+		sym.kind = SYM_OFLAG;
+		sym.name = prg->objflagpred[id]->printed_name;
+		break;
+	case OPER_OVAR:
+		sym.kind = SYM_OVAR;
+		sym.name = prg->objvarpred[id]->printed_name;
+		break;
+	default:
+		assert(0);
+	}
+
+	key = (uint32_t) v.tag << 24 | (id & 0xffffff);
+	for(h = key * 2654435761u; ; h++) {
+		h &= cc->nsymbucket - 1;
+		if(!cc->symkeys[h]) break;
+		if(cc->symkeys[h] == key + 1) return cc->symindex[h];
+	}
+
+	if(cc->nsym >= cc->nalloc_sym) {
+		cc->nalloc_sym = cc->nsym * 2 + 64;
+		cc->syms = realloc(cc->syms, cc->nalloc_sym * sizeof(struct cc_sym));
+	}
+	cc->syms[cc->nsym] = sym;
+	cc->symkeys[h] = key + 1;
+	cc->symindex[h] = cc->nsym;
+	return cc->nsym++;
+}
+
+static struct cc_entry *record(struct codecache *cc, struct program *prg, struct predname *predname, uint64_t fp, int nword0, int nbox0, int nflag0) {
+	struct predicate *pred = predname->pred;
+	struct cc_entry *e;
+	struct comp_routine *r;
+	struct cinstr *ci;
+	int i, j, k, n, ninstr = 0;
+
+	e = calloc(1, sizeof(*e));
+	arena_init(&e->arena, 4096);
+	e->name = arena_strdup(&e->arena, predname->printed_name);
+	e->fingerprint = fp;
+	e->normal_entry = pred->normal_entry;
+	e->initial_value_entry = pred->initial_value_entry;
+
+	e->nclause = pred->nclause;
+	e->nvar = arena_alloc(&e->arena, pred->nclause * sizeof(uint16_t));
+	e->next_temp = arena_alloc(&e->arena, pred->nclause * sizeof(uint16_t));
+	for(i = 0; i < pred->nclause; i++) {
+		e->nvar[i] = pred->clauses[i]->nvar;
+		e->next_temp[i] = pred->clauses[i]->next_temp;
+	}
+
+	e->nnewword = prg->nword - nword0;
+	e->newwords = copy_names(&e->arena, prg->allwords + nword0, e->nnewword);
+	e->nnewbox = prg->nboxclass - nbox0;
+	e->newboxes = arena_alloc(&e->arena, e->nnewbox * sizeof(char *));
+	for(i = 0; i < e->nnewbox; i++) {
+		e->newboxes[i] = arena_strdup(&e->arena, prg->boxclasses[nbox0 + i].class->name);
+	}
+	e->nanonflag = prg->nglobalflag - nflag0;
+
+	n = 0;
+	for(i = 0; i < cc->ncallee; i++) {
+		if(cc->callees[i]->pred->flags & PREDF_NEEDS_LABEL) n++;
+	}
+	e->labelled = arena_alloc(&e->arena, n * sizeof(char *));
+	for(i = 0; i < cc->ncallee; i++) {
+		if(cc->callees[i]->pred->flags & PREDF_NEEDS_LABEL) {
+			e->labelled[e->nlabelled++] = arena_strdup(&e->arena, cc->callees[i]->printed_name);
+			cc->callees[i]->pred->flags &= ~PREDF_NEEDS_LABEL;
+			cc->calleelabel[i] = 1;
+		}
+	}
+
+	for(i = 0; i < pred->nroutine; i++) {
+		ninstr += pred->routines[i].ninstr;
+	}
+	for(n = 64; n < ninstr * 6; n <<= 1);
+	if(n > cc->nsymbucket) {
+		cc->nsymbucket = n;
+		cc->symkeys = realloc(cc->symkeys, n * sizeof(uint32_t));
+		cc->symindex = realloc(cc->symindex, n * sizeof(int));
+	}
+	memset(cc->symkeys, 0, cc->nsymbucket * sizeof(uint32_t));
+	cc->nsym = 0;
+
+	e->nroutine = pred->nroutine;
+	e->routines = arena_alloc(&e->arena, pred->nroutine * sizeof(struct comp_routine));
+	memcpy(e->routines, pred->routines, pred->nroutine * sizeof(struct comp_routine));
+	for(i = 0; i < pred->nroutine; i++) {
+		r = &e->routines[i];
+		r->threaded = 0;
+		r->instr = arena_alloc(&e->arena, r->ninstr * sizeof(struct cinstr));
+		memcpy(r->instr, pred->routines[i].instr, r->ninstr * sizeof(struct cinstr));
+		for(j = 0; j < r->ninstr; j++) {
+			ci = &r->instr[j];
+			for(k = 0; k < 3; k++) {
+				if(is_symbolic(ci->oper[k].tag)) {
+					ci->oper[k].value = record_sym(cc, prg, ci->oper[k], nflag0);
+				} else if(is_select_id(ci, k)) {
+					ci->oper[k].value -= cc->selectbase;
+				}
+			}
+		}
+	}
+
+	e->nsym = cc->nsym;
+	e->syms = arena_alloc(&e->arena, cc->nsym * sizeof(struct cc_sym));
+	for(i = 0; i < cc->nsym; i++) {
+		e->syms[i] = cc->syms[i];
+		if(e->syms[i].name) {
+			e->syms[i].name = arena_strdup(&e->arena, e->syms[i].name);
+		}
+	}
+
+	return e;
+}
+
+static int is_new_word(struct cc_entry *e, char *name) {
+	int i;
+
+	for(i = 0; i < e->nnewword; i++) {
+		if(!strcmp(e->newwords[i], name)) return 1;
+	}
+	return 0;
+}
+
+// Returns the number that a symbol stands for in the current program, or -1.
+// Unless create is set, words and box classes that the predicate would have
+// created are reported as 0.
+
+static int resolve_sym(struct codecache *cc, struct program *prg, struct cc_entry *e, struct cc_sym *sym, int anonbase, int create) {
+	struct word *w;
+	struct predname *predname;
+
+	switch(sym->kind) {
+	case SYM_OBJ:
+		w = find_word_nocreate(prg, sym->name);
+		return (w && (w->flags & WORDF_TAG))? w->obj_id : -1;
+	case SYM_DICT:
+		w = find_word_nocreate(prg, sym->name);
+		return (w && (w->flags & WORDF_DICT) && prg->dictwordnames[w->dict_id] == w)? w->dict_id : -1;
+	case SYM_WORD:
+	case SYM_BOX:
+		w = find_word_nocreate(prg, sym->name);
+		if(!create) {
+			return (w || is_new_word(e, sym->name))? 0 : -1;
+		}
+		if(!w) return -1;
+		return (sym->kind == SYM_WORD)? (int) w->word_id : find_boxclass(prg, w);
+	case SYM_ANONFLAG:
+		return anonbase + sym->value;
+	}
+
+	predname = lookup_pred(cc, sym->name);
+	if(!predname) return -1;
+	switch(sym->kind) {
+	case SYM_PRED:
+		return predname->pred_id;
+	case SYM_GFLAG:
+		if(predname->dyn_id < prg->nglobalflag
+		&& prg->globalflagpred[predname->dyn_id] == predname) {
+			return predname->dyn_id;
+		}
+		break;
+	case SYM_GVAR:
+		if(predname->dyn_var_id < prg->nglobalvar
+		&& prg->globalvarpred[predname->dyn_var_id] == predname) {
+			return predname->dyn_var_id;
+		}
+		break;
+	case SYM_OFLAG:
+		if(predname->dyn_id < prg->nobjflag
+		&& prg->objflagpred[predname->dyn_id] == predname) {
+			return predname->dyn_id;
+		}
+		break;
+	case SYM_OVAR:
+		if(predname->dyn_id < prg->nobjvar
+		&& prg->objvarpred[predname->dyn_id] == predname) {
+			return predname->dyn_id;
+		}
+		break;
+	default:
+		assert(0);
+	}
+
+	return -1;
+}
+
+static int install(struct codecache *cc, struct program *prg, struct predname *predname, struct cc_entry *e) {
+	struct predicate *pred = predname->pred;
+	struct predname *other;
+	struct comp_routine *r;
+	struct cinstr *ci;
+	int i, j, k, anonbase;
+
+	if(e->nclause != pred->nclause) return 0;
+	for(i = 0; i < e->nlabelled; i++) {
+		if(!lookup_pred(cc, e->labelled[i])) return 0;
+	}
+	for(i = 0; i < e->nsym; i++) {
+		if(resolve_sym(cc, prg, e, &e->syms[i], 0, 0) < 0) return 0;
+	}
+
+	// Everything checks out, so make the same changes to the program as
+	// comp_predicate would have made.
+
+	for(i = 0; i < e->nnewword; i++) {
+		(void) find_word(prg, e->newwords[i]);
+	}
+	for(i = 0; i < e->nnewbox; i++) {
+		(void) find_boxclass(prg, find_word(prg, e->newboxes[i]));
+	}
+	anonbase = prg->nglobalflag;
+	if(e->nanonflag) {
+		prg->nglobalflag += e->nanonflag;
+		prg->globalflagpred = realloc(prg->globalflagpred, prg->nglobalflag * sizeof(struct predname *));
+		for(i = anonbase; i < prg->nglobalflag; i++) {
+			prg->globalflagpred[i] = 0;
+		}
+	}
+	for(i = 0; i < e->nlabelled; i++) {
+		other = lookup_pred(cc, e->labelled[i]);
+		other->pred->flags |= PREDF_NEEDS_LABEL;
+	}
+
+	if(e->nsym > cc->nalloc_symval) {
+		cc->nalloc_symval = e->nsym * 2;
+		cc->symval = realloc(cc->symval, cc->nalloc_symval * sizeof(int));
+	}
+	for(i = 0; i < e->nsym; i++) {
+		cc->symval[i] = resolve_sym(cc, prg, e, &e->syms[i], anonbase, 1);
+		assert(cc->symval[i] >= 0);
+	}
+
+	pred->routines = arena_alloc(&pred->arena, e->nroutine * sizeof(struct comp_routine));
+	memcpy(pred->routines, e->routines, e->nroutine * sizeof(struct comp_routine));
+	pred->nroutine = e->nroutine;
+	for(i = 0; i < e->nroutine; i++) {
+		r = &pred->routines[i];
+		r->instr = arena_alloc(&pred->arena, r->ninstr * sizeof(struct cinstr));
+		memcpy(r->instr, e->routines[i].instr, r->ninstr * sizeof(struct cinstr));
+		for(j = 0; j < r->ninstr; j++) {
+			ci = &r->instr[j];
+			for(k = 0; k < 3; k++) {
+				if(is_symbolic(ci->oper[k].tag)) {
+					ci->oper[k].value = cc->symval[ci->oper[k].value];
+				} else if(is_select_id(ci, k)) {
+					ci->oper[k].value += cc->selectbase;
+				}
+			}
+		}
+	}
+
+	pred->normal_entry = e->normal_entry;
+	pred->initial_value_entry = e->initial_value_entry;
+	for(i = 0; i < pred->nclause; i++) {
+		pred->clauses[i]->clause_id = i;
+		pred->clauses[i]->nvar = e->nvar[i];
+		pred->clauses[i]->next_temp = e->next_temp[i];
+	}
+
+	if(verbose >= 4) {
+		comp_dump_predicate(prg, predname);
+	}
+
+	return 1;
+}
+
+void codecache_comp_predicate(struct codecache *cc, struct program *prg, struct predname *predname) {
+	struct cc_entry *e = 0, **eptr;
+	uint64_t fp;
+	int i, nword, nboxclass, nglobalflag;
+
+	fp = fingerprint(cc, prg, predname);
+
+	if(cc->noldbucket) {
+		eptr = &cc->oldhash[strhash(predname->printed_name) & (cc->noldbucket - 1)];
+		for(; (e = *eptr); eptr = &e->next_in_hash) {
+			if(!strcmp(e->name, predname->printed_name)) {
+				*eptr = e->next_in_hash;
+				break;
+			}
+		}
+	}
+	if(e) {
+		if(e->fingerprint == fp && install(cc, prg, predname, e)) {
+			add_entry(cc, e);
+			return;
+		}
+		free_entry(e);
+	}
+
+	// The compiler marks queried predicates that need a label, and we
+	// want to know which ones this predicate is responsible for.
+	for(i = 0; i < cc->ncallee; i++) {
+		cc->calleelabel[i] = !!(cc->callees[i]->pred->flags & PREDF_NEEDS_LABEL);
+		cc->callees[i]->pred->flags &= ~PREDF_NEEDS_LABEL;
+	}
+
+	nword = prg->nword;
+	nboxclass = prg->nboxclass;
+	nglobalflag = prg->nglobalflag;
+	comp_predicate(prg, predname);
+	if(!prg->errorflag) {
+		add_entry(cc, record(cc, prg, predname, fp, nword, nboxclass, nglobalflag));
+	}
+
+	for(i = 0; i < cc->ncallee; i++) {
+		if(cc->calleelabel[i]) {
+			cc->callees[i]->pred->flags |= PREDF_NEEDS_LABEL;
+		}
+	}
+}
+
+void codecache_begin(struct codecache *cc, struct program *prg) {
+	struct predname *predname;
+	uint32_t h;
+	int i;
+
+	for(cc->npredbucket = 64; cc->npredbucket < prg->npredicate * 2; cc->npredbucket <<= 1);
+	free(cc->predhash);
+	free(cc->predambiguous);
+	cc->predhash = calloc(cc->npredbucket, sizeof(struct predname *));
+	cc->predambiguous = calloc(cc->npredbucket, 1);
+	for(i = 0; i < prg->npredicate; i++) {
+		predname = prg->predicates[i];
+		for(h = strhash(predname->printed_name); ; h++) {
+			h &= cc->npredbucket - 1;
+			if(!cc->predhash[h]) {
+				cc->predhash[h] = predname;
+				break;
+			}
+			if(!strcmp(cc->predhash[h]->printed_name, predname->printed_name)) {
+				cc->predambiguous[h] = 1;
+				break;
+			}
+		}
+	}
+
+	for(cc->nnewbucket = 64; cc->nnewbucket < prg->npredicate; cc->nnewbucket <<= 1);
+	cc->newhash = calloc(cc->nnewbucket, sizeof(struct cc_entry *));
+}
+
+void codecache_end(struct codecache *cc) {
+	struct cc_entry *e, *next;
+	int i;
+
+	for(i = 0; i < cc->noldbucket; i++) {
+		for(e = cc->oldhash[i]; e; e = next) {
+			next = e->next_in_hash;
+			free_entry(e);
+		}
+	}
+	free(cc->oldhash);
+	cc->oldhash = cc->newhash;
+	cc->noldbucket = cc->nnewbucket;
+	cc->newhash = 0;
+	cc->nnewbucket = 0;
+	free(cc->predhash);
+	free(cc->predambiguous);
+	cc->predhash = 0;
+	cc->predambiguous = 0;
+	cc->npredbucket = 0;
+}
+
+// Returns the fingerprint of the most recently compiled version of a
+// predicate, or zero if it wasn't compiled. Predicates that print the same
+// are lumped together.
+
+uint64_t codecache_fingerprint(struct codecache *cc, struct predname *predname) {
+	struct cc_entry *e;
+	uint64_t fp = 0;
+
+	if(cc->noldbucket) {
+		e = cc->oldhash[strhash(predname->printed_name) & (cc->noldbucket - 1)];
+		for(; e; e = e->next_in_hash) {
+			if(!strcmp(e->name, predname->printed_name)) {
+				fp += e->fingerprint;
+			}
+		}
+	}
+
+	return fp;
+}
+
+struct codecache *codecache_new() {
+	return calloc(1, sizeof(struct codecache));
+}
+
+void codecache_free(struct codecache *cc) {
+	struct cc_entry *e, *next;
+	int i;
+
+	for(i = 0; i < cc->noldbucket; i++) {
+		for(e = cc->oldhash[i]; e; e = next) {
+			next = e->next_in_hash;
+			free_entry(e);
+		}
+	}
+	free(cc->oldhash);
+	free(cc->predhash);
+	free(cc->predambiguous);
+	free(cc->callees);
+	free(cc->calleelabel);
+	free(cc->syms);
+	free(cc->symkeys);
+	free(cc->symindex);
+	free(cc->symval);
+	free(cc);
+}
@@ -0,0 +1,14 @@
+// The code cache keeps the compiled routines of every predicate from the
+// previous compilation, so that the debugger only has to recompile the
+// predicates that were affected by a change to the source code.
+
+struct codecache;
+
+struct codecache *codecache_new(void);
+void codecache_free(struct codecache *cc);
+
+void codecache_begin(struct codecache *cc, struct program *prg);
+void codecache_comp_predicate(struct codecache *cc, struct program *prg, struct predname *predname);
+void codecache_end(struct codecache *cc);
+
+uint64_t codecache_fingerprint(struct codecache *cc, struct predname *predname);
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,17 +13,51 @@
 #include "report.h"
 #include "frontend.h"
 #include "accesspred.h"
+#include "codecache.h"
+#include "pool.h"
+
+// Everything that comp_predicate keeps while compiling one predicate lives in
+// a context, so that several predicates can be compiled at the same time, one
+// per thread. Changes to the program as a whole (new flags and box classes,
+// labels on other predicates, error messages) are deferred, and applied in
+// predicate order by comp_commit, so that the output doesn't depend on how
+// the work was divided between the threads.
+
+struct comp_message {
+	line_t			line;
+	char			*text;
+};
+
+struct comp_deferred {
+	int			nflag0;		// prg->nglobalflag when compilation began
+	int			nanonflag;	// allocated for (select) statements
+	int			nbox0;		// prg->nboxclass when compilation began
+	char			**newboxes;	// box classes to create, by name
+	int			nnewbox;
+	struct predname		**labelled;	// queried predicates that need a label
+	int			nlabelled;
+	struct comp_message	*messages;
+	int			nmessage;
+};
 
-static struct cinstr *instrbuf;
-static int ninstr;
-static int nalloc_instr;
-static int instr_routine_id = -1;
+struct comp_context {
+	struct cinstr		*instrbuf;
+	int			ninstr;
+	int			nalloc_instr;
+	int			instr_routine_id;
 
-static int ntemp;
+	int			ntemp;
 
-static struct comp_routine *routines;
-static int nroutine;
-static int nalloc_routine;
+	struct comp_routine	*routines;
+	int			nroutine;
+	int			nalloc_routine;
+
+	struct arena		*arena;		// of the predicate being compiled
+	struct comp_deferred	*deferred;
+};
+
+static struct comp_context main_context = {.instr_routine_id = -1};
+static _Thread_local struct comp_context *ctx = &main_context;
 
 #define NO_TAIL 0xffff
 #define CONT_TAIL 0xfffe
@@ -154,15 +189,15 @@ struct opinfosrc {
 static void comp_value_into(struct clause *cl, struct astnode *an, value_t dest, uint8_t *seen, struct astnode **known_args);
 
 static int make_routine_block(int n) {
-	int r_id = nroutine;
+	int r_id = ctx->nroutine;
 
-	if(nroutine + n > nalloc_routine) {
-		nalloc_routine = (nroutine + n) * 2 + 8;
-		routines = realloc(routines, nalloc_routine * sizeof(struct comp_routine));
-		memset(routines + nroutine, 0, (nalloc_routine - nroutine) * sizeof(struct comp_routine));
+	if(ctx->nroutine + n > ctx->nalloc_routine) {
+		ctx->nalloc_routine = (ctx->nroutine + n) * 2 + 8;
+		ctx->routines = realloc(ctx->routines, ctx->nalloc_routine * sizeof(struct comp_routine));
+		memset(ctx->routines + ctx->nroutine, 0, (ctx->nalloc_routine - ctx->nroutine) * sizeof(struct comp_routine));
 	}
 
-	nroutine += n;
+	ctx->nroutine += n;
 	return r_id;
 }
 
@@ -171,47 +206,93 @@ static int make_routine_id() {
 }
 
 static void begin_routine(int r_id) {
-	assert(!ninstr);
-	instr_routine_id = r_id;
+	assert(!ctx->ninstr);
+	ctx->instr_routine_id = r_id;
 }
 
 static struct cinstr *add_instr(uint8_t op) {
-	if(ninstr >= nalloc_instr) {
-		nalloc_instr = ninstr * 2 + 8;
-		instrbuf = realloc(instrbuf, nalloc_instr * sizeof(struct cinstr));
+	if(ctx->ninstr >= ctx->nalloc_instr) {
+		ctx->nalloc_instr = ctx->ninstr * 2 + 8;
+		ctx->instrbuf = realloc(ctx->instrbuf, ctx->nalloc_instr * sizeof(struct cinstr));
 	}
 
-	assert(!ninstr || !(opinfo[instrbuf[ninstr - 1].op].flags & OPF_ENDS_ROUTINE));
+	assert(!ctx->ninstr || !(opinfo[ctx->instrbuf[ctx->ninstr - 1].op].flags & OPF_ENDS_ROUTINE));
 
-	instrbuf[ninstr].op = op;
-	instrbuf[ninstr].subop = 0;
-	instrbuf[ninstr].implicit = 0xffff;
-	memset(instrbuf[ninstr].oper, 0, sizeof(instrbuf[ninstr].oper));
-	return &instrbuf[ninstr++];
+	ctx->instrbuf[ctx->ninstr].op = op;
+	ctx->instrbuf[ctx->ninstr].subop = 0;
+	ctx->instrbuf[ctx->ninstr].implicit = 0xffff;
+	memset(ctx->instrbuf[ctx->ninstr].oper, 0, sizeof(ctx->instrbuf[ctx->ninstr].oper));
+	return &ctx->instrbuf[ctx->ninstr++];
 }
 
 static void end_routine(uint16_t clause_id, struct arena *arena) {
-	int r_id = instr_routine_id;
+	int r_id = ctx->instr_routine_id;
 
 	assert(r_id >= 0);
-	assert(r_id < nroutine);
+	assert(r_id < ctx->nroutine);
 
-	assert(ninstr);
-	assert(opinfo[instrbuf[ninstr - 1].op].flags & OPF_ENDS_ROUTINE);
+	assert(ctx->ninstr);
+	assert(opinfo[ctx->instrbuf[ctx->ninstr - 1].op].flags & OPF_ENDS_ROUTINE);
 
-	routines[r_id].instr = arena_alloc(arena, ninstr * sizeof(struct cinstr));
-	memcpy(routines[r_id].instr, instrbuf, ninstr * sizeof(struct cinstr));
-	routines[r_id].ninstr = ninstr;
+	ctx->routines[r_id].instr = arena_alloc(arena, ctx->ninstr * sizeof(struct cinstr));
+	memcpy(ctx->routines[r_id].instr, ctx->instrbuf, ctx->ninstr * sizeof(struct cinstr));
+	ctx->routines[r_id].ninstr = ctx->ninstr;
 
-	routines[r_id].clause_id = clause_id;
-	routines[r_id].diverted = r_id;
+	ctx->routines[r_id].clause_id = clause_id;
+	ctx->routines[r_id].diverted = r_id;
 
-	ninstr = 0;
-	instr_routine_id = -1;
+	ctx->ninstr = 0;
+	ctx->instr_routine_id = -1;
 }
 
 static void end_routine_cl(struct clause *cl) {
-	end_routine(cl->clause_id, &cl->predicate->pred->arena);
+	end_routine(cl->clause_id, ctx->arena);
+}
+
+static void comp_error(line_t line, char *fmt, ...) {
+	struct comp_deferred *d = ctx->deferred;
+	char buf[256];
+	va_list valist;
+
+	va_start(valist, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, valist);
+	va_end(valist);
+
+	d->messages = realloc(d->messages, (d->nmessage + 1) * sizeof(struct comp_message));
+	d->messages[d->nmessage].line = line;
+	d->messages[d->nmessage].text = strdup(buf);
+	d->nmessage++;
+}
+
+// Box classes are numbered in order of creation. Ones that don't exist yet
+// get provisional numbers after nbox0, and are created by comp_commit.
+
+static int comp_boxclass(struct program *prg, char *name) {
+	struct comp_deferred *d = ctx->deferred;
+	int i;
+
+	for(i = 0; i < d->nbox0; i++) {
+		if(!strcmp(prg->boxclasses[i].class->name, name)) return i;
+	}
+	for(i = 0; i < d->nnewbox; i++) {
+		if(!strcmp(d->newboxes[i], name)) return d->nbox0 + i;
+	}
+
+	d->newboxes = realloc(d->newboxes, (d->nnewbox + 1) * sizeof(char *));
+	d->newboxes[d->nnewbox] = name;
+	return d->nbox0 + d->nnewbox++;
+}
+
+static void comp_needs_label(struct predname *predname) {
+	struct comp_deferred *d = ctx->deferred;
+	int i;
+
+	for(i = 0; i < d->nlabelled; i++) {
+		if(d->labelled[i] == predname) return;
+	}
+
+	d->labelled = realloc(d->labelled, (d->nlabelled + 1) * sizeof(struct predname *));
+	d->labelled[d->nlabelled++] = predname;
 }
 
 static void comp_dump_instr(struct program *prg, struct clause *cl, struct cinstr *ci) {
@@ -356,9 +437,9 @@ void comp_dump_routines(struct program *prg) {
 	int i;
 
 	printf("####\n");
-	for(i = 0; i < nroutine; i++) {
+	for(i = 0; i < ctx->nroutine; i++) {
 		printf("R%d:\n", i);
-		comp_dump_routine(prg, 0, &routines[i]);
+		comp_dump_routine(prg, 0, &ctx->routines[i]);
 	}
 }
 
@@ -581,11 +662,11 @@ static value_t comp_value(struct clause *cl, struct astnode *an, uint8_t *seen,
 			return (value_t) {OPER_VAR, vnum};
 		} else {
 			ci = add_instr(I_MAKE_VAR);
-			ci->oper[0] = (value_t) {OPER_TEMP, ntemp++};
+			ci->oper[0] = (value_t) {OPER_TEMP, ctx->ntemp++};
 			return ci->oper[0];
 		}
 	} else if(an->kind == AN_PAIR) {
-		dest = (value_t) {OPER_TEMP, ntemp++};
+		dest = (value_t) {OPER_TEMP, ctx->ntemp++};
 		comp_value_into(cl, an, dest, seen, known_args);
 		return dest;
 	} else {
@@ -641,7 +722,7 @@ static void comp_value_into(struct clause *cl, struct astnode *an, value_t dest,
 					is_ref[i] = !seen[vnum];
 					seen[vnum] = 1;
 				} else {
-					sub[i] = (value_t) {OPER_TEMP, ntemp++};
+					sub[i] = (value_t) {OPER_TEMP, ctx->ntemp++};
 					is_ref[i] = 1;
 				}
 			} else {
@@ -714,7 +795,7 @@ static void comp_param(struct clause *cl, struct astnode *an, value_t src, uint8
 		if(i < 10 + (all_seen_are_bound ? 10 : 0)) { // If this parameter will always be bound, or the list is "small", compile it the "old" (pre-1b/02) way, building the list from first to last with a whole lot of temporaries. This means unification will fail at the first non-matching element, without building the rest of the list, but it also needs one temporary for each list element, which can cause compilation to fail.
 			for(i = 0; i < 2; i++) {
 				if(an->children[i]->kind == AN_PAIR) {
-					sub[i] = (value_t) {OPER_TEMP, ntemp++};
+					sub[i] = (value_t) {OPER_TEMP, ctx->ntemp++};
 					is_ref[i] = 1;
 				} else if(an->children[i]->kind == AN_VARIABLE) {
 					if(an->children[i]->word->name[0]) {
@@ -735,7 +816,7 @@ static void comp_param(struct clause *cl, struct astnode *an, value_t src, uint8
 							seen[vnum] = 1;
 						}
 					} else {
-						sub[i] = (value_t) {OPER_TEMP, ntemp++};
+						sub[i] = (value_t) {OPER_TEMP, ctx->ntemp++};
 						is_ref[i] = 1;
 					}
 				} else {
@@ -753,7 +834,7 @@ static void comp_param(struct clause *cl, struct astnode *an, value_t src, uint8
 				}
 			}
 		} else { // If it *won't* always be bound, and the list is "large", compile it the "new" (post-1b/02) way: build the whole list first, then unify. This only requires one temporary, but means comparison can't be short-circuited and thus takes longer at runtime.
-			holder = (value_t) {OPER_TEMP, ntemp++};
+			holder = (value_t) {OPER_TEMP, ctx->ntemp++};
 			comp_value_into(cl, an, holder, seen, known_args);
 			ci = add_instr(I_UNIFY);
 			ci->oper[0] = src;
@@ -802,7 +883,7 @@ static void comp_rev_lookup(struct program *prg, struct clause *cl, int mapnum)
 	int labend = make_routine_id();
 	int labend2 = make_routine_id();
 	int i, j;
-	struct arena *arena = &cl->predicate->pred->arena;
+	struct arena *arena = ctx->arena;
 
 	// a0 = output value
 	// a1 = words iterator
@@ -945,6 +1026,45 @@ static void comp_rev_lookup(struct program *prg, struct clause *cl, int mapnum)
 	begin_routine(labend2);
 }
 
+static uint16_t call_mode(struct astnode *an) {
+	uint16_t mask = 0;
+	int i;
+
+	for(i = 0; i < an->predicate->arity; i++) {
+		if(an->children[i]->unbound) mask |= 1 << i;
+	}
+
+	return mask;
+}
+
+static int count_bits(uint16_t mask) {
+	int n = 0;
+
+	while(mask) {
+		mask &= mask - 1;
+		n++;
+	}
+
+	return n;
+}
+
+static int invoke_target(struct astnode *an) {
+	struct predicate *pred = an->predicate->pred;
+	struct predname *target = an->predicate, *variant;
+	uint16_t mask = call_mode(an);
+	int i;
+
+	for(i = 0; i < pred->nvariant; i++) {
+		variant = pred->variants[i];
+		if(!(mask & ~variant->pred->unbound_in)
+		&& count_bits(variant->pred->unbound_in) < count_bits(target->pred->unbound_in)) {
+			target = variant;
+		}
+	}
+
+	return target->pred_id;
+}
+
 static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an, uint8_t *seen, int tail, uint32_t predflags, struct astnode **known_args) {
 	int i;
 	struct cinstr *ci;
@@ -1194,7 +1314,7 @@ static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an,
 			if(an->children[2]->kind == AN_VARIABLE) {
 				if(!an->children[2]->word->name[0]) {
 					ci = add_instr(I_COMPUTE_R);
-					ci->oper[2] = (value_t) {OPER_TEMP, ntemp++};
+					ci->oper[2] = (value_t) {OPER_TEMP, ctx->ntemp++};
 				} else if(seen[(vnum = findvar(cl, an->children[2]->word))]) {
 					ci = add_instr(I_COMPUTE_V);
 					ci->oper[2] = (value_t) {OPER_VAR, vnum};
@@ -1225,7 +1345,7 @@ static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an,
 			if(an->children[0]->kind == AN_VARIABLE) { // Variable
 				if(!an->children[0]->word->name[0]) { // Anonymous variable
 					ci = add_instr(I_COMPUTE_R);
-					ci->oper[2] = (value_t) {OPER_TEMP, ntemp++};
+					ci->oper[2] = (value_t) {OPER_TEMP, ctx->ntemp++};
 				} else if(seen[(vnum = findvar(cl, an->children[0]->word))]) { // Existing variable
 					ci = add_instr(I_COMPUTE_V);
 					ci->oper[2] = (value_t) {OPER_VAR, vnum};
@@ -1297,8 +1417,8 @@ static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an,
 			}
 			comp_value_into(cl, an->children[3], (value_t) {OPER_ARG, 3}, seen, known_args);
 		}
-		t1 = ntemp++;
-		t2 = ntemp++;
+		t1 = ctx->ntemp++;
+		t2 = ctx->ntemp++;
 		labloop = make_routine_id();
 		labmatch = make_routine_id();
 		lab = make_routine_id();
@@ -1486,14 +1606,12 @@ static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an,
 	if(an->predicate->builtin == BI_GLOBAL_STYLE) {
 		int box;
 		if(an->children[0]->kind == AN_DICTWORD) {
-			box = find_boxclass(prg, an->children[0]->word);
+			box = comp_boxclass(prg, an->children[0]->word->name);
 		} else {
-			report(
-				LVL_ERR,
+			comp_error(
 				an->line,
 				"The parameter of (body style $) must be a dictionary word."
 				);
-			prg->errorflag = 1;
 			box = -1;
 		}
 		ci = add_instr(I_BUILTIN);
@@ -1505,7 +1623,7 @@ static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an,
 	
 	if(an->predicate->builtin == BI_GLOBAL_UNSTYLE) {
 		// If this predicate is called, we make a special empty boxclass to use
-		find_boxclass(prg, find_word(prg, "*empty"));
+		(void) comp_boxclass(prg, "*empty");
 		// Then we handle it like any other builtin
 		ci = add_instr(I_BUILTIN);
 		ci->oper[2] = (value_t) {OPER_PRED, an->predicate->pred_id};
@@ -1588,7 +1706,7 @@ static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an,
 				v2 = comp_value(cl, an->children[1], seen, known_args);
 			}
 		}
-		t1 = ntemp++;
+		t1 = ctx->ntemp++;
 		ci = add_instr(i);
 		ci->oper[0] = v1;
 		ci->oper[1] = (value_t) {OPER_TEMP, t1};
@@ -1649,7 +1767,7 @@ static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an,
 				post_rule_trace(prg, cl, an, seen);
 				return 0;
 			} else {
-				an->predicate->pred->flags |= PREDF_NEEDS_LABEL;
+				comp_needs_label(an->predicate);
 				// compile to a regular query
 			}
 		} else {
@@ -1719,7 +1837,7 @@ static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an,
 		} else {
 			ci->subop = 0;
 		}
-		ci->oper[0] = (value_t) {OPER_PRED, an->predicate->pred_id};
+		ci->oper[0] = (value_t) {OPER_PRED, invoke_target(an)};
 		end_routine_cl(cl);
 		return 1;
 	} else {
@@ -1727,7 +1845,7 @@ static int comp_rule(struct program *prg, struct clause *cl, struct astnode *an,
 		ci = add_instr(I_SET_CONT);
 		ci->oper[0] = (value_t) {OPER_RLAB, lab};
 		ci = add_instr(I_INVOKE_ONCE + (an->subkind == RULE_MULTI));
-		ci->oper[0] = (value_t) {OPER_PRED, an->predicate->pred_id};
+		ci->oper[0] = (value_t) {OPER_PRED, invoke_target(an)};
 		end_routine_cl(cl);
 		memset(known_args, 0, MAXPARAM * sizeof(struct astnode *));
 		begin_routine(lab);
@@ -1751,14 +1869,12 @@ static void comp_now(struct program *prg, struct clause *cl, struct astnode *an,
 		if(an->kind == AN_NEG_BLOCK) {
 			an = an->children[0];
 			if(an->predicate->arity > 1 || (an->predicate->pred->flags & PREDF_GLOBAL_VAR)) {
-				report(LVL_ERR, an->line, "Invalid (now) syntax.");
-				prg->errorflag = 1;
+				comp_error(an->line, "Invalid (now) syntax.");
 				return;
 			}
 		}
 		if(!(an->predicate->pred->flags & PREDF_DYNAMIC)) {
-			report(LVL_ERR, an->line, "Cannot modify non-dynamic predicate.");
-			prg->errorflag = 1;
+			comp_error(an->line, "Cannot modify non-dynamic predicate.");
 		} else if(an->predicate->arity == 0) {
 			assert(an->predicate->dyn_id != DYN_NONE);
 			ci = add_instr(I_SET_GFLAG);
@@ -1795,8 +1911,7 @@ static void comp_now(struct program *prg, struct clause *cl, struct astnode *an,
 			an = an->children[0];
 		}
 		if(!(an->predicate->pred->flags & PREDF_DYNAMIC)) {
-			report(LVL_ERR, an->line, "Cannot modify non-dynamic predicate.");
-			prg->errorflag = 1;
+			comp_error(an->line, "Cannot modify non-dynamic predicate.");
 		} else if(an->predicate->arity == 0) {
 			assert(an->predicate->dyn_id != DYN_NONE);
 			ci = add_instr(I_SET_GFLAG);
@@ -1810,8 +1925,7 @@ static void comp_now(struct program *prg, struct clause *cl, struct astnode *an,
 					ci = add_instr(I_SET_GVAR);
 					ci->oper[0] = (value_t) {OPER_GVAR, an->predicate->dyn_var_id};
 				} else {
-					report(LVL_ERR, an->line, "When unsetting a global variable, the argument must be anonymous ($).");
-					prg->errorflag = 1;
+					comp_error(an->line, "When unsetting a global variable, the argument must be anonymous ($).");
 				}
 			} else {
 				assert(an->predicate->dyn_id != DYN_NONE);
@@ -1843,8 +1957,7 @@ static void comp_now(struct program *prg, struct clause *cl, struct astnode *an,
 					ci->oper[1] = v1;
 				}
 			} else {
-				report(LVL_ERR, an->line, "When unsetting a per-object variable, the second argument must be anonymous ($).");
-				prg->errorflag = 1;
+				comp_error(an->line, "When unsetting a per-object variable, the second argument must be anonymous ($).");
 			}
 		}
 	} else if(an->kind == AN_BLOCK || an->kind == AN_FIRSTRESULT) {
@@ -1852,8 +1965,7 @@ static void comp_now(struct program *prg, struct clause *cl, struct astnode *an,
 			comp_now(prg, cl, an, seen, known_args);
 		}
 	} else {
-		report(LVL_ERR, an->line, "Invalid (now) syntax.");
-		prg->errorflag = 1;
+		comp_error(an->line, "Invalid (now) syntax.");
 	}
 }
 
@@ -2119,9 +2231,7 @@ static void comp_body(struct program *prg, struct clause *cl, struct astnode *an
 				if(an->subkind == SEL_STOPPING
 				&& an->nchild == 2
 				&& (prg->optflags & OPTF_SIMPLE_SELECT)) {
-					dyn_id = prg->nglobalflag++;
-					prg->globalflagpred = realloc(prg->globalflagpred, prg->nglobalflag * sizeof(struct predname *));
-					prg->globalflagpred[dyn_id] = 0;
+					dyn_id = ctx->deferred->nflag0 + ctx->deferred->nanonflag++;
 					lab = make_routine_id();
 					ci = add_instr(I_IF_GFLAG);
 					ci->oper[0] = (value_t) {OPER_GFLAG, dyn_id};
@@ -2308,17 +2418,15 @@ static void comp_body(struct program *prg, struct clause *cl, struct astnode *an
 			vnum = findvar(cl, an->word);
 			
 			if(an->children[0]->kind == AN_DICTWORD) {
-				box = find_boxclass(prg, an->children[0]->word);
+				box = comp_boxclass(prg, an->children[0]->word->name);
 			} else {
-				report(
-					LVL_ERR,
+				comp_error(
 					an->line,
 					"The parameter of %s must be a dictionary word.",
 					(an->kind == AN_STATUSAREA || an->kind == AN_STATUSAREA_OVERRIDE)?
 						(an->subkind == AREA_TOP)? "(status bar $)" : "(inline status bar $)"
 					:
 						(an->subkind == BOX_SPAN)? "(span $)" : "(div $)");
-				prg->errorflag = 1;
 				box = -1;
 			}
 			
@@ -2596,7 +2704,7 @@ static void comp_body(struct program *prg, struct clause *cl, struct astnode *an
 			comp_now(prg, cl, an->children[0], seen, known_args);
 			break;
 		case AN_BAREWORD:
-			if(ninstr && (ci = &instrbuf[ninstr - 1])->op == I_PRINT_WORDS) {
+			if(ctx->ninstr && (ci = &ctx->instrbuf[ctx->ninstr - 1])->op == I_PRINT_WORDS) {
 				if(ci->oper[1].tag == VAL_NONE) {
 					ci->oper[1] = (value_t) {OPER_WORD, an->word->word_id};
 				} else if(ci->oper[2].tag == VAL_NONE) {
@@ -2661,9 +2769,10 @@ static void comp_body(struct program *prg, struct clause *cl, struct astnode *an
 
 struct index_entry {
 	value_t		key;
-	uint16_t	n_drop_from_arg0;
+	uint16_t	n_drop_from_arg;
 	uint16_t	n_drop_from_body;
 	uint16_t	clause_id;
+	uint8_t		argno;
 };
 
 static int cmp_index_entry(const void *a, const void *b) {
@@ -2679,17 +2788,17 @@ static int cmp_index_entry(const void *a, const void *b) {
 	return diff;
 }
 
-static void parse_index_entry(struct predicate *pred, struct index_entry *entry, struct astnode **arg0, struct astnode **body) {
+static void parse_index_entry(struct predicate *pred, struct index_entry *entry, struct astnode **arg, struct astnode **body) {
 	struct astnode *an;
 	int i;
 
-	assert(pred->predname->arity);
-	an = pred->clauses[entry->clause_id]->params[0];
-	for(i = 0; i < entry->n_drop_from_arg0; i++) {
+	assert(entry->argno < pred->predname->arity);
+	an = pred->clauses[entry->clause_id]->params[entry->argno];
+	for(i = 0; i < entry->n_drop_from_arg; i++) {
 		assert(an->kind == AN_PAIR);
 		an = an->children[1];
 	}
-	*arg0 = an;
+	*arg = an;
 	an = pred->clauses[entry->clause_id]->body;
 	for(i = 0; i < entry->n_drop_from_body; i++) {
 		an = an->next_in_body;
@@ -2701,15 +2810,14 @@ static int number_of_identical_keys(struct index_entry *entry, int nentry) {
 	int i = 1;
 
 	while(i < nentry
-	&& entry[i].key.tag == entry[0].key.tag
-	&& entry[i].key.value == entry[0].key.value) {
+	&& VALUE_EQ(entry[i].key, entry[0].key)) {
 		i++;
 	}
 
 	return i;
 }
 
-static void comp_clause(struct program *prg, struct predicate *pred, struct index_entry *entry, int ignore_arg0) {
+static void comp_clause(struct program *prg, struct predicate *pred, struct index_entry *entry, int ignore_arg) {
 	struct cinstr *ci;
 	int i, j, vnum;
 	struct clause *cl = pred->clauses[entry->clause_id];
@@ -2720,9 +2828,10 @@ static void comp_clause(struct program *prg, struct predicate *pred, struct inde
 	struct clause_code *cc;
 
 	for(cc = cl->entrypoints; cc; cc = cc->next) {
-		if(entry->n_drop_from_arg0 == cc->ndrop_arg0
+		if(entry->argno == cc->argno
+		&& entry->n_drop_from_arg == cc->ndrop_arg
 		&& entry->n_drop_from_body == cc->ndrop_body
-		&& !!ignore_arg0 == cc->ignore_arg0) {
+		&& !!ignore_arg == cc->ignore_arg) {
 			ci = add_instr(I_JUMP);
 			ci->oper[0] = (value_t) {OPER_RLAB, cc->routine_id};
 			end_routine_cl(cl);
@@ -2731,10 +2840,11 @@ static void comp_clause(struct program *prg, struct predicate *pred, struct inde
 	}
 
 	cc = arena_alloc(cl->arena, sizeof(*cc));
-	cc->ndrop_arg0 = entry->n_drop_from_arg0;
+	cc->argno = entry->argno;
+	cc->ndrop_arg = entry->n_drop_from_arg;
 	cc->ndrop_body = entry->n_drop_from_body;
 	cc->routine_id = make_routine_id();
-	cc->ignore_arg0 = !!ignore_arg0;
+	cc->ignore_arg = !!ignore_arg;
 	cc->next = cl->entrypoints;
 	cl->entrypoints = cc;
 	ci = add_instr(I_JUMP);
@@ -2744,7 +2854,7 @@ static void comp_clause(struct program *prg, struct predicate *pred, struct inde
 	begin_routine(cc->routine_id);
 
 	memset(seen, 0, cl->nvar);
-	ntemp = 0;
+	ctx->ntemp = 0;
 
 	ci = add_instr(I_ALLOCATE);
 	ci->subop = 1;
@@ -2760,14 +2870,14 @@ static void comp_clause(struct program *prg, struct predicate *pred, struct inde
 
 	for(i = 0; i < cl->predicate->arity; i++) {
 		an = cl->params[i];
-		if(!i) {
-			for(j = 0; j < entry->n_drop_from_arg0 - !!ignore_arg0; j++) {
+		if(i == entry->argno) {
+			for(j = 0; j < entry->n_drop_from_arg - !!ignore_arg; j++) {
 				assert(an->kind == AN_PAIR);
 				an = an->children[1];
 			}
 		}
-		if(i || !ignore_arg0) {
-			if(cl->predicate->pred->unbound_in & (1 << i)) all_seen_are_bound = 0;
+		if(i != entry->argno || !ignore_arg) {
+			if(pred->unbound_in & (1 << i)) all_seen_are_bound = 0;
 			comp_param(
 				cl,
 				an,
@@ -2777,7 +2887,7 @@ static void comp_clause(struct program *prg, struct predicate *pred, struct inde
 				all_seen_are_bound);
 		}
 #if 0
-		if(!i && ignore_arg0) {
+		if(i == entry->argno && ignore_arg) {
 			printf("would ignore ");
 			pp_expr(an);
 			printf(" in %s\n", pred->predname->printed_name);
@@ -2811,11 +2921,10 @@ static void comp_clause(struct program *prg, struct predicate *pred, struct inde
 
 	comp_body(prg, cl, body, seen, CONT_TAIL, pred->flags, known_args);
 
-	if(ntemp >= prg->max_temp) {
-		report(LVL_ERR, cl->line, "Rule too complex. Try breaking it into smaller parts.");
-		prg->errorflag = 1;
+	if(ctx->ntemp >= prg->max_temp) {
+		comp_error(cl->line, "Rule too complex. Try breaking it into smaller parts.");
 	}
-	cl->next_temp = ntemp;
+	cl->next_temp = ctx->ntemp;
 }
 
 static int is_indexable_value(struct astnode *param, struct astnode *body, int *nval) {
@@ -2866,27 +2975,40 @@ static int can_be_indirectly_indexed(struct predicate *pred, struct index_entry
 	}
 }
 
-static void comp_clause_chain_unbound(struct program *prg, struct predicate *pred, struct index_entry *entries, int nentry, int ignore_arg0) {
+// Clauses are tried in order by pushing a choice point before each one but
+// the last. The choice point resumes at the returned label, where it must be
+// popped before the next alternative.
+
+static int comp_push_alternative(int narg) {
+	struct cinstr *ci;
+	int next = make_routine_id();
+
+	ci = add_instr(I_PUSH_CHOICE);
+	ci->oper[0] = (value_t) {OPER_NUM, narg};
+	ci->oper[1] = (value_t) {OPER_RLAB, next};
+
+	return next;
+}
+
+static void comp_pop_alternative(int narg, int next) {
+	struct cinstr *ci;
+
+	begin_routine(next);
+	ci = add_instr(I_POP_CHOICE);
+	ci->oper[0] = (value_t) {OPER_NUM, narg};
+}
+
+static void comp_clause_chain_unbound(struct program *prg, struct predicate *pred, struct index_entry *entries, int nentry, int ignore_arg) {
 	int i, last, narg;
 	int next = -1;
-	struct cinstr *ci;
 
 	assert(nentry);
 	narg = pred->predname->arity + !!(pred->flags & PREDF_CONTAINS_JUST);
 	for(i = 0; i < nentry; i++) {
 		last = (i == nentry - 1);
-		if(!last) {
-			next = make_routine_id();
-			ci = add_instr(I_PUSH_CHOICE);
-			ci->oper[0] = (value_t) {OPER_NUM, narg};
-			ci->oper[1] = (value_t) {OPER_RLAB, next};
-		}
-		comp_clause(prg, pred, &entries[i], ignore_arg0);
-		if(!last) {
-			begin_routine(next);
-			ci = add_instr(I_POP_CHOICE);
-			ci->oper[0] = (value_t) {OPER_NUM, narg};
-		}
+		if(!last) next = comp_push_alternative(narg);
+		comp_clause(prg, pred, &entries[i], ignore_arg);
+		if(!last) comp_pop_alternative(narg, next);
 	}
 }
 
@@ -2906,17 +3028,19 @@ static int comp_direct_index_entry(struct program *prg, struct predicate *pred,
 		for(an = body->children[1]; an->kind != AN_EMPTY_LIST; an = an->children[1]) {
 			assert(an->kind == AN_PAIR);
 			dest[count].key = comp_resolve_value(prg, comp_tag_simple(an->children[0]));
-			dest[count].n_drop_from_arg0 = src->n_drop_from_arg0;
+			dest[count].n_drop_from_arg = src->n_drop_from_arg;
 			dest[count].n_drop_from_body = 1 + src->n_drop_from_body;
 			dest[count].clause_id = src->clause_id;
+			dest[count].argno = src->argno;
 			count++;
 		}
 		return count;
 	} else {
 		dest->key = comp_resolve_value(prg, comp_tag_simple(param));
-		dest->n_drop_from_arg0 = src->n_drop_from_arg0;
+		dest->n_drop_from_arg = src->n_drop_from_arg;
 		dest->n_drop_from_body = src->n_drop_from_body;
 		dest->clause_id = src->clause_id;
+		dest->argno = src->argno;
 		return 1;
 	}
 }
@@ -2944,24 +3068,26 @@ static int comp_indirect_index_entry(struct program *prg, struct predicate *pred
 		for(an = body->children[1]; an->kind != AN_EMPTY_LIST; an = an->children[1]) {
 			assert(an->kind == AN_PAIR);
 			dest[count].key = comp_resolve_value(prg, comp_tag_simple(an->children[0]));
-			dest[count].n_drop_from_arg0 = 1 + src->n_drop_from_arg0;
+			dest[count].n_drop_from_arg = 1 + src->n_drop_from_arg;
 			dest[count].n_drop_from_body = 1 + src->n_drop_from_body;
 			dest[count].clause_id = src->clause_id;
+			dest[count].argno = src->argno;
 			count++;
 		}
 		return count;
 	} else {
 		dest->key = comp_resolve_value(prg, comp_tag_simple(param));
-		dest->n_drop_from_arg0 = 1 + src->n_drop_from_arg0;
+		dest->n_drop_from_arg = 1 + src->n_drop_from_arg;
 		dest->n_drop_from_body = src->n_drop_from_body;
 		dest->clause_id = src->clause_id;
+		dest->argno = src->argno;
 		return 1;
 	}
 
 	return count;
 }
 
-static void comp_clause(struct program *prg, struct predicate *pred, struct index_entry *entry, int ignore_arg0);
+static void comp_clause(struct program *prg, struct predicate *pred, struct index_entry *entry, int ignore_arg);
 static void comp_clause_chain(struct program *prg, struct predicate *pred, struct index_entry *entries, int nentry);
 
 struct index_target {
@@ -2979,7 +3105,7 @@ static int find_index_target(struct index_target *table, int *size, struct index
 		if(t->nentry == nentry) {
 			for(j = 0; j < nentry; j++) {
 				if(entries[first + j].clause_id != entries[t->first + j].clause_id
-				|| entries[first + j].n_drop_from_arg0 != entries[t->first + j].n_drop_from_arg0
+				|| entries[first + j].n_drop_from_arg != entries[t->first + j].n_drop_from_arg
 				|| entries[first + j].n_drop_from_body != entries[t->first + j].n_drop_from_body) {
 					break;
 				}
@@ -3069,10 +3195,10 @@ static void comp_direct_index_block(struct program *prg, struct predicate *pred,
 	}
 
 	if(nfork == 1) {
-		comp_index_check_and_go(prg, pred, entries, nval, nfork, 0, (value_t) {OPER_ARG, 0});
+		comp_index_check_and_go(prg, pred, entries, nval, nfork, 0, (value_t) {OPER_ARG, entries[0].argno});
 	} else {
 		ci = add_instr(I_PREPARE_INDEX);
-		ci->oper[0] = (value_t) {OPER_ARG, 0};
+		ci->oper[0] = (value_t) {OPER_ARG, entries[0].argno};
 		comp_index_check_and_go(prg, pred, entries, nval, nfork, 0, (value_t) {VAL_NONE});
 	}
 }
@@ -3137,10 +3263,96 @@ static void comp_indirect_index_block(struct program *prg, struct predicate *pre
 	}
 }
 
+static int can_be_secondarily_indexed(struct predicate *pred, struct index_entry *entry, int argno, int *nval) {
+	struct clause *cl = pred->clauses[entry->clause_id];
+	struct astnode *param = cl->params[argno];
+	int i;
+
+	if(entry->n_drop_from_arg || entry->n_drop_from_body) return 0;
+
+	// The parameter won't be unified when we get there via the index, so
+	// it mustn't bind a variable that the other parameters depend on.
+	if(param->kind == AN_VARIABLE) {
+		for(i = 0; i < pred->predname->arity; i++) {
+			if(i != argno && variable_mentioned_in(param->word, cl->params[i])) {
+				return 0;
+			}
+		}
+	}
+
+	return is_indexable_value(param, cl->body, nval);
+}
+
+static int find_secondary_index(struct predicate *pred, struct index_entry *entries, int nentry, int first_arg, int *chunkcount, int *nval) {
+	int argno, best = -1, count, n;
+
+	*chunkcount = 0;
+	*nval = 0;
+	if(pred->flags & PREDF_FIXED_FLAG) return -1;
+
+	for(argno = first_arg; argno < pred->predname->arity; argno++) {
+		n = 0;
+		for(count = 0; count < nentry; count++) {
+			if(!can_be_secondarily_indexed(pred, &entries[count], argno, &n)) break;
+		}
+		if(count > 1 && count > *chunkcount) {
+			best = argno;
+			*chunkcount = count;
+			*nval = n;
+		}
+	}
+
+	return best;
+}
+
+static void comp_direct_index_chunk(struct program *prg, struct predicate *pred, struct index_entry *entries, int nentry, int nval);
+
+static void comp_secondary_chunk(struct program *prg, struct predicate *pred, struct index_entry *entries, int nentry, int argno, int nval) {
+	struct index_entry sub[nentry];
+	int i;
+
+	for(i = 0; i < nentry; i++) {
+		sub[i] = entries[i];
+		sub[i].argno = argno;
+	}
+	comp_direct_index_chunk(prg, pred, sub, nentry, nval);
+}
+
+static void comp_secondary_chain(struct program *prg, struct predicate *pred, struct index_entry *entries, int nentry, int first_arg) {
+	int argno, chunkcount, nval;
+
+	argno = find_secondary_index(pred, entries, nentry, first_arg, &chunkcount, &nval);
+	if(argno >= 0 && chunkcount == nentry) {
+		comp_secondary_chunk(prg, pred, entries, nentry, argno, nval);
+	} else {
+		comp_clause_chain_unbound(prg, pred, entries, nentry, 0);
+	}
+}
+
+static void comp_direct_index_chunk(struct program *prg, struct predicate *pred, struct index_entry *entries, int nentry, int nval) {
+	int argno = entries[0].argno;
+	int lab;
+	struct cinstr *ci;
+
+	if(!(prg->optflags & OPTF_BOUND_PARAMS)
+	|| (pred->unbound_in & (1 << argno))
+	|| (pred->flags & PREDF_DYNAMIC)) {
+		lab = make_routine_id();
+		ci = add_instr(I_IF_BOUND);
+		ci->subop = 1;
+		ci->oper[0] = (value_t) {OPER_ARG, argno};
+		ci->implicit = lab;
+		comp_direct_index_block(prg, pred, entries, nentry, nval);
+		begin_routine(lab);
+		comp_secondary_chain(prg, pred, entries, nentry, argno + 1);
+	} else {
+		comp_direct_index_block(prg, pred, entries, nentry, nval);
+	}
+}
+
 static void comp_clause_chain(struct program *prg, struct predicate *pred, struct index_entry *entries, int nentry) {
-	int i, last, narg, chunkcount, nval;
+	int i, last, narg, chunkcount, nval, argno;
 	int next = -1, lab;
-	struct cinstr *ci;
 
 	assert(nentry);
 	narg = pred->predname->arity + !!(pred->flags & PREDF_CONTAINS_JUST);
@@ -3152,35 +3364,13 @@ static void comp_clause_chain(struct program *prg, struct predicate *pred, struc
 				chunkcount++;
 			}
 			last = (i + chunkcount == nentry);
-			if(!last) {
-				next = make_routine_id();
-				ci = add_instr(I_PUSH_CHOICE);
-				ci->oper[0] = (value_t) {OPER_NUM, narg};
-				ci->oper[1] = (value_t) {OPER_RLAB, next};
-			}
+			if(!last) next = comp_push_alternative(narg);
 			if(nval > 1) {
-				if(!(prg->optflags & OPTF_BOUND_PARAMS)
-				|| (pred->unbound_in & 1)
-				|| (pred->flags & PREDF_DYNAMIC)) {
-					lab = make_routine_id();
-					ci = add_instr(I_IF_BOUND);
-					ci->subop = 1;
-					ci->oper[0] = (value_t) {OPER_ARG, 0};
-					ci->implicit = lab;
-					comp_direct_index_block(prg, pred, entries + i, chunkcount, nval);
-					begin_routine(lab);
-					comp_clause_chain_unbound(prg, pred, entries + i, chunkcount, 0);
-				} else {
-					comp_direct_index_block(prg, pred, entries + i, chunkcount, nval);
-				}
+				comp_direct_index_chunk(prg, pred, entries + i, chunkcount, nval);
 			} else {
 				comp_clause(prg, pred, &entries[i], 0);
 			}
-			if(!last) {
-				begin_routine(next);
-				ci = add_instr(I_POP_CHOICE);
-				ci->oper[0] = (value_t) {OPER_NUM, narg};
-			}
+			if(!last) comp_pop_alternative(narg, next);
 			i += chunkcount;
 		} else if(can_be_indirectly_indexed(pred, &entries[i], &nval)) {
 			chunkcount = 1;
@@ -3188,12 +3378,7 @@ static void comp_clause_chain(struct program *prg, struct predicate *pred, struc
 				chunkcount++;
 			}
 			last = (i + chunkcount == nentry);
-			if(!last) {
-				next = make_routine_id();
-				ci = add_instr(I_PUSH_CHOICE);
-				ci->oper[0] = (value_t) {OPER_NUM, narg};
-				ci->oper[1] = (value_t) {OPER_RLAB, next};
-			}
+			if(!last) next = comp_push_alternative(narg);
 			if(nval > 1) {
 				if(!(prg->optflags & OPTF_BOUND_PARAMS)
 				|| (pred->unbound_in & 1)
@@ -3201,33 +3386,26 @@ static void comp_clause_chain(struct program *prg, struct predicate *pred, struc
 					lab = make_routine_id();
 					comp_indirect_index_block(prg, pred, entries + i, chunkcount, nval, lab);
 					begin_routine(lab);
-					comp_clause_chain_unbound(prg, pred, entries + i, chunkcount, 0);
+					comp_secondary_chain(prg, pred, entries + i, chunkcount, 1);
 				} else {
 					comp_indirect_index_block(prg, pred, entries + i, chunkcount, nval, -1);
 				}
 			} else {
 				comp_clause(prg, pred, &entries[i], 0);
 			}
-			if(!last) {
-				begin_routine(next);
-				ci = add_instr(I_POP_CHOICE);
-				ci->oper[0] = (value_t) {OPER_NUM, narg};
-			}
+			if(!last) comp_pop_alternative(narg, next);
+			i += chunkcount;
+		} else if((argno = find_secondary_index(pred, entries + i, nentry - i, 1, &chunkcount, &nval)) >= 0) {
+			last = (i + chunkcount == nentry);
+			if(!last) next = comp_push_alternative(narg);
+			comp_secondary_chunk(prg, pred, entries + i, chunkcount, argno, nval);
+			if(!last) comp_pop_alternative(narg, next);
 			i += chunkcount;
 		} else {
 			last = (i + 1 == nentry);
-			if(!last) {
-				next = make_routine_id();
-				ci = add_instr(I_PUSH_CHOICE);
-				ci->oper[0] = (value_t) {OPER_NUM, narg};
-				ci->oper[1] = (value_t) {OPER_RLAB, next};
-			}
+			if(!last) next = comp_push_alternative(narg);
 			comp_clause(prg, pred, &entries[i], 0);
-			if(!last) {
-				begin_routine(next);
-				ci = add_instr(I_POP_CHOICE);
-				ci->oper[0] = (value_t) {OPER_NUM, narg};
-			}
+			if(!last) comp_pop_alternative(narg, next);
 			i++;
 		}
 	}
@@ -3244,7 +3422,7 @@ static int can_eliminate_push_choice(
 	int arity)
 {
 	int i, j, retval = 1;
-	struct comp_routine *r = &routines[rnum];
+	struct comp_routine *r = &ctx->routines[rnum];
 
 	if(!inum) {
 		if(visited[rnum]) {
@@ -3254,7 +3432,7 @@ static int can_eliminate_push_choice(
 			// don't perform the optimization.
 			visited[rnum] = 1;
 		}
-		if(routines[rnum].n_edge_in > 1) {
+		if(ctx->routines[rnum].n_edge_in > 1) {
 			shared_path = 1;
 		}
 	}
@@ -3355,13 +3533,13 @@ static int can_eliminate_save_choice(
 	uint8_t *visited)
 {
 	int i, j, retval = 0;
-	struct comp_routine *r = &routines[rnum];
+	struct comp_routine *r = &ctx->routines[rnum];
 
 	if(!inum) {
 		if(visited[rnum]) {
 			return visited[rnum] - 1;
 		}
-		if(routines[rnum].n_edge_in > 1) {
+		if(ctx->routines[rnum].n_edge_in > 1) {
 			visited[rnum] = 1;
 			return 0;
 		}
@@ -3369,8 +3547,7 @@ static int can_eliminate_save_choice(
 
 	for(i = inum; i < r->ninstr; i++) {
 		if(r->instr[i].op == I_RESTORE_CHOICE) {
-			if(r->instr[i].oper[0].tag == restore_var.tag
-			&& r->instr[i].oper[0].value == restore_var.value) {
+			if(VALUE_EQ(r->instr[i].oper[0], restore_var)) {
 				*restore_instr = &r->instr[i];
 				retval = 1;
 			}
@@ -3434,7 +3611,7 @@ static void do_eliminate_push_choice(struct comp_routine *r, int inum, uint16_t
 			} else {
 				if(!visited[r->instr[i].implicit]) {
 					visited[r->instr[i].implicit] = 1;
-					do_eliminate_push_choice(&routines[r->instr[i].implicit], 0, fail_lab, visited);
+					do_eliminate_push_choice(&ctx->routines[r->instr[i].implicit], 0, fail_lab, visited);
 				}
 			}
 		}
@@ -3445,7 +3622,7 @@ static void do_eliminate_push_choice(struct comp_routine *r, int inum, uint16_t
 			} else if(r->instr[i].oper[j].tag == OPER_RLAB) {
 				if(!visited[r->instr[i].oper[j].value]) {
 					visited[r->instr[i].oper[j].value] = 1;
-					do_eliminate_push_choice(&routines[r->instr[i].oper[j].value], 0, fail_lab, visited);
+					do_eliminate_push_choice(&ctx->routines[r->instr[i].oper[j].value], 0, fail_lab, visited);
 				}
 			}
 		}
@@ -3456,16 +3633,16 @@ static int try_eliminate_push_choice(int rnum, int i, struct program *prg, uint8
 	uint16_t fail_lab;
 	struct cinstr *pop_instr, *cut_instr;
 	int any = 0;
-	struct comp_routine *r = &routines[rnum];
+	struct comp_routine *r = &ctx->routines[rnum];
 
 	assert(r->instr[i].op == I_PUSH_CHOICE);
 	assert(r->instr[i].oper[1].tag == OPER_RLAB);
 
 	fail_lab = r->instr[i].oper[1].value;
-	pop_instr = &routines[fail_lab].instr[0];
+	pop_instr = &ctx->routines[fail_lab].instr[0];
 	cut_instr = 0;
 
-	memset(visited, 0, nroutine);
+	memset(visited, 0, ctx->nroutine);
 	if(can_eliminate_push_choice(
 		rnum,
 		i + 1,
@@ -3477,7 +3654,7 @@ static int try_eliminate_push_choice(int rnum, int i, struct program *prg, uint8
 		r->instr[i].oper[0].value))
 	{
 		any = 1;
-		memset(visited, 0, nroutine);
+		memset(visited, 0, ctx->nroutine);
 		do_eliminate_push_choice(r, i + 1, fail_lab, visited);
 		r->instr[i].op = I_NOP;
 		memset(r->instr[i].oper, 0, sizeof(r->instr[i].oper));
@@ -3496,7 +3673,7 @@ static int try_eliminate_push_choice(int rnum, int i, struct program *prg, uint8
 static int try_eliminate_save_choice(int rnum, int i, struct program *prg, uint8_t *visited) {
 	struct cinstr *restore_instr;
 	int any = 0;
-	struct comp_routine *r = &routines[rnum];
+	struct comp_routine *r = &ctx->routines[rnum];
 
 	assert(r->instr[i].op == I_SAVE_CHOICE);
 
@@ -3519,24 +3696,24 @@ static int optimize_choice_frames(struct program *prg) {
 	int rnum, i;
 	struct comp_routine *r;
 	int any = 0;
-	uint8_t visited[nroutine];
+	uint8_t visited[ctx->nroutine];
 
-	memset(visited, 0, nroutine);
-	for(rnum = nroutine - 1; rnum >= 0; rnum--) {
-		r = &routines[rnum];
+	memset(visited, 0, ctx->nroutine);
+	for(rnum = ctx->nroutine - 1; rnum >= 0; rnum--) {
+		r = &ctx->routines[rnum];
 		for(i = r->ninstr - 1; i >= 0; i--) {
 			if(r->instr[i].op == I_PUSH_CHOICE) {
 				any |= try_eliminate_push_choice(rnum, i, prg, visited);
 			}
 		}
 	}
-	for(rnum = nroutine - 1; rnum >= 0; rnum--) {
-		r = &routines[rnum];
+	for(rnum = ctx->nroutine - 1; rnum >= 0; rnum--) {
+		r = &ctx->routines[rnum];
 		for(i = r->ninstr - 1; i >= 0; i--) {
 			if(r->instr[i].op == I_SAVE_CHOICE
 			&& r->instr[i].subop
 			&& r->instr[i].oper[0].tag == OPER_TEMP) {
-				memset(visited, 0, nroutine);
+				memset(visited, 0, ctx->nroutine);
 				any |= try_eliminate_save_choice(rnum, i, prg, visited);
 			}
 		}
@@ -3547,7 +3724,7 @@ static int optimize_choice_frames(struct program *prg) {
 
 static int eliminate_env_visitor(uint16_t rnum, int inum, int edit, uint8_t *visited) {
 	int i, j, retval = 1;
-	struct comp_routine *r = &routines[rnum];
+	struct comp_routine *r = &ctx->routines[rnum];
 
 	if(!inum && visited[rnum]) {
 		return visited[rnum] - 1;
@@ -3590,7 +3767,7 @@ static int eliminate_env_visitor(uint16_t rnum, int inum, int edit, uint8_t *vis
 }
 
 static int try_eliminate_env(uint16_t rnum, int i, uint8_t *visited) {
-	struct comp_routine *r = &routines[rnum];
+	struct comp_routine *r = &ctx->routines[rnum];
 	int any = 0;
 
 	assert(r->instr[i].oper[0].tag == OPER_NUM);
@@ -3599,9 +3776,9 @@ static int try_eliminate_env(uint16_t rnum, int i, uint8_t *visited) {
 			any = 1;
 			r->instr[i].op = I_NOP;
 			memset(r->instr[i].oper, 0, sizeof(r->instr[i].oper));
-			memset(visited, 0, nroutine);
+			memset(visited, 0, ctx->nroutine);
 			(void) eliminate_env_visitor(rnum, i + 1, 1, visited);
-			memset(visited, 0, nroutine);
+			memset(visited, 0, ctx->nroutine);
 		}
 	}
 
@@ -3612,12 +3789,12 @@ static int optimize_env_frames(struct program *prg) {
 	int rnum, i;
 	struct comp_routine *r;
 	int any = 0;
-	uint8_t visited[nroutine];
+	uint8_t visited[ctx->nroutine];
 
-	memset(visited, 0, nroutine);
+	memset(visited, 0, ctx->nroutine);
 	if(prg->optflags & OPTF_ENV_FRAMES) {
-		for(rnum = nroutine - 1; rnum >= 0; rnum--) {
-			r = &routines[rnum];
+		for(rnum = ctx->nroutine - 1; rnum >= 0; rnum--) {
+			r = &ctx->routines[rnum];
 			for(i = r->ninstr - 1; i >= 0; i--) {
 				if(r->instr[i].op == I_ALLOCATE) {
 					any |= try_eliminate_env(rnum, i, visited);
@@ -3644,8 +3821,8 @@ static int optimize_vars(struct program *prg, struct predicate *pred) {
 		struct cinstr *tempdef[cl->next_temp];
 
 		memset(tempseen, 0, cl->next_temp);
-		for(rnum = 0; rnum < nroutine; rnum++) {
-			r = &routines[rnum];
+		for(rnum = 0; rnum < ctx->nroutine; rnum++) {
+			r = &ctx->routines[rnum];
 			if(r->clause_id == cnum && r->reftrack != 0xffff) {
 				for(i = 0; i < r->ninstr; i++) {
 					ci = &r->instr[i];
@@ -3693,8 +3870,8 @@ static int optimize_vars(struct program *prg, struct predicate *pred) {
 			memset(seen_in, 0xff, cl->nvar * sizeof(uint16_t));
 			memset(multi, 0, cl->nvar);
 
-			for(rnum = 0; rnum < nroutine; rnum++) {
-				r = &routines[rnum];
+			for(rnum = 0; rnum < ctx->nroutine; rnum++) {
+				r = &ctx->routines[rnum];
 				if(r->clause_id == cnum && r->reftrack != 0xffff) {
 					for(i = 0; i < r->ninstr; i++) {
 						ci = &r->instr[i];
@@ -3733,8 +3910,8 @@ static int optimize_vars(struct program *prg, struct predicate *pred) {
 			if(cl->nvar && !nextvar) eliminated++;
 
 			if(any || nextvar != cl->nvar) {
-				for(rnum = 0; rnum < nroutine; rnum++) {
-					r = &routines[rnum];
+				for(rnum = 0; rnum < ctx->nroutine; rnum++) {
+					r = &ctx->routines[rnum];
 					if(r->clause_id == cnum) {
 						for(i = 0; i < r->ninstr; i++) {
 							ci = &r->instr[i];
@@ -3767,7 +3944,7 @@ static int optimize_vars(struct program *prg, struct predicate *pred) {
 }
 
 static int try_reftrack_from(int rnum, int group, int force) {
-	struct comp_routine *r = &routines[rnum];
+	struct comp_routine *r = &ctx->routines[rnum];
 	int i;
 
 	//printf("r%d g%d f%d rt%04x\n", rnum, group, force, r->reftrack);
@@ -3808,30 +3985,68 @@ static int try_reftrack_from(int rnum, int group, int force) {
 	return 1;
 }
 
-static void track_refs(struct predicate *pred) {
-	int i, j, k;
+// A run of CHECK_INDEX instructions is dense if the keys are all objects, or
+// all numbers, and fill a large enough part of their range. The Z-machine
+// backend turns dense runs into jump tables, so the targets must be compiled as
+// separate routines.
+
+#define JUMPTABLE_MIN		16
+#define JUMPTABLE_DENSITY	3	// at most this many slots per key
+
+int comp_dense_index(struct cinstr *ci, int n) {
+	int i, min, max;
+
+	if(n < JUMPTABLE_MIN) return 0;
+	if(ci[0].oper[0].tag != VAL_OBJ && ci[0].oper[0].tag != VAL_NUM) return 0;
+
+	min = max = ci[0].oper[0].value;
+	for(i = 1; i < n; i++) {
+		if(ci[i].oper[0].tag != ci[0].oper[0].tag) return 0;
+		if(min > ci[i].oper[0].value) min = ci[i].oper[0].value;
+		if(max < ci[i].oper[0].value) max = ci[i].oper[0].value;
+	}
+
+	return max - min + 1 <= n * JUMPTABLE_DENSITY;
+}
+
+static void track_refs(struct program *prg, struct predicate *pred) {
+	int i, j, k, n;
 	struct comp_routine *r;
 
 	//printf("%s\n", pred->predname->printed_name);
 
-	for(i = 0; i < nroutine; i++) {
-		routines[i].reftrack = 0xffff;
+	for(i = 0; i < ctx->nroutine; i++) {
+		ctx->routines[i].reftrack = 0xffff;
 	}
 
-	routines[pred->normal_entry].reftrack = pred->normal_entry;
+	ctx->routines[pred->normal_entry].reftrack = pred->normal_entry;
 	if(pred->initial_value_entry >= 0) {
-		routines[pred->initial_value_entry].reftrack = pred->initial_value_entry;
+		ctx->routines[pred->initial_value_entry].reftrack = pred->initial_value_entry;
 	}
 
-	for(i = 0; i < nroutine; i++) {
-		r = &routines[i];
+	for(i = 0; i < ctx->nroutine; i++) {
+		r = &ctx->routines[i];
 		for(j = 0; j < r->ninstr; j++) {
+			if(r->instr[j].op == I_CHECK_INDEX
+			&& (prg->optflags & OPTF_JUMP_TABLES)
+			&& (!j || r->instr[j - 1].op != I_CHECK_INDEX)) {
+				n = 1;
+				while(j + n < r->ninstr && r->instr[j + n].op == I_CHECK_INDEX) n++;
+				if(comp_dense_index(&r->instr[j], n)) {
+					for(k = j; k < j + n; k++) {
+						if(r->instr[k].oper[1].tag == OPER_RLAB) {
+							ctx->routines[r->instr[k].oper[1].value].reftrack =
+								r->instr[k].oper[1].value;
+						}
+					}
+				}
+			}
 			if(r->instr[j].op != I_CHECK_INDEX
 			&& r->instr[j].op != I_CHECK_WORDMAP
 			&& r->instr[j].op != I_JUMP) {
 				for(k = 0; k < 3; k++) {
 					if(r->instr[j].oper[k].tag == OPER_RLAB) {
-						routines[r->instr[j].oper[k].value].reftrack =
+						ctx->routines[r->instr[j].oper[k].value].reftrack =
 							r->instr[j].oper[k].value;
 					}
 				}
@@ -3840,23 +4055,23 @@ static void track_refs(struct predicate *pred) {
 	}
 
 	do {
-		for(i = 0; i < nroutine; i++) {
-			r = &routines[i];
+		for(i = 0; i < ctx->nroutine; i++) {
+			r = &ctx->routines[i];
 			if(r->reftrack == i) {
 				if(!try_reftrack_from(i, i, 1)) {
-					for(j = 0; j < nroutine; j++) {
-						if(routines[j].reftrack != j) {
-							routines[j].reftrack = 0xffff;
+					for(j = 0; j < ctx->nroutine; j++) {
+						if(ctx->routines[j].reftrack != j) {
+							ctx->routines[j].reftrack = 0xffff;
 						}
 					}
 					break;
 				}
 			}
 		}
-	} while(i < nroutine);
+	} while(i < ctx->nroutine);
 
-	for(i = 0; i < nroutine; i++) {
-		r = &routines[i];
+	for(i = 0; i < ctx->nroutine; i++) {
+		r = &ctx->routines[i];
 		if(r->reftrack == 0xffff) {
 			r->ninstr = 0;
 		}
@@ -3870,8 +4085,8 @@ void comp_builtin(struct program *prg, int builtin) {
 	int lab, labloop, labcheck, labnext, labmatch, labend;
 	int i;
 
-	memset(routines, 0, nroutine * sizeof(struct comp_routine));
-	nroutine = 0;
+	memset(ctx->routines, 0, ctx->nroutine * sizeof(struct comp_routine));
+	ctx->nroutine = 0;
 	pred->normal_entry = make_routine_id();
 	begin_routine(pred->normal_entry);
 
@@ -4284,11 +4499,11 @@ void comp_builtin(struct program *prg, int builtin) {
 		assert(0);
 	}
 
-	track_refs(pred);
+	track_refs(prg, pred);
 
-	pred->routines = arena_alloc(&pred->arena, nroutine * sizeof(struct comp_routine));
-	memcpy(pred->routines, routines, nroutine * sizeof(struct comp_routine));
-	pred->nroutine = nroutine;
+	pred->routines = arena_alloc(&pred->arena, ctx->nroutine * sizeof(struct comp_routine));
+	memcpy(pred->routines, ctx->routines, ctx->nroutine * sizeof(struct comp_routine));
+	pred->nroutine = ctx->nroutine;
 
 	if(verbose >= 4) {
 		printf("Intermediate code for builtin %d, %s:\n", builtin, predname->printed_name);
@@ -4510,7 +4725,7 @@ static int cmp_routine_size(const void *a, const void *b) {
 	const int *aa = a;
 	const int *bb = b;
 
-	return routines[*bb].ninstr - routines[*aa].ninstr;
+	return ctx->routines[*bb].ninstr - ctx->routines[*aa].ninstr;
 }
 
 static void anonymize_routines(struct predicate *pred) {
@@ -4518,8 +4733,8 @@ static void anonymize_routines(struct predicate *pred) {
 	struct comp_routine *r;
 	struct clause *cl;
 
-	for(i = 0; i < nroutine; i++) {
-		r = &routines[i];
+	for(i = 0; i < ctx->nroutine; i++) {
+		r = &ctx->routines[i];
 		if(r->clause_id != 0xffff) {
 			cl = pred->clauses[r->clause_id];
 			if(!cl->nvar) {
@@ -4533,30 +4748,30 @@ static void anonymize_routines(struct predicate *pred) {
 
 static void pack_instructions() {
 	int i, j, k, pos;
-	int order[nroutine];
+	int order[ctx->nroutine];
 	struct comp_routine *r1, *r2;
 
-	for(i = 0; i < nroutine; i++) {
+	for(i = 0; i < ctx->nroutine; i++) {
 		k = 0;
-		for(j = 0; j < routines[i].ninstr; j++) {
-			if(routines[i].instr[j].op != I_NOP) {
-				memcpy(&routines[i].instr[k], &routines[i].instr[j], sizeof(struct cinstr));
+		for(j = 0; j < ctx->routines[i].ninstr; j++) {
+			if(ctx->routines[i].instr[j].op != I_NOP) {
+				memcpy(&ctx->routines[i].instr[k], &ctx->routines[i].instr[j], sizeof(struct cinstr));
 				k++;
 			}
 		}
-		routines[i].ninstr = k;
+		ctx->routines[i].ninstr = k;
 	}
 
-	for(i = 0; i < nroutine; i++) {
+	for(i = 0; i < ctx->nroutine; i++) {
 		order[i] = i;
 	}
-	qsort(order, nroutine, sizeof(int), cmp_routine_size);
+	qsort(order, ctx->nroutine, sizeof(int), cmp_routine_size);
 
-	for(i = 0; i < nroutine; i++) {
-		r1 = &routines[order[i]];
+	for(i = 0; i < ctx->nroutine; i++) {
+		r1 = &ctx->routines[order[i]];
 		if(r1->ninstr) {
-			for(j = i + 1; j < nroutine; j++) {
-				r2 = &routines[order[j]];
+			for(j = i + 1; j < ctx->nroutine; j++) {
+				r2 = &ctx->routines[order[j]];
 				if(r2->ninstr > 1
 				&& ((r1->clause_id == r2->clause_id) || r1->clause_id == 0xffff || r2->clause_id == 0xffff)) {
 					pos = r1->ninstr - r2->ninstr;
@@ -4589,60 +4804,66 @@ static void resolve_jump_chains(struct predicate *pred) {
 	int i, j, k;
 	uint16_t lab;
 
-	for(i = 0; i < nroutine; i++) {
+	for(i = 0; i < ctx->nroutine; i++) {
 		lab = i;
 		while(lab != pred->normal_entry
 		&& lab != pred->initial_value_entry
-		&& routines[lab].ninstr
-		&& routines[lab].instr[0].op == I_JUMP) {
-			if(routines[lab].instr[0].oper[0].tag == OPER_RLAB) {
-				lab = routines[lab].instr[0].oper[0].value;
+		&& ctx->routines[lab].ninstr
+		&& ctx->routines[lab].instr[0].op == I_JUMP) {
+			if(ctx->routines[lab].instr[0].oper[0].tag == OPER_RLAB) {
+				lab = ctx->routines[lab].instr[0].oper[0].value;
 			} else {
-				assert(routines[lab].instr[0].oper[0].tag == OPER_FAIL);
+				assert(ctx->routines[lab].instr[0].oper[0].tag == OPER_FAIL);
 				lab = 0xffff;
 				break;
 			}
 		}
-		routines[i].diverted = lab;
+		ctx->routines[i].diverted = lab;
 	}
 
-	for(i = 0; i < nroutine; i++) {
-		if(routines[i].diverted == i) {
-			for(j = 0; j < routines[i].ninstr; j++) {
-				if(opinfo[routines[i].instr[j].op].flags & OPF_BRANCH) {
-					lab = routines[i].instr[j].implicit;
+	for(i = 0; i < ctx->nroutine; i++) {
+		if(ctx->routines[i].diverted == i) {
+			for(j = 0; j < ctx->routines[i].ninstr; j++) {
+				if(opinfo[ctx->routines[i].instr[j].op].flags & OPF_BRANCH) {
+					lab = ctx->routines[i].instr[j].implicit;
 					if(lab != 0xffff) {
-						lab = routines[lab].diverted;
+						lab = ctx->routines[lab].diverted;
 					}
-					routines[i].instr[j].implicit = lab;
+					ctx->routines[i].instr[j].implicit = lab;
 				}
 				for(k = 0; k < 3; k++) {
-					if(routines[i].instr[j].oper[k].tag == OPER_RLAB) {
-						lab = routines[i].instr[j].oper[k].value;
+					if(ctx->routines[i].instr[j].oper[k].tag == OPER_RLAB) {
+						lab = ctx->routines[i].instr[j].oper[k].value;
 						if(lab != 0xffff) {
-							lab = routines[lab].diverted;
+							lab = ctx->routines[lab].diverted;
 						}
 						if(lab != 0xffff) {
-							routines[i].instr[j].oper[k].value = lab;
+							ctx->routines[i].instr[j].oper[k].value = lab;
 						} else {
-							routines[i].instr[j].oper[k] = (value_t) {OPER_FAIL};
+							ctx->routines[i].instr[j].oper[k] = (value_t) {OPER_FAIL};
 						}
 					}
 				}
 			}
 		} else {
-			routines[i].ninstr = 0;
+			ctx->routines[i].ninstr = 0;
 		}
 	}
 }
 
-void comp_predicate(struct program *prg, struct predname *predname) {
+static void comp_predicate_deferred(struct program *prg, struct predname *predname, struct comp_deferred *d) {
 	struct predicate *pred = predname->pred;
 	struct cinstr *ci;
 	int i, j, k, any, pass;
 
-	memset(routines, 0, nroutine * sizeof(struct comp_routine));
-	nroutine = 0;
+	memset(d, 0, sizeof(*d));
+	d->nflag0 = prg->nglobalflag;
+	d->nbox0 = prg->nboxclass;
+	ctx->deferred = d;
+	ctx->arena = &pred->arena;
+
+	memset(ctx->routines, 0, ctx->nroutine * sizeof(struct comp_routine));
+	ctx->nroutine = 0;
 	assert(pred->normal_entry == -1);
 	pred->normal_entry = make_routine_id();
 
@@ -4653,9 +4874,10 @@ void comp_predicate(struct program *prg, struct predname *predname) {
 		for(i = 0; i < pred->nclause; i++) {
 			pred->clauses[i]->clause_id = i;
 			entries[i].key = (value_t) {VAL_NONE, 0};
-			entries[i].n_drop_from_arg0 = 0;
+			entries[i].n_drop_from_arg = 0;
 			entries[i].n_drop_from_body = 0;
 			entries[i].clause_id = i;
+			entries[i].argno = 0;
 		}
 		if(pred->flags & PREDF_CONTAINS_JUST) {
 			ci = add_instr(I_SAVE_CHOICE);
@@ -4668,7 +4890,7 @@ void comp_predicate(struct program *prg, struct predname *predname) {
 		ci->oper[0] = (value_t) {OPER_FAIL};
 		end_routine(0xffff, &pred->arena);
 	}
-	routines[pred->normal_entry].n_edge_in++;
+	ctx->routines[pred->normal_entry].n_edge_in++;
 
 	if(predname->builtin == BI_HASPARENT) {
 		assert(pred->initial_value_entry == -1);
@@ -4676,14 +4898,14 @@ void comp_predicate(struct program *prg, struct predname *predname) {
 		pred->normal_entry = make_routine_id();
 		begin_routine(pred->normal_entry);
 		comp_has_parent(prg, predname);
-		routines[pred->normal_entry].n_edge_in++;
+		ctx->routines[pred->normal_entry].n_edge_in++;
 	} else if((pred->flags & PREDF_DYNAMIC) && predname->arity == 2) {
 		assert(pred->initial_value_entry == -1);
 		pred->initial_value_entry = pred->normal_entry;
 		pred->normal_entry = make_routine_id();
 		begin_routine(pred->normal_entry);
 		comp_dyn_var(prg, predname);
-		routines[pred->normal_entry].n_edge_in++;
+		ctx->routines[pred->normal_entry].n_edge_in++;
 	} else if((pred->flags & PREDF_DYNAMIC) && predname->arity == 1
 	&& !(pred->flags & PREDF_GLOBAL_VAR)) {
 		assert(pred->initial_value_entry == -1);
@@ -4691,17 +4913,17 @@ void comp_predicate(struct program *prg, struct predname *predname) {
 		pred->normal_entry = make_routine_id();
 		begin_routine(pred->normal_entry);
 		comp_dyn_list(prg, predname);
-		routines[pred->normal_entry].n_edge_in++;
+		ctx->routines[pred->normal_entry].n_edge_in++;
 	}
 
-	for(i = 0; i < nroutine; i++) {
-		for(j = 0; j < routines[i].ninstr; j++) {
-			if(routines[i].instr[j].implicit != 0xffff) {
-				routines[routines[i].instr[j].implicit].n_edge_in++;
+	for(i = 0; i < ctx->nroutine; i++) {
+		for(j = 0; j < ctx->routines[i].ninstr; j++) {
+			if(ctx->routines[i].instr[j].implicit != 0xffff) {
+				ctx->routines[ctx->routines[i].instr[j].implicit].n_edge_in++;
 			}
 			for(k = 0; k < 3; k++) {
-				if(routines[i].instr[j].oper[k].tag == OPER_RLAB) {
-					routines[routines[i].instr[j].oper[k].value].n_edge_in++;
+				if(ctx->routines[i].instr[j].oper[k].tag == OPER_RLAB) {
+					ctx->routines[ctx->routines[i].instr[j].oper[k].value].n_edge_in++;
 				}
 			}
 		}
@@ -4712,37 +4934,94 @@ void comp_predicate(struct program *prg, struct predname *predname) {
 			any = 0;
 			any |= optimize_env_frames(prg);
 			any |= optimize_choice_frames(prg);
-			track_refs(pred);
+			track_refs(prg, pred);
 			any |= optimize_vars(prg, pred);
-		} while(any && !prg->errorflag);
+		} while(any && !prg->errorflag && !ctx->deferred->nmessage);
 
-		track_refs(pred);
+		track_refs(prg, pred);
 	}
 
 	anonymize_routines(pred);
 	pack_instructions();
 	resolve_jump_chains(pred);
-	track_refs(pred);
+	track_refs(prg, pred);
 
 	for(i = 0; i < pred->nclause; i++) {
 		if(pred->clauses[i]->nvar >= 64) {
-			report(
-				LVL_ERR,
+			comp_error(
 				pred->clauses[i]->line,
 				"Rule too complex. Try breaking it into smaller parts.");
-			prg->errorflag = 1;
 		}
 	}
 
-	pred->routines = arena_alloc(&pred->arena, nroutine * sizeof(struct comp_routine));
-	memcpy(pred->routines, routines, nroutine * sizeof(struct comp_routine));
-	pred->nroutine = nroutine;
+	pred->routines = arena_alloc(&pred->arena, ctx->nroutine * sizeof(struct comp_routine));
+	memcpy(pred->routines, ctx->routines, ctx->nroutine * sizeof(struct comp_routine));
+	pred->nroutine = ctx->nroutine;
+
+	ctx->deferred = 0;
+	ctx->arena = 0;
+}
+
+static void comp_commit(struct program *prg, struct predname *predname, struct comp_deferred *d) {
+	struct predicate *pred = predname->pred;
+	struct cinstr *ci;
+	int i, j, k, flagbase = prg->nglobalflag;
+	int boxmap[d->nnewbox + 1];
+
+	for(i = 0; i < d->nmessage; i++) {
+		report(LVL_ERR, d->messages[i].line, "%s", d->messages[i].text);
+		prg->errorflag = 1;
+		free(d->messages[i].text);
+	}
+
+	for(i = 0; i < d->nlabelled; i++) {
+		d->labelled[i]->pred->flags |= PREDF_NEEDS_LABEL;
+	}
+
+	if(d->nanonflag) {
+		prg->nglobalflag += d->nanonflag;
+		prg->globalflagpred = realloc(prg->globalflagpred, prg->nglobalflag * sizeof(struct predname *));
+		for(i = flagbase; i < prg->nglobalflag; i++) {
+			prg->globalflagpred[i] = 0;
+		}
+	}
+
+	for(i = 0; i < d->nnewbox; i++) {
+		boxmap[i] = find_boxclass(prg, find_word(prg, d->newboxes[i]));
+	}
+
+	// Renumber the provisional flags and box classes.
+	if((d->nanonflag && flagbase != d->nflag0) || d->nnewbox) {
+		for(i = 0; i < pred->nroutine; i++) {
+			for(j = 0; j < pred->routines[i].ninstr; j++) {
+				ci = &pred->routines[i].instr[j];
+				for(k = 0; k < 3; k++) {
+					if(ci->oper[k].tag == OPER_GFLAG && ci->oper[k].value >= d->nflag0) {
+						ci->oper[k].value += flagbase - d->nflag0;
+					} else if(ci->oper[k].tag == OPER_BOX && ci->oper[k].value >= d->nbox0) {
+						ci->oper[k].value = boxmap[ci->oper[k].value - d->nbox0];
+					}
+				}
+			}
+		}
+	}
+
+	free(d->messages);
+	free(d->labelled);
+	free(d->newboxes);
 
 	if(verbose >= 4) {
 		comp_dump_predicate(prg, predname);
 	}
 }
 
+void comp_predicate(struct program *prg, struct predname *predname) {
+	struct comp_deferred d;
+
+	comp_predicate_deferred(prg, predname, &d);
+	comp_commit(prg, predname, &d);
+}
+
 void comp_builtins(struct program *prg) {
 	comp_builtin(prg, BI_IS_ONE_OF);
 	comp_builtin(prg, BI_SPLIT);
@@ -4764,32 +5043,287 @@ void comp_builtins(struct program *prg) {
 	comp_builtin(prg, BI_FAIL);
 }
 
-void comp_program(struct program *prg) {
+static int should_compile(struct predname *predname) {
+	return (
+		!predname->builtin
+		|| predname->builtin == BI_HASPARENT
+		|| predname->builtin == BI_QUERY
+		|| predname->builtin == BI_QUERY_ARG
+		|| predname->builtin == BI_EMBEDRESOURCE
+		|| predname->builtin == BI_CAN_EMBED
+		|| (predname->nameflags & PREDNF_DEFINABLE_BI))
+	&& !predname->special
+	&& !(predname->pred->flags & PREDF_MACRO);
+}
+
+// Mode-specialized variants: When a predicate is called with different
+// combinations of bound and unbound arguments, its code has to cater for the
+// union of them. For the most common call modes that are strictly more bound
+// than that, we compile an extra copy of the predicate with a narrower
+// unbound_in, and point the matching call sites at it.
+
+#define MAXCALLMODE 8
+#define MAXVARIANT 2
+#define VARIANT_BUDGET 8	// at most 1/8 of the clauses may be duplicated,
+#define MIN_VARIANT_BUDGET 32	// or this many, whichever is greater
+
+struct call_mode {
+	uint16_t		mask;
+	uint16_t		count;
+};
+
+struct mode_candidate {
+	struct predname		*predname;
+	uint16_t		mask;
+	uint16_t		count;
+};
+
+static int is_variant_candidate(struct predname *predname) {
+	struct predicate *pred = predname->pred;
+
+	return !predname->builtin
+		&& !predname->special
+		&& predname->arity
+		&& pred->nclause
+		&& (pred->flags & PREDF_INVOKED)
+		&& !(pred->flags & (PREDF_MACRO | PREDF_DYNAMIC | PREDF_FIXED_FLAG));
+}
+
+static void count_call_modes(struct astnode *an, struct call_mode *modes) {
+	struct call_mode *cm;
+	uint16_t mask;
+	int i;
+
+	while(an) {
+		if((an->kind == AN_RULE || an->kind == AN_NEG_RULE)
+		&& is_variant_candidate(an->predicate)) {
+			mask = call_mode(an);
+			cm = &modes[an->predicate->pred_id * MAXCALLMODE];
+			for(i = 0; i < MAXCALLMODE && cm[i].count; i++) {
+				if(cm[i].mask == mask) break;
+			}
+			if(i < MAXCALLMODE) {
+				cm[i].mask = mask;
+				cm[i].count++;
+			}
+		}
+		for(i = 0; i < an->nchild; i++) {
+			count_call_modes(an->children[i], modes);
+		}
+		an = an->next_in_body;
+	}
+}
+
+static int mode_makes_a_difference(struct predicate *pred, uint16_t mask) {
+	struct astnode *param;
+	int i, j;
+
+	// Parameters that are anonymous variables in every clause compile
+	// to nothing, whether they are bound or not.
+	for(i = 0; i < pred->nclause; i++) {
+		for(j = 0; j < pred->predname->arity; j++) {
+			if(mask & (1 << j)) {
+				param = pred->clauses[i]->params[j];
+				if(param->kind != AN_VARIABLE || param->word->name[0]) {
+					return 1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int cmp_mode_candidate(const void *a, const void *b) {
+	const struct mode_candidate *aa = a;
+	const struct mode_candidate *bb = b;
+	int diff;
+
+	diff = bb->count - aa->count;
+	if(diff) return diff;
+	diff = aa->predname->pred->nclause - bb->predname->pred->nclause;
+	if(diff) return diff;
+	diff = aa->predname->pred_id - bb->predname->pred_id;
+	if(diff) return diff;
+	return aa->mask - bb->mask;
+}
+
+static void make_mode_variant(struct program *prg, struct predname *predname, uint16_t mask) {
+	struct predicate *pred = predname->pred, *vpred;
+	struct predname *variant;
+	struct word *words[predname->nword + 1];
+	struct clause *cl;
+	char buf[16];
 	int i;
+
+	memcpy(words, predname->words, predname->nword * sizeof(struct word *));
+	snprintf(buf, sizeof(buf), "*mode%x", mask);
+	words[predname->nword] = find_word(prg, buf);
+	variant = find_predicate(prg, predname->nword + 1, words);
+	vpred = variant->pred;
+
+	vpred->flags = pred->flags;
+	vpred->unbound_in = mask;
+	vpred->unbound_out = pred->unbound_out;
+	vpred->nclause = pred->nclause;
+	vpred->clauses = malloc(pred->nclause * sizeof(struct clause *));
+	for(i = 0; i < pred->nclause; i++) {
+		// Compiling a clause renumbers its variables, so the copy needs
+		// its own variable table. It still belongs to the original
+		// predicate, for tracing and word maps.
+		cl = arena_alloc(&vpred->arena, sizeof(*cl));
+		*cl = *pred->clauses[i];
+		cl->arena = &vpred->arena;
+		cl->varnames = arena_alloc(&vpred->arena, cl->nvar * sizeof(struct word *));
+		memcpy(cl->varnames, pred->clauses[i]->varnames, cl->nvar * sizeof(struct word *));
+		cl->entrypoints = 0;
+		vpred->clauses[i] = cl;
+	}
+
+	if(!pred->variants) {
+		pred->variants = arena_alloc(&pred->arena, MAXVARIANT * sizeof(struct predname *));
+	}
+	assert(pred->nvariant < MAXVARIANT);
+	pred->variants[pred->nvariant++] = variant;
+}
+
+static void comp_mode_variants(struct program *prg) {
+	int npred = prg->npredicate;
+	struct call_mode *modes = calloc(npred * MAXCALLMODE, sizeof(struct call_mode));
+	struct mode_candidate *cand;
 	struct predname *predname;
 	struct predicate *pred;
+	int i, j, ncand = 0, nclause = 0, budget, nvariant = 0, nduplicated = 0;
+
+	for(i = 0; i < npred; i++) {
+		predname = prg->predicates[i];
+		if(should_compile(predname)) {
+			pred = predname->pred;
+			nclause += pred->nclause;
+			for(j = 0; j < pred->nclause; j++) {
+				count_call_modes(pred->clauses[j]->body, modes);
+			}
+		}
+	}
+
+	cand = malloc(npred * MAXCALLMODE * sizeof(struct mode_candidate));
+	for(i = 0; i < npred; i++) {
+		pred = prg->predicates[i]->pred;
+		for(j = 0; j < MAXCALLMODE && modes[i * MAXCALLMODE + j].count; j++) {
+			if(modes[i * MAXCALLMODE + j].mask != pred->unbound_in
+			&& !(modes[i * MAXCALLMODE + j].mask & ~pred->unbound_in)
+			&& mode_makes_a_difference(pred, pred->unbound_in & ~modes[i * MAXCALLMODE + j].mask)) {
+				cand[ncand].predname = prg->predicates[i];
+				cand[ncand].mask = modes[i * MAXCALLMODE + j].mask;
+				cand[ncand].count = modes[i * MAXCALLMODE + j].count;
+				ncand++;
+			}
+		}
+	}
+
+	qsort(cand, ncand, sizeof(struct mode_candidate), cmp_mode_candidate);
+
+	budget = nclause / VARIANT_BUDGET;
+	if(budget < MIN_VARIANT_BUDGET) budget = MIN_VARIANT_BUDGET;
+	for(i = 0; i < ncand; i++) {
+		pred = cand[i].predname->pred;
+		if(pred->nvariant < MAXVARIANT
+		&& nduplicated + pred->nclause <= budget) {
+			make_mode_variant(prg, cand[i].predname, cand[i].mask);
+			nduplicated += pred->nclause;
+			nvariant++;
+		}
+	}
 
+	report(LVL_DEBUG, 0, "Mode-specialized variants: %d (%d of %d clauses)", nvariant, nduplicated, nclause);
+
+	free(cand);
+	free(modes);
+}
+
+#define MIN_PRED_PER_THREAD 32
+
+struct comp_pool {
+	struct program		*prg;
+	struct predname		**prednames;
+	struct comp_deferred	*deferred;
+};
+
+static void comp_pool_worker(struct pool *pool, void *arg) {
+	struct comp_pool *cp = arg;
+	struct comp_context context = {.instr_routine_id = -1};
+	struct comp_context *saved = ctx;
+	int i;
+
+	ctx = &context;
+	while((i = pool_next(pool)) >= 0) {
+		comp_predicate_deferred(cp->prg, cp->prednames[i], &cp->deferred[i]);
+	}
+	free(context.instrbuf);
+	free(context.routines);
+	ctx = saved;
+}
+
+// Compiles the given predicates on all available cores, then commits the
+// results in order, so the outcome doesn't depend on the number of threads.
+
+static void comp_parallel(struct program *prg, struct predname **prednames, int njob) {
+	struct comp_pool cp = {prg, prednames};
+	int i, nthread;
+
+	cp.deferred = malloc(njob * sizeof(struct comp_deferred));
+	nthread = pool_run(njob, MIN_PRED_PER_THREAD, comp_pool_worker, &cp);
+
+	for(i = 0; i < njob; i++) {
+		comp_commit(prg, prednames[i], &cp.deferred[i]);
+	}
+
+	report(LVL_DEBUG, 0, "Compiled %d predicates using %d threads", njob, nthread);
+	free(cp.deferred);
+}
+
+void comp_program(struct program *prg) {
+	int i, njob = 0;
+	struct predname *predname;
+	struct predname **prednames;
+
+	if(prg->codecache) {
+		codecache_begin(prg->codecache, prg);
+	}
+
+	// Trace output refers to the original predicates, so only do this
+	// when tracing is disabled.
+	if((prg->optflags & OPTF_MODE_VARIANTS) && (prg->optflags & OPTF_NO_TRACE)) {
+		comp_mode_variants(prg);
+	}
+
+	prednames = malloc(prg->npredicate * sizeof(struct predname *));
 	for(i = 0; i < prg->npredicate; i++) {
 		predname = prg->predicates[i];
-		pred = predname->pred;
-		if((
-			!predname->builtin
-			|| predname->builtin == BI_HASPARENT
-			|| predname->builtin == BI_QUERY
-			|| predname->builtin == BI_QUERY_ARG
-			|| predname->builtin == BI_EMBEDRESOURCE
-			|| predname->builtin == BI_CAN_EMBED
-			|| (predname->nameflags & PREDNF_DEFINABLE_BI))
-		&& !predname->special
-		&& !(pred->flags & PREDF_MACRO)) {
-			comp_predicate(prg, predname);
+		if(should_compile(predname)) {
+			if(prg->codecache) {
+				codecache_comp_predicate(prg->codecache, prg, predname);
+			} else {
+				prednames[njob++] = predname;
+			}
 		}
 	}
+
+	if(njob) {
+		comp_parallel(prg, prednames, njob);
+	}
+	free(prednames);
+
+	if(prg->codecache) {
+		codecache_end(prg->codecache);
+	}
 }
 
 void comp_init() {
 	int i;
 
+	assert(sizeof(value_t) == sizeof(uint32_t));
+
 	for(i = 0; i < N_OPCODES; i++) {
 		opinfo[opinfosrc[i].op].refs = opinfosrc[i].refs;
 		opinfo[opinfosrc[i].op].flags = opinfosrc[i].flags;
@@ -4798,11 +5332,11 @@ void comp_init() {
 }
 
 void comp_cleanup() {
-	free(instrbuf);
-	free(routines);
-	nalloc_instr = 0;
-	nalloc_routine = 0;
-	instrbuf = 0;
-	routines = 0;
-	nroutine = 0;
+	free(main_context.instrbuf);
+	free(main_context.routines);
+	main_context.nalloc_instr = 0;
+	main_context.nalloc_routine = 0;
+	main_context.instrbuf = 0;
+	main_context.routines = 0;
+	main_context.nroutine = 0;
 }
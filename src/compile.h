@@ -170,11 +170,17 @@ enum {
 	N_TR_KIND,
 };
 
+// A value is a single 32-bit word, with the tag in the low byte. Heap and
+// stack sizes are counted in values. Two values are equal if their words are.
+
 typedef struct value {
 	int			tag:8;
 	int			value:24;
 } value_t;
 
+#define VALUE_WORD(v) (((union {value_t val; uint32_t word;}) {(v)}).word)
+#define VALUE_EQ(a, b) (VALUE_WORD(a) == VALUE_WORD(b))
+
 enum {
 	VAL_NONE,
 	VAL_NUM,
@@ -217,6 +223,7 @@ struct comp_routine {
 	uint16_t		diverted;
 	uint16_t		reftrack;	// ffff = unvisited, self = group leader, other = part of group
 	uint16_t		n_edge_in;
+	void			**threaded;	// handler addresses, filled in by the evaluator
 };
 
 void comp_init();
@@ -226,3 +233,4 @@ void comp_predicate(struct program *prg, struct predname *predname);
 void comp_builtins(struct program *prg);
 void comp_program(struct program *prg);
 void comp_cleanup(void);
+int comp_dense_index(struct cinstr *ci, int n);
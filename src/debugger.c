@@ -11,6 +11,12 @@
 #include <sys/types.h>
 //#include <unistd.h>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 #include "common.h"
 #include "arena.h"
 #include "ast.h"
@@ -23,13 +29,31 @@
 #include "fs.h"
 #include "terminal.h"
 #include "unicode.h"
+#include "codecache.h"
+#include "stats.h"
 
 #define MAXINPUT 1024
 
 #define DEBUGGERNAME "Dialog Interactive Debugger (dgdebug) version " VERSION
 
+#define CHECKPOINT_INTERVAL 10	// lines of input
+#define MAX_CHECKPOINT 16
+
 extern struct output_config output_config;
 
+struct checkpoint {
+	struct eval_checkpoint	*eval;
+	struct dyn_state	dyn;		// values only
+	int			ninput;
+	uint64_t		inputhash;
+	uint64_t		predhash;	// of the predicates touched so far
+};
+
+struct watch {
+	int			wd;
+	char			*name;
+};
+
 struct debugger {
 	int			nfilename;
 	char			**filenames;
@@ -37,12 +61,24 @@ struct debugger {
 	struct dyn_state	ds;
 	struct program		*prg;
 	struct timespec		*timestamps;
+	int			watchfd;
+	struct watch		*watches;
+	int			nwatch;
+	int			dirty;
 	int			randomseed;
 	int			status;
 	char			**pending_input;
 	int			pending_wpos;
 	int			pending_rpos;
 	int			nalloc_pend;
+	struct eval_profile	*profile;
+	int			profiling;
+	char			*cachedir;
+	struct codecache	*codecache;
+	struct checkpoint	checkpoints[MAX_CHECKPOINT];
+	int			ncheckpoint;
+	int			checkpoint_interval;
+	int			tainted;	// not reachable by replaying input
 };
 
 char *STOPCHARS; // Declared in common.h, defined here and in backend.c
@@ -60,14 +96,101 @@ static void prepare_wordseps(uint8_t *wordseps) {
 	strcpy(STOPCHARS+1, (char*)wordseps);
 }
 
+// Every modification of the dynamic state is preceded by a call to log_dyn,
+// which appends the old value to the undo journal. Variables are only
+// journalled the first time they change after an undo marker.
+
+static void log_dyn(struct dyn_state *ds, int kind, int onum, int index) {
+	struct dyn_undo *u;
+	struct dyn_undo_rec *r;
+	struct dyn_var *v = 0;
+
+	if(!ds->nundo) return;
+	u = &ds->undo[ds->nundo - 1];
+
+	if(kind == DU_GVAR || kind == DU_OVAR) {
+		v = (kind == DU_GVAR)? &ds->gvar[index] : &ds->obj[onum].var[index];
+		if(v->undostamp == u->serial) return;
+		v->undostamp = u->serial;
+	}
+
+	if(ds->nundolog >= ds->nalloc_undolog) {
+		ds->nalloc_undolog = ds->nundolog * 2 + 64;
+		ds->undolog = realloc(ds->undolog, ds->nalloc_undolog * sizeof(struct dyn_undo_rec));
+	}
+	r = &ds->undolog[ds->nundolog++];
+	r->kind = kind;
+	r->onum = onum;
+	r->index = index;
+
+	switch(kind) {
+	case DU_GFLAG:
+		r->old.gflag = ds->gflag[index];
+		break;
+	case DU_OFLAG:
+		r->old.flag = ds->obj[onum].flag[index];
+		break;
+	case DU_FIRST:
+		r->old.link = ds->first_in_oflag[index];
+		break;
+	case DU_SIBLING:
+		r->old.link = ds->obj[onum].sibling;
+		break;
+	case DU_CHILD:
+		r->old.link = ds->obj[onum].child;
+		break;
+	default:
+		r->old.var.rendered = arena_alloc(&u->arena, v->size * sizeof(value_t));
+		memcpy(r->old.var.rendered, v->rendered, v->size * sizeof(value_t));
+		r->old.var.size = v->size;
+		r->old.var.changed = v->changed;
+		break;
+	}
+}
+
+static void unlog_dyn(struct dyn_state *ds, struct dyn_undo_rec *r) {
+	struct dyn_var *v;
+
+	switch(r->kind) {
+	case DU_GFLAG:
+		ds->gflag[r->index] = r->old.gflag;
+		break;
+	case DU_OFLAG:
+		ds->obj[r->onum].flag[r->index] = r->old.flag;
+		break;
+	case DU_FIRST:
+		ds->first_in_oflag[r->index] = r->old.link;
+		break;
+	case DU_SIBLING:
+		ds->obj[r->onum].sibling = r->old.link;
+		break;
+	case DU_CHILD:
+		ds->obj[r->onum].child = r->old.link;
+		break;
+	default:
+		v = (r->kind == DU_GVAR)? &ds->gvar[r->index] : &ds->obj[r->onum].var[r->index];
+		if(v->nalloc < r->old.var.size) {
+			v->nalloc = r->old.var.size;
+			v->rendered = realloc(v->rendered, v->nalloc * sizeof(value_t));
+		}
+		memcpy(v->rendered, r->old.var.rendered, r->old.var.size * sizeof(value_t));
+		v->size = r->old.var.size;
+		v->changed = r->old.var.changed;
+		break;
+	}
+}
+
 static void set_oflag(struct dyn_state *ds, int onum, int fnum) {
 	struct dyn_obj *o = &ds->obj[onum];
 
 	if(!(o->flag[fnum].value & DF_ON)) {
 		assert(o->flag[fnum].next == 0xffff);
 		assert(o->flag[fnum].prev == 0xffff);
+		log_dyn(ds, DU_OFLAG, onum, fnum);
+		log_dyn(ds, DU_FIRST, 0, fnum);
 		o->flag[fnum].value = DF_ON;
 		if(ds->first_in_oflag[fnum] != 0xffff) {
+			log_dyn(ds, DU_OFLAG, ds->first_in_oflag[fnum], fnum);
 			ds->obj[ds->first_in_oflag[fnum]].flag[fnum].prev = onum;
 			o->flag[fnum].next = ds->first_in_oflag[fnum];
 		}
@@ -79,14 +202,20 @@ static void reset_oflag(struct dyn_state *ds, int onum, int fnum) {
 	struct dyn_obj *o = &ds->obj[onum];
 
 	if(o->flag[fnum].value & DF_ON) {
+		log_dyn(ds, DU_OFLAG, onum, fnum);
+		if(o->flag[fnum].next != 0xffff) {
+			log_dyn(ds, DU_OFLAG, o->flag[fnum].next, fnum);
+		}
 		if(ds->first_in_oflag[fnum] == onum) {
 			assert(o->flag[fnum].prev == 0xffff);
 			if(o->flag[fnum].next != 0xffff) {
 				ds->obj[o->flag[fnum].next].flag[fnum].prev = 0xffff;
 			}
+			log_dyn(ds, DU_FIRST, 0, fnum);
 			ds->first_in_oflag[fnum] = o->flag[fnum].next;
 		} else {
 			assert(o->flag[fnum].prev != 0xffff);
+			log_dyn(ds, DU_OFLAG, o->flag[fnum].prev, fnum);
 			ds->obj[o->flag[fnum].prev].flag[fnum].next = o->flag[fnum].next;
 			if(o->flag[fnum].next != 0xffff) {
 				ds->obj[o->flag[fnum].next].flag[fnum].prev = o->flag[fnum].prev;
@@ -115,10 +244,12 @@ static void remove_child_from(struct dyn_state *ds, uint16_t cnum, uint16_t pnum
 
 	c = ds->obj[pnum].child;
 	if(c == cnum) {
+		log_dyn(ds, DU_CHILD, pnum, 0);
 		ds->obj[pnum].child = ds->obj[cnum].sibling;
 	} else {
 		while(c != 0xffff) {
 			if(ds->obj[c].sibling == cnum) {
+				log_dyn(ds, DU_SIBLING, c, 0);
 				ds->obj[c].sibling = ds->obj[cnum].sibling;
 				return;
 			}
@@ -131,7 +262,7 @@ static void remove_child_from(struct dyn_state *ds, uint16_t cnum, uint16_t pnum
 static int set_parent(struct eval_state *es, struct dyn_state *ds, uint16_t onum, value_t parent, int append) {
 	struct dyn_var *v = &ds->obj[onum].var[DYN_HASPARENT];
 	uint8_t seen[es->program->nworldobj];
-	uint16_t *ptr;
+	uint16_t c;
 
 	if(parent.tag != VAL_OBJ && parent.tag != VAL_NONE) {
 		report(
@@ -142,6 +273,8 @@ static int set_parent(struct eval_state *es, struct dyn_state *ds, uint16_t onum
 		return 0;
 	}
 
+	log_dyn(ds, DU_OVAR, onum, DYN_HASPARENT);
+
 	if(!v->nalloc) {
 		v->nalloc = 1;
 		v->rendered = calloc(1, sizeof(value_t));
@@ -155,14 +288,22 @@ static int set_parent(struct eval_state *es, struct dyn_state *ds, uint16_t onum
 	if(parent.tag == VAL_OBJ) {
 		v->size = 1;
 		v->rendered[0] = parent;
+		log_dyn(ds, DU_SIBLING, onum, 0);
 		if(append) {
-			ptr = &ds->obj[parent.value].child;
-			while(*ptr != 0xffff) {
-				ptr = &ds->obj[*ptr].sibling;
+			c = ds->obj[parent.value].child;
+			if(c == 0xffff) {
+				log_dyn(ds, DU_CHILD, parent.value, 0);
+				ds->obj[parent.value].child = onum;
+			} else {
+				while(ds->obj[c].sibling != 0xffff) {
+					c = ds->obj[c].sibling;
+				}
+				log_dyn(ds, DU_SIBLING, c, 0);
+				ds->obj[c].sibling = onum;
 			}
-			*ptr = onum;
 			ds->obj[onum].sibling = 0xffff;
 		} else {
+			log_dyn(ds, DU_CHILD, parent.value, 0);
 			ds->obj[onum].sibling = ds->obj[parent.value].child;
 			ds->obj[parent.value].child = onum;
 		}
@@ -189,11 +330,11 @@ static int set_parent(struct eval_state *es, struct dyn_state *ds, uint16_t onum
 }
 
 static int render_complex_value(struct dyn_var *dv, value_t v, struct eval_state *es, struct predname *predname) {
-	int count, new_size;
+	int count, new_size, max_size;
 
 	// Simple elements are serialized as themselves.
 	// Proper lists are serialized as the elements, followed by VAL_PAIR(n).
-	// Improper lists are serialized as the elements, followed by the improper tail element, followed by VAL_PAIR(0x8000+n).
+	// Improper lists are serialized as the elements, followed by the improper tail element, followed by VAL_PAIR(EVAL_IMPROPER+n).
 	// Extended dictionary words are serialized as the optional part, followed by the mandatory part, followed by VAL_DICTEXT(0);
 
 	switch(v.tag) {
@@ -217,7 +358,7 @@ static int render_complex_value(struct dyn_var *dv, value_t v, struct eval_state
 				if(!render_complex_value(dv, v, es, predname)) {
 					return 0;
 				}
-				v = (value_t) {VAL_PAIR, 0x8000 | count};
+				v = (value_t) {VAL_PAIR, EVAL_IMPROPER | count};
 				break;
 			}
 		}
@@ -245,7 +386,8 @@ static int render_complex_value(struct dyn_var *dv, value_t v, struct eval_state
 
 	if(dv->size >= dv->nalloc) {
 		new_size = dv->size * 2 + 1;
-		if(new_size > 0x1fff) new_size = 0x1fff;
+		max_size = (eval_maxindex > EVAL_MAXINDEX_Z)? eval_maxindex : 0x1fff;
+		if(new_size > max_size) new_size = max_size;
 		dv->nalloc = new_size;
 		dv->rendered = realloc(dv->rendered, new_size * sizeof(value_t));
 		if(dv->size >= dv->nalloc) {
@@ -274,8 +416,8 @@ static value_t rebuild_complex_value(value_t *src, int *pos, struct eval_state *
 	case VAL_NIL:
 		return v;
 	case VAL_PAIR:
-		count = v.value & 0x7fff;
-		if(v.value & 0x8000) {
+		count = v.value & ~EVAL_IMPROPER;
+		if(v.value & EVAL_IMPROPER) {
 			v = rebuild_complex_value(src, pos, es);
 			if(v.tag == VAL_ERROR) return v;
 		} else {
@@ -307,6 +449,7 @@ static int update_ovar(struct eval_state *es, struct dyn_state *ds, int onum, in
 	eval_reinitialize(es);
 	args[0] = (value_t) {VAL_OBJ, onum};
 	args[1] = eval_makevar(es);
+	log_dyn(ds, DU_OVAR, onum, vnum);
 	if(eval_initial(es, es->program->objvarpred[vnum], args)) {
 		assert(vnum != DYN_HASPARENT);
 		v->size = 0;
@@ -636,6 +779,7 @@ static int set_globalvar(struct eval_state *es, void *userdata, int dyn_id, valu
 	struct dyn_var *v;
 
 	maybe_grow_dyn_state(ds, es->program);
+	log_dyn(ds, DU_GVAR, 0, dyn_id);
 	v = &ds->gvar[dyn_id];
 	v->changed = 1;
 	v->size = 0;
@@ -663,6 +807,7 @@ static void set_globalflag(struct eval_state *es, void *userdata, int dyn_id, in
 
 	maybe_grow_dyn_state(ds, es->program);
 	assert(dyn_id < ds->ngflag);
+	log_dyn(ds, DU_GFLAG, 0, dyn_id);
 	ds->gflag[dyn_id] = DF_CHANGED | (val? DF_ON : 0);
 }
 
@@ -685,7 +830,10 @@ static void set_objflag(struct eval_state *es, void *userdata, int dyn_id, int o
 	} else {
 		reset_oflag(ds, onum, dyn_id);
 	}
-	ds->obj[onum].flag[dyn_id].value |= DF_CHANGED;
+	if(!(ds->obj[onum].flag[dyn_id].value & DF_CHANGED)) {
+		log_dyn(ds, DU_OFLAG, onum, dyn_id);
+		ds->obj[onum].flag[dyn_id].value |= DF_CHANGED;
+	}
 }
 
 static value_t get_objvar(struct eval_state *es, void *userdata, int dyn_id, int onum) {
@@ -708,6 +856,7 @@ static int set_objvar(struct eval_state *es, void *userdata, int dyn_id, int obj
 	struct dyn_var *v;
 
 	maybe_grow_dyn_state(ds, es->program);
+	log_dyn(ds, DU_OVAR, obj_id, dyn_id);
 	v = &ds->obj[obj_id].var[dyn_id];
 	v->changed = 1;
 	if(dyn_id == DYN_HASPARENT) {
@@ -779,7 +928,9 @@ static void clrall_objflag(struct eval_state *es, void *userdata, int dyn_id) {
 	struct dyn_flag *f;
 
 	maybe_grow_dyn_state(ds, es->program);
+	log_dyn(ds, DU_FIRST, 0, dyn_id);
 	for(onum = ds->first_in_oflag[dyn_id]; onum != 0xffff; onum = next) {
+		log_dyn(ds, DU_OFLAG, onum, dyn_id);
 		f = &ds->obj[onum].flag[dyn_id];
 		next = f->next;
 		f->next = 0xffff;
@@ -801,6 +952,7 @@ static int clrall_objvar(struct eval_state *es, void *userdata, int dyn_id) {
 
 	maybe_grow_dyn_state(ds, es->program);
 	for(onum = 0; onum < es->program->nworldobj; onum++) {
+		log_dyn(ds, DU_OVAR, onum, dyn_id);
 		v = &ds->obj[onum].var[dyn_id];
 		v->changed = 1;
 		v->size = 0;
@@ -818,10 +970,17 @@ static void update_initial_values(struct program *prg, struct dyn_state *ds) {
 	maybe_grow_dyn_state(ds, prg);
 	init_evalstate(&es, prg);
 
+	// The initial values may have been computed by a different version of
+	// the program when the undo markers were pushed.
+	for(i = 0; i < ds->nundo; i++) {
+		ds->undo[i].stale = 1;
+	}
+
 	for(i = 0; i < ds->ngflag; i++) {
 		if(!(ds->gflag[i] & DF_CHANGED)) {
 			eval_reinitialize(&es);
 			assert(i < prg->nglobalflag);
+			log_dyn(ds, DU_GFLAG, 0, i);
 			if(eval_initial(&es, prg->globalflagpred[i], 0)) {
 				ds->gflag[i] = DF_ON;
 			} else {
@@ -834,6 +993,7 @@ static void update_initial_values(struct program *prg, struct dyn_state *ds) {
 		v = &ds->gvar[i];
 		assert(i < prg->nglobalvar);
 		if(!v->changed) {
+			log_dyn(ds, DU_GVAR, 0, i);
 			v->size = 0;
 			eval_reinitialize(&es);
 			arg = eval_makevar(&es);
@@ -865,55 +1025,29 @@ static void update_initial_values(struct program *prg, struct dyn_state *ds) {
 	free_evalstate(&es);
 }
 
-static void copy_var(struct dyn_var *dest, struct dyn_var *src) {
-	memcpy(dest->rendered, src->rendered, src->size * sizeof(value_t));
-	dest->size = src->size;
-	dest->changed = src->changed;
-}
-
 static void push_undo(void *userdata) {
 	struct dyn_state *ds = userdata;
 	struct dyn_undo *u;
-	struct arena *a;
-	int i, j;
+	int i, n;
 
 	if(ds->nundo >= ds->nalloc_undo) {
+		n = ds->undo[1].logpos;
+		memmove(ds->undolog, ds->undolog + n, (ds->nundolog - n) * sizeof(struct dyn_undo_rec));
+		ds->nundolog -= n;
 		arena_free(&ds->undo[0].arena);
 		memmove(ds->undo, ds->undo + 1, (ds->nalloc_undo - 1) * sizeof(struct dyn_undo));
 		ds->nundo--;
+		for(i = 0; i < ds->nundo; i++) {
+			ds->undo[i].logpos -= n;
+		}
 		ds->did_prune_undo = 1;
 	}
 
 	u = &ds->undo[ds->nundo++];
-	a = &u->arena;
-	arena_init(a, 512);
-
-	u->gflag = arena_alloc(a, ds->ngflag);
-	memcpy(u->gflag, ds->gflag, ds->ngflag);
-
-	u->gvar = arena_alloc(a, ds->ngvar * sizeof(struct dyn_var));
-	for(i = 0; i < ds->ngvar; i++) {
-		u->gvar[i].rendered = arena_alloc(a, ds->gvar[i].size * sizeof(value_t));
-		u->gvar[i].nalloc = ds->gvar[i].size;
-		copy_var(&u->gvar[i], &ds->gvar[i]);
-	}
-
-	u->obj = arena_alloc(a, ds->nobj * sizeof(struct dyn_obj));
-	for(i = 0; i < ds->nobj; i++) {
-		u->obj[i].flag = arena_alloc(a, ds->nobjflag * sizeof(struct dyn_flag));
-		memcpy(u->obj[i].flag, ds->obj[i].flag, ds->nobjflag * sizeof(struct dyn_flag));
-		u->obj[i].var = arena_alloc(a, ds->nobjvar * sizeof(struct dyn_var));
-		for(j = 0; j < ds->nobjvar; j++) {
-			u->obj[i].var[j].rendered = arena_alloc(a, ds->obj[i].var[j].size * sizeof(value_t));
-			u->obj[i].var[j].nalloc = ds->obj[i].var[j].size;
-			copy_var(&u->obj[i].var[j], &ds->obj[i].var[j]);
-		}
-		u->obj[i].sibling = ds->obj[i].sibling;
-		u->obj[i].child = ds->obj[i].child;
-	}
-
-	u->first_in_oflag = arena_alloc(a, ds->nobjflag * sizeof(uint16_t));
-	memcpy(u->first_in_oflag, ds->first_in_oflag, ds->nobjflag * sizeof(uint16_t));
+	arena_init(&u->arena, 512);
+	u->logpos = ds->nundolog;
+	u->serial = ++ds->undoserial;
+	u->stale = 0;
 
 	u->ngflag = ds->ngflag;
 	u->ngvar = ds->ngvar;
@@ -948,38 +1082,30 @@ static void pop_undo(struct eval_state *es, void *userdata) {
 	assert(ds->nobjflag >= u->nobjflag);
 	assert(ds->nobjvar >= u->nobjvar);
 
-	memcpy(ds->gflag, u->gflag, u->ngflag);
-	memset(ds->gflag + u->ngflag, 0, ds->ngflag - u->ngflag);
-
-	for(i = 0; i < u->ngvar; i++) {
-		assert(ds->gvar[i].nalloc >= u->gvar[i].nalloc);
-		copy_var(&ds->gvar[i], &u->gvar[i]);
+	while(ds->nundolog > u->logpos) {
+		unlog_dyn(ds, &ds->undolog[--ds->nundolog]);
 	}
+
+	// Anything that was added to the program after the undo marker was
+	// pushed goes back to its initial state.
+
+	memset(ds->gflag + u->ngflag, 0, ds->ngflag - u->ngflag);
 	for(i = u->ngvar; i < ds->ngvar; i++) {
 		ds->gvar[i].size = 0;
 	}
 
 	for(i = 0; i < u->nobj; i++) {
-		// Copy all values and prev/next pointers.
-		memcpy(ds->obj[i].flag, u->obj[i].flag, u->nobjflag * sizeof(struct dyn_flag));
 		for(j = u->nobjflag; j < ds->nobjflag; j++) {
 			ds->obj[i].flag[j].value = 0;
 			ds->obj[i].flag[j].prev = 0xffff;
 			ds->obj[i].flag[j].next = 0xffff;
 		}
-		for(j = 0; j < u->nobjvar; j++) {
-			assert(ds->obj[i].var[j].nalloc >= u->obj[i].var[j].nalloc);
-			copy_var(&ds->obj[i].var[j], &u->obj[i].var[j]);
-		}
 		for(j = u->nobjvar; j < ds->nobjvar; j++) {
 			assert(j != DYN_HASPARENT);
 			ds->obj[i].var[j].changed = 0;
 			ds->obj[i].var[j].size = 0;
 		}
-		ds->obj[i].sibling = u->obj[i].sibling;
-		ds->obj[i].child = u->obj[i].child;
 	}
-	memcpy(ds->first_in_oflag, u->first_in_oflag, u->nobjflag * sizeof(uint16_t));
 	memset(ds->first_in_oflag + u->nobjflag, 0xff, (ds->nobjflag - u->nobjflag) * sizeof(uint16_t));
 	for(i = u->nobj; i < ds->nobj; i++) {
 		for(j = 0; j < ds->nobjflag; j++) {
@@ -994,7 +1120,14 @@ static void pop_undo(struct eval_state *es, void *userdata) {
 		ds->obj[i].child = 0xffff;
 	}
 
-	update_initial_values(es->program, ds);
+	if(u->stale
+	|| ds->ngflag != u->ngflag
+	|| ds->ngvar != u->ngvar
+	|| ds->nobj != u->nobj
+	|| ds->nobjflag != u->nobjflag
+	|| ds->nobjvar != u->nobjvar) {
+		update_initial_values(es->program, ds);
+	}
 
 	while(ds->ninput > u->ninput) {
 		free(ds->inputlog[--ds->ninput]);
@@ -1009,7 +1142,7 @@ static int init_dynstate(struct dyn_state *ds, struct program *prg) {
 	return grow_dyn_state(ds, prg);
 }
 
-static void free_dyn_state(struct dyn_state *ds) {
+static void free_dyn_values(struct dyn_state *ds) {
 	int i, j;
 
 	free(ds->gflag);
@@ -1026,10 +1159,68 @@ static void free_dyn_state(struct dyn_state *ds) {
 	}
 	free(ds->obj);
 	free(ds->first_in_oflag);
+}
+
+static void copy_dyn_var(struct dyn_var *dest, struct dyn_var *src) {
+	*dest = *src;
+	dest->undostamp = 0;
+	if(src->rendered) {
+		dest->nalloc = src->size + 1;
+		dest->rendered = malloc(dest->nalloc * sizeof(value_t));
+		memcpy(dest->rendered, src->rendered, src->size * sizeof(value_t));
+	}
+}
+
+static void copy_dyn_values(struct dyn_state *dest, struct dyn_state *src) {
+	int i, j;
+
+	dest->ngflag = src->ngflag;
+	dest->ngvar = src->ngvar;
+	dest->nobj = src->nobj;
+	dest->nobjflag = src->nobjflag;
+	dest->nobjvar = src->nobjvar;
+
+	dest->gflag = malloc(src->ngflag + 1);
+	memcpy(dest->gflag, src->gflag, src->ngflag);
+	dest->gvar = malloc((src->ngvar + 1) * sizeof(struct dyn_var));
+	for(i = 0; i < src->ngvar; i++) {
+		copy_dyn_var(&dest->gvar[i], &src->gvar[i]);
+	}
+	dest->obj = malloc((src->nobj + 1) * sizeof(struct dyn_obj));
+	for(i = 0; i < src->nobj; i++) {
+		dest->obj[i] = src->obj[i];
+		if(src->nobjflag) {
+			dest->obj[i].flag = malloc(src->nobjflag * sizeof(struct dyn_flag));
+			memcpy(dest->obj[i].flag, src->obj[i].flag, src->nobjflag * sizeof(struct dyn_flag));
+		}
+		if(src->nobjvar) {
+			dest->obj[i].var = malloc(src->nobjvar * sizeof(struct dyn_var));
+			for(j = 0; j < src->nobjvar; j++) {
+				copy_dyn_var(&dest->obj[i].var[j], &src->obj[i].var[j]);
+			}
+		}
+	}
+	dest->first_in_oflag = malloc((src->nobjflag + 1) * sizeof(uint16_t));
+	memcpy(dest->first_in_oflag, src->first_in_oflag, src->nobjflag * sizeof(uint16_t));
+}
+
+static void drop_dyn_undo(struct dyn_state *ds) {
+	int i;
+
 	for(i = 0; i < ds->nundo; i++) {
 		arena_free(&ds->undo[i].arena);
 	}
+	ds->nundo = 0;
+	ds->nundolog = 0;
+}
+
+static void free_dyn_state(struct dyn_state *ds) {
+	int i;
+
+	free_dyn_values(ds);
+	drop_dyn_undo(ds);
 	free(ds->undo);
+	free(ds->undolog);
 	for(i = 0; i < ds->ninput; i++) {
 		free(ds->inputlog[i]);
 	}
@@ -1072,6 +1263,161 @@ static void inject_input_line(struct debugger *dbg, char *line) {
 	dbg->pending_input[dbg->pending_wpos++] = strdup(line);
 }
 
+// While the game is played, the debugger keeps checkpoints of the complete
+// program state at regular intervals of input. Each checkpoint is tagged with
+// a hash of the compiled code of every predicate that has been entered so
+// far, and of every dynamic predicate, since those provide the initial
+// values. If, after an edit, the code of those predicates is still the same,
+// replaying the input up to the checkpoint would lead to the very same state,
+// so @replay can resume from there.
+
+static uint64_t hash_input(struct dyn_state *ds, int ninput) {
+	uint64_t h = 14695981039346656037ull;
+	uint8_t *str;
+	int i;
+
+	for(i = 0; i < ninput; i++) {
+		for(str = (uint8_t *) ds->inputlog[i]; ; str++) {
+			h = (h ^ *str) * 1099511628211ull;
+			if(!*str) break;
+		}
+	}
+
+	return h;
+}
+
+static uint64_t hash_touched(struct debugger *dbg, uint8_t *touched, int ntouched) {
+	struct program *prg = dbg->prg;
+	struct predname *predname;
+	uint64_t h = 14695981039346656037ull;
+	int i;
+
+	h = (h ^ prg->nworldobj) * 1099511628211ull;
+	for(i = 0; i < prg->npredicate; i++) {
+		predname = prg->predicates[i];
+		if(predname->builtin == BI_INVOKE_CLOSURE) {
+			// A closure body never changes once it has been assigned
+			// an id, but the clauses of ( invoke-closure $ $ $) are
+			// rebuilt in a different way after the first compilation.
+			continue;
+		}
+		if((i < ntouched && touched[i]) || (predname->pred->flags & PREDF_DYNAMIC)) {
+			h = (h ^ i) * 1099511628211ull;
+			h = (h ^ codecache_fingerprint(dbg->codecache, predname)) * 1099511628211ull;
+		}
+	}
+
+	return h;
+}
+
+static void free_checkpoint(struct checkpoint *cp) {
+	eval_free_checkpoint(cp->eval);
+	free_dyn_values(&cp->dyn);
+}
+
+static void free_checkpoints(struct debugger *dbg) {
+	while(dbg->ncheckpoint) {
+		free_checkpoint(&dbg->checkpoints[--dbg->ncheckpoint]);
+	}
+	dbg->checkpoint_interval = CHECKPOINT_INTERVAL;
+	dbg->tainted = 0;
+}
+
+// Predicates that were replaced by a recompile, or by an injected query, are
+// freed once neither the running program nor any checkpoint refers to them.
+
+static void reclaim_predicates(struct debugger *dbg) {
+	int i;
+
+	if(!pred_any_retired(dbg->prg)) return;
+
+	dbg->prg->pred_epoch++;
+	eval_mark_predicates(&dbg->es);
+	for(i = 0; i < dbg->ncheckpoint; i++) {
+		eval_mark_checkpoint(dbg->checkpoints[i].eval);
+	}
+	pred_reclaim(dbg->prg);
+}
+
+static void take_checkpoint(struct debugger *dbg) {
+	struct checkpoint *cp;
+	struct eval_checkpoint *ec;
+	int i, last;
+
+	// Checkpoints that were taken before an undo are of no use.
+	while(dbg->ncheckpoint && dbg->checkpoints[dbg->ncheckpoint - 1].ninput > dbg->ds.ninput) {
+		free_checkpoint(&dbg->checkpoints[--dbg->ncheckpoint]);
+	}
+
+	last = dbg->ncheckpoint? dbg->checkpoints[dbg->ncheckpoint - 1].ninput : 0;
+	if(dbg->tainted || dbg->ds.ninput < last + dbg->checkpoint_interval) {
+		return;
+	}
+
+	if(!(ec = eval_checkpoint(&dbg->es))) {
+		return;
+	}
+
+	if(dbg->ncheckpoint == MAX_CHECKPOINT) {
+		// Keep every other checkpoint, and space them out more from now on.
+		for(i = 0; i < MAX_CHECKPOINT / 2; i++) {
+			free_checkpoint(&dbg->checkpoints[2 * i]);
+			dbg->checkpoints[i] = dbg->checkpoints[2 * i + 1];
+		}
+		dbg->ncheckpoint = MAX_CHECKPOINT / 2;
+		dbg->checkpoint_interval *= 2;
+	}
+
+	cp = &dbg->checkpoints[dbg->ncheckpoint++];
+	cp->eval = ec;
+	memset(&cp->dyn, 0, sizeof(cp->dyn));
+	copy_dyn_values(&cp->dyn, &dbg->ds);
+	cp->ninput = dbg->ds.ninput;
+	cp->inputhash = hash_input(&dbg->ds, cp->ninput);
+	cp->predhash = hash_touched(dbg, dbg->es.touched, dbg->es.ntouched);
+}
+
+static int resume_from_checkpoint(struct debugger *dbg) {
+	struct checkpoint *cp = 0;
+	char buf[64];
+	int i;
+
+	for(i = dbg->ncheckpoint - 1; i >= 0; i--) {
+		cp = &dbg->checkpoints[i];
+		if(cp->ninput <= dbg->ds.ninput
+		&& cp->inputhash == hash_input(&dbg->ds, cp->ninput)
+		&& cp->predhash == hash_touched(dbg, cp->eval->state.touched, cp->eval->state.ntouched)) {
+			break;
+		}
+	}
+	if(i < 0) return 0;
+
+	while(dbg->ncheckpoint > i + 1) {
+		free_checkpoint(&dbg->checkpoints[--dbg->ncheckpoint]);
+	}
+
+	for(i = cp->ninput; i < dbg->ds.ninput; i++) {
+		inject_input_line(dbg, dbg->ds.inputlog[i]);
+		free(dbg->ds.inputlog[i]);
+	}
+	dbg->ds.ninput = cp->ninput;
+
+	drop_dyn_undo(&dbg->ds);
+	free_dyn_values(&dbg->ds);
+	copy_dyn_values(&dbg->ds, &cp->dyn);
+	eval_restore_checkpoint(&dbg->es, cp->eval);
+	update_initial_values(dbg->prg, &dbg->ds);
+	dbg->tainted = 0;
+
+	snprintf(buf, sizeof(buf), "%d", cp->ninput);
+	o_print_str("Resuming from a checkpoint after");
+	o_print_word(buf);
+	o_print_str((cp->ninput == 1)? "line of input." : "lines of input.");
+	dbg->status = ESTATUS_GET_INPUT;
+
+	return 1;
+}
+
 static void cmd_help(struct debugger *dbg);
 
 static void cmd_again(struct debugger *dbg) {
@@ -1112,6 +1458,11 @@ static void cmd_replay(struct debugger *dbg) {
 		free(dbg->pending_input[--dbg->pending_wpos]);
 	}
 	dbg->pending_rpos = dbg->pending_wpos = 0;
+
+	if(resume_from_checkpoint(dbg)) {
+		return;
+	}
+
 	free(dbg->pending_input);
 
 	dbg->pending_input = dbg->ds.inputlog;
@@ -1154,6 +1505,36 @@ static void cmd_nomore(struct debugger *dbg) {
 	o_begin_box("debugger"); // Because the debugger will attempt to end it again after this
 }
 
+static void cmd_profile(struct debugger *dbg) {
+	if(dbg->profiling) {
+		dbg->profiling = 0;
+		dbg->es.profile = 0;
+		eval_profile_report(dbg->profile, dbg->prg);
+	} else {
+		eval_profile_free(dbg->profile);
+		dbg->profile = eval_profile_new(dbg->prg);
+		dbg->profiling = 1;
+		dbg->es.profile = dbg->profile;
+		o_print_str("Collecting profiling data. Enter @profile again to stop and see the results.");
+	}
+}
+
+static void cmd_flamegraph(struct debugger *dbg) {
+	char **lines;
+	int i, nline;
+
+	if(!dbg->profile) {
+		report(LVL_ERR, 0, "No profiling data. Use @profile to collect some.");
+	} else {
+		lines = eval_profile_collapsed(dbg->profile, dbg->prg, &nline);
+		fs_writefile(lines, nline, "call stacks");
+		for(i = 0; i < nline; i++) {
+			free(lines[i]);
+		}
+		free(lines);
+	}
+}
+
 struct debugcmd {
 	char	*name;
 	void	(*invoke)(struct debugger *dbg);
@@ -1161,10 +1542,12 @@ struct debugcmd {
 } debugcmd[] = {
 	{"again",	cmd_again,	"Undo, then re-enter the last line of game input."},
 	{"dynamic",	cmd_dyn,	"Show the current state of all dynamic predicates."},
+	{"flamegraph",	cmd_flamegraph,	"Save profiled call stacks to a file, for flame graph tools."},
 	{"g",		cmd_again,	"Same as @again."},
 	{"help",	cmd_help,	"Display this help text."},
 	{"more",	cmd_more,	"Enable [more] prompts for long output, if possible."},
 	{"nomore",	cmd_nomore,	"Disable [more] prompts for long output, if possible."},
+	{"profile",	cmd_profile,	"Start profiling. Enter again to stop and show the results."},
 	{"quit",	cmd_quit,	"Quit the debugger."},
 	{"replay",	cmd_replay,	"Restart, then replay the accumulated game input."},
 	{"restore",	cmd_restore,	"Restart and read game input from a file."},
@@ -1223,7 +1606,115 @@ static void cmd_help(struct debugger *dbg) {
 	o_par();
 }
 
-int check_modification_times(struct debugger *dbg) {
+// On Linux, the directories of the source files are watched with inotify,
+// so that a file is seen to change without having to stat it on every turn.
+// Editors that save by renaming a new file into place are handled because
+// it's the directory, not the file, that is watched. For a symlinked source
+// file, the directory of its target is watched as well. If anything goes
+// wrong with the watches, we fall back on comparing modification times.
+
+#ifdef __linux__
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+static void unwatch_files(struct debugger *dbg) {
+	if(dbg->watchfd >= 0) {
+		close(dbg->watchfd);
+		dbg->watchfd = -1;
+	}
+}
+
+static void add_watch(struct debugger *dbg, char *path) {
+	struct watch *w;
+	char *dir, *slash;
+
+	if(dbg->watchfd < 0) return;
+
+	w = &dbg->watches[dbg->nwatch];
+	dir = strdup(path);
+	slash = strrchr(dir, '/');
+	if(!slash) {
+		w->name = strdup(dir);
+		strcpy(dir, ".");
+	} else {
+		w->name = strdup(slash + 1);
+		if(slash == dir) {
+			slash[1] = 0;
+		} else {
+			*slash = 0;
+		}
+	}
+	w->wd = inotify_add_watch(dbg->watchfd, dir, WATCH_EVENTS | IN_ONLYDIR);
+	dbg->nwatch++;
+	if(w->wd < 0) {
+		unwatch_files(dbg);
+	}
+	free(dir);
+}
+
+static void watch_files(struct debugger *dbg) {
+	int i;
+	char *real;
+
+	dbg->watches = calloc(2 * dbg->nfilename + 1, sizeof(struct watch));
+	dbg->nwatch = 0;
+	dbg->watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	for(i = 0; i < dbg->nfilename; i++) {
+		add_watch(dbg, dbg->filenames[i]);
+		if((real = realpath(dbg->filenames[i], 0))) {
+			add_watch(dbg, real);
+			free(real);
+		}
+	}
+}
+
+static void poll_watches(struct debugger *dbg) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *ptr;
+	int i;
+
+	while((len = read(dbg->watchfd, buf, sizeof(buf))) > 0) {
+		for(ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) ptr;
+			if(ev->mask & (IN_Q_OVERFLOW | IN_IGNORED)) {
+				dbg->dirty = 1;
+				if(ev->mask & IN_IGNORED) {
+					// The directory itself went away.
+					unwatch_files(dbg);
+					return;
+				}
+			} else if(ev->len) {
+				for(i = 0; i < dbg->nwatch; i++) {
+					if(dbg->watches[i].wd == ev->wd && !strcmp(ev->name, dbg->watches[i].name)) {
+						dbg->dirty = 1;
+					}
+				}
+			}
+		}
+	}
+	if(len < 0 && errno != EAGAIN && errno != EINTR) {
+		dbg->dirty = 1;
+		unwatch_files(dbg);
+	}
+}
+
+#else
+
+static void unwatch_files(struct debugger *dbg) {
+}
+
+static void watch_files(struct debugger *dbg) {
+	dbg->watchfd = -1;
+}
+
+static void poll_watches(struct debugger *dbg) {
+}
+
+#endif
+
+static int stat_files(struct debugger *dbg) {
 	int i;
 	struct stat st;
 	int flag = 0;
@@ -1240,6 +1731,25 @@ int check_modification_times(struct debugger *dbg) {
 	return flag;
 }
 
+// The timestamps are kept up to date while the watches are working, so that
+// a later fallback doesn't see every file as modified.
+
+int check_modification_times(struct debugger *dbg) {
+	int flag;
+
+	if(dbg->watchfd >= 0) {
+		poll_watches(dbg);
+	}
+	flag = dbg->dirty;
+	dbg->dirty = 0;
+	if(dbg->watchfd >= 0) {
+		if(flag) (void) stat_files(dbg);
+		return flag;
+	}
+
+	return stat_files(dbg) || flag;
+}
+
 static int recompile(struct program *prg, int argc, char **argv) {
 	uint8_t termbuf[1];
 
@@ -1258,6 +1768,7 @@ static int recompile(struct program *prg, int argc, char **argv) {
 		o_end_box();
 	}
 	o_end_box();
+	stats_report(prg);
 
 	return 1;
 }
@@ -1267,12 +1778,19 @@ static int restart(struct debugger *dbg) {
 	int old_trace = dbg->es.trace;
 	int old_hidelinks = dbg->es.hide_links;
 
+	free_checkpoints(dbg);
 	free_dyn_state(&dbg->ds);
 	free_evalstate(&dbg->es);
 	free_program(dbg->prg);
+	// The profile is indexed by predicate id, which is only valid for the
+	// old program. If profiling is on, it starts over below.
+	eval_profile_free(dbg->profile);
+	dbg->profile = 0;
 
 	dbg->prg = new_program();
 	dbg->prg->eval_ticker = term_ticker;
+	dbg->prg->cachedir = dbg->cachedir;
+	dbg->prg->codecache = dbg->codecache;
 	frontend_add_builtins(dbg->prg);
 	if(!recompile(dbg->prg, dbg->nfilename, dbg->filenames)) {
 		return 0;
@@ -1284,6 +1802,11 @@ static int restart(struct debugger *dbg) {
 	dbg->es.hide_links = old_hidelinks;
 	dbg->es.dyn_callbacks = &dyn_callbacks;
 	dbg->es.dyn_callback_data = &dbg->ds;
+	eval_track_touched(&dbg->es);
+	if(dbg->profiling) {
+		dbg->profile = eval_profile_new(dbg->prg);
+		dbg->es.profile = dbg->profile;
+	}
 	if(dbg->randomseed) {
 		dbg->es.randomseed = dbg->randomseed;
 	} else if(!gettimeofday(&tv, 0)) {
@@ -1314,6 +1837,8 @@ void usage(char *prgname) {
 	fprintf(stderr, "--word-seps       -W    Set word separator characters (default .,;\"()* ).\n");
 	fprintf(stderr, "--warn-not-topic        Always warn about objects not used as topics.\n");
 	fprintf(stderr, "--no-warn-not-topic     Never warn about objects not used as topics.\n");
+	fprintf(stderr, "--cache           -C    Keep parsed source files in this directory, to load faster.\n");
+	stats_usage();
 	fprintf(stderr, "\n");
 	fprintf(stderr, "--trace           -t    Enable tracing from the beginning.\n");
 	fprintf(stderr, "--no-entry        -n    Don't query '(program entry point)'.\n");
@@ -1330,6 +1855,7 @@ void usage(char *prgname) {
 	fprintf(stderr, "--unit-test       -u    Same as --quit --height=-1 --no-header.\n");
 	fprintf(stderr, "--formatting      -f    Choose formatting style: \"default\", \"ansi\", or \"none\".\n");
 	fprintf(stderr, "--transcripting         Make '(transcript active)' succeed.\n");
+	fprintf(stderr, "--wide-indices          Allow a larger heap and deeper stacks than the Z-machine.\n");
 }
 
 struct output_config output_config;
@@ -1338,6 +1864,7 @@ int debugger(int argc, char **argv) {
 	int topic_warning_level = WARN_DEFAULT;
 	int suppress_header = 0;
 	int transcripting = 0;
+	int wide_indices = 0;
 	
 	struct option longopts[] = {
 		{"help", 0, 0, 'h'},
@@ -1360,6 +1887,9 @@ int debugger(int argc, char **argv) {
 		{"unit-test", 0, 0, 'u'},
 		{"formatting", 1, 0, 'f'},
 		{"transcripting", 0, &transcripting, 1},
+		{"wide-indices", 0, &wide_indices, 1},
+		{"cache", 1, 0, 'C'},
+		STATS_LONGOPTS,
 		{0, 0, 0, 0}
 	};
 
@@ -1379,11 +1909,14 @@ int debugger(int argc, char **argv) {
 	struct word *w;
 	uint16_t unibuf[2];
 	uint8_t *wordseps = 0;
+	uint64_t predhash;
 
 	dbg.timestamps = calloc(argc, sizeof(struct timespec));
+	dbg.watchfd = -1;
+	dbg.checkpoint_interval = CHECKPOINT_INTERVAL;
 
 	do {
-		opt = getopt_long(argc, argv, "?hVvtnqw:H:s:W:LDNTuf:", longopts, 0);
+		opt = getopt_long(argc, argv, "?hVvtnqw:H:s:W:LDNTuf:C:", longopts, 0);
 		switch(opt) {
 			case 0:
 				break; // Changed DMS to allow long-only options
@@ -1418,6 +1951,9 @@ int debugger(int argc, char **argv) {
 			case 'W':
 				wordseps = (uint8_t*)strdup(optarg);
 				break;
+			case 'C':
+				dbg.cachedir = strdup(optarg);
+				break;
 			case 'L':
 				hide_links = 1;
 				break;
@@ -1448,7 +1984,7 @@ int debugger(int argc, char **argv) {
 				}
 				break;
 			default:
-				if(opt >= 0) {
+				if(opt >= 0 && !stats_option(opt, optarg)) {
 					fprintf(stderr, "Unimplemented option '%c'\n", opt);
 					return 1;
 				}
@@ -1457,6 +1993,7 @@ int debugger(int argc, char **argv) {
 	} while(opt >= 0);
 	
 	output_config.transcripting = transcripting;
+	if(wide_indices) eval_maxindex = EVAL_MAXINDEX_WIDE;
 
 	dbg.nfilename = argc - optind;
 	dbg.filenames = argv + optind;
@@ -1496,16 +2033,21 @@ int debugger(int argc, char **argv) {
 		report(LVL_NOTE, 0, "No source code filenames given. Queries are limited to the built-in predicates.");
 	}
 
+	dbg.codecache = codecache_new();
 	dbg.prg = new_program();
 	dbg.prg->topic_warning_level = topic_warning_level;
+	dbg.prg->cachedir = dbg.cachedir;
+	dbg.prg->codecache = dbg.codecache;
 	dbg.prg->eval_ticker = term_ticker;
 	frontend_add_builtins(dbg.prg);
 	(void) check_modification_times(&dbg);
+	watch_files(&dbg);
 	if(!frontend(dbg.prg, dbg.nfilename, dbg.filenames, 0)) {
 		free_program(dbg.prg);
 		term_cleanup();
 		return 1;
 	}
+	stats_report(dbg.prg);
 	if(!init_dynstate(&dbg.ds, dbg.prg)) {
 		free_dyn_state(&dbg.ds);
 		free_program(dbg.prg);
@@ -1517,6 +2059,7 @@ int debugger(int argc, char **argv) {
 	dbg.es.hide_links = hide_links;
 	dbg.es.dyn_callbacks = &dyn_callbacks;
 	dbg.es.dyn_callback_data = &dbg.ds;
+	eval_track_touched(&dbg.es);
 	if(dbg.randomseed) {
 		dbg.es.randomseed = dbg.randomseed;
 	} else if(!gettimeofday(&tv, 0)) {
@@ -1651,6 +2194,9 @@ int debugger(int argc, char **argv) {
 				o_post_input(1);
 				o_end_box();
 			} else {
+				if(dbg.status == ESTATUS_GET_INPUT) {
+					take_checkpoint(&dbg);
+				}
 				if(dbg.pending_rpos < dbg.pending_wpos) {
 					snprintf((char *) termbuf, sizeof(termbuf), "%s", dbg.pending_input[dbg.pending_rpos]);
 					free(dbg.pending_input[dbg.pending_rpos++]);
@@ -1677,13 +2223,20 @@ int debugger(int argc, char **argv) {
 				o_begin_box("debugger");
 				o_print_str("The source code has been modified. Merging changes into the running program.");
 				o_end_box();
+				predhash = hash_touched(&dbg, dbg.es.touched, dbg.es.ntouched);
 				if(!recompile(dbg.prg, dbg.nfilename, dbg.filenames)) {
 					running = 0;
 					break;
 				}
+				if(hash_touched(&dbg, dbg.es.touched, dbg.es.ntouched) != predhash) {
+					// Part of the game so far was played using code that
+					// has now changed.
+					dbg.tainted = 1;
+				}
 				(void) check_modification_times(&dbg);
 				update_initial_values(dbg.prg, &dbg.ds);
 			}
+			reclaim_predicates(&dbg);
 			if(*termbuf == '@') {
 				o_begin_box("debugger");
 				j = -1;
@@ -1710,6 +2263,8 @@ int debugger(int argc, char **argv) {
 			} else if(dbg.status == ESTATUS_DEBUGGER && !*termbuf) {
 				dbg.status = eval_resume(&dbg.es, (value_t) {VAL_NONE, 0});
 			} else if(termbuf[0] == '(' || (termbuf[0] == '*' && termbuf[1] == '(')) {
+				// Queries may modify the state.
+				dbg.tainted = 1;
 				predname = find_builtin(dbg.prg, BI_INJECTED_QUERY);
 				if(dbg.status == ESTATUS_DEBUGGER) {
 					dbg.es.arg[0] = (value_t) {VAL_NUM, 0};
@@ -1803,10 +2358,18 @@ int debugger(int argc, char **argv) {
 		free(dbg.pending_input[--dbg.pending_wpos]);
 	}
 	free(dbg.pending_input);
+	free_checkpoints(&dbg);
 	free_dyn_state(&dbg.ds);
 	free_evalstate(&dbg.es);
 	free_program(dbg.prg);
+	codecache_free(dbg.codecache);
+	eval_profile_free(dbg.profile);
 	free(dbg.timestamps);
+	unwatch_files(&dbg);
+	for(i = 0; i < dbg.nwatch; i++) {
+		free(dbg.watches[i].name);
+	}
+	free(dbg.watches);
 	o_cleanup();
 	term_cleanup();
 	return output_config.return_value;
@@ -7,6 +7,7 @@ struct dyn_var {
 	uint16_t		size;
 	uint16_t		nalloc;
 	uint8_t			changed;
+	uint32_t		undostamp;
 };
 
 struct dyn_flag {
@@ -22,18 +23,39 @@ struct dyn_obj {
 	uint16_t		child;
 };
 
+enum {
+	DU_GFLAG,
+	DU_GVAR,
+	DU_OFLAG,
+	DU_OVAR,
+	DU_FIRST,
+	DU_SIBLING,
+	DU_CHILD,
+};
+
+struct dyn_undo_rec {
+	uint8_t			kind;
+	uint16_t		onum;
+	uint16_t		index;
+	union {
+		uint8_t			gflag;
+		uint16_t		link;
+		struct dyn_flag		flag;
+		struct dyn_var		var;	// rendered lives in the arena of the undo marker
+	} old;
+};
+
 struct dyn_undo {
 	struct arena		arena;
-	uint8_t			*gflag;
-	struct dyn_var		*gvar;
-	struct dyn_obj		*obj;
-	uint16_t		*first_in_oflag;
+	int			logpos;
+	uint32_t		serial;
 	int			ngflag;
 	int			ngvar;
 	int			nobj;
 	int			nobjflag;
 	int			nobjvar;
 	int			ninput;
+	uint8_t			stale;
 };
 
 struct dyn_state {
@@ -55,4 +77,9 @@ struct dyn_state {
 	int			nalloc_undo;
 	int			nundo;
 	int			did_prune_undo;
+	uint32_t		undoserial;
+
+	struct dyn_undo_rec	*undolog;
+	int			nalloc_undolog;
+	int			nundolog;
 };
@@ -16,6 +16,8 @@
 
 static volatile int interrupted = 0;
 
+uint32_t eval_maxindex = EVAL_MAXINDEX_Z;
+
 extern struct output_config output_config;
 
 void eval_interrupt() {
@@ -44,18 +46,118 @@ value_t eval_deref(value_t v, struct eval_state *es) {
 	return v;
 }
 
-static int add_trail(struct eval_state *es, uint16_t index) {
+// The undo journal records the old contents of any state that was part of the
+// most recent undo snapshot, just before that state is overwritten. Stacks and
+// the heap are protected below a watermark; the first write below a mark
+// journals everything between the write position and the mark, and lowers the
+// mark. Cells that can be modified in place (bound heap refs, env vars and
+// select bytes) are journalled once per snapshot, tracked using stamps.
+
+static struct eval_undo_rec *undo_log(struct eval_state *es, int kind, uint32_t index, uint32_t count) {
+	struct eval_undo_rec *rec;
+
+	assert(es->nundo);
+	if(es->nundolog >= es->nalloc_undolog) {
+		es->nalloc_undolog = 2 * es->nundolog + 64;
+		es->undolog = realloc(es->undolog, es->nalloc_undolog * sizeof(struct eval_undo_rec));
+	}
+	rec = &es->undolog[es->nundolog++];
+	rec->kind = kind;
+	rec->index = index;
+	rec->count = count;
+
+	return rec;
+}
+
+static void undo_log_range(struct eval_state *es, int kind, void *base, uint32_t from, uint32_t to, int elsize) {
+	struct eval_undo_rec *rec = undo_log(es, kind, from, to - from);
+
+	rec->old.data = arena_alloc(&es->undostack[es->nundo - 1].arena, (to - from) * elsize);
+	memcpy(rec->old.data, (uint8_t *) base + from * elsize, (to - from) * elsize);
+}
+
+static void undo_log_env(struct eval_state *es, int index) {
+	struct env *env = &es->envstack[index];
+	struct eval_undo_rec *rec = undo_log(es, UNDO_ENV, index, 1);
+
+	rec->old.data = arena_alloc(&es->undostack[es->nundo - 1].arena, sizeof(struct env));
+	memcpy(rec->old.data, env, sizeof(struct env));
+	es->undomark.env = index;
+
+	if(env->vars < es->undomark.vars) {
+		undo_log_range(es, UNDO_VAR_RANGE, es->varstack, env->vars, es->undomark.vars, sizeof(value_t));
+		es->undomark.vars = env->vars;
+	}
+}
+
+static void undo_log_choice(struct eval_state *es, int index) {
+	struct choice *cho = &es->choicestack[index];
+	struct eval_undo_rec *rec = undo_log(es, UNDO_CHOICE, index, 1);
+
+	rec->old.data = arena_alloc(&es->undostack[es->nundo - 1].arena, sizeof(struct choice));
+	memcpy(rec->old.data, cho, sizeof(struct choice));
+	es->undomark.choice = index - 1;
+}
+
+static void store_heap(struct eval_state *es, int index, value_t v) {
+	struct eval_undo_rec *rec;
+
+	if(index < es->undomark.top && es->heapstamp[index] != es->undomark.gen) {
+		rec = undo_log(es, UNDO_HEAP, index, 1);
+		rec->old.value = es->heap[index];
+		es->heapstamp[index] = es->undomark.gen;
+	}
+	es->heap[index] = v;
+}
+
+static void store_var(struct eval_state *es, uint32_t index, value_t v) {
+	struct eval_undo_rec *rec;
+
+	if(index < es->undomark.vars && es->varstamp[index] != es->undomark.gen) {
+		rec = undo_log(es, UNDO_VAR, index, 1);
+		rec->old.value = es->varstack[index];
+		es->varstamp[index] = es->undomark.gen;
+	}
+	es->varstack[index] = v;
+}
+
+static void store_select(struct eval_state *es, int index, uint8_t val) {
+	struct eval_undo_rec *rec;
+	int n;
+
+	if(es->undomark.gen) {
+		if(index >= es->nalloc_selectstamp) {
+			n = es->program->nselect;
+			assert(index < n);
+			es->selectstamp = realloc(es->selectstamp, n * sizeof(uint32_t));
+			memset(es->selectstamp + es->nalloc_selectstamp, 0, (n - es->nalloc_selectstamp) * sizeof(uint32_t));
+			es->nalloc_selectstamp = n;
+		}
+		if(es->selectstamp[index] != es->undomark.gen) {
+			rec = undo_log(es, UNDO_SELECT, index, 1);
+			rec->old.byte = es->program->select[index];
+			es->selectstamp[index] = es->undomark.gen;
+		}
+	}
+	es->program->select[index] = val;
+}
+
+static int add_trail(struct eval_state *es, uint32_t index) {
 	if(es->trail >= es->nalloc_trail) {
-		int newsize = 2 * es->trail + 8;
-		if(newsize >= 0xffff) {
-			newsize = 0xffff;
+		uint32_t newsize = 2 * es->trail + 8;
+		if(newsize >= eval_maxindex) {
+			newsize = eval_maxindex;
 			if(es->trail >= newsize) {
 				report(LVL_ERR, 0, "Trail overflow (perhaps infinite recursion).");
 				return -1;
 			}
 		}
 		es->nalloc_trail = newsize;
-		es->trailstack = realloc(es->trailstack, es->nalloc_trail * sizeof(uint16_t));
+		es->trailstack = realloc(es->trailstack, es->nalloc_trail * sizeof(uint32_t));
+	}
+	if(es->trail < es->undomark.trail) {
+		undo_log_range(es, UNDO_TRAIL_RANGE, es->trailstack, es->trail, es->undomark.trail, sizeof(uint32_t));
+		es->undomark.trail = es->trail;
 	}
 	es->trailstack[es->trail++] = index;
 
@@ -66,16 +168,23 @@ static int alloc_heap_struct(struct eval_state *es, int n) {
 	int offs;
 
 	if(es->top + n > es->nalloc_heap) {
-		int newsize = 2 * (es->top + n);
-		if(newsize >= 0xffff) {
-			newsize = 0xffff;
+		uint32_t newsize = 2 * (es->top + n);
+		if(newsize >= eval_maxindex) {
+			newsize = eval_maxindex;
 			if(es->top + n > newsize) {
 				report(LVL_ERR, 0, "Heap overflow (perhaps infinite recursion).");
 				return -1;
 			}
 		}
+		es->heap = realloc(es->heap, newsize * sizeof(value_t));
+		es->heapstamp = realloc(es->heapstamp, newsize * sizeof(uint32_t));
+		memset(es->heapstamp + es->nalloc_heap, 0, (newsize - es->nalloc_heap) * sizeof(uint32_t));
 		es->nalloc_heap = newsize;
-		es->heap = realloc(es->heap, es->nalloc_heap * sizeof(value_t));
+	}
+
+	if(es->top < es->undomark.top) {
+		undo_log_range(es, UNDO_HEAP_RANGE, es->heap, es->top, es->undomark.top, sizeof(value_t));
+		es->undomark.top = es->top;
 	}
 
 	offs = es->top;
@@ -137,37 +246,48 @@ static int envtop(struct eval_state *es) {
 	}
 }
 
-static void cut_to(struct eval_state *es, int new_choice) {
-	struct choice *cho;
+static uint32_t vartop(struct env *envstack, int etop) {
 	struct env *env;
+
+	if(etop) {
+		env = &envstack[etop - 1];
+		return env->vars + env->nvar + env->ntracevar;
+	} else {
+		return 0;
+	}
+}
+
+// Discarded frames are only journalled if they are below the undo marks.
+
+static void cut_to(struct eval_state *es, int new_choice) {
 	int oldtop = envtop(es), newtop;
 
 	assert(new_choice <= es->choice);
 
+	if(es->choice > es->undomark.choice) {
+		es->choice = (new_choice > es->undomark.choice)? new_choice : es->undomark.choice;
+	}
 	while(es->choice > new_choice) {
-		cho = &es->choicestack[es->choice--];
-		pred_release(cho->nextcase.pred);
-		pred_release(cho->cont.pred);
+		undo_log_choice(es, es->choice--);
 	}
 
 	newtop = envtop(es);
+	if(oldtop > es->undomark.env) {
+		oldtop = es->undomark.env;
+	}
 	while(oldtop > newtop) {
-		env = &es->envstack[--oldtop];
-		pred_release(env->cont.pred);
-		free(env->vars);
-		free(env->tracevars);
+		undo_log_env(es, --oldtop);
 	}
 }
 
 static void revert_env_to(struct eval_state *es, int new_env) {
-	struct env *env;
 	struct choice *cho = &es->choicestack[es->choice];
 
 	while(es->env > new_env && (es->choice < 0 || es->env >= cho->envtop)) {
-		env = &es->envstack[es->env--];
-		pred_release(env->cont.pred);
-		free(env->vars);
-		free(env->tracevars);
+		if(es->env < es->undomark.env) {
+			undo_log_env(es, es->env);
+		}
+		es->env--;
 	}
 
 	es->env = new_env;
@@ -175,10 +295,11 @@ static void revert_env_to(struct eval_state *es, int new_env) {
 
 static int push_env(struct eval_state *es, int nvar, int ntrace) {
 	int top = envtop(es);
+	uint32_t vtop = vartop(es->envstack, top);
 
 	if(top >= es->nalloc_env) {
-		int newsize = top * 2 + 8;
-		if(newsize >= 0xffff) {
+		uint32_t newsize = top * 2 + 8;
+		if(newsize >= eval_maxindex) {
 			report(LVL_ERR, 0, "Env stack overflow (perhaps infinite recursion).");
 			es->errorflag = 1;
 			return 0;
@@ -187,15 +308,23 @@ static int push_env(struct eval_state *es, int nvar, int ntrace) {
 		es->envstack = realloc(es->envstack, es->nalloc_env * sizeof(struct env));
 	}
 
+	if(vtop + nvar + ntrace > es->nalloc_var) {
+		uint32_t newsize = (vtop + nvar + ntrace) * 2 + 64;
+		es->varstack = realloc(es->varstack, newsize * sizeof(value_t));
+		es->varstamp = realloc(es->varstamp, newsize * sizeof(uint32_t));
+		memset(es->varstamp + es->nalloc_var, 0, (newsize - es->nalloc_var) * sizeof(uint32_t));
+		es->nalloc_var = newsize;
+	}
+
 	es->envstack[top].env = es->env;
 	es->envstack[top].level = (es->env >= 0)? es->envstack[es->env].level + 1 : 0;
 	es->envstack[top].simple = es->simple;
 	es->envstack[top].cont = es->cont;
 	es->cont.pred = 0;
 	es->envstack[top].nvar = nvar;
-	es->envstack[top].vars = calloc(nvar, sizeof(value_t));
 	es->envstack[top].ntracevar = ntrace;
-	es->envstack[top].tracevars = calloc(ntrace, sizeof(value_t));
+	es->envstack[top].vars = vtop;
+	memset(es->varstack + vtop, 0, (nvar + ntrace) * sizeof(value_t));
 	es->env = top;
 
 	return 1;
@@ -207,14 +336,15 @@ static int push_choice(struct eval_state *es, int narg, struct predicate *pred,
 	int top = envtop(es);
 
 	if(++es->choice >= es->nalloc_choice) {
-		int newsize = es->choice * 2 + 8;
-		if(newsize >= 0xffff) {
+		uint32_t newsize = es->choice * 2 + 8;
+		if(newsize >= eval_maxindex) {
 			report(LVL_ERR, 0, "Choice stack overflow (perhaps infinite recursion).");
 			es->errorflag = 1;
 			return 0;
 		}
+		es->choicestack = realloc(es->choicestack, newsize * sizeof(struct choice));
+		memset(es->choicestack + es->nalloc_choice, 0, (newsize - es->nalloc_choice) * sizeof(struct choice));
 		es->nalloc_choice = newsize;
-		es->choicestack = realloc(es->choicestack, es->nalloc_choice * sizeof(struct choice));
 	}
 
 	cho = &es->choicestack[es->choice];
@@ -228,18 +358,16 @@ static int push_choice(struct eval_state *es, int narg, struct predicate *pred,
 	}
 	cho->orig_arg0 = es->orig_arg0;
 	cho->cont = es->cont;
-	pred_claim(cho->cont.pred);
 	cho->nextcase.pred = pred;
 	cho->nextcase.routine = routine;
-	pred_claim(pred);
 
 	return 1;
 }
 
 static int push_aux(struct eval_state *es, value_t v) {
 	if(es->aux >= es->nalloc_aux) {
-		int newsize = es->aux * 2 + 8;
-		if(newsize >= 0xffff) {
+		uint32_t newsize = es->aux * 2 + 8;
+		if(newsize >= eval_maxindex) {
 			report(LVL_ERR, 0, "Aux stack overflow (perhaps infinite recursion).");
 			es->errorflag = 1;
 			return 0;
@@ -247,6 +375,10 @@ static int push_aux(struct eval_state *es, value_t v) {
 		es->nalloc_aux = newsize;
 		es->auxstack = realloc(es->auxstack, es->nalloc_aux * sizeof(value_t));
 	}
+	if(es->aux < es->undomark.aux) {
+		undo_log_range(es, UNDO_AUX_RANGE, es->auxstack, es->aux, es->undomark.aux, sizeof(value_t));
+		es->undomark.aux = es->aux;
+	}
 	es->auxstack[es->aux++] = v;
 
 	return 1;
@@ -257,7 +389,7 @@ static int collect_push(struct eval_state *es, value_t v) {
 
 	// Simple elements are serialised as themselves.
 	// Proper lists are serialized as n elements, followed by VAL_PAIR(n).
-	// Improper lists are serialized as n elements, followed by the improper tail element, followed by VAL_PAIR(0x8000+n).
+	// Improper lists are serialized as n elements, followed by the improper tail element, followed by VAL_PAIR(EVAL_IMPROPER+n).
 	// Extended dictionary words are serialized as the optional part, followed by the mandatory part, followed by VAL_DICTEXT(0).
 
 	v = eval_deref(v, es);
@@ -284,7 +416,7 @@ static int collect_push(struct eval_state *es, value_t v) {
 				if(!collect_push(es, v)) {
 					return 0;
 				}
-				v = (value_t) {VAL_PAIR, 0x8000 | count};
+				v = (value_t) {VAL_PAIR, EVAL_IMPROPER | count};
 				break;
 			}
 		}
@@ -319,8 +451,8 @@ static value_t collect_pop(struct eval_state *es) {
 	v = es->auxstack[--es->aux];
 	if(v.tag == VAL_PAIR) {
 		count = v.value;
-		if(count & 0x8000) {
-			count &= 0x7fff;
+		if(count & EVAL_IMPROPER) {
+			count &= ~EVAL_IMPROPER;
 			v = collect_pop(es);
 			if(v.tag == VAL_ERROR) return v;
 		} else {
@@ -349,89 +481,63 @@ static value_t collect_pop(struct eval_state *es) {
 	return v;
 }
 
-void free_evalstate_undo(struct eval_undo *u) {
-	int j, etop;
+static void eval_prune_undo(struct eval_state *es) {
+	struct eval_undo *u = &es->undostack[0];
+	int i, n;
 
-	if(u->choice >= 0 && u->choicestack[u->choice].envtop > u->env + 1) {
-		etop = u->choicestack[u->choice].envtop;
-	} else {
-		etop = u->env + 1;
-	}
-	for(j = 0; j < etop; j++) {
-		free(u->envstack[j].vars);
-		free(u->envstack[j].tracevars);
-		pred_release(u->envstack[j].cont.pred);
+	n = (es->nundo > 1)? es->undostack[1].logpos : es->nundolog;
+	arena_free(&u->arena);
+
+	memmove(es->undolog, es->undolog + n, (es->nundolog - n) * sizeof(struct eval_undo_rec));
+	es->nundolog -= n;
+	memmove(es->undostack, es->undostack + 1, (es->nundo - 1) * sizeof(struct eval_undo));
+	es->nundo--;
+	for(i = 0; i < es->nundo; i++) {
+		es->undostack[i].logpos -= n;
 	}
-	for(j = 0; j <= u->choice; j++) {
-		pred_release(u->choicestack[j].cont.pred);
-		pred_release(u->choicestack[j].nextcase.pred);
+
+	if(es->nundo) {
+		memset(&es->undostack[0].prevmark, 0, sizeof(struct eval_undo_mark));
+		es->undostack[0].prevmark.choice = -1;
+	} else {
+		memset(&es->undomark, 0, sizeof(struct eval_undo_mark));
+		es->undomark.choice = -1;
 	}
-	pred_release(u->cont.pred);
-	arena_free(&u->arena);
 }
 
 static void eval_push_undo(struct eval_state *es) {
-	struct arena *a;
 	struct eval_undo *u;
 	int etop;
-	int i;
 
 	if(es->nundo >= es->nalloc_undo) {
-		free_evalstate_undo(&es->undostack[0]);
-		memmove(es->undostack, es->undostack + 1, (es->nalloc_undo - 1) * sizeof(struct eval_undo));
-		es->nundo--;
+		eval_prune_undo(es);
 		es->did_prune_undo = 1;
 	}
 
-	u = &es->undostack[es->nundo];
-	a = &u->arena;
-	arena_init(a, 512);
+	u = &es->undostack[es->nundo++];
+	arena_init(&u->arena, 512);
+	u->logpos = es->nundolog;
+	u->prevmark = es->undomark;
 
 	etop = envtop(es);
-	u->envstack = arena_alloc(a, etop * sizeof(struct env));
-	for(i = 0; i < etop; i++) {
-		u->envstack[i].vars = malloc(es->envstack[i].nvar * sizeof(value_t));
-		memcpy(u->envstack[i].vars, es->envstack[i].vars, es->envstack[i].nvar * sizeof(value_t));
-		u->envstack[i].nvar = es->envstack[i].nvar;
-		u->envstack[i].tracevars = malloc(es->envstack[i].ntracevar * sizeof(value_t));
-		memcpy(u->envstack[i].tracevars, es->envstack[i].tracevars, es->envstack[i].ntracevar * sizeof(value_t));
-		pred_claim(es->envstack[i].cont.pred);
-		u->envstack[i].cont.pred = es->envstack[i].cont.pred;
-		u->envstack[i].cont.routine = es->envstack[i].cont.routine;
-		u->envstack[i].ntracevar = es->envstack[i].ntracevar;
-		u->envstack[i].env = es->envstack[i].env;
-		u->envstack[i].simple = es->envstack[i].simple;
-		u->envstack[i].level = es->envstack[i].level;
-	}
-	u->env = es->env;
+	es->undomark.gen = ++es->undoserial;
+	es->undomark.vars = vartop(es->envstack, etop);
+	es->undomark.env = etop;
+	es->undomark.choice = es->choice;
+	es->undomark.top = es->top;
+	es->undomark.trail = es->trail;
+	es->undomark.aux = es->aux;
 
-	u->choicestack = arena_alloc(a, (es->choice + 1) * sizeof(struct choice));
-	memcpy(u->choicestack, es->choicestack, (es->choice + 1) * sizeof(struct choice));
-	for(i = 0; i <= es->choice; i++) {
-		pred_claim(es->choicestack[i].cont.pred);
-		pred_claim(es->choicestack[i].nextcase.pred);
-	}
+	u->env = es->env;
 	u->choice = es->choice;
 	u->stopchoice = es->stopchoice;
-
-	u->auxstack = arena_alloc(a, es->aux * sizeof(value_t));
-	memcpy(u->auxstack, es->auxstack, es->aux * sizeof(value_t));
 	u->aux = es->aux;
 	u->stopaux = es->stopaux;
-
-	u->trailstack = arena_alloc(a, es->trail * sizeof(uint16_t));
-	memcpy(u->trailstack, es->trailstack, es->trail * sizeof(uint16_t));
 	u->trail = es->trail;
-
-	u->heap = arena_alloc(a, es->top * sizeof(value_t));
-	memcpy(u->heap, es->heap, es->top * sizeof(value_t));
 	u->top = es->top;
 
-	pred_claim(es->cont.pred);
 	u->cont = es->cont;
 
-	u->select = arena_alloc(a, es->program->nselect);
-	memcpy(u->select, es->program->select, es->program->nselect);
 	u->nselect = es->program->nselect;
 
 	u->divsp = es->divsp;
@@ -439,64 +545,70 @@ static void eval_push_undo(struct eval_state *es) {
 
 	u->randomseed = es->randomseed;
 	u->arg0 = es->arg[0];
-
-	es->nundo++;
 }
 
 static int eval_pop_undo(struct eval_state *es) {
 	struct eval_undo *u;
-	int etop;
+	struct eval_undo_rec *rec;
 	int i;
 
 	if(!es->nundo) return 0;
 
-	u = &es->undostack[--es->nundo];
+	u = &es->undostack[es->nundo - 1];
+
+	while(es->nundolog > u->logpos) {
+		rec = &es->undolog[--es->nundolog];
+		switch(rec->kind) {
+		case UNDO_HEAP:
+			es->heap[rec->index] = rec->old.value;
+			break;
+		case UNDO_HEAP_RANGE:
+			memcpy(es->heap + rec->index, rec->old.data, rec->count * sizeof(value_t));
+			break;
+		case UNDO_VAR:
+			es->varstack[rec->index] = rec->old.value;
+			break;
+		case UNDO_VAR_RANGE:
+			memcpy(es->varstack + rec->index, rec->old.data, rec->count * sizeof(value_t));
+			break;
+		case UNDO_AUX_RANGE:
+			memcpy(es->auxstack + rec->index, rec->old.data, rec->count * sizeof(value_t));
+			break;
+		case UNDO_TRAIL_RANGE:
+			memcpy(es->trailstack + rec->index, rec->old.data, rec->count * sizeof(uint32_t));
+			break;
+		case UNDO_ENV:
+			memcpy(&es->envstack[rec->index], rec->old.data, sizeof(struct env));
+			break;
+		case UNDO_CHOICE:
+			memcpy(&es->choicestack[rec->index], rec->old.data, sizeof(struct choice));
+			break;
+		case UNDO_SELECT:
+			es->program->select[rec->index] = rec->old.byte;
+			break;
+		default:
+			assert(0);
+		}
+	}
+
+	es->nundo--;
+	es->undomark = u->prevmark;
 
 	es->arg[0] = u->arg0;
 	//es->randomseed = u->randomseed;
 
 	assert(u->nselect <= es->program->nselect);
-	memcpy(es->program->select, u->select, u->nselect);
 	memset(es->program->select + u->nselect, 0, es->program->nselect - u->nselect);
 
-	pred_release(es->cont.pred);
 	es->cont = u->cont;
 
-	assert(u->top <= es->nalloc_heap);
-	memcpy(es->heap, u->heap, u->top * sizeof(value_t));
 	es->top = u->top;
-
-	assert(u->trail <= es->nalloc_trail);
-	memcpy(es->trailstack, u->trailstack, u->trail * sizeof(uint16_t));
 	es->trail = u->trail;
-
-	assert(u->aux <= es->nalloc_aux);
-	memcpy(es->auxstack, u->auxstack, u->aux * sizeof(value_t));
 	es->aux = u->aux;
 	es->stopaux = u->stopaux;
-
-	etop = envtop(es);
-	for(i = 0; i < etop; i++) {
-		pred_release(es->envstack[i].cont.pred);
-		free(es->envstack[i].vars);
-		free(es->envstack[i].tracevars);
-	}
-	for(i = 0; i <= es->choice; i++) {
-		pred_release(es->choicestack[i].cont.pred);
-		pred_release(es->choicestack[i].nextcase.pred);
-	}
-
 	es->choice = u->choice;
 	es->stopchoice = u->stopchoice;
-
 	es->env = u->env;
-	etop = envtop(es);
-
-	assert(u->choice < es->nalloc_choice);
-	assert(etop <= es->nalloc_env);
-
-	memcpy(es->choicestack, u->choicestack, (u->choice + 1) * sizeof(struct choice));
-	memcpy(es->envstack, u->envstack, etop * sizeof(struct env));
 
 	while(es->divsp--) o_end_box();
 	es->divsp = u->divsp;
@@ -522,6 +634,194 @@ static int eval_pop_undo(struct eval_state *es) {
 	return 1;
 }
 
+// The heap is otherwise only reclaimed by backtracking. While the program is
+// waiting for input, the part of the heap above the undo watermark can also be
+// compacted: live cells are marked from the stacks, and then slid down in
+// order. The relative age of cells is preserved, so choice points can still
+// refer to heap boundaries, and variables are still bound from younger to
+// older. Trail entries for dead cells are dropped. Cells below the watermark
+// belong to the latest undo snapshot and stay where they are, but references
+// from them (and from stack entries that the snapshot protects) into the
+// compacted region are updated via the journal.
+
+struct gc_state {
+	uint32_t	base;
+	uint32_t	top;
+	uint32_t	*fwd;		// mark bit, then new index, per cell from base
+	uint32_t	*work;
+	uint32_t	nwork;
+};
+
+static int gc_ncell(struct gc_state *gc, value_t v) {
+	uint32_t i = v.value, n;
+
+	switch(v.tag) {
+	case VAL_REF:
+		n = 1;
+		break;
+	case VAL_PAIR:
+	case VAL_DICTEXT:
+		n = 2;
+		break;
+	default:
+		return 0;
+	}
+
+	// Unused slots in the stacks may hold stale values.
+	if(i < gc->base || i >= gc->top || gc->top - i < n) return 0;
+
+	return n;
+}
+
+static void gc_mark(struct gc_state *gc, value_t v) {
+	uint32_t i;
+	int n = gc_ncell(gc, v);
+
+	for(i = v.value - gc->base; n--; i++) {
+		if(!gc->fwd[i]) {
+			gc->fwd[i] = 1;
+			gc->work[gc->nwork++] = i;
+		}
+	}
+}
+
+static value_t gc_remap(struct gc_state *gc, value_t v) {
+	if(gc_ncell(gc, v)) {
+		v.value = gc->fwd[v.value - gc->base];
+	}
+
+	return v;
+}
+
+static uint32_t gc_remap_index(struct gc_state *gc, uint32_t i) {
+	if(i >= gc->base && i <= gc->top) {
+		i = gc->fwd[i - gc->base];
+	}
+
+	return i;
+}
+
+static int gc_is_live(struct gc_state *gc, uint32_t i) {
+	return i < gc->base || i >= gc->top || gc->fwd[i - gc->base + 1] != gc->fwd[i - gc->base];
+}
+
+static void collect_garbage(struct eval_state *es) {
+	struct gc_state gc;
+	struct choice cho;
+	uint32_t i, n, pos, live, ntrail, *tfwd;
+	uint32_t vtop = vartop(es->envstack, envtop(es));
+	value_t v;
+	int j, k;
+
+	gc.base = es->undomark.top;
+	gc.top = es->top;
+	if(gc.top < gc.base || gc.top - gc.base < EVAL_GC_MIN) return;
+
+	n = gc.top - gc.base;
+	gc.fwd = calloc(n + 1, sizeof(uint32_t));
+	gc.work = malloc(n * sizeof(uint32_t));
+	gc.nwork = 0;
+
+	// The aux stack only holds serialized values, and temporaries don't
+	// survive the end of a routine, so neither can refer to the heap. Of the
+	// arguments, only the first one (to receive the input) is still in use.
+
+	for(i = 0; i < gc.base; i++) {
+		gc_mark(&gc, es->heap[i]);
+	}
+	for(i = 0; i < vtop; i++) {
+		gc_mark(&gc, es->varstack[i]);
+	}
+	for(j = 0; j <= es->choice; j++) {
+		for(k = 0; k < MAXPARAM + 1; k++) {
+			gc_mark(&gc, es->choicestack[j].arg[k]);
+		}
+		gc_mark(&gc, es->choicestack[j].orig_arg0);
+	}
+	gc_mark(&gc, es->arg[0]);
+	gc_mark(&gc, es->orig_arg0);
+	while(gc.nwork) {
+		gc_mark(&gc, es->heap[gc.base + gc.work[--gc.nwork]]);
+	}
+
+	pos = gc.base;
+	for(i = 0; i < n; i++) {
+		live = gc.fwd[i];
+		gc.fwd[i] = pos;
+		pos += live;
+	}
+	gc.fwd[n] = pos;
+
+	if(pos == gc.top) {
+		free(gc.fwd);
+		free(gc.work);
+		return;
+	}
+
+	for(i = 0; i < n; i++) {
+		if(gc.fwd[i + 1] != gc.fwd[i]) {
+			es->heap[gc.fwd[i]] = gc_remap(&gc, es->heap[gc.base + i]);
+		}
+	}
+	es->top = pos;
+
+	for(i = 0; i < gc.base; i++) {
+		v = gc_remap(&gc, es->heap[i]);
+		if(!VALUE_EQ(v, es->heap[i])) {
+			store_heap(es, i, v);
+		}
+	}
+	for(i = 0; i < vtop; i++) {
+		v = gc_remap(&gc, es->varstack[i]);
+		if(!VALUE_EQ(v, es->varstack[i])) {
+			store_var(es, i, v);
+		}
+	}
+	es->arg[0] = gc_remap(&gc, es->arg[0]);
+	es->orig_arg0 = gc_remap(&gc, es->orig_arg0);
+
+	tfwd = malloc((es->trail + 1) * sizeof(uint32_t));
+	ntrail = 0;
+	for(i = 0; i < es->trail; i++) {
+		tfwd[i] = ntrail;
+		if(gc_is_live(&gc, es->trailstack[i])) {
+			pos = gc_remap_index(&gc, es->trailstack[i]);
+			if(pos != es->trailstack[i] || ntrail != i) {
+				if(ntrail < es->undomark.trail) {
+					undo_log_range(es, UNDO_TRAIL_RANGE, es->trailstack, ntrail, es->undomark.trail, sizeof(uint32_t));
+					es->undomark.trail = ntrail;
+				}
+				es->trailstack[ntrail] = pos;
+			}
+			ntrail++;
+		}
+	}
+	tfwd[es->trail] = ntrail;
+
+	for(j = es->choice; j >= 0; j--) {
+		cho = es->choicestack[j];
+		for(k = 0; k < MAXPARAM + 1; k++) {
+			cho.arg[k] = gc_remap(&gc, cho.arg[k]);
+		}
+		cho.orig_arg0 = gc_remap(&gc, cho.orig_arg0);
+		cho.top = gc_remap_index(&gc, cho.top);
+		if(cho.trail <= es->trail) {
+			cho.trail = tfwd[cho.trail];
+		}
+		if(memcmp(&cho, &es->choicestack[j], sizeof(struct choice))) {
+			while(es->undomark.choice >= j) {
+				undo_log_choice(es, es->undomark.choice);
+			}
+			es->choicestack[j] = cho;
+		}
+	}
+	es->trail = ntrail;
+
+	free(tfwd);
+	free(gc.fwd);
+	free(gc.work);
+}
+
 static value_t value_of(value_t v, struct eval_state *es) {
 	struct env *env;
 
@@ -535,7 +835,7 @@ static value_t value_of(value_t v, struct eval_state *es) {
 	case OPER_VAR:
 		env = &es->envstack[es->env];
 		assert(v.value < env->nvar);
-		return env->vars[v.value];
+		return es->varstack[env->vars + v.value];
 	case OPER_BOX: // Only for BI_GLOBAL_STYLE
 	case VAL_NUM:
 	case VAL_OBJ:
@@ -568,7 +868,7 @@ static void set_by_ref(value_t dest, value_t v, struct eval_state *es) {
 	case OPER_VAR:
 		env = &es->envstack[es->env];
 		assert(dest.value < env->nvar);
-		env->vars[dest.value] = v;
+		store_var(es, env->vars + dest.value, v);
 		break;
 	default:
 		assert(0);
@@ -576,86 +876,131 @@ static void set_by_ref(value_t dest, value_t v, struct eval_state *es) {
 }
 
 static int set_heap_ref(struct eval_state *es, int ref, value_t v) {
-	es->heap[ref] = v;
+	store_heap(es, ref, v);
 	return add_trail(es, ref);
 }
 
-static int unify(struct eval_state *es, value_t v1, value_t v2, int rec_depth) {
-	if(rec_depth >= 8) {
-		report(
-			LVL_WARN,
-			0,
-			"Detected a very deeply nested (possibly cyclic) list structure.");
-		return 0;
+// Binds v1 to v2 or vice versa. At least one of them is an unbound variable,
+// and the younger one is bound to the older one.
+
+static int bind_ref(struct eval_state *es, value_t v1, value_t v2) {
+	if(v1.tag == VAL_REF && (v2.tag != VAL_REF || v1.value > v2.value)) {
+		if(add_trail(es, v1.value)) return 0;
+		store_heap(es, v1.value, v2);
+	} else {
+		if(add_trail(es, v2.value)) return 0;
+		store_heap(es, v2.value, v1);
 	}
 
-	v1 = eval_deref(v1, es);
-	v2 = eval_deref(v2, es);
+	return 1;
+}
+
+static int is_compound(value_t v) {
+	return v.tag == VAL_PAIR || v.tag == VAL_DICTEXT;
+}
+
+// Unification walks both structures in step. The spines of lists are followed
+// in a loop, and nested lists are entered after pushing the pending tails on a
+// small explicit stack. Identical values, such as a shared tail, are accepted
+// without looking inside them.
+
+static int unify(struct eval_state *es, value_t v1, value_t v2) {
+	value_t stack[2 * EVAL_UNIFY_DEPTH];
+	value_t h1, h2;
+	int sp = 0;
+
 	for(;;) {
-		if(v1.tag == VAL_REF) {
-			if(v2.tag == VAL_REF) {
-				if(v1.value > v2.value) {
-					if(add_trail(es, v1.value)) return 0;
-					es->heap[v1.value] = v2;
-				} else {
-					if(add_trail(es, v2.value)) return 0;
-					es->heap[v2.value] = v1;
+		v1 = eval_deref(v1, es);
+		v2 = eval_deref(v2, es);
+		while(v1.tag == VAL_PAIR && v2.tag == VAL_PAIR && !VALUE_EQ(v1, v2)) {
+			h1 = eval_deref(es->heap[v1.value + 0], es);
+			h2 = eval_deref(es->heap[v2.value + 0], es);
+			// The tails are dereferenced after the heads have been bound,
+			// since they may be the same variables.
+			v1 = es->heap[v1.value + 1];
+			v2 = es->heap[v2.value + 1];
+			if(VALUE_EQ(h1, h2)) {
+				// nothing to do
+			} else if(h1.tag == VAL_REF || h2.tag == VAL_REF) {
+				if(!bind_ref(es, h1, h2)) return 0;
+			} else if(is_compound(h1) || is_compound(h2)) {
+				if(sp == 2 * EVAL_UNIFY_DEPTH) {
+					report(
+						LVL_WARN,
+						0,
+						"Detected a very deeply nested (possibly cyclic) list structure.");
+					return 0;
 				}
+				stack[sp++] = v1;
+				stack[sp++] = v2;
+				v1 = h1;
+				v2 = h2;
 			} else {
-				if(add_trail(es, v1.value)) return 0;
-				es->heap[v1.value] = v2;
+				return 0;
 			}
-			return 1;
-		} else if(v2.tag == VAL_REF) {
-			if(add_trail(es, v2.value)) return 0;
-			es->heap[v2.value] = v1;
-			return 1;
-		} else if(v1.tag == VAL_PAIR) {
-			if(v2.tag != VAL_PAIR) return 0;
-			if(!unify(es, es->heap[v1.value], es->heap[v2.value], rec_depth + 1)) return 0;
-			v1 = eval_deref(es->heap[v1.value + 1], es);
-			v2 = eval_deref(es->heap[v2.value + 1], es);
+			v1 = eval_deref(v1, es);
+			v2 = eval_deref(v2, es);
+		}
+		if(VALUE_EQ(v1, v2)) {
+			// nothing to do
+		} else if(v1.tag == VAL_REF || v2.tag == VAL_REF) {
+			if(!bind_ref(es, v1, v2)) return 0;
 		} else if(v1.tag == VAL_DICTEXT && v2.tag == VAL_DICTEXT) {
 			v1 = es->heap[v1.value + 0];
 			v2 = es->heap[v2.value + 0];
+			continue;
 		} else {
 			if(v1.tag == VAL_DICTEXT) v1 = es->heap[v1.value + 0];
 			if(v2.tag == VAL_DICTEXT) v2 = es->heap[v2.value + 0];
-			return (v1.tag == v2.tag) && (v1.value == v2.value);
+			if(!VALUE_EQ(v1, v2)) return 0;
 		}
+		if(!sp) return 1;
+		v2 = stack[--sp];
+		v1 = stack[--sp];
 	}
 }
 
-static int would_unify(struct eval_state *es, value_t v1, value_t v2, int rec_depth) {
-	int res;
+// Returns -1 if the structures are nested too deeply to compare.
 
-	if(rec_depth >= 8) return -1;
+static int would_unify(struct eval_state *es, value_t v1, value_t v2) {
+	value_t stack[2 * EVAL_UNIFY_DEPTH];
+	value_t h1, h2;
+	int sp = 0;
 
 	for(;;) {
 		v1 = eval_deref(v1, es);
 		v2 = eval_deref(v2, es);
-		if(v1.tag == VAL_REF || v2.tag == VAL_REF) {
-			return 1;
-		} else if(v1.tag == VAL_PAIR) {
-			if(v2.tag != VAL_PAIR) return 0;
-			res = would_unify(
-				es,
-				es->heap[v1.value + 0],
-				es->heap[v2.value + 0],
-				rec_depth + 1);
-			if(res != 1) {
-				return res;
+		while(v1.tag == VAL_PAIR && v2.tag == VAL_PAIR && !VALUE_EQ(v1, v2)) {
+			h1 = eval_deref(es->heap[v1.value + 0], es);
+			h2 = eval_deref(es->heap[v2.value + 0], es);
+			v1 = eval_deref(es->heap[v1.value + 1], es);
+			v2 = eval_deref(es->heap[v2.value + 1], es);
+			if(VALUE_EQ(h1, h2) || h1.tag == VAL_REF || h2.tag == VAL_REF) {
+				// nothing to do
+			} else if(is_compound(h1) || is_compound(h2)) {
+				if(sp == 2 * EVAL_UNIFY_DEPTH) return -1;
+				stack[sp++] = v1;
+				stack[sp++] = v2;
+				v1 = h1;
+				v2 = h2;
+			} else {
+				return 0;
 			}
-			v1 = es->heap[v1.value + 1];
-			v2 = es->heap[v2.value + 1];
+		}
+		if(VALUE_EQ(v1, v2) || v1.tag == VAL_REF || v2.tag == VAL_REF) {
+			// nothing to do
 		} else if(v1.tag == VAL_DICTEXT && v2.tag == VAL_DICTEXT) {
 			v1 = es->heap[v1.value + 0];
 			v2 = es->heap[v2.value + 0];
+			continue;
 		} else {
 			if(v1.tag == VAL_DICTEXT) v1 = es->heap[v1.value + 0];
 			if(v2.tag == VAL_DICTEXT) v2 = es->heap[v2.value + 0];
-			return (v1.tag == v2.tag) && (v1.value == v2.value);
+			if(!VALUE_EQ(v1, v2)) return 0;
 		}
+		if(!sp) return 1;
+		v2 = stack[--sp];
+		v1 = stack[--sp];
 	}
 }
 
@@ -903,18 +1248,222 @@ int ensure_fixed_values(struct eval_state *es, struct program *prg, struct predn
 	return retval;
 }
 
+// The profiler counts calls, failures and executed instructions per
+// predicate. Every EVAL_PROFILE_INTERVAL instructions, at a routine entry,
+// the call stack is reconstructed from the continuations in the env frames.
+
+struct eval_profile *eval_profile_new(struct program *prg) {
+	struct eval_profile *prof = calloc(1, sizeof(*prof));
+
+	arena_init(&prof->arena, 4096);
+	prof->npred = prg->npredicate;
+	prof->pred = calloc(prof->npred, sizeof(struct eval_profile_pred));
+	return prof;
+}
+
+void eval_profile_free(struct eval_profile *prof) {
+	if(prof) {
+		arena_free(&prof->arena);
+		free(prof->pred);
+		free(prof->frames);
+		free(prof);
+	}
+}
+
+static struct eval_profile_pred *profile_pred(struct eval_profile *prof, int id) {
+	if(id >= prof->npred) {
+		prof->pred = realloc(prof->pred, (id + 1) * sizeof(struct eval_profile_pred));
+		memset(prof->pred + prof->npred, 0, (id + 1 - prof->npred) * sizeof(struct eval_profile_pred));
+		prof->npred = id + 1;
+	}
+	return &prof->pred[id];
+}
+
+static void touch_pred(struct eval_state *es, int id) {
+	int n;
+
+	if(id >= es->ntouched) {
+		n = es->program->npredicate;
+		if(n <= id) n = id + 1;
+		es->touched = realloc(es->touched, n);
+		memset(es->touched + es->ntouched, 0, n - es->ntouched);
+		es->ntouched = n;
+	}
+	es->touched[id] = 1;
+}
+
+void eval_track_touched(struct eval_state *es) {
+	if(!es->touched) {
+		es->ntouched = es->program->npredicate;
+		es->touched = calloc(es->ntouched + 1, 1);
+	}
+}
+
+static void profile_push_frame(struct eval_profile *prof, int *n, struct predicate *pred) {
+	if(*n >= prof->nalloc_frame) {
+		prof->nalloc_frame = *n * 2 + 32;
+		prof->frames = realloc(prof->frames, prof->nalloc_frame * sizeof(uint16_t));
+	}
+	prof->frames[(*n)++] = pred->predname->pred_id;
+}
+
+static void profile_sample(struct eval_state *es, struct predicate *pred) {
+	struct eval_profile *prof = es->profile;
+	struct eval_profile_stack *st;
+	struct eval_profile_pred *pp;
+	uint64_t weight = prof->ninstr - prof->lastsample;
+	uint32_t hash = 2166136261u;
+	int i, n = 0, e;
+
+	// Until the current predicate allocates an env frame, es->cont is its
+	// continuation. After that, the continuation is kept in the frame.
+
+	profile_push_frame(prof, &n, pred);
+	if(es->cont.pred) {
+		profile_push_frame(prof, &n, es->cont.pred);
+	}
+	for(e = es->env; e >= 0; e = es->envstack[e].env) {
+		if(es->envstack[e].cont.pred) {
+			profile_push_frame(prof, &n, es->envstack[e].cont.pred);
+		}
+	}
+
+	prof->lastsample = prof->ninstr;
+	prof->nsample++;
+	for(i = 0; i < n; i++) {
+		pp = profile_pred(prof, prof->frames[i]);
+		if(pp->stamp != prof->nsample) {
+			pp->stamp = prof->nsample;
+			pp->inclusive += weight;
+		}
+		hash = (hash ^ prof->frames[i]) * 16777619u;
+	}
+
+	for(st = prof->bucket[hash % EVAL_PROFILE_NBUCKET]; st; st = st->next) {
+		if(st->hash == hash
+		&& st->nframe == n
+		&& !memcmp(st->frame, prof->frames, n * sizeof(uint16_t))) {
+			break;
+		}
+	}
+	if(!st) {
+		st = arena_alloc(&prof->arena, sizeof(*st));
+		st->hash = hash;
+		st->nframe = n;
+		st->frame = arena_alloc(&prof->arena, n * sizeof(uint16_t));
+		memcpy(st->frame, prof->frames, n * sizeof(uint16_t));
+		st->weight = 0;
+		st->next = prof->bucket[hash % EVAL_PROFILE_NBUCKET];
+		prof->bucket[hash % EVAL_PROFILE_NBUCKET] = st;
+		prof->nstack++;
+	}
+	st->weight += weight;
+}
+
+static struct eval_profile_pred *sort_profile;
+
+static int cmp_profile_pred(const void *a, const void *b) {
+	const uint16_t *aa = a;
+	const uint16_t *bb = b;
+	uint64_t ia = sort_profile[*aa].instr, ib = sort_profile[*bb].instr;
+
+	if(ia != ib) return (ia < ib)? 1 : -1;
+	return *aa - *bb;
+}
+
+void eval_profile_report(struct eval_profile *prof, struct program *prg) {
+	uint16_t order[prof->npred];
+	struct eval_profile_pred *pp;
+	int i, n = 0;
+	uint64_t total = prof->ninstr? prof->ninstr : 1;
+	uint64_t sampled = prof->lastsample? prof->lastsample : 1;
+	char buf[256];
+
+	for(i = 0; i < prof->npred && i < prg->npredicate; i++) {
+		if(prof->pred[i].calls || prof->pred[i].instr) {
+			order[n++] = i;
+		}
+	}
+	sort_profile = prof->pred;
+	qsort(order, n, sizeof(uint16_t), cmp_profile_pred);
+
+	o_line();
+	o_set_style(STYLE_BOLD);
+	o_print_word("PROFILE");
+	o_set_style(STYLE_ROMAN);
+	o_line();
+	snprintf(buf, sizeof(buf), "%llu instructions, %u call stack samples.", (unsigned long long) prof->ninstr, prof->nsample);
+	o_print_str(buf);
+	o_line();
+	o_set_style(STYLE_FIXED);
+	o_print_word("  self%  incl%     calls    fails   instrs  predicate");
+	o_line();
+	for(i = 0; i < n; i++) {
+		pp = &prof->pred[order[i]];
+		snprintf(
+			buf,
+			sizeof(buf),
+			"%6.1f%% %5.1f%% %9llu %8llu %8llu  %s",
+			100.0 * pp->instr / total,
+			100.0 * pp->inclusive / sampled,
+			(unsigned long long) pp->calls,
+			(unsigned long long) pp->fails,
+			(unsigned long long) pp->instr,
+			prg->predicates[order[i]]->printed_name);
+		o_print_word(buf);
+		o_line();
+	}
+	o_set_style(STYLE_ROMAN);
+}
+
+// One line per sampled call stack, outermost predicate first, in the
+// collapsed format read by flame graph tools.
+
+char **eval_profile_collapsed(struct eval_profile *prof, struct program *prg, int *nline) {
+	char **lines = malloc((prof->nstack + 1) * sizeof(char *));
+	struct eval_profile_stack *st;
+	char *line, *name;
+	int i, j, len, pos, n = 0;
+
+	for(i = 0; i < EVAL_PROFILE_NBUCKET; i++) {
+		for(st = prof->bucket[i]; st; st = st->next) {
+			len = 32;
+			for(j = 0; j < st->nframe; j++) {
+				len += strlen(prg->predicates[st->frame[j]]->printed_name) + 1;
+			}
+			line = malloc(len);
+			pos = 0;
+			for(j = st->nframe - 1; j >= 0; j--) {
+				for(name = prg->predicates[st->frame[j]]->printed_name; *name; name++) {
+					line[pos++] = (*name == ';')? ':' : *name;
+				}
+				line[pos++] = j? ';' : ' ';
+			}
+			snprintf(line + pos, len - pos, "%llu", (unsigned long long) st->weight);
+			lines[n++] = line;
+		}
+	}
+
+	*nline = n;
+	return lines;
+}
+
 static void do_fail(struct eval_state *es, prgpoint_t *pp) {
 	struct choice *cho = &es->choicestack[es->choice];
 	struct predicate *pred;
 
-	pred_release(pp->pred);
+	if(es->profile && pp->pred) {
+		profile_pred(es->profile, pp->pred->predname->pred_id)->fails++;
+	}
 	if(es->program->eval_ticker) es->program->eval_ticker();
 	if(interrupted) {
 		pred = find_builtin(es->program, BI_BREAK_FAIL)->pred;
-		pred_claim(pred);
 		pp->pred = pred;
 		pp->routine = pred->normal_entry;
 	} else {
+		if(es->choice <= es->undomark.choice) {
+			undo_log_choice(es, es->choice);
+		}
 		*pp = cho->nextcase;
 		cho->nextcase.pred = 0;
 	}
@@ -1368,6 +1917,17 @@ static int eval_builtin(struct eval_state *es, int builtin, value_t o1, value_t
 	return 0;
 }
 
+// With GCC, each routine is threaded the first time it runs: the opcodes are
+// replaced by the addresses of their handlers, and dispatch is a computed
+// goto into the switch below. Define EVAL_NO_THREADING to use the plain switch.
+
+#if defined(__GNUC__) && !defined(EVAL_NO_THREADING)
+#define EVAL_THREADED
+#define CASE(op) case op: L_##op:
+#else
+#define CASE(op) case op:
+#endif
+
 static int eval_run(struct eval_state *es) {
 	prgpoint_t pp;
 	int i, j, n, res;
@@ -1382,58 +1942,204 @@ static int eval_run(struct eval_state *es) {
 	line_t tr_line = 0;
 	struct word *w;
 	struct wordmap *map;
+	struct comp_routine *r = 0;
+	struct eval_profile *prof = es->profile;
+#ifdef EVAL_THREADED
+	static void *const dispatch[N_OPCODES] = {
+		[I_ALLOCATE] = &&L_I_ALLOCATE,
+		[I_ASSIGN] = &&L_I_ASSIGN,
+		[I_BEGIN_AREA] = &&L_I_BEGIN_AREA,
+		[I_BEGIN_AREA_OVERRIDE] = &&L_I_BEGIN_AREA_OVERRIDE,
+		[I_BEGIN_BOX] = &&L_I_BEGIN_BOX,
+		[I_BEGIN_LINK] = &&L_I_BEGIN_LINK,
+		[I_BEGIN_LINK_RES] = &&L_I_BEGIN_LINK_RES,
+		[I_BEGIN_LOG] = &&L_I_BEGIN_LOG,
+		[I_BEGIN_SELF_LINK] = &&L_I_BEGIN_SELF_LINK,
+		[I_BREAKPOINT] = &&L_I_BREAKPOINT,
+		[I_BUILTIN] = &&L_I_BUILTIN,
+		[I_CHECK_INDEX] = &&L_I_CHECK_INDEX,
+		[I_CHECK_WORDMAP] = &&L_I_CHECK_WORDMAP,
+		[I_CLRALL_OFLAG] = &&L_I_CLRALL_OFLAG,
+		[I_CLRALL_OVAR] = &&L_I_CLRALL_OVAR,
+		[I_COLLECT_BEGIN] = &&L_I_COLLECT_BEGIN,
+		[I_COLLECT_CHECK] = &&L_I_COLLECT_CHECK,
+		[I_COLLECT_END_R] = &&L_I_COLLECT_END_R,
+		[I_COLLECT_END_V] = &&L_I_COLLECT_END_V,
+		[I_COLLECT_MATCH_ALL] = &&L_I_COLLECT_MATCH_ALL,
+		[I_COLLECT_PUSH] = &&L_I_COLLECT_PUSH,
+		[I_COMPUTE_R] = &&L_I_COMPUTE_R,
+		[I_COMPUTE_V] = &&L_I_COMPUTE_V,
+		[I_CUT_CHOICE] = &&L_I_CUT_CHOICE,
+		[I_DEALLOCATE] = &&L_I_DEALLOCATE,
+		[I_EMBED_RES] = &&L_I_EMBED_RES,
+		[I_END_AREA] = &&L_I_END_AREA,
+		[I_END_BOX] = &&L_I_END_BOX,
+		[I_END_LINK] = &&L_I_END_LINK,
+		[I_END_LINK_RES] = &&L_I_END_LINK_RES,
+		[I_END_LOG] = &&L_I_END_LOG,
+		[I_END_SELF_LINK] = &&L_I_END_SELF_LINK,
+		[I_FIRST_CHILD] = &&L_I_FIRST_CHILD,
+		[I_FIRST_OFLAG] = &&L_I_FIRST_OFLAG,
+		[I_FOR_WORDS] = &&L_I_FOR_WORDS,
+		[I_GET_GVAR_R] = &&L_I_GET_GVAR_R,
+		[I_GET_GVAR_V] = &&L_I_GET_GVAR_V,
+		[I_GET_INPUT] = &&L_I_GET_INPUT,
+		[I_GET_KEY] = &&L_I_GET_KEY,
+		[I_GET_OVAR_R] = &&L_I_GET_OVAR_R,
+		[I_GET_OVAR_V] = &&L_I_GET_OVAR_V,
+		[I_GET_PAIR_RR] = &&L_I_GET_PAIR_RR,
+		[I_GET_PAIR_RV] = &&L_I_GET_PAIR_RV,
+		[I_GET_PAIR_VR] = &&L_I_GET_PAIR_VR,
+		[I_GET_PAIR_VV] = &&L_I_GET_PAIR_VV,
+		[I_GET_RAW_INPUT] = &&L_I_GET_RAW_INPUT,
+		[I_IF_BOUND] = &&L_I_IF_BOUND,
+		[I_IF_CAN_EMBED] = &&L_I_IF_CAN_EMBED,
+		[I_IF_GREATER] = &&L_I_IF_GREATER,
+		[I_IF_HAVE_LINK] = &&L_I_IF_HAVE_LINK,
+		[I_IF_HAVE_UNDO] = &&L_I_IF_HAVE_UNDO,
+		[I_IF_HAVE_QUIT] = &&L_I_IF_HAVE_QUIT,
+		[I_IF_HAVE_STYLE] = &&L_I_IF_HAVE_STYLE,
+		[I_IF_HAVE_COLOR] = &&L_I_IF_HAVE_COLOR,
+		[I_IF_HAVE_ALIGN] = &&L_I_IF_HAVE_ALIGN,
+		[I_IF_SCRIPT_ACTIVE] = &&L_I_IF_SCRIPT_ACTIVE,
+		[I_IF_HAVE_STATUS] = &&L_I_IF_HAVE_STATUS,
+		[I_IF_MATCH] = &&L_I_IF_MATCH,
+		[I_IF_UNIFY] = &&L_I_IF_UNIFY,
+		[I_IF_NIL] = &&L_I_IF_NIL,
+		[I_IF_NUM] = &&L_I_IF_NUM,
+		[I_IF_OBJ] = &&L_I_IF_OBJ,
+		[I_IF_PAIR] = &&L_I_IF_PAIR,
+		[I_IF_WORD] = &&L_I_IF_WORD,
+		[I_IF_UNKNOWN_WORD] = &&L_I_IF_UNKNOWN_WORD,
+		[I_IF_GFLAG] = &&L_I_IF_GFLAG,
+		[I_IF_OFLAG] = &&L_I_IF_OFLAG,
+		[I_IF_GVAR_EQ] = &&L_I_IF_GVAR_EQ,
+		[I_IF_OVAR_EQ] = &&L_I_IF_OVAR_EQ,
+		[I_INVOKE_MULTI] = &&L_I_INVOKE_MULTI,
+		[I_INVOKE_ONCE] = &&L_I_INVOKE_ONCE,
+		[I_INVOKE_TAIL_ONCE] = &&L_I_INVOKE_TAIL_ONCE,
+		[I_INVOKE_TAIL_MULTI] = &&L_I_INVOKE_TAIL_MULTI,
+		[I_JOIN_WORDS] = &&L_I_JOIN_WORDS,
+		[I_JUMP] = &&L_I_JUMP,
+		[I_MAKE_PAIR_RR] = &&L_I_MAKE_PAIR_RR,
+		[I_MAKE_PAIR_RV] = &&L_I_MAKE_PAIR_RV,
+		[I_MAKE_PAIR_VR] = &&L_I_MAKE_PAIR_VR,
+		[I_MAKE_PAIR_VV] = &&L_I_MAKE_PAIR_VV,
+		[I_MAKE_VAR] = &&L_I_MAKE_VAR,
+		[I_NEXT_CHILD_PUSH] = &&L_I_NEXT_CHILD_PUSH,
+		[I_NEXT_OBJ_PUSH] = &&L_I_NEXT_OBJ_PUSH,
+		[I_NEXT_OFLAG_PUSH] = &&L_I_NEXT_OFLAG_PUSH,
+		[I_NOP] = &&L_I_NOP,
+		[I_NOP_DEBUG] = &&L_I_NOP_DEBUG,
+		[I_POP_CHOICE] = &&L_I_POP_CHOICE,
+		[I_POP_STOP] = &&L_I_POP_STOP,
+		[I_PREPARE_INDEX] = &&L_I_PREPARE_INDEX,
+		[I_PRINT_VAL] = &&L_I_PRINT_VAL,
+		[I_PRINT_WORDS] = &&L_I_PRINT_WORDS,
+		[I_PROCEED] = &&L_I_PROCEED,
+		[I_PUSH_CHOICE] = &&L_I_PUSH_CHOICE,
+		[I_PUSH_STOP] = &&L_I_PUSH_STOP,
+		[I_QUIT_N] = &&L_I_QUIT_N,
+		[I_QUIT] = &&L_I_QUIT,
+		[I_RESTART] = &&L_I_RESTART,
+		[I_RESTORE] = &&L_I_RESTORE,
+		[I_RESTORE_CHOICE] = &&L_I_RESTORE_CHOICE,
+		[I_SAVE] = &&L_I_SAVE,
+		[I_SAVE_CHOICE] = &&L_I_SAVE_CHOICE,
+		[I_SAVE_UNDO] = &&L_I_SAVE_UNDO,
+		[I_SELECT] = &&L_I_SELECT,
+		[I_SET_CONT] = &&L_I_SET_CONT,
+		[I_SET_GFLAG] = &&L_I_SET_GFLAG,
+		[I_SET_GVAR] = &&L_I_SET_GVAR,
+		[I_SET_OFLAG] = &&L_I_SET_OFLAG,
+		[I_SET_OVAR] = &&L_I_SET_OVAR,
+		[I_SPLIT_LIST] = &&L_I_SPLIT_LIST,
+		[I_SPLIT_WORD] = &&L_I_SPLIT_WORD,
+		[I_STOP] = &&L_I_STOP,
+		[I_TRACEPOINT] = &&L_I_TRACEPOINT,
+		[I_TRANSCRIPT] = &&L_I_TRANSCRIPT,
+		[I_UNDO] = &&L_I_UNDO,
+		[I_UNIFY] = &&L_I_UNIFY,
+	};
+#endif
 
 	pp = es->resume;
 	es->resume.pred = 0;
 	pc = 0;
 
 	while(pp.pred) {
-		if(pp.routine >= pp.pred->nroutine) {
-			printf("%s %d\n", pp.pred->predname->printed_name, pp.routine);
-			assert(0);
+		if(!pc) {
+			// Routines are only ever entered at the top, and control
+			// never falls off the end, so the checks are done here.
+			if(pp.routine >= pp.pred->nroutine) {
+				printf("%s %d\n", pp.pred->predname->printed_name, pp.routine);
+				assert(0);
+			}
+			r = &pp.pred->routines[pp.routine];
+			if(es->touched) {
+				touch_pred(es, pp.pred->predname->pred_id);
+			}
+#ifdef EVAL_THREADED
+			if(!r->threaded) {
+				r->threaded = arena_alloc(&pp.pred->arena, (r->ninstr + 1) * sizeof(void *));
+				for(i = 0; i < r->ninstr; i++) {
+					r->threaded[i] = dispatch[r->instr[i].op];
+					if(!r->threaded[i]) r->threaded[i] = &&L_default;
+				}
+				r->threaded[r->ninstr] = &&L_overrun;
+			}
+#endif
+			if(es->max_eval) {
+				if(!--es->max_eval) {
+					report(LVL_ERR, 0, "Timeout while computing initial value. Infinite loop?");
+					return ESTATUS_QUIT;
+				}
+			}
+			if(prof && prof->ninstr - prof->lastsample >= EVAL_PROFILE_INTERVAL) {
+				profile_sample(es, pp.pred);
+			}
+		}
+		if(prof) {
+			prof->ninstr++;
+			profile_pred(prof, pp.pred->predname->pred_id)->instr++;
 		}
-		if(pc >= pp.pred->routines[pp.routine].ninstr) {
+		ci = &r->instr[pc];
+#ifdef EVAL_THREADED
+		goto *r->threaded[pc++];
+#else
+		if(pc >= r->ninstr) {
 			printf("%s %d\n", pp.pred->predname->printed_name, pp.routine);
 			assert(0);
 		}
-		if(es->max_eval) {
-			if(!--es->max_eval) {
-				report(LVL_ERR, 0, "Timeout while computing initial value. Infinite loop?");
-				pred_release(pp.pred);
-				return ESTATUS_QUIT;
-			}
-		}
-		ci = &pp.pred->routines[pp.routine].instr[pc];
 		pc++;
+#endif
 		switch(ci->op) {
-		case I_ALLOCATE:
+		CASE(I_ALLOCATE)
 			assert(ci->oper[0].tag == OPER_NUM);
 			assert(ci->oper[1].tag == OPER_NUM);
 			if(!push_env(es, ci->oper[0].value, ci->oper[1].value)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			}
+			env = &es->envstack[es->env];
 			if(ci->oper[1].value && ci->subop) {
-				es->envstack[es->env].tracevars[0] = es->orig_arg0;
+				es->varstack[env->vars + env->nvar] = es->orig_arg0;
 			}
 			for(i = ci->subop; i < ci->oper[1].value; i++) {
-				es->envstack[es->env].tracevars[i] = es->arg[i];
+				es->varstack[env->vars + env->nvar + i] = es->arg[i];
 			}
 			break;
-		case I_ASSIGN:
+		CASE(I_ASSIGN)
 			set_by_ref(ci->oper[0], value_of(ci->oper[1], es), es);
 			break;
-		case I_BEGIN_AREA:
-		case I_BEGIN_AREA_OVERRIDE:
+		CASE(I_BEGIN_AREA)
+		CASE(I_BEGIN_AREA_OVERRIDE)
 			assert(ci->oper[0].tag == OPER_BOX);
 			if(!es->forwords) {
 				if(es->divsp == EVAL_MAXDIV) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_IO;
 				}
 				es->divstack[es->divsp++] = ci->oper[0].value;
 				if(es->inStatus || es->nSpan) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_IO;
 				} else {
 					if(ci->subop == AREA_TOP) {
@@ -1446,16 +2152,14 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_BEGIN_BOX:
+		CASE(I_BEGIN_BOX)
 			assert(ci->oper[0].tag == OPER_BOX);
 			if(!es->forwords) {
 				if(es->divsp == EVAL_MAXDIV) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_IO;
 				}
 				es->divstack[es->divsp++] = ci->oper[0].value;
 				if(ci->subop == BOX_DIV && es->nSpan) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_IO;
 				} else {
 					if(
@@ -1463,7 +2167,6 @@ static int eval_run(struct eval_state *es) {
 						!push_aux(es, (value_t) {VAL_NUM, es->divfg}) || // Push fg
 						!push_aux(es, (value_t) {VAL_NUM, es->divstyle}) // Push style
 					) {
-						pred_release(pp.pred);
 						return ESTATUS_ERR_AUX;
 					}
 					if(ci->subop == BOX_SPAN) {
@@ -1483,7 +2186,7 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_BEGIN_LINK:
+		CASE(I_BEGIN_LINK)
 			if(!es->forwords) {
 				if(!es->nLink) {
 					begin_link(es, value_of(ci->oper[0], es));
@@ -1492,7 +2195,7 @@ static int eval_run(struct eval_state *es) {
 				es->nSpan++;
 			}
 			break;
-		case I_BEGIN_LINK_RES:
+		CASE(I_BEGIN_LINK_RES)
 			if(!es->forwords) {
 				if(!es->nLink) {
 					v = eval_deref(value_of(ci->oper[0], es), es);
@@ -1503,10 +2206,10 @@ static int eval_run(struct eval_state *es) {
 				es->nSpan++;
 			}
 			break;
-		case I_BEGIN_LOG:
+		CASE(I_BEGIN_LOG)
 			o_begin_box("debugger");
 			break;
-		case I_BEGIN_SELF_LINK:
+		CASE(I_BEGIN_SELF_LINK)
 			if(!es->forwords) {
 				if(!es->nLink) {
 					if(!es->hide_links) {
@@ -1517,15 +2220,14 @@ static int eval_run(struct eval_state *es) {
 				es->nSpan++;
 			}
 			break;
-		case I_BREAKPOINT:
+		CASE(I_BREAKPOINT)
 			if(!ci->subop && tr_line) {
 				report(LVL_NOTE, tr_line, "Query made to (breakpoint)");
 			}
-			pred_release(pp.pred);
 			es->resume = es->cont;
 			es->cont.pred = 0;
 			return ci->subop? ESTATUS_DEBUGGER : ESTATUS_SUSPENDED;
-		case I_BUILTIN:
+		CASE(I_BUILTIN)
 			assert(ci->oper[2].tag == OPER_PRED);
 			res = eval_builtin(
 				es,
@@ -1533,13 +2235,11 @@ static int eval_run(struct eval_state *es) {
 				value_of(ci->oper[0], es),
 				value_of(ci->oper[1], es));
 			if(res) {
-				pred_release(pp.pred);
 				return res;
 			}
 			break;
-		case I_CHECK_INDEX:
-			if(es->index.tag == ci->oper[0].tag
-			&& es->index.value == ci->oper[0].value) {
+		CASE(I_CHECK_INDEX)
+			if(VALUE_EQ(es->index, ci->oper[0])) {
 				if(ci->oper[1].tag == OPER_RLAB) {
 					pp.routine = ci->oper[1].value;
 					pc = 0;
@@ -1550,7 +2250,7 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_CHECK_WORDMAP:
+		CASE(I_CHECK_WORDMAP)
 			assert(ci->oper[0].tag == OPER_NUM);
 			assert(ci->oper[2].tag == OPER_PRED);
 			assert(ci->oper[0].value < es->program->predicates[ci->oper[2].value]->pred->nwordmap);
@@ -1567,7 +2267,6 @@ static int eval_run(struct eval_state *es) {
 				} else {
 					for(j = 0; j < map->map[i].count; j++) {
 						if(!push_aux(es, (value_t) {VAL_OBJ, map->map[i].onumtable[j]})) {
-							pred_release(pp.pred);
 							return ESTATUS_ERR_AUX;
 						}
 					}
@@ -1587,11 +2286,10 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_CLRALL_OFLAG:
+		CASE(I_CLRALL_OFLAG)
 			assert(ci->oper[0].tag == OPER_OFLAG);
 			predname = es->program->objflagpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v = (value_t) {VAL_NONE, 0};
@@ -1606,11 +2304,10 @@ static int eval_run(struct eval_state *es) {
 				es->dyn_callback_data,
 				ci->oper[0].value);
 			break;
-		case I_CLRALL_OVAR:
+		CASE(I_CLRALL_OVAR)
 			assert(ci->oper[0].tag == OPER_OVAR);
 			predname = es->program->objvarpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			args[0] = (value_t) {VAL_NONE, 0};
@@ -1626,22 +2323,19 @@ static int eval_run(struct eval_state *es) {
 				es->dyn_callback_data,
 				ci->oper[0].value))
 			{
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			break;
-		case I_COLLECT_BEGIN:
+		CASE(I_COLLECT_BEGIN)
 			if(!push_aux(es, (value_t) {ci->subop? VAL_NUM : VAL_NONE, 0})) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_AUX;
 			}
 			break;
-		case I_COLLECT_CHECK:
+		CASE(I_COLLECT_CHECK)
 			res = 0;
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			while((v = collect_pop(es)).tag != VAL_NONE) {
-				if(v0.tag == v.tag
-				&& v0.value == v.value) {
+				if(VALUE_EQ(v0, v)) {
 					res = 1;
 				}
 			}
@@ -1650,20 +2344,18 @@ static int eval_run(struct eval_state *es) {
 				pc = 0;
 			}
 			break;
-		case I_COLLECT_END_R:
-		case I_COLLECT_END_V:
+		CASE(I_COLLECT_END_R)
+		CASE(I_COLLECT_END_V)
 			if(ci->subop) {
 				v = collect_pop(es);
 			} else {
 				v = (value_t) {VAL_NIL, 0};
 				while((v1 = collect_pop(es)).tag != VAL_NONE) {
 					if(v1.tag == VAL_ERROR) {
-						pred_release(pp.pred);
 						return ESTATUS_ERR_HEAP;
 					}
 					v = eval_makepair(v1, v, es);
 					if(v.tag == VAL_ERROR) {
-						pred_release(pp.pred);
 						return ESTATUS_ERR_HEAP;
 					}
 				}
@@ -1674,23 +2366,21 @@ static int eval_run(struct eval_state *es) {
 			} else if(ci->op == I_COLLECT_END_R) {
 				set_by_ref(ci->oper[0], v, es);
 			} else {
-				if(!unify(es, v, value_of(ci->oper[0], es), 0)) {
+				if(!unify(es, v, value_of(ci->oper[0], es))) {
 					do_fail(es, &pp);
 					pc = 0;
 				}
 			}
 			break;
-		case I_COLLECT_MATCH_ALL:
+		CASE(I_COLLECT_MATCH_ALL)
 			i = es->top;
 			v2 = (value_t) {VAL_NIL, 0};
 			while((v1 = collect_pop(es)).tag != VAL_NONE) {
 				if(v1.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 				v2 = eval_makepair(v1, v2, es);
 				if(v2.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 			}
@@ -1701,7 +2391,7 @@ static int eval_run(struct eval_state *es) {
 					v0 = es->heap[v0.value + 0];
 				}
 				for(v = v2; v.tag == VAL_PAIR; v = es->heap[v.value + 1]) {
-					res = would_unify(es, es->heap[v.value + 0], v0, 0);
+					res = would_unify(es, es->heap[v.value + 0], v0);
 					if(res == 1) {
 						break;
 					}
@@ -1717,7 +2407,7 @@ static int eval_run(struct eval_state *es) {
 				pc = 0;
 			}
 			break;
-		case I_COLLECT_PUSH:
+		CASE(I_COLLECT_PUSH)
 			if(ci->subop) {
 				v0 = eval_deref(value_of(ci->oper[0], es), es);
 				v1 = collect_pop(es);
@@ -1732,11 +2422,10 @@ static int eval_run(struct eval_state *es) {
 				v = value_of(ci->oper[0], es);
 			}
 			if(!collect_push(es, v)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_AUX;
 			}
 			break;
-		case I_COMPUTE_R:
+		CASE(I_COMPUTE_R)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			v1 = eval_deref(value_of(ci->oper[1], es), es);
 			if(v0.tag != VAL_NUM
@@ -1748,37 +2437,35 @@ static int eval_run(struct eval_state *es) {
 				set_by_ref(ci->oper[2], (value_t) {VAL_NUM, res}, es);
 			}
 			break;
-		case I_COMPUTE_V:
+		CASE(I_COMPUTE_V)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			v1 = eval_deref(value_of(ci->oper[1], es), es);
 			v2 = value_of(ci->oper[2], es);
 			if(v0.tag != VAL_NUM
 			|| v1.tag != VAL_NUM
 			|| !eval_compute(es, ci->subop, v0.value, v1.value, &res)
-			|| !unify(es, (value_t) {VAL_NUM, res}, v2, 0)) {
+			|| !unify(es, (value_t) {VAL_NUM, res}, v2)) {
 				do_fail(es, &pp);
 				pc = 0;
 			}
 			break;
-		case I_CUT_CHOICE:
+		CASE(I_CUT_CHOICE)
 			assert(es->choice);
 			cut_to(es, es->choice - 1);
 			break;
-		case I_DEALLOCATE:
+		CASE(I_DEALLOCATE)
 			assert(es->env > 0);
 			env = &es->envstack[es->env];
 			if(ci->subop) {
 				for(i = 0; i < env->ntracevar; i++) {
-					es->arg[i] = env->tracevars[i];
+					es->arg[i] = es->varstack[env->vars + env->nvar + i];
 				}
 			}
-			pred_release(es->cont.pred);
 			es->simple = env->simple;
 			es->cont = env->cont;
-			pred_claim(es->cont.pred);
 			revert_env_to(es, env->env);
 			break;
-		case I_EMBED_RES:
+		CASE(I_EMBED_RES)
 			if(!es->forwords) {
 				v = eval_deref(value_of(ci->oper[0], es), es);
 				assert(v.tag == VAL_NUM);
@@ -1787,10 +2474,9 @@ static int eval_run(struct eval_state *es) {
 				o_print_word("]");
 			}
 			break;
-		case I_END_AREA:
+		CASE(I_END_AREA)
 			if(!es->forwords) {
 				if(!es->divsp) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_IO;
 				}
 				es->divsp--;
@@ -1803,10 +2489,9 @@ static int eval_run(struct eval_state *es) {
 				o_set_style_colors(es->divstyle, es->divfg, es->divbg);
 			}
 			break;
-		case I_END_BOX:
+		CASE(I_END_BOX)
 			if(!es->forwords) {
 				if(!es->divsp) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_IO;
 				}
 				es->divsp--;
@@ -1832,8 +2517,8 @@ static int eval_run(struct eval_state *es) {
 				o_set_style_colors(es->divstyle, es->divfg, es->divbg);
 			}
 			break;
-		case I_END_LINK:
-		case I_END_LINK_RES:
+		CASE(I_END_LINK)
+		CASE(I_END_LINK_RES)
 			if(!es->forwords) {
 				es->nLink--;
 				es->nSpan--;
@@ -1844,10 +2529,10 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_END_LOG:
+		CASE(I_END_LOG)
 			o_end_box();
 			break;
-		case I_END_SELF_LINK:
+		CASE(I_END_SELF_LINK)
 			if(!es->forwords) {
 				es->nLink--;
 				es->nSpan--;
@@ -1858,10 +2543,9 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_FIRST_CHILD:
+		CASE(I_FIRST_CHILD)
 			predname = es->program->objvarpred[DYN_HASPARENT];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v = eval_deref(value_of(ci->oper[0], es), es);
@@ -1874,11 +2558,10 @@ static int eval_run(struct eval_state *es) {
 				set_by_ref(ci->oper[1], (value_t) {VAL_OBJ, onum}, es);
 			}
 			break;
-		case I_FIRST_OFLAG:
+		CASE(I_FIRST_OFLAG)
 			assert(ci->oper[0].tag == OPER_OFLAG);
 			predname = es->program->objflagpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			onum = es->dyn_callbacks->get_first_oflag(es, es->dyn_callback_data, ci->oper[0].value);
@@ -1889,7 +2572,7 @@ static int eval_run(struct eval_state *es) {
 				set_by_ref(ci->oper[1], (value_t) {VAL_OBJ, onum}, es);
 			}
 			break;
-		case I_FOR_WORDS:
+		CASE(I_FOR_WORDS)
 			if(ci->subop) {
 				es->forwords++;
 			} else {
@@ -1897,16 +2580,14 @@ static int eval_run(struct eval_state *es) {
 				es->forwords--;
 			}
 			break;
-		case I_GET_GVAR_R:
+		CASE(I_GET_GVAR_R)
 			assert(ci->oper[0].tag == OPER_GVAR);
 			predname = es->program->globalvarpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v = es->dyn_callbacks->get_globalvar(es, es->dyn_callback_data, ci->oper[0].value);
 			if(v.tag == VAL_ERROR) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			} else if(v.tag == VAL_NONE) {
 				do_fail(es, &pp);
@@ -1915,39 +2596,36 @@ static int eval_run(struct eval_state *es) {
 				set_by_ref(ci->oper[1], v, es);
 			}
 			break;
-		case I_GET_GVAR_V:
+		CASE(I_GET_GVAR_V)
 			assert(ci->oper[0].tag == OPER_GVAR);
 			predname = es->program->globalvarpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v = es->dyn_callbacks->get_globalvar(es, es->dyn_callback_data, ci->oper[0].value);
 			if(v.tag == VAL_ERROR) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			if(v.tag == VAL_NONE
-			|| !unify(es, v, value_of(ci->oper[1], es), 0)) {
+			|| !unify(es, v, value_of(ci->oper[1], es))) {
 				do_fail(es, &pp);
 				pc = 0;
 			}
 			break;
-		case I_GET_INPUT:
-			pred_release(pp.pred);
+		CASE(I_GET_INPUT)
 			es->resume = es->cont;
 			es->cont.pred = 0;
+			collect_garbage(es);
 			return ESTATUS_GET_INPUT;
-		case I_GET_KEY:
-			pred_release(pp.pred);
+		CASE(I_GET_KEY)
 			es->resume = es->cont;
 			es->cont.pred = 0;
+			collect_garbage(es);
 			return ESTATUS_GET_KEY;
-		case I_GET_OVAR_R:
+		CASE(I_GET_OVAR_R)
 			assert(ci->oper[0].tag == OPER_OVAR);
 			predname = es->program->objvarpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v1 = eval_deref(value_of(ci->oper[1], es), es);
@@ -1962,7 +2640,6 @@ static int eval_run(struct eval_state *es) {
 					ci->oper[0].value,
 					v1.value);
 				if(v2.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				} else if(v2.tag == VAL_NONE) {
 					do_fail(es, &pp);
@@ -1972,11 +2649,10 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_GET_OVAR_V:
+		CASE(I_GET_OVAR_V)
 			assert(ci->oper[0].tag == OPER_OVAR);
 			predname = es->program->objvarpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v1 = eval_deref(value_of(ci->oper[1], es), es);
@@ -1991,25 +2667,22 @@ static int eval_run(struct eval_state *es) {
 					ci->oper[0].value,
 					v1.value);
 				if(v2.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				} else if(v2.tag == VAL_NONE
-				|| !unify(es, v2, value_of(ci->oper[2], es), 0)) {
+				|| !unify(es, v2, value_of(ci->oper[2], es))) {
 					do_fail(es, &pp);
 					pc = 0;
 				}
 			}
 			break;
-		case I_GET_PAIR_RR:
+		CASE(I_GET_PAIR_RR)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			if(v0.tag == VAL_REF) {
 				v = alloc_heap_pair(es);
 				if(v.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 				if(set_heap_ref(es, v0.value, v)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_AUX;
 				}
 				es->heap[v.value + 0] = v1 = (value_t) {VAL_REF, v.value + 0};
@@ -2026,16 +2699,14 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_GET_PAIR_RV:
+		CASE(I_GET_PAIR_RV)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			if(v0.tag == VAL_REF) {
 				v = alloc_heap_pair(es);
 				if(v.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 				if(set_heap_ref(es, v0.value, v)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_AUX;
 				}
 				es->heap[v.value + 0] = v1 = (value_t) {VAL_REF, v.value + 0};
@@ -2043,7 +2714,7 @@ static int eval_run(struct eval_state *es) {
 				es->heap[v.value + 1] = value_of(ci->oper[2], es);
 			} else {
 				if(v0.tag != VAL_PAIR
-				|| !unify(es, es->heap[v0.value + 1], value_of(ci->oper[2], es), 0)) {
+				|| !unify(es, es->heap[v0.value + 1], value_of(ci->oper[2], es))) {
 					do_fail(es, &pp);
 					pc = 0;
 				} else {
@@ -2051,16 +2722,14 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_GET_PAIR_VR:
+		CASE(I_GET_PAIR_VR)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			if(v0.tag == VAL_REF) {
 				v = alloc_heap_pair(es);
 				if(v.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 				if(set_heap_ref(es, v0.value, v)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_AUX;
 				}
 				es->heap[v.value + 0] = value_of(ci->oper[1], es);
@@ -2068,7 +2737,7 @@ static int eval_run(struct eval_state *es) {
 				set_by_ref(ci->oper[2], v2, es);
 			} else {
 				if(v0.tag != VAL_PAIR
-				|| !unify(es, es->heap[v0.value + 0], value_of(ci->oper[1], es), 0)) {
+				|| !unify(es, es->heap[v0.value + 0], value_of(ci->oper[1], es))) {
 					do_fail(es, &pp);
 					pc = 0;
 				} else {
@@ -2076,44 +2745,42 @@ static int eval_run(struct eval_state *es) {
 				}
 			}
 			break;
-		case I_GET_PAIR_VV:
+		CASE(I_GET_PAIR_VV)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			if(v0.tag == VAL_REF) {
 				v = alloc_heap_pair(es);
 				if(v.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 				if(set_heap_ref(es, v0.value, v)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_AUX;
 				}
 				es->heap[v.value + 0] = value_of(ci->oper[1], es);
 				es->heap[v.value + 1] = value_of(ci->oper[2], es);
 			} else {
 				if(v0.tag != VAL_PAIR
-				|| !unify(es, es->heap[v0.value + 0], value_of(ci->oper[1], es), 0)
-				|| !unify(es, es->heap[v0.value + 1], value_of(ci->oper[2], es), 0)) {
+				|| !unify(es, es->heap[v0.value + 0], value_of(ci->oper[1], es))
+				|| !unify(es, es->heap[v0.value + 1], value_of(ci->oper[2], es))) {
 					do_fail(es, &pp);
 					pc = 0;
 				}
 			}
 			break;
-		case I_GET_RAW_INPUT:
-			pred_release(pp.pred);
+		CASE(I_GET_RAW_INPUT)
 			es->resume = es->cont;
 			es->cont.pred = 0;
+			collect_garbage(es);
 			return ESTATUS_GET_RAW_INPUT;
-		case I_IF_BOUND:
+		CASE(I_IF_BOUND)
 			v = eval_deref(value_of(ci->oper[0], es), es);
 			res = (v.tag != VAL_REF);
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_CAN_EMBED:
+		CASE(I_IF_CAN_EMBED)
 			res = 0;
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_GREATER:
+		CASE(I_IF_GREATER)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			v1 = eval_deref(value_of(ci->oper[1], es), es);
 			res =
@@ -2122,29 +2789,29 @@ static int eval_run(struct eval_state *es) {
 				v0.value > v1.value;
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_HAVE_LINK:
+		CASE(I_IF_HAVE_LINK)
 			res = !es->hide_links;
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_HAVE_UNDO:
-		case I_IF_HAVE_QUIT:
+		CASE(I_IF_HAVE_UNDO)
+		CASE(I_IF_HAVE_QUIT)
 			res = 1;
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_HAVE_STYLE:
-		case I_IF_HAVE_COLOR:
+		CASE(I_IF_HAVE_STYLE)
+		CASE(I_IF_HAVE_COLOR)
 			res = o_is_pretty();
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_HAVE_ALIGN:
+		CASE(I_IF_HAVE_ALIGN)
 			res = 0;
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_SCRIPT_ACTIVE:
+		CASE(I_IF_SCRIPT_ACTIVE)
 			res = output_config.transcripting;
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_HAVE_STATUS:
+		CASE(I_IF_HAVE_STATUS)
 			assert(ci->oper[0].tag == VAL_RAW);
 			if(ci->oper[0].value == 1) {
 				res = 1;
@@ -2153,16 +2820,16 @@ static int eval_run(struct eval_state *es) {
 			}
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_MATCH:
+		CASE(I_IF_MATCH)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			v1 = value_of(ci->oper[1], es);
 			if(v0.tag == VAL_DICTEXT) v0 = es->heap[v0.value + 0];
 			assert(v1.tag != VAL_DICTEXT);
-			res = (v0.tag == v1.tag && v0.value == v1.value);
+			res = VALUE_EQ(v0, v1);
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_UNIFY:
-			res = would_unify(es, value_of(ci->oper[0], es), value_of(ci->oper[1], es), 0);
+		CASE(I_IF_UNIFY)
+			res = would_unify(es, value_of(ci->oper[0], es), value_of(ci->oper[1], es));
 			if(res < 0) {
 				report(
 					LVL_WARN,
@@ -2172,41 +2839,40 @@ static int eval_run(struct eval_state *es) {
 			}
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_NIL:
+		CASE(I_IF_NIL)
 			v = eval_deref(value_of(ci->oper[0], es), es);
 			res = (v.tag == VAL_NIL);
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_NUM:
+		CASE(I_IF_NUM)
 			v = eval_deref(value_of(ci->oper[0], es), es);
 			res = (v.tag == VAL_NUM);
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_OBJ:
+		CASE(I_IF_OBJ)
 			v = eval_deref(value_of(ci->oper[0], es), es);
 			res = (v.tag == VAL_OBJ);
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_PAIR:
+		CASE(I_IF_PAIR)
 			v = eval_deref(value_of(ci->oper[0], es), es);
 			res = (v.tag == VAL_PAIR);
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_WORD:
+		CASE(I_IF_WORD)
 			v = eval_deref(value_of(ci->oper[0], es), es);
 			res = (v.tag == VAL_DICT || v.tag == VAL_DICTEXT);
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_UNKNOWN_WORD:
+		CASE(I_IF_UNKNOWN_WORD)
 			v = eval_deref(value_of(ci->oper[0], es), es);
 			res = (v.tag == VAL_DICTEXT) && (es->heap[v.value + 0].tag == VAL_PAIR);
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_GFLAG:
+		CASE(I_IF_GFLAG)
 			assert(ci->oper[0].tag == OPER_GFLAG);
 			predname = es->program->globalflagpred[ci->oper[0].value];
 			if(predname && !check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			if(es->dyn_callbacks) {
@@ -2216,7 +2882,7 @@ static int eval_run(struct eval_state *es) {
 			}
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_OFLAG:
+		CASE(I_IF_OFLAG)
 			assert(ci->oper[0].tag == OPER_OFLAG);
 			predname = es->program->objflagpred[ci->oper[0].value];
 			v = eval_deref(value_of(ci->oper[1], es), es);
@@ -2228,37 +2894,32 @@ static int eval_run(struct eval_state *es) {
 				res = (v.tag == VAL_OBJ && predname->fixedvalues[v.value]);
 			} else {
 				if(!check_dyn_dependency(es, pp, predname)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_DYN;
 				}
 				res = (v.tag == VAL_OBJ && es->dyn_callbacks->get_objflag(es, es->dyn_callback_data, ci->oper[0].value, v.value));
 			}
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_GVAR_EQ:
+		CASE(I_IF_GVAR_EQ)
 			assert(ci->oper[0].tag == OPER_GVAR);
 			predname = es->program->globalvarpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v = es->dyn_callbacks->get_globalvar(es, es->dyn_callback_data, ci->oper[0].value);
 			if(v.tag == VAL_ERROR) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			}
-			res = (v.tag == ci->oper[1].tag && v.value == ci->oper[1].value) || (
+			res = VALUE_EQ(v, ci->oper[1]) || (
 				v.tag == VAL_DICTEXT &&
 				ci->oper[1].tag == VAL_DICT &&
-				es->heap[v.value + 0].tag == VAL_DICT &&
-				es->heap[v.value + 0].value == ci->oper[1].value);
+				VALUE_EQ(es->heap[v.value + 0], ci->oper[1]));
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_IF_OVAR_EQ:
+		CASE(I_IF_OVAR_EQ)
 			assert(ci->oper[0].tag == OPER_OVAR);
 			predname = es->program->objvarpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v1 = eval_deref(value_of(ci->oper[1], es), es);
@@ -2272,25 +2933,22 @@ static int eval_run(struct eval_state *es) {
 					ci->oper[0].value,
 					v1.value);
 				if(v2.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
-				res = (v2.tag == ci->oper[2].tag && v2.value == ci->oper[2].value) || (
+				res = VALUE_EQ(v2, ci->oper[2]) || (
 					v2.tag == VAL_DICTEXT &&
 					ci->oper[2].tag == VAL_DICT &&
-					es->heap[v2.value + 0].tag == VAL_DICT &&
-					es->heap[v2.value + 0].value == ci->oper[2].value);
+					VALUE_EQ(es->heap[v2.value + 0], ci->oper[2]));
 			}
 			if(ci->subop ^ res) perform_branch(ci->implicit, es, &pp, &pc);
 			break;
-		case I_INVOKE_MULTI:
+		CASE(I_INVOKE_MULTI)
 			assert(ci->oper[0].tag == OPER_PRED);
 			assert(ci->oper[0].value < es->program->npredicate);
 			predname = es->program->predicates[ci->oper[0].value];
 			es->simple = EVAL_MULTI;
-			pred_release(pp.pred);
 			pp.pred = predname->pred;
-			pred_claim(pp.pred);
+			if(prof) profile_pred(prof, predname->pred_id)->calls++;
 			if(!es->dyn_callbacks
 			&& pp.pred->initial_value_entry >= 0) {
 				pp.routine = pp.pred->initial_value_entry;
@@ -2303,14 +2961,13 @@ static int eval_run(struct eval_state *es) {
 			}
 			pc = 0;
 			break;
-		case I_INVOKE_ONCE:
+		CASE(I_INVOKE_ONCE)
 			assert(ci->oper[0].tag == OPER_PRED);
 			assert(ci->oper[0].value < es->program->npredicate);
 			predname = es->program->predicates[ci->oper[0].value];
 			es->simple = es->choice;
-			pred_release(pp.pred);
 			pp.pred = predname->pred;
-			pred_claim(pp.pred);
+			if(prof) profile_pred(prof, predname->pred_id)->calls++;
 			if(!es->dyn_callbacks
 			&& pp.pred->initial_value_entry >= 0) {
 				pp.routine = pp.pred->initial_value_entry;
@@ -2323,18 +2980,17 @@ static int eval_run(struct eval_state *es) {
 			}
 			pc = 0;
 			break;
-		case I_INVOKE_TAIL_ONCE:
+		CASE(I_INVOKE_TAIL_ONCE)
 			if(es->simple == EVAL_MULTI) {
 				es->simple = es->choice;
 			}
 			// drop through
-		case I_INVOKE_TAIL_MULTI:
+		CASE(I_INVOKE_TAIL_MULTI)
 			assert(ci->oper[0].tag == OPER_PRED);
 			assert(ci->oper[0].value < es->program->npredicate);
 			predname = es->program->predicates[ci->oper[0].value];
-			pred_release(pp.pred);
 			pp.pred = predname->pred;
-			pred_claim(pp.pred);
+			if(prof) profile_pred(prof, predname->pred_id)->calls++;
 			if(!es->dyn_callbacks
 			&& pp.pred->initial_value_entry >= 0) {
 				pp.routine = pp.pred->initial_value_entry;
@@ -2347,20 +3003,19 @@ static int eval_run(struct eval_state *es) {
 			}
 			pc = 0;
 			break;
-		case I_JOIN_WORDS:
+		CASE(I_JOIN_WORDS)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			v1 = join_words(v0, es);
 			if(v1.tag == VAL_NONE) {
 				do_fail(es, &pp);
 				pc = 0;
 			} else if(v1.tag == VAL_ERROR) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			} else {
 				set_by_ref(ci->oper[1], v1, es);
 			}
 			break;
-		case I_JUMP:
+		CASE(I_JUMP)
 			if(ci->oper[0].tag == OPER_RLAB) {
 				pp.routine = ci->oper[0].value;
 				pc = 0;
@@ -2370,10 +3025,9 @@ static int eval_run(struct eval_state *es) {
 				pc = 0;
 			}
 			break;
-		case I_MAKE_PAIR_RR:
+		CASE(I_MAKE_PAIR_RR)
 			v = alloc_heap_pair(es);
 			if(v.tag == VAL_ERROR) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			}
 			es->heap[v.value + 0] = v1 = (value_t) {VAL_REF, v.value + 0};
@@ -2382,10 +3036,9 @@ static int eval_run(struct eval_state *es) {
 			set_by_ref(ci->oper[2], v1, es);
 			set_by_ref(ci->oper[0], v, es);
 			break;
-		case I_MAKE_PAIR_RV:
+		CASE(I_MAKE_PAIR_RV)
 			v = alloc_heap_pair(es);
 			if(v.tag == VAL_ERROR) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			}
 			es->heap[v.value + 0] = v1 = (value_t) {VAL_REF, v.value + 0};
@@ -2393,10 +3046,9 @@ static int eval_run(struct eval_state *es) {
 			es->heap[v.value + 1] = value_of(ci->oper[2], es);
 			set_by_ref(ci->oper[0], v, es);
 			break;
-		case I_MAKE_PAIR_VR:
+		CASE(I_MAKE_PAIR_VR)
 			v = alloc_heap_pair(es);
 			if(v.tag == VAL_ERROR) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			}
 			es->heap[v.value + 0] = value_of(ci->oper[1], es);
@@ -2404,25 +3056,23 @@ static int eval_run(struct eval_state *es) {
 			set_by_ref(ci->oper[2], v1, es);
 			set_by_ref(ci->oper[0], v, es);
 			break;
-		case I_MAKE_PAIR_VV:
+		CASE(I_MAKE_PAIR_VV)
 			v = alloc_heap_pair(es);
 			if(v.tag == VAL_ERROR) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			}
 			es->heap[v.value + 0] = value_of(ci->oper[1], es);
 			es->heap[v.value + 1] = value_of(ci->oper[2], es);
 			set_by_ref(ci->oper[0], v, es);
 			break;
-		case I_MAKE_VAR:
+		CASE(I_MAKE_VAR)
 			v = eval_makevar(es);
 			if(v.tag == VAL_ERROR) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			}
 			set_by_ref(ci->oper[0], v, es);
 			break;
-		case I_NEXT_CHILD_PUSH:
+		CASE(I_NEXT_CHILD_PUSH)
 			assert(ci->oper[1].tag == OPER_RLAB);
 			assert(es->dyn_callbacks);
 			v = value_of(ci->oper[0], es); // no need to deref
@@ -2431,33 +3081,30 @@ static int eval_run(struct eval_state *es) {
 			if(onum >= 0) {
 				es->arg[1] = (value_t) {VAL_OBJ, onum};
 				if(!push_choice(es, 2, pp.pred, ci->oper[1].value)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 			} else {
 				es->arg[1] = (value_t) {VAL_NONE};
 			}
 			break;
-		case I_NEXT_OBJ_PUSH:
+		CASE(I_NEXT_OBJ_PUSH)
 			assert(ci->oper[1].tag == OPER_RLAB);
 			v = value_of(ci->oper[0], es); // no need to deref
 			assert(v.tag == VAL_OBJ);
 			if(v.value < es->program->nworldobj - 1) {
 				es->arg[1] = (value_t) {VAL_OBJ, v.value + 1};
 				if(!push_choice(es, 2, pp.pred, ci->oper[1].value)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 			} else {
 				es->arg[1] = (value_t) {VAL_NONE};
 			}
 			break;
-		case I_NEXT_OFLAG_PUSH:
+		CASE(I_NEXT_OFLAG_PUSH)
 			assert(ci->oper[0].tag == OPER_OFLAG);
 			assert(ci->oper[2].tag == OPER_RLAB);
 			predname = es->program->objflagpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			assert(es->dyn_callbacks);
@@ -2467,27 +3114,26 @@ static int eval_run(struct eval_state *es) {
 			if(onum >= 0) {
 				es->arg[1] = (value_t) {VAL_OBJ, onum};
 				if(!push_choice(es, 2, pp.pred, ci->oper[2].value)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 			} else {
 				es->arg[1] = (value_t) {VAL_NONE};
 			}
 			break;
-		case I_NOP:
-		case I_NOP_DEBUG:
+		CASE(I_NOP)
+		CASE(I_NOP_DEBUG)
 			break;
-		case I_POP_CHOICE:
+		CASE(I_POP_CHOICE)
 			assert(ci->oper[0].tag == OPER_NUM);
 			assert(es->choice > 0);
 			cho = &es->choicestack[es->choice];
 			assert(!cho->nextcase.pred);
-			pred_release(es->cont.pred);
+			assert(es->choice > es->undomark.choice);
 			es->cont = cho->cont;
 			cho->cont.pred = 0;
 			while(es->trail > cho->trail) {
 				i = es->trailstack[--es->trail];
-				es->heap[i] = (value_t) {VAL_REF, i};
+				store_heap(es, i, (value_t) {VAL_REF, i});
 			}
 			es->top = cho->top;
 			es->simple = cho->simple;
@@ -2498,7 +3144,7 @@ static int eval_run(struct eval_state *es) {
 			es->choice--;
 			revert_env_to(es, cho->env);
 			break;
-		case I_POP_STOP:
+		CASE(I_POP_STOP)
 			es->aux = es->stopaux;
 			assert(es->aux >= 2);
 			v = es->auxstack[--es->aux];
@@ -2508,31 +3154,29 @@ static int eval_run(struct eval_state *es) {
 			assert(v.tag == VAL_NUM);
 			es->stopchoice = v.value;
 			break;
-		case I_PREPARE_INDEX:
+		CASE(I_PREPARE_INDEX)
 			es->index = eval_deref(value_of(ci->oper[0], es), es);
 			if(es->index.tag == VAL_DICTEXT) {
 				es->index = es->heap[es->index.value + 0];
 			}
 			break;
-		case I_PRINT_VAL:
+		CASE(I_PRINT_VAL)
 			v0 = value_of(ci->oper[0], es);
 			if(es->forwords) {
 				if(!collect_push(es, v0)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_AUX;
 				}
 			} else {
 				pp_value(es, v0, 0, 0);
 			}
 			break;
-		case I_PRINT_WORDS:
+		CASE(I_PRINT_WORDS)
 			for(i = 0; i < 3; i++) {
 				if(ci->oper[i].tag == OPER_WORD) {
 					w = es->program->allwords[ci->oper[i].value];
 					if(es->forwords) {
 						assert(w->flags & WORDF_DICT);
 						if(!push_aux(es, (value_t) {VAL_DICT, w->dict_id})) {
-							pred_release(pp.pred);
 							return ESTATUS_ERR_AUX;
 						}
 					} else {
@@ -2541,11 +3185,10 @@ static int eval_run(struct eval_state *es) {
 				} else break;
 			}
 			break;
-		case I_PROCEED:
+		CASE(I_PROCEED)
 			if(es->simple != EVAL_MULTI) {
 				cut_to(es, es->simple);
 			}
-			pred_release(pp.pred);
 			if(es->program->eval_ticker) es->program->eval_ticker();
 			if(interrupted) {
 				es->resume = es->cont;
@@ -2558,32 +3201,28 @@ static int eval_run(struct eval_state *es) {
 				pc = 0;
 			}
 			break;
-		case I_PUSH_CHOICE:
+		CASE(I_PUSH_CHOICE)
 			assert(ci->oper[0].tag == OPER_NUM);
 			assert(ci->oper[1].tag == OPER_RLAB);
 			if(!push_choice(es, ci->oper[0].value, pp.pred, ci->oper[1].value)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			}
 			break;
-		case I_PUSH_STOP:
+		CASE(I_PUSH_STOP)
 			assert(ci->oper[0].tag == OPER_RLAB);
 			if(!push_aux(es, (value_t) {VAL_NUM, es->stopchoice})) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_AUX;
 			}
 			if(!push_aux(es, (value_t) {VAL_NUM, es->stopaux})) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_AUX;
 			}
 			es->stopaux = es->aux;
 			if(!push_choice(es, 0, pp.pred, ci->oper[0].value)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_HEAP;
 			}
 			es->stopchoice = es->choice;
 			break;
-		case I_QUIT_N:
+		CASE(I_QUIT_N)
 			v0 = value_of(ci->oper[0], es);
 			if(v0.tag == VAL_NUM) {
 				output_config.return_value = v0.value;
@@ -2594,32 +3233,27 @@ static int eval_run(struct eval_state *es) {
 				o_end_box();
 			}
 			// drop through
-		case I_QUIT:
-			pred_release(pp.pred);
+		CASE(I_QUIT)
 			return ESTATUS_QUIT;
-		case I_RESTART:
-			pred_release(pp.pred);
+		CASE(I_RESTART)
 			return ESTATUS_RESTART;
-		case I_RESTORE:
+		CASE(I_RESTORE)
 			if(es->dyn_callbacks) {
-				pred_release(pp.pred);
 				es->resume = es->cont;
 				es->cont.pred = 0;
 				return ESTATUS_RESTORE;
 			}
 			break;
-		case I_RESTORE_CHOICE:
+		CASE(I_RESTORE_CHOICE)
 			v = value_of(ci->oper[0], es);
 			assert(v.tag == VAL_NUM);
 			cut_to(es, v.value);
 			break;
-		case I_SAVE:
+		CASE(I_SAVE)
 			if(es->inStatus || es->nSpan) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_IO;
 			}
 			if(es->dyn_callbacks) {
-				pred_release(pp.pred);
 				es->resume = es->cont;
 				es->cont.pred = 0;
 				return ESTATUS_SAVE;
@@ -2628,20 +3262,18 @@ static int eval_run(struct eval_state *es) {
 				pc = 0;
 			}
 			break;
-		case I_SAVE_CHOICE:
+		CASE(I_SAVE_CHOICE)
 			set_by_ref(ci->oper[0], (value_t) {VAL_NUM, es->choice}, es);
 			break;
-		case I_SAVE_UNDO:
+		CASE(I_SAVE_UNDO)
 			if(es->inStatus || es->nSpan) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_IO;
 			}
 			if(es->dyn_callbacks) {
 				es->dyn_callbacks->push_undo(es->dyn_callback_data);
-				pred_release(pp.pred);
 				pp.pred = 0;
 				eval_push_undo(es);
-				if(!unify(es, es->arg[0], (value_t) {VAL_NUM, 0}, 0)) {
+				if(!unify(es, es->arg[0], (value_t) {VAL_NUM, 0})) {
 					do_fail(es, &pp);
 					pc = 0;
 				} else {
@@ -2655,7 +3287,7 @@ static int eval_run(struct eval_state *es) {
 				pc = 0;
 			}
 			break;
-		case I_SELECT:
+		CASE(I_SELECT)
 			assert(ci->oper[0].tag == OPER_NUM);
 			n = ci->oper[0].value;
 			assert(n > 1);
@@ -2668,7 +3300,7 @@ static int eval_run(struct eval_state *es) {
 				switch(ci->subop) {
 				case SEL_STOPPING:
 					if(i + 1 < n) {
-						es->program->select[ci->oper[1].value] = i + 1;
+						store_select(es, ci->oper[1].value, i + 1);
 					}
 					break;
 				case SEL_RANDOM:
@@ -2679,34 +3311,34 @@ static int eval_run(struct eval_state *es) {
 					} else {
 						i = compatible_random(es, 0, n - 1);
 					}
-					es->program->select[ci->oper[1].value] = i + 1;
+					store_select(es, ci->oper[1].value, i + 1);
 					break;
 				case SEL_T_RANDOM:
 					if(i < n) {
 						if(i < n - 1) {
-							es->program->select[ci->oper[1].value] = i + 1;
+							store_select(es, ci->oper[1].value, i + 1);
 						} else {
-							es->program->select[ci->oper[1].value] = n + n - 1;
+							store_select(es, ci->oper[1].value, n + n - 1);
 						}
 					} else {
 						j = compatible_random(es, 0, n - 2);
 						if(j >= i - n) j++;
 						i = j;
-						es->program->select[ci->oper[1].value] = n + i;
+						store_select(es, ci->oper[1].value, n + i);
 					}
 					break;
 				case SEL_T_P_RANDOM:
 					if(i < n) {
-						es->program->select[ci->oper[1].value] = i + 1;
+						store_select(es, ci->oper[1].value, i + 1);
 					} else {
 						i = compatible_random(es, 0, n - 1);
 					}
 					break;
 				case SEL_CYCLING:
 					if(i < n - 1) {
-						es->program->select[ci->oper[1].value] = i + 1;
+						store_select(es, ci->oper[1].value, i + 1);
 					} else {
-						es->program->select[ci->oper[1].value] = 0;
+						store_select(es, ci->oper[1].value, 0);
 					}
 					break;
 				default:
@@ -2719,25 +3351,22 @@ static int eval_run(struct eval_state *es) {
 			}
 			es->index = (value_t) {VAL_RAW, i};
 			break;
-		case I_SET_CONT:
+		CASE(I_SET_CONT)
 			assert(!es->cont.pred);
 			if(ci->oper[0].tag == OPER_RLAB) {
 				es->cont.pred = pp.pred;
-				pred_claim(es->cont.pred);
 				es->cont.routine = ci->oper[0].value;
 			} else {
 				assert(ci->oper[0].tag == OPER_FAIL);
 				es->cont.pred = find_builtin(es->program, BI_FAIL)->pred;
-				pred_claim(es->cont.pred);
 				es->cont.routine = es->cont.pred->normal_entry;
 			}
 			break;
-		case I_SET_GFLAG:
+		CASE(I_SET_GFLAG)
 			assert(ci->oper[0].tag == OPER_GFLAG);
 			predname = es->program->globalflagpred[ci->oper[0].value];
 			if(predname) {
 				if(!check_dyn_dependency(es, pp, predname)) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_DYN;
 				}
 				trace(
@@ -2753,11 +3382,10 @@ static int eval_run(struct eval_state *es) {
 					ci->subop);
 			}
 			break;
-		case I_SET_GVAR:
+		CASE(I_SET_GVAR)
 			assert(ci->oper[0].tag == OPER_GVAR);
 			predname = es->program->globalvarpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v = eval_deref(value_of(ci->oper[1], es), es);
@@ -2773,15 +3401,13 @@ static int eval_run(struct eval_state *es) {
 				ci->oper[0].value,
 				v))
 			{
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			break;
-		case I_SET_OFLAG:
+		CASE(I_SET_OFLAG)
 			assert(ci->oper[0].tag == OPER_OFLAG);
 			predname = es->program->objflagpred[ci->oper[0].value];
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			v = eval_deref(value_of(ci->oper[1], es), es);
@@ -2798,7 +3424,6 @@ static int eval_run(struct eval_state *es) {
 						tr_line,
 						"Attempting to set per-object flag %s for non-object.",
 						predname->printed_name);
-					pred_release(pp.pred);
 					return ESTATUS_ERR_OBJ;
 				}
 			} else {
@@ -2810,12 +3435,11 @@ static int eval_run(struct eval_state *es) {
 					ci->subop);
 			}
 			break;
-		case I_SET_OVAR:
+		CASE(I_SET_OVAR)
 			assert(ci->oper[0].tag == OPER_OVAR);
 			predname = es->program->objvarpred[ci->oper[0].value];
 			assert(predname);
 			if(!check_dyn_dependency(es, pp, predname)) {
-				pred_release(pp.pred);
 				return ESTATUS_ERR_DYN;
 			}
 			args[0] = v1 = eval_deref(value_of(ci->oper[1], es), es);
@@ -2833,7 +3457,6 @@ static int eval_run(struct eval_state *es) {
 						tr_line,
 						"Attempting to set per-object variable %s for non-object.",
 						predname->printed_name);
-					pred_release(pp.pred);
 					return ESTATUS_ERR_OBJ;
 				}
 			} else {
@@ -2844,17 +3467,16 @@ static int eval_run(struct eval_state *es) {
 					v1.value,
 					v2))
 				{
-					pred_release(pp.pred);
 					return ESTATUS_ERR_DYN;
 				}
 			}
 			break;
-		case I_SPLIT_LIST:
+		CASE(I_SPLIT_LIST)
 			v0 = value_of(ci->oper[0], es);
 			v1 = eval_deref(value_of(ci->oper[1], es), es);
 			v2 = value_of(ci->oper[2], es);
 			if(v1.tag == VAL_NIL) {
-				if(!unify(es, v0, v2, 0)) {
+				if(!unify(es, v0, v2)) {
 					do_fail(es, &pp);
 					pc = 0;
 				}
@@ -2868,12 +3490,11 @@ static int eval_run(struct eval_state *es) {
 					} else {
 						v = alloc_heap_pair(es);
 						if(v.tag == VAL_ERROR) {
-							pred_release(pp.pred);
 							return ESTATUS_ERR_HEAP;
 						}
 						es->heap[v.value + 0] = es->heap[v0.value + 0];
 						es->heap[v.value + 1] = (value_t) {VAL_REF, v.value + 1};
-						if(!unify(es, v, v2, 0)) {
+						if(!unify(es, v, v2)) {
 							do_fail(es, &pp);
 							pc = 0;
 							break;
@@ -2883,21 +3504,20 @@ static int eval_run(struct eval_state *es) {
 					}
 				}
 				if(v0.value == v1.value) {
-					if(!unify(es, (value_t) {VAL_NIL}, v2, 0)) {
+					if(!unify(es, (value_t) {VAL_NIL}, v2)) {
 						do_fail(es, &pp);
 						pc = 0;
 					}
 				}
 			}
 			break;
-		case I_SPLIT_WORD:
+		CASE(I_SPLIT_WORD)
 			v0 = eval_deref(value_of(ci->oper[0], es), es);
 			if(v0.tag == VAL_DICT) {
 				w = es->program->dictwordnames[v0.value];
 				n = strlen(w->name);
 				v = prepend_word_chars(w->name, n + 1, (value_t) {VAL_NIL}, es);
 				if(v.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 				set_by_ref(ci->oper[1], v, es);
@@ -2911,7 +3531,6 @@ static int eval_run(struct eval_state *es) {
 					n = strlen(w->name);
 					v = prepend_word_chars(w->name, n + 1, es->heap[v0.value + 1], es);
 					if(v.tag == VAL_ERROR) {
-						pred_release(pp.pred);
 						return ESTATUS_ERR_HEAP;
 					}
 					set_by_ref(ci->oper[1], v, es);
@@ -2928,7 +3547,6 @@ static int eval_run(struct eval_state *es) {
 					v = eval_makepair((value_t) {VAL_NUM, 0}, v, es);
 				}
 				if(v.tag == VAL_ERROR) {
-					pred_release(pp.pred);
 					return ESTATUS_ERR_HEAP;
 				}
 				set_by_ref(ci->oper[1], v, es);
@@ -2937,12 +3555,12 @@ static int eval_run(struct eval_state *es) {
 				pc = 0;
 			}
 			break;
-		case I_STOP:
+		CASE(I_STOP)
 			cut_to(es, es->stopchoice);
 			do_fail(es, &pp);
 			pc = 0;
 			break;
-		case I_TRACEPOINT:
+		CASE(I_TRACEPOINT)
 			assert(ci->oper[0].tag == OPER_FILE);
 			assert(ci->oper[1].tag == OPER_NUM);
 			if(ci->subop == TR_LINE) {
@@ -2971,7 +3589,7 @@ static int eval_run(struct eval_state *es) {
 					es,
 					TR_ENTER,
 					predname,
-					es->envstack[es->env].tracevars,
+					es->varstack + es->envstack[es->env].vars + es->envstack[es->env].nvar,
 					MKLINE(ci->oper[0].value, ci->oper[1].value));
 			} else if(ci->subop == TR_QDONE) {
 				assert(ci->oper[2].tag == OPER_PRED);
@@ -3002,20 +3620,19 @@ static int eval_run(struct eval_state *es) {
 				assert(0);
 			}
 			break;
-		case I_TRANSCRIPT:
+		CASE(I_TRANSCRIPT)
 			if(ci->subop) {
 				// Not supported in the debugger.
 				do_fail(es, &pp);
 				pc = 0;
 			}
 			break;
-		case I_UNDO:
+		CASE(I_UNDO)
 			if(eval_pop_undo(es)) {
 				assert(es->dyn_callbacks);
-				pred_release(pp.pred);
 				pp.pred = 0;
 				es->dyn_callbacks->pop_undo(es, es->dyn_callback_data);
-				if(!unify(es, es->arg[0], (value_t) {VAL_NUM, 1}, 0)) {
+				if(!unify(es, es->arg[0], (value_t) {VAL_NUM, 1})) {
 					do_fail(es, &pp);
 					pc = 0;
 				} else {
@@ -3029,13 +3646,21 @@ static int eval_run(struct eval_state *es) {
 				pc = 0;
 			}
 			break;
-		case I_UNIFY:
-			if(!unify(es, value_of(ci->oper[0], es), value_of(ci->oper[1], es), 0)) {
+		CASE(I_UNIFY)
+			if(!unify(es, value_of(ci->oper[0], es), value_of(ci->oper[1], es))) {
 				do_fail(es, &pp);
 				pc = 0;
 			}
 			break;
+#ifdef EVAL_THREADED
+		L_overrun:
+			printf("%s %d\n", pp.pred->predname->printed_name, pp.routine);
+			assert(0);
+#endif
 		default:
+#ifdef EVAL_THREADED
+		L_default:
+#endif
 			printf("unimplemented cinstr! %d\n", ci->op);
 			cid = pp.pred->routines[pp.routine].clause_id;
 			comp_dump_routine(
@@ -3054,9 +3679,7 @@ void eval_reinitialize(struct eval_state *es) {
 	revert_env_to(es, -1);
 	assert(envtop(es) == 0);
 
-	pred_release(es->cont.pred);
 	es->cont.pred = 0;
-	pred_release(es->resume.pred);
 	es->resume.pred = 0;
 
 	es->aux = 0;
@@ -3087,7 +3710,6 @@ int eval_initial(struct eval_state *es, struct predname *predname, value_t *args
 	assert(!es->dyn_callbacks);
 	es->top_target = predname;
 
-	pred_claim(predname->pred);
 	es->resume.pred = predname->pred;
 	if(predname->pred->initial_value_entry >= 0) {
 		es->resume.routine = predname->pred->initial_value_entry;
@@ -3118,7 +3740,6 @@ int eval_initial_multi(struct eval_state *es, struct predname *predname, value_t
 
 	assert(!es->dyn_callbacks);
 
-	pred_claim(predname->pred);
 	es->resume.pred = predname->pred;
 	if(predname->pred->initial_value_entry >= 0) {
 		es->resume.routine = predname->pred->initial_value_entry;
@@ -3158,7 +3779,6 @@ int eval_program_entry(struct eval_state *es, struct predname *predname, value_t
 	assert(es->dyn_callbacks);
 	assert(!es->resume.pred);
 
-	pred_claim(predname->pred);
 	es->resume.pred = predname->pred;
 	es->resume.routine = predname->pred->normal_entry;
 
@@ -3173,7 +3793,7 @@ int eval_program_entry(struct eval_state *es, struct predname *predname, value_t
 }
 
 int eval_resume(struct eval_state *es, value_t arg) {
-	if(arg.tag != VAL_NONE && !unify(es, es->arg[0], arg, 0)) {
+	if(arg.tag != VAL_NONE && !unify(es, es->arg[0], arg)) {
 		do_fail(es, &es->resume);
 	}
 
@@ -3185,7 +3805,6 @@ int eval_injected_query(struct eval_state *es, struct predname *predname) {
 	assert(!es->cont.pred);
 	es->cont = es->resume;
 
-	pred_claim(predname->pred);
 	es->resume.pred = predname->pred;
 	es->resume.routine = predname->pred->normal_entry;
 
@@ -3201,6 +3820,7 @@ void init_evalstate(struct eval_state *es, struct program *prg) {
 	es->randomseed = 1;
 	es->nalloc_undo = EVAL_MAX_UNDO;
 	es->undostack = malloc(es->nalloc_undo * sizeof(struct eval_undo));
+	es->undomark.choice = -1;
 	eval_reinitialize(es);
 }
 
@@ -3211,20 +3831,180 @@ void free_evalstate(struct eval_state *es) {
 	revert_env_to(es, -1);
 	assert(envtop(es) == 0);
 
-	pred_release(es->cont.pred);
 	es->cont.pred = 0;
-	pred_release(es->resume.pred);
 	es->resume.pred = 0;
 
 	for(i = 0; i < es->nundo; i++) {
-		free_evalstate_undo(&es->undostack[i]);
+		arena_free(&es->undostack[i].arena);
 	}
 	free(es->undostack);
+	free(es->undolog);
+	free(es->heapstamp);
+	free(es->varstamp);
+	free(es->selectstamp);
 
 	free(es->envstack);
+	free(es->varstack);
 	free(es->choicestack);
 	free(es->auxstack);
 	free(es->trailstack);
 	free(es->heap);
 	free(es->temp);
+	free(es->touched);
+}
+
+static void *copy_array(void *src, size_t size) {
+	void *dest = malloc(size? size : 1);
+
+	if(size) memcpy(dest, src, size);
+	return dest;
+}
+
+static void copy_stacks(struct eval_state *dest, struct eval_state *src) {
+	dest->envstack = copy_array(src->envstack, src->nalloc_env * sizeof(struct env));
+	dest->varstack = copy_array(src->varstack, src->nalloc_var * sizeof(value_t));
+	dest->choicestack = copy_array(src->choicestack, src->nalloc_choice * sizeof(struct choice));
+	dest->auxstack = copy_array(src->auxstack, src->nalloc_aux * sizeof(value_t));
+	dest->trailstack = copy_array(src->trailstack, src->nalloc_trail * sizeof(uint32_t));
+	dest->heap = copy_array(src->heap, src->nalloc_heap * sizeof(value_t));
+	dest->temp = copy_array(src->temp, src->nalloc_temp * sizeof(value_t));
+	dest->touched = src->touched? copy_array(src->touched, src->ntouched) : 0;
+}
+
+static void free_stacks(struct eval_state *es) {
+	free(es->envstack);
+	free(es->varstack);
+	free(es->choicestack);
+	free(es->auxstack);
+	free(es->trailstack);
+	free(es->heap);
+	free(es->temp);
+	free(es->touched);
+}
+
+// The frames refer to predicates without claiming them. Before retired
+// predicates are reclaimed, every surviving state must be marked.
+
+static void mark_pred(struct predicate *pred, int epoch) {
+	if(pred) pred->epoch = epoch;
+}
+
+static void mark_frames(struct eval_state *es, int epoch) {
+	int i, etop = envtop(es);
+
+	for(i = 0; i < etop; i++) {
+		mark_pred(es->envstack[i].cont.pred, epoch);
+	}
+	for(i = 0; i <= es->choice; i++) {
+		mark_pred(es->choicestack[i].cont.pred, epoch);
+		mark_pred(es->choicestack[i].nextcase.pred, epoch);
+	}
+	mark_pred(es->cont.pred, epoch);
+	mark_pred(es->resume.pred, epoch);
+}
+
+void eval_mark_predicates(struct eval_state *es) {
+	int epoch = es->program->pred_epoch;
+	struct eval_undo_rec *rec;
+	int i;
+
+	mark_frames(es, epoch);
+	for(i = 0; i < es->nundo; i++) {
+		mark_pred(es->undostack[i].cont.pred, epoch);
+	}
+	for(i = 0; i < es->nundolog; i++) {
+		rec = &es->undolog[i];
+		if(rec->kind == UNDO_ENV) {
+			mark_pred(((struct env *) rec->old.data)->cont.pred, epoch);
+		} else if(rec->kind == UNDO_CHOICE) {
+			mark_pred(((struct choice *) rec->old.data)->cont.pred, epoch);
+			mark_pred(((struct choice *) rec->old.data)->nextcase.pred, epoch);
+		}
+	}
+}
+
+void eval_mark_checkpoint(struct eval_checkpoint *cp) {
+	mark_frames(&cp->state, cp->state.program->pred_epoch);
+}
+
+// Checkpoints remain valid when the program is recompiled, as long as their
+// predicates are marked before each call to pred_reclaim. Only a clean state
+// can be captured, i.e. one where no output areas are open.
+
+struct eval_checkpoint *eval_checkpoint(struct eval_state *es) {
+	struct eval_checkpoint *cp;
+	struct eval_state *cs;
+
+	if(es->divsp || es->inStatus || es->nSpan || es->nLink) {
+		return 0;
+	}
+
+	cp = malloc(sizeof(*cp));
+	cs = &cp->state;
+	memcpy(cs, es, sizeof(*cs));
+	cs->undostack = 0;
+	cs->nalloc_undo = 0;
+	cs->nundo = 0;
+	cs->undolog = 0;
+	cs->nalloc_undolog = 0;
+	cs->nundolog = 0;
+	cs->heapstamp = 0;
+	cs->varstamp = 0;
+	cs->selectstamp = 0;
+	cs->nalloc_selectstamp = 0;
+	cs->profile = 0;
+	copy_stacks(cs, es);
+
+	cp->nselect = es->program->nselect;
+	cp->select = copy_array(es->program->select, cp->nselect);
+
+	return cp;
+}
+
+void eval_restore_checkpoint(struct eval_state *es, struct eval_checkpoint *cp) {
+	struct eval_state saved;
+	struct program *prg = es->program;
+	int n;
+
+	while(es->nundo) {
+		eval_prune_undo(es);
+	}
+	free_stacks(es);
+	free(es->heapstamp);
+	free(es->varstamp);
+	free(es->selectstamp);
+
+	while(es->divsp--) o_end_box();
+	o_leave_all();
+	o_set_style(STYLE_ROMAN);
+
+	memcpy(&saved, es, sizeof(saved));
+	memcpy(es, &cp->state, sizeof(*es));
+	es->program = saved.program;
+	es->dyn_callbacks = saved.dyn_callbacks;
+	es->dyn_callback_data = saved.dyn_callback_data;
+	es->undostack = saved.undostack;
+	es->nalloc_undo = saved.nalloc_undo;
+	es->did_prune_undo = saved.did_prune_undo;
+	es->undolog = saved.undolog;
+	es->nalloc_undolog = saved.nalloc_undolog;
+	es->undomark = saved.undomark;
+	es->undoserial = saved.undoserial;
+	es->profile = saved.profile;
+	es->trace = saved.trace;
+	es->hide_links = saved.hide_links;
+
+	copy_stacks(es, &cp->state);
+	es->heapstamp = calloc(es->nalloc_heap + 1, sizeof(uint32_t));
+	es->varstamp = calloc(es->nalloc_var + 1, sizeof(uint32_t));
+
+	n = (cp->nselect < prg->nselect)? cp->nselect : prg->nselect;
+	memcpy(prg->select, cp->select, n);
+	memset(prg->select + n, 0, prg->nselect - n);
+}
+
+void eval_free_checkpoint(struct eval_checkpoint *cp) {
+	free_stacks(&cp->state);
+	free(cp->select);
+	free(cp);
 }
@@ -1,60 +1,142 @@
 
-#define EVAL_MULTI 0xffff
+#define EVAL_MULTI 0xffffffff
+
+// Stack and heap indices are 32 bits wide, but by default they are limited to
+// what the Z-machine can address. The wide limit keeps indices, and the
+// element counts of serialized lists, below EVAL_IMPROPER.
+
+#define EVAL_MAXINDEX_Z		0xffff
+#define EVAL_MAXINDEX_WIDE	0x3fffff
+
+extern uint32_t eval_maxindex;
+
+// Serialized lists end with VAL_PAIR(n), or VAL_PAIR(EVAL_IMPROPER | n) when
+// the elements are followed by an improper tail. The count n is bounded by the
+// size of the aux stack or the long-term storage, i.e. by eval_maxindex.
+
+#define EVAL_IMPROPER 0x400000
 
 #define EVAL_MAXDIV 8
 #define EVAL_MAX_UNDO 50
 
+#define EVAL_UNIFY_DEPTH 64	// nested list heads
+
+#define EVAL_GC_MIN 256	// heap cells above the undo watermark
+
+#define EVAL_PROFILE_INTERVAL 64	// instructions between call stack samples
+#define EVAL_PROFILE_NBUCKET 1024
+
 typedef struct prgpoint {
 	struct predicate	*pred;
 	uint16_t		routine;
 } prgpoint_t;
 
 struct env {
-	value_t			*vars;
-	value_t			*tracevars;
+	uint32_t		vars;		// varstack index, trace vars follow
 	prgpoint_t		cont;
-	uint16_t		env;
+	int32_t			env;
+	uint32_t		simple;
+	uint32_t		level;
 	uint16_t		nvar;
-	uint16_t		simple;
-	uint16_t		level;
 	uint16_t		ntracevar;
 };
 
 struct choice {
-	uint16_t		env;		// env index
-	uint16_t		envtop;
-	uint16_t		trail;
-	uint16_t		top;
-	uint16_t		simple;
+	int32_t			env;		// env index
+	uint32_t		envtop;
+	uint32_t		trail;
+	uint32_t		top;
+	uint32_t		simple;
 	value_t			arg[MAXPARAM + 1];
 	value_t			orig_arg0;
 	prgpoint_t		cont;
 	prgpoint_t		nextcase;
 };
 
+enum {
+	UNDO_HEAP,		// single heap cell
+	UNDO_HEAP_RANGE,
+	UNDO_VAR,		// single varstack cell
+	UNDO_VAR_RANGE,
+	UNDO_AUX_RANGE,
+	UNDO_TRAIL_RANGE,
+	UNDO_ENV,		// env frame
+	UNDO_CHOICE,		// choice frame
+	UNDO_SELECT		// single select byte
+};
+
+struct eval_undo_rec {
+	uint8_t			kind;
+	uint32_t		index;
+	uint32_t		count;
+	union {
+		value_t		value;
+		uint8_t		byte;
+		void		*data;	// in the arena of the owning snapshot
+	} old;
+};
+
+// Watermarks below which the state must be journalled before it is
+// overwritten, together with the generation used for cell stamps.
+
+struct eval_undo_mark {
+	uint32_t		gen;
+	uint32_t		vars;
+	int			env;
+	int			choice;
+	uint32_t		top;
+	uint32_t		trail;
+	uint32_t		aux;
+};
+
 struct eval_undo {
 	struct arena		arena;
-	struct env		*envstack;
-	struct choice		*choicestack;
-	value_t			*auxstack;
-	uint16_t		*trailstack;
-	value_t			*heap;
-	uint8_t			*select;
+	int			logpos;		// first journal entry after this snapshot
+	struct eval_undo_mark	prevmark;	// marks of the previous snapshot
 	uint16_t		divstack[EVAL_MAXDIV];
 	int			nselect;
 	long			randomseed;
 	prgpoint_t		cont;
 	int			choice;
 	int			env;
-	uint16_t		aux;
-	uint16_t		trail;
-	uint16_t		top;
-	uint16_t		stopchoice;
-	uint16_t		stopaux;
+	uint32_t		aux;
+	uint32_t		trail;
+	uint32_t		top;
+	int			stopchoice;
+	uint32_t		stopaux;
 	uint8_t			divsp;
 	value_t			arg0; // where to put the 1 for $ComingBack
 };
 
+struct eval_profile_pred {
+	uint64_t		calls;
+	uint64_t		fails;
+	uint64_t		instr;		// exclusive, exact
+	uint64_t		inclusive;	// instructions, sampled
+	uint32_t		stamp;		// sample number, to count recursion once
+};
+
+struct eval_profile_stack {
+	struct eval_profile_stack *next;
+	uint32_t		hash;
+	uint16_t		nframe;
+	uint16_t		*frame;		// pred_id, innermost first
+	uint64_t		weight;		// instructions
+};
+
+struct eval_profile {
+	struct arena		arena;
+	struct eval_profile_pred *pred;	// indexed by pred_id
+	int			npred;
+	struct eval_profile_stack *bucket[EVAL_PROFILE_NBUCKET];
+	int			nstack;
+	uint16_t		*frames;	// scratch
+	int			nalloc_frame;
+	uint64_t		ninstr;
+	uint64_t		lastsample;
+	uint32_t		nsample;
+};
+
 struct eval_state {
 	struct program		*program;
 
@@ -65,22 +147,33 @@ struct eval_state {
 	int			nalloc_undo;
 	int			nundo;
 	int			did_prune_undo;
+	struct eval_undo_rec	*undolog;	// journal of overwritten state
+	int			nalloc_undolog;
+	int			nundolog;
+	struct eval_undo_mark	undomark;
+	uint32_t		undoserial;
+	uint32_t		*heapstamp;	// undomark.gen when journalled
+	uint32_t		*varstamp;
+	uint32_t		*selectstamp;
+	int			nalloc_selectstamp;
 
 	struct env		*envstack;
+	value_t			*varstack;	// env and trace vars for all frames
 	struct choice		*choicestack;
 	value_t			*auxstack;
-	uint16_t		*trailstack;	// heap index
+	uint32_t		*trailstack;	// heap index
 	value_t			*heap;
 	value_t			*temp;
 	uint16_t		divstack[EVAL_MAXDIV];
 	value_t			arg[MAXPARAM + 1];
 	value_t			orig_arg0;	// for tracing an indexed argument
-	uint16_t		nalloc_env;
-	uint16_t		nalloc_choice;
-	uint16_t		nalloc_aux;
-	uint16_t		nalloc_trail;
-	uint16_t		nalloc_heap;
-	uint16_t		nalloc_temp;
+	uint32_t		nalloc_env;
+	uint32_t		nalloc_choice;
+	uint32_t		nalloc_aux;
+	uint32_t		nalloc_trail;
+	uint32_t		nalloc_heap;
+	uint32_t		nalloc_temp;
+	uint32_t		nalloc_var;
 	long			randomseed;
 
 	prgpoint_t		resume;		// between calls to eval_run
@@ -89,16 +182,20 @@ struct eval_state {
 	prgpoint_t		cont;
 	int			env;
 	int			choice;
-	uint16_t		aux;
-	uint16_t		trail;
-	uint16_t		top;		// heap index
-	uint16_t		stopchoice;	// choice index
-	uint16_t		stopaux;	// aux index
-	uint16_t		simple;		// choice index or EVAL_MULTI
+	uint32_t		aux;
+	uint32_t		trail;
+	uint32_t		top;		// heap index
+	int			stopchoice;	// choice index
+	uint32_t		stopaux;	// aux index
+	uint32_t		simple;		// choice index or EVAL_MULTI
 	value_t			index;
 
 	uint16_t		max_eval;
 
+	struct eval_profile	*profile;
+	uint8_t			*touched;	// per pred_id, or null when not tracked
+	int			ntouched;
+
 	uint8_t			forwords;
 	uint8_t			trace;
 	uint8_t			divstyle; // Style (italic etc)
@@ -113,6 +210,15 @@ struct eval_state {
 	uint8_t			nLink;
 };
 
+// A checkpoint is a copy of the evaluator state without its undo history,
+// taken while the program is waiting for input.
+
+struct eval_checkpoint {
+	struct eval_state	state;
+	uint8_t			*select;
+	int			nselect;
+};
+
 struct eval_dyn_cb {
 	value_t	(*get_globalvar)(struct eval_state *es, void *userdata, int dyn_id);
 	int	(*set_globalvar)(struct eval_state *es, void *userdata, int dyn_id, value_t val);
@@ -173,3 +279,13 @@ int eval_program_entry(struct eval_state *es, struct predname *predname, value_t
 int eval_resume(struct eval_state *es, value_t arg);
 int eval_injected_query(struct eval_state *es, struct predname *predname);
 void eval_interrupt(); // called from the signal handler
+struct eval_profile *eval_profile_new(struct program *prg);
+void eval_profile_free(struct eval_profile *prof);
+void eval_profile_report(struct eval_profile *prof, struct program *prg);
+char **eval_profile_collapsed(struct eval_profile *prof, struct program *prg, int *nline);
+void eval_track_touched(struct eval_state *es);
+struct eval_checkpoint *eval_checkpoint(struct eval_state *es);
+void eval_restore_checkpoint(struct eval_state *es, struct eval_checkpoint *cp);
+void eval_free_checkpoint(struct eval_checkpoint *cp);
+void eval_mark_predicates(struct eval_state *es);
+void eval_mark_checkpoint(struct eval_checkpoint *cp);
@@ -15,6 +15,8 @@
 #include "parse.h"
 #include "report.h"
 #include "unicode.h"
+#include "libimage.h"
+#include "stats.h"
 
 struct predlist {
 	struct predlist		*next;
@@ -79,28 +81,28 @@ struct builtinspec {
 	int nword;
 	char *word[8];
 } builtinspec[] = {
-	{BI_LESSTHAN,		0, 0,				3,	{0, "<", 0}},
-	{BI_GREATERTHAN,	0, 0,				3,	{0, ">", 0}},
-	{BI_PLUS,		0, 0,				5,	{0, "plus", 0, "into", 0}},
-	{BI_MINUS,		0, 0,				5,	{0, "minus", 0, "into", 0}},
-	{BI_TIMES,		0, 0,				5,	{0, "times", 0, "into", 0}},
-	{BI_DIVIDED,		0, 0,				6,	{0, "divided", "by", 0, "into", 0}},
-	{BI_MODULO,		0, 0,				5,	{0, "modulo", 0, "into", 0}},
-	{BI_RANDOM,		0, 0,				7,	{"random", "from", 0, "to", 0, "into", 0}},
+	{BI_LESSTHAN,		0, PREDF_SEMIDET,		3,	{0, "<", 0}},
+	{BI_GREATERTHAN,	0, PREDF_SEMIDET,		3,	{0, ">", 0}},
+	{BI_PLUS,		0, PREDF_SEMIDET,		5,	{0, "plus", 0, "into", 0}},
+	{BI_MINUS,		0, PREDF_SEMIDET,		5,	{0, "minus", 0, "into", 0}},
+	{BI_TIMES,		0, PREDF_SEMIDET,		5,	{0, "times", 0, "into", 0}},
+	{BI_DIVIDED,		0, PREDF_SEMIDET,		6,	{0, "divided", "by", 0, "into", 0}},
+	{BI_MODULO,		0, PREDF_SEMIDET,		5,	{0, "modulo", 0, "into", 0}},
+	{BI_RANDOM,		0, PREDF_SEMIDET,		7,	{"random", "from", 0, "to", 0, "into", 0}},
 	{BI_DIV_WIDTH,		0, 0,				4, {"current", "div", "width", 0}},
 	{BI_DIV_HEIGHT,		0, 0,				4, {"current", "div", "height", 0}},
 	{BI_FAIL,		0, PREDF_FAIL,			1,	{"fail"}},
 	{BI_STOP,		0, PREDF_SUCCEEDS|PREDF_STOP|PREDF_MIGHT_STOP,	1,	{"stop"}},
 	{BI_REPEAT,		0, PREDF_SUCCEEDS,		2,	{"repeat", "forever"}},
-	{BI_NUMBER,		0, 0,				2,	{"number", 0}},
-	{BI_LIST,		0, 0,				2,	{"list", 0}},
-	{BI_EMPTY,		0, 0,				2,	{"empty", 0}},
-	{BI_NONEMPTY,		0, 0,				2,	{"nonempty", 0}},
-	{BI_WORD,		0, 0,				2,	{"word", 0}},
-	{BI_UNKNOWN_WORD,	0, 0,				3,	{"unknown", "word", 0}},
+	{BI_NUMBER,		0, PREDF_SEMIDET,		2,	{"number", 0}},
+	{BI_LIST,		0, PREDF_SEMIDET,		2,	{"list", 0}},
+	{BI_EMPTY,		0, PREDF_SEMIDET,		2,	{"empty", 0}},
+	{BI_NONEMPTY,		0, PREDF_SEMIDET,		2,	{"nonempty", 0}},
+	{BI_WORD,		0, PREDF_SEMIDET,		2,	{"word", 0}},
+	{BI_UNKNOWN_WORD,	0, PREDF_SEMIDET,		3,	{"unknown", "word", 0}},
 	{BI_OBJECT,		0, 0,				2,	{"object", 0}},
-	{BI_BOUND,		0, 0,				2,	{"bound", 0}},
-	{BI_FULLY_BOUND,	0, 0,				3,	{"fully", "bound", 0}},
+	{BI_BOUND,		0, PREDF_SEMIDET,		2,	{"bound", 0}},
+	{BI_FULLY_BOUND,	0, PREDF_SEMIDET,		3,	{"fully", "bound", 0}},
 	{BI_QUIT,		0, PREDF_SUCCEEDS,		1,	{"quit"}},
 	{BI_QUIT_N,             0, PREDF_SUCCEEDS,              2,      {"quit", 0}},
 	{BI_RESTART,		0, PREDF_SUCCEEDS,		1,	{"restart"}},
@@ -143,7 +145,7 @@ struct builtinspec {
 	{BI_COMPILERVERSION,	0, PREDF_SUCCEEDS,		2,	{"compiler", "version"}},
 	{BI_MEMSTATS,		0, PREDF_SUCCEEDS,		3,	{"display", "memory", "statistics"}},
 	{BI_HASPARENT,		0, PREDF_DYNAMIC,		4,	{0, "has", "parent", 0}},
-	{BI_UNIFY,		0, 0,				3,	{0, "=", 0}},
+	{BI_UNIFY,		0, PREDF_SEMIDET,		3,	{0, "=", 0}},
 	{BI_IS_ONE_OF,		0, 0,				5,	{0, "is", "one", "of", 0}},
 	{BI_SPLIT,		0, 0,				8,	{"split", 0, "by", 0, "into", 0, "and", 0}},
 	{BI_APPEND,		0, 0,				4,	{"append", 0, 0, 0}},
@@ -1623,7 +1625,11 @@ int body_succeeds_at_most_once(struct astnode *an) {
 			if(!body_succeeds_at_most_once(an->children[0])) return 0;
 			break;
 		case AN_RULE:
-			if(an->subkind == RULE_MULTI) return 0;
+			if(an->subkind == RULE_MULTI
+			&& !(an->predicate->pred->flags & PREDF_SEMIDET)
+			&& !((an->predicate->pred->flags & PREDF_SEMIDET_BOUND) && !an->children[0]->unbound)) {
+				return 0;
+			}
 			break;
 		case AN_OR:
 			if(an->nchild > 1
@@ -2336,6 +2342,394 @@ static void update_select_statements(struct program *prg, struct astnode *an, st
 	}
 }
 
+static int count_select_statements(struct astnode *an) {
+	int i, n = 0;
+
+	while(an) {
+		if(an->kind == AN_SELECT) n++;
+		for(i = 0; i < an->nchild; i++) {
+			n += count_select_statements(an->children[i]);
+		}
+		an = an->next_in_body;
+	}
+
+	return n;
+}
+
+// Drop the clauses of predicates that can't be reached from any entry point,
+// before select statements, dictionary words, wordmaps and code are generated
+// for them. In the debugger, every predicate is an entry point.
+
+static int eliminate_dead_predicates(struct program *prg) {
+	int i, j, npred = 0, nclause = 0, nselect = 0;
+	struct predname *predname;
+	struct predicate *pred;
+
+	for(i = 0; i < prg->npredicate; i++) {
+		predname = prg->predicates[i];
+		pred = predname->pred;
+		if(!predname->special
+		&& !predname->builtin
+		&& pred->nclause
+		&& !(pred->flags & (PREDF_INVOKED | PREDF_DYNAMIC | PREDF_MACRO))) {
+			for(j = 0; j < pred->nclause; j++) {
+				nselect += count_select_statements(pred->clauses[j]->body);
+			}
+			npred++;
+			nclause += pred->nclause;
+			pred->nclause = 0;
+		}
+	}
+
+	if(npred) {
+		report(
+			LVL_INFO,
+			0,
+			"Removed %d unreachable predicates (%d clauses, %d select statements).",
+			npred,
+			nclause,
+			nselect);
+	}
+
+	return npred;
+}
+
+// Partial evaluation of queries whose outcome is known at compile time.
+// Fixed flags are pure, and succeed at most once, so their value for a
+// known object can be computed from the clauses. The same goes for type
+// checks and comparisons on constants. Each function returns 1 (succeeds),
+// 0 (fails) or -1 (unknown).
+
+#define FOLD_DEPTH 8
+
+static int fixed_flag_value(struct program *prg, struct predname *predname, int onum, int depth);
+
+static int known_object(struct astnode *an, struct word *objvar, int onum) {
+	if(an->kind == AN_TAG) {
+		return an->word->obj_id;
+	} else if(an->kind == AN_VARIABLE && objvar && an->word == objvar) {
+		return onum;
+	} else {
+		return -1;
+	}
+}
+
+static int known_query_value(struct program *prg, struct astnode *an, struct word *objvar, int onum, int depth) {
+	struct predname *predname = an->predicate;
+	struct astnode *sub;
+	int o, count;
+
+	if(predname->pred->flags & PREDF_FAIL) {
+		return 0;
+	}
+
+	if(predname->pred->flags & PREDF_FIXED_FLAG) {
+		o = known_object(an->children[0], objvar, onum);
+		return (o < 0)? -1 : fixed_flag_value(prg, predname, o, depth - 1);
+	}
+
+	switch(predname->builtin) {
+	case BI_IS_ONE_OF:
+		if((o = known_object(an->children[0], objvar, onum)) < 0) return -1;
+		count = 0;
+		for(sub = an->children[1]; sub->kind == AN_PAIR; sub = sub->children[1]) {
+			if(sub->children[0]->kind != AN_TAG) return -1;
+			if(sub->children[0]->word->obj_id == o) count++;
+		}
+		if(sub->kind != AN_EMPTY_LIST) return -1;
+		// A repeated element would make the query succeed more than once.
+		return (count <= 1)? count : -1;
+	case BI_OBJECT:
+		if(known_object(an->children[0], objvar, onum) >= 0) return 1;
+		sub = an->children[0];
+		return (sub->kind == AN_INTEGER || sub->kind == AN_PAIR || sub->kind == AN_EMPTY_LIST)? 0 : -1;
+	case BI_NUMBER:
+		sub = an->children[0];
+		if(sub->kind == AN_INTEGER) return 1;
+		return (known_object(sub, objvar, onum) >= 0 || sub->kind == AN_PAIR || sub->kind == AN_EMPTY_LIST)? 0 : -1;
+	case BI_LIST:
+		sub = an->children[0];
+		if(sub->kind == AN_PAIR || sub->kind == AN_EMPTY_LIST) return 1;
+		return (known_object(sub, objvar, onum) >= 0 || sub->kind == AN_INTEGER)? 0 : -1;
+	case BI_EMPTY:
+		sub = an->children[0];
+		if(sub->kind == AN_EMPTY_LIST) return 1;
+		return (known_object(sub, objvar, onum) >= 0 || sub->kind == AN_INTEGER || sub->kind == AN_PAIR)? 0 : -1;
+	case BI_NONEMPTY:
+		sub = an->children[0];
+		if(sub->kind == AN_PAIR) return 1;
+		return (known_object(sub, objvar, onum) >= 0 || sub->kind == AN_INTEGER || sub->kind == AN_EMPTY_LIST)? 0 : -1;
+	case BI_LESSTHAN:
+	case BI_GREATERTHAN:
+		if(an->children[0]->kind != AN_INTEGER
+		|| an->children[1]->kind != AN_INTEGER) {
+			return -1;
+		}
+		if(predname->builtin == BI_LESSTHAN) {
+			return an->children[0]->value < an->children[1]->value;
+		} else {
+			return an->children[0]->value > an->children[1]->value;
+		}
+	case BI_UNIFY:
+		if((o = known_object(an->children[0], objvar, onum)) >= 0) {
+			if((count = known_object(an->children[1], objvar, onum)) >= 0) {
+				return o == count;
+			}
+			sub = an->children[1];
+		} else if(an->children[0]->kind == AN_INTEGER) {
+			if(an->children[1]->kind == AN_INTEGER) {
+				return an->children[0]->value == an->children[1]->value;
+			}
+			sub = an->children[1];
+			if(known_object(sub, objvar, onum) >= 0) return 0;
+		} else {
+			return -1;
+		}
+		return (sub->kind == AN_INTEGER || sub->kind == AN_PAIR || sub->kind == AN_EMPTY_LIST)? 0 : -1;
+	}
+
+	return -1;
+}
+
+static int known_body_value(struct program *prg, struct astnode *an, struct word *objvar, int onum, int depth) {
+	int result = 1, res;
+
+	if(depth <= 0) {
+		return -1;
+	}
+
+	while(an) {
+		if(an->kind == AN_RULE) {
+			res = known_query_value(prg, an, objvar, onum, depth);
+		} else if(an->kind == AN_NEG_RULE) {
+			res = known_query_value(prg, an, objvar, onum, depth);
+			if(res >= 0) res = !res;
+		} else if(an->kind == AN_BLOCK) {
+			res = known_body_value(prg, an->children[0], objvar, onum, depth - 1);
+		} else if(an->kind == AN_NEG_BLOCK) {
+			res = known_body_value(prg, an->children[0], objvar, onum, depth - 1);
+			if(res >= 0) res = !res;
+		} else {
+			return -1;
+		}
+		if(!res) return 0;
+		if(res < 0) result = -1;
+		an = an->next_in_body;
+	}
+
+	return result;
+}
+
+static int fixed_flag_value(struct program *prg, struct predname *predname, int onum, int depth) {
+	struct clause *cl;
+	int i, res;
+
+	if(depth <= 0) {
+		return -1;
+	}
+
+	for(i = 0; i < predname->pred->nclause; i++) {
+		cl = predname->pred->clauses[i];
+		if(cl->params[0]->kind == AN_TAG) {
+			if(cl->params[0]->word->obj_id != onum) continue;
+			res = known_body_value(prg, cl->body, 0, -1, depth);
+		} else {
+			res = known_body_value(prg, cl->body, cl->params[0]->word, onum, depth);
+		}
+		if(res) return res;
+	}
+
+	return 0;
+}
+
+static int fold_known_queries(struct program *prg, struct astnode **anptr, struct clause *cl) {
+	struct astnode *an;
+	int i, res, nfold = 0;
+
+	while((an = *anptr)) {
+		res = -1;
+		switch(an->kind) {
+		case AN_RULE:
+		case AN_NEG_RULE:
+			if(!(an->predicate->pred->flags & PREDF_FAIL)) {
+				res = known_query_value(prg, an, 0, -1, FOLD_DEPTH);
+				if(res >= 0 && an->kind == AN_NEG_RULE) res = !res;
+			}
+			break;
+		case AN_BLOCK:
+		case AN_NEG_BLOCK:
+		case AN_FIRSTRESULT:
+		case AN_EXHAUST:
+		case AN_STOPPABLE:
+		case AN_COLLECT:
+		case AN_ACCUMULATE:
+			nfold += fold_known_queries(prg, &an->children[0], cl);
+			break;
+		case AN_OR:
+		case AN_IF:
+		case AN_SELECT:
+			for(i = 0; i < an->nchild; i++) {
+				nfold += fold_known_queries(prg, &an->children[i], cl);
+			}
+			break;
+		}
+		if(res == 1) {
+			*anptr = an->next_in_body;
+			nfold++;
+		} else if(res == 0) {
+			// The rest of the body is dead code.
+			*anptr = mkast(AN_RULE, 0, cl->arena, an->line);
+			(*anptr)->predicate = find_builtin(prg, BI_FAIL);
+			(*anptr)->subkind = RULE_SIMPLE;
+			nfold++;
+			break;
+		} else {
+			anptr = &an->next_in_body;
+		}
+	}
+
+	return nfold;
+}
+
+static int fold_constant_queries(struct program *prg) {
+	int i, j, nfold = 0, nclause = 0;
+	struct predname *predname;
+	struct predicate *pred;
+
+	for(i = 0; i < prg->npredicate; i++) {
+		predname = prg->predicates[i];
+		pred = predname->pred;
+		if(!predname->special
+		&& !(predname->builtin && !(predname->nameflags & PREDNF_DEFINABLE_BI))
+		&& !(pred->flags & (PREDF_MACRO | PREDF_FIXED_FLAG))) {
+			for(j = 0; j < pred->nclause; j++) {
+				nfold += fold_known_queries(prg, &pred->clauses[j]->body, pred->clauses[j]);
+				if(!pred->dynamic
+				&& pred->clauses[j]->body
+				&& pred->clauses[j]->body->kind == AN_RULE
+				&& (pred->clauses[j]->body->predicate->pred->flags & PREDF_FAIL)) {
+					memmove(pred->clauses + j, pred->clauses + j + 1, (pred->nclause - j - 1) * sizeof(struct clause *));
+					pred->nclause--;
+					nclause++;
+					j--;
+					if(!pred->nclause) {
+						pred->flags |= PREDF_FAIL;
+					}
+				}
+			}
+		}
+	}
+
+	if(nfold) {
+		report(
+			LVL_INFO,
+			0,
+			"Folded %d queries with a known outcome (%d clauses removed).",
+			nfold,
+			nclause);
+	}
+
+	return nfold;
+}
+
+// Determinism inference. A predicate with at most one clause, whose body
+// succeeds at most once, can be queried with a multi-query without leaving
+// a choice point behind. So can a predicate whose clauses have distinct
+// constants as their first parameter, provided that the first argument is
+// bound: The first-argument index then selects a single clause, without
+// pushing a choice point. Recursive predicates are handled by starting from
+// the optimistic assumption and retracting it until nothing changes.
+
+static value_t first_param_key(struct program *prg, struct astnode *an) {
+	// These are the keys of comp_direct_index_entry.
+	switch(an->kind) {
+	case AN_DICTWORD:
+		if(prg->dictmap) {
+			return (value_t) {VAL_RAW, prg->dictmap[an->word->dict_id]};
+		} else {
+			return (value_t) {VAL_DICT, an->word->dict_id};
+		}
+	case AN_TAG:
+		return (value_t) {VAL_OBJ, an->word->obj_id};
+	case AN_INTEGER:
+		return (value_t) {VAL_NUM, an->value};
+	case AN_EMPTY_LIST:
+		return (value_t) {VAL_NIL, 0};
+	default:
+		return (value_t) {VAL_NONE};
+	}
+}
+
+static int cmp_key(const void *a, const void *b) {
+	const value_t *va = a, *vb = b;
+
+	if(VALUE_WORD(*va) < VALUE_WORD(*vb)) return -1;
+	if(VALUE_WORD(*va) > VALUE_WORD(*vb)) return 1;
+	return 0;
+}
+
+static int has_disjoint_first_params(struct program *prg, struct predicate *pred) {
+	value_t keys[pred->nclause];
+	int i;
+
+	for(i = 0; i < pred->nclause; i++) {
+		keys[i] = first_param_key(prg, pred->clauses[i]->params[0]);
+		if(keys[i].tag == VAL_NONE) return 0;
+	}
+
+	qsort(keys, pred->nclause, sizeof(value_t), cmp_key);
+	for(i = 1; i < pred->nclause; i++) {
+		if(VALUE_EQ(keys[i - 1], keys[i])) return 0;
+	}
+
+	return 1;
+}
+
+static void find_semidet_predicates(struct program *prg) {
+	int i, j, flag;
+	struct predname *predname;
+	struct predicate *pred;
+
+	for(i = 0; i < prg->npredicate; i++) {
+		predname = prg->predicates[i];
+		pred = predname->pred;
+		if(!predname->special
+		&& !predname->builtin
+		&& !(pred->flags & PREDF_MACRO)) {
+			if(pred->flags & PREDF_DYNAMIC) {
+				if(!predname->arity) {
+					pred->flags |= PREDF_SEMIDET;
+				}
+			} else if(pred->nclause <= 1) {
+				pred->flags |= PREDF_SEMIDET;
+			} else if(predname->arity
+			&& !(pred->flags & PREDF_FIXED_FLAG)
+			&& has_disjoint_first_params(prg, pred)) {
+				pred->flags |= PREDF_SEMIDET_BOUND;
+			}
+		}
+	}
+
+	do {
+		flag = 0;
+		for(i = 0; i < prg->npredicate; i++) {
+			predname = prg->predicates[i];
+			pred = predname->pred;
+			if((pred->flags & (PREDF_SEMIDET | PREDF_SEMIDET_BOUND))
+			&& !predname->builtin
+			&& !(pred->flags & PREDF_DYNAMIC)) {
+				for(j = 0; j < pred->nclause; j++) {
+					if(!body_succeeds_at_most_once(pred->clauses[j]->body)) {
+						pred->flags &= ~(PREDF_SEMIDET | PREDF_SEMIDET_BOUND);
+						flag = 1;
+						break;
+					}
+				}
+			}
+		}
+	} while(flag);
+}
+
 static void assign_select_statements(struct program *prg) {
 	int i, j, next;
 	struct predname *predname;
@@ -2421,6 +2815,65 @@ char *decode_metadata_str(int builtin, struct word *param, struct program *prg,
 	return 0;
 }
 
+// Read a whole source file into *bufptr, growing it as needed.
+// Returns the size, or -1 on error.
+static long load_source(char *fname, uint8_t **bufptr, size_t *nallocptr) {
+	FILE *f;
+	size_t size = 0, n;
+
+	f = fopen(fname, "r");
+	if(!f) {
+		report(LVL_ERR, 0, "Failed to open \"%s\": %s", fname, strerror(errno));
+		return -1;
+	}
+	for(;;) {
+		if(size == *nallocptr) {
+			*nallocptr = *nallocptr? *nallocptr * 2 : 65536;
+			*bufptr = realloc(*bufptr, *nallocptr);
+		}
+		n = fread(*bufptr + size, 1, *nallocptr - size, f);
+		size += n;
+		if(!n) break;
+	}
+	if(ferror(f)) {
+		report(LVL_ERR, 0, "Failed to read \"%s\": %s", fname, strerror(errno));
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return (long) size;
+}
+
+static int count_clauses(struct program *prg) {
+	int i, n = 0;
+
+	for(i = 0; i < prg->npredicate; i++) {
+		n += prg->predicates[i]->pred->nclause;
+	}
+
+	return n;
+}
+
+static int count_flagged(struct program *prg, uint32_t flags) {
+	int i, n = 0;
+
+	for(i = 0; i < prg->npredicate; i++) {
+		if(prg->predicates[i]->pred->flags & flags) n++;
+	}
+
+	return n;
+}
+
+static int count_compiled(struct program *prg) {
+	int i, n = 0;
+
+	for(i = 0; i < prg->npredicate; i++) {
+		if(prg->predicates[i]->pred->nroutine) n++;
+	}
+
+	return n;
+}
+
 int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t dictmap_callback) {
 	struct clause **clause_dest, *first_clause, *cl;
 	struct predname *predname;
@@ -2432,6 +2885,11 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 	struct lexer lexer = {0};
 	struct eval_state es;
 	int success;
+	uint8_t *srcbuf = 0;
+	size_t nalloc_srcbuf = 0;
+	long size;
+	uint64_t key = 0;
+	int loaded;
 
 	for(i = 0; i < prg->npredicate; i++) {
 		predname = prg->predicates[i];
@@ -2449,6 +2907,9 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 
 	frontend_reset_program(prg);
 
+	stats_reset();
+	stats_begin("parse");
+
 	arena_init(&lexer.temp_arena, 16384);
 	lexer.program = prg;
 
@@ -2458,22 +2919,47 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 	lexer.lib_file = -1;
 	clause_dest = &first_clause;
 	for(fnum = 0; fnum < nfile; fnum++) {
-		lexer.file = fopen(fname[fnum], "r");
-		if(!lexer.file) {
-			report(LVL_ERR, 0, "Failed to open \"%s\": %s", fname[fnum], strerror(errno));
+		if((size = load_source(fname[fnum], &srcbuf, &nalloc_srcbuf)) < 0) {
+			free(srcbuf);
 			arena_free(&lexer.temp_arena);
 			frontend_reset_program(prg);
 			return 0;
 		}
-		success = parse_file(&lexer, fnum, &clause_dest);
-		fclose(lexer.file);
+		loaded = 0;
+		if(prg->cachedir) {
+			key = libimage_key(srcbuf, size);
+			loaded = libimage_load(&lexer, prg->cachedir, key, fnum, &clause_dest);
+		}
+		if(loaded) {
+			success = (loaded > 0);
+		} else {
+			if(prg->cachedir) {
+				lexer.image = libimage_new(prg, fnum);
+			}
+			lexer.filepos = srcbuf;
+			lexer.fileend = srcbuf + size;
+			success = parse_file(&lexer, fnum, &clause_dest);
+			lexer.filepos = lexer.fileend = 0;
+			if(lexer.image) {
+				if(success) {
+					libimage_save(lexer.image, prg->cachedir, key);
+				}
+				libimage_free(lexer.image);
+				lexer.image = 0;
+			}
+		}
 		if(!success) {
+			free(srcbuf);
 			arena_free(&lexer.temp_arena);
 			frontend_reset_program(prg);
 			return 0;
 		}
 	}
 	*clause_dest = 0;
+	free(srcbuf);
+
+	for(i = 0, cl = first_clause; cl; cl = cl->next_in_source) i++;
+	stats_end(i);
 
 	report(LVL_INFO, 0, "Total word count: %d", lexer.totalwords);
 
@@ -2497,17 +2983,15 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 	}
 
 	if(verbose >= 4) {
-		struct word *w;
-
-		for(i = 0; i < WORDBUCKETS; i++) {
-			for(w = prg->wordhash[i]; w; w = w->next_in_hash) {
-				if(w->flags & (WORDF_OUTPUT | WORDF_DICT)) {
-					printf("Output: %s\n", w->name);
-				}
+		for(i = 0; i < prg->nword; i++) {
+			if(prg->allwords[i]->flags & (WORDF_OUTPUT | WORDF_DICT)) {
+				printf("Output: %s\n", prg->allwords[i]->name);
 			}
 		}
 	}
 
+	stats_begin("expand");
+
 	if(!frontend_visit_clauses(prg, &lexer.temp_arena, &first_clause)) {
 		arena_free(&lexer.temp_arena);
 		frontend_reset_program(prg);
@@ -2677,6 +3161,9 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 	}
 #endif
 
+	stats_end(prg->npredicate);
+	stats_begin("analyse");
+
 	for(i = 0; i < prg->npredicate; i++) {
 		predname = prg->predicates[i];
 		pred = predname->pred;
@@ -2772,15 +3259,40 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 		}
 	} while(flag);
 
-	assign_select_statements(prg);
+	stats_end(count_clauses(prg));
+
+	stats_begin("trace_invocations");
 	trace_invocations(prg);
+	stats_end(count_flagged(prg, PREDF_INVOKED));
+
+	stats_begin("eliminate_dead_predicates");
+	stats_end(eliminate_dead_predicates(prg));
+
+	stats_begin("assign_select_statements");
+	assign_select_statements(prg);
+	stats_end(prg->nselect);
+
+	stats_begin("find_fixed_flags");
 	find_fixed_flags(prg);
+	stats_end(count_flagged(prg, PREDF_FIXED_FLAG));
 
+	stats_begin("build_dictionary");
 	build_dictionary(prg);
 	if(dictmap_callback) {
 		dictmap_callback(prg);
 	}
+	stats_end(prg->ndictword);
+
+	stats_begin("build_reverse_wordmaps");
 	build_reverse_wordmaps(prg);
+	stats_end(prg->nwordmappred);
+
+	if(prg->optflags & OPTF_FOLD_QUERIES) {
+		stats_begin("fold_constant_queries");
+		stats_end(fold_constant_queries(prg));
+	}
+
+	stats_begin("flow_analysis");
 
 	do {
 		flag = 0;
@@ -2841,6 +3353,12 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 		}
 	} while(flag);
 
+	stats_end(count_flagged(prg, PREDF_SUCCEEDS | PREDF_MIGHT_STOP));
+
+	stats_begin("find_semidet_predicates");
+	find_semidet_predicates(prg);
+	stats_end(count_flagged(prg, PREDF_SEMIDET | PREDF_SEMIDET_BOUND));
+
 	if(verbose >= 3) {
 		for(i = 0; i < prg->npredicate; i++) {
 			if(!prg->predicates[i]->special
@@ -2890,9 +3408,13 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 	}
 
 	prg->errorflag = 0;
+	stats_begin("comp_builtins");
 	comp_builtins(prg);
+	stats_end(i = count_compiled(prg));
+	stats_begin("comp_program");
 	comp_program(prg);
 	comp_cleanup();
+	stats_end(count_compiled(prg) - i);
 
 	for(i = 0; i < prg->nboxclass; i++) {
 		struct boxclass *bc = &prg->boxclasses[i];
@@ -3055,6 +3577,7 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 	}
 
 	success = 1;
+	stats_begin("fixed_values");
 	init_evalstate(&es, prg);
 	//es.trace = 1;
 	for(i = 0; i < prg->npredicate; i++) {
@@ -3069,6 +3592,7 @@ int frontend(struct program *prg, int nfile, char **fname, dictmap_callback_t di
 		}
 	}
 	free_evalstate(&es);
+	stats_end(count_flagged(prg, PREDF_FIXED_FLAG));
 
 	prg->totallines = lexer.totallines;
 
@@ -0,0 +1,691 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "arena.h"
+#include "ast.h"
+#include "parse.h"
+#include "report.h"
+#include "accesspred.h"
+#include "libimage.h"
+
+// An image is a header followed by a stream of events, in the order the
+// parser produced them. Loading an image replays the events against the
+// program, which leaves it in the same state as parsing the file would.
+// Words and predicate names are referred to by their index in the image,
+// assigned when they are first mentioned. All integers are little-endian,
+// and nothing in the stream depends on where it is loaded.
+
+#define LIBIMAGE_FORMAT		1
+#define LIBIMAGE_MAGIC		"DGLI"
+#define LIBIMAGE_HEADERSIZE	24
+
+enum {
+	EV_WORD = 1,	// length:16, name
+	EV_FRESH,	//
+	EV_PRED,	// nword:16, word:32 * nword (0 for a parameter)
+	EV_TAG,		// word:32
+	EV_OUTPUT,	// word:32
+	EV_TOPIC,	// word:32
+	EV_MENTION,	// pred:32, line:32
+	EV_CLOSURE,	// id:32, line:32, orig_line:32, body
+	EV_CLAUSE,	// flags:8, pred:32, line:32, params, body
+	EV_END		// wordcount:32, line:32
+};
+
+enum {
+	NODE_END,
+	NODE_PLAIN,	// kind:8, subkind:8, nchild:16, line:32, word:32, value:32, pred:32, children
+	NODE_CLOSURE	// id:32, line:32, orig_line:32
+};
+
+#define CLAUSEF_MACRO		1
+#define CLAUSEF_NEGATED		2
+
+#define SYMF_TAG		1
+#define SYMF_OUTPUT		2
+#define SYMF_MENTION		4
+
+struct libimage_sym {
+	uint32_t		index;	// 1-based position in the image, 0 if not yet mentioned
+	uint32_t		flags;
+};
+
+struct libimage {
+	struct program		*program;
+	int			filenum;
+	int			failed;
+	int			have_topic;
+	uint8_t			*data;
+	size_t			size;
+	size_t			nalloc;
+	struct libimage_sym	*wordsym;	// indexed by word_id
+	int			nalloc_wordsym;
+	uint32_t		nword;
+	struct libimage_sym	*predsym;	// indexed by pred_id
+	int			nalloc_predsym;
+	uint32_t		npred;
+};
+
+static uint64_t fnv64(uint64_t h, const uint8_t *data, size_t size) {
+	size_t i;
+
+	for(i = 0; i < size; i++) {
+		h ^= data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+uint64_t libimage_key(const uint8_t *src, size_t size) {
+	char buf[128];
+
+	// Anything that affects how a file is parsed must be part of the key.
+	snprintf(buf, sizeof(buf), "%d %s %d %d %s", LIBIMAGE_FORMAT, VERSION, NBUILTIN, AN_REPORT_RULE, STOPCHARS);
+	return fnv64(fnv64(14695981039346656037ULL, (uint8_t *) buf, strlen(buf) + 1), src, size);
+}
+
+static char *image_path(char *dir, uint64_t key) {
+	char *path = malloc(strlen(dir) + 32);
+
+	sprintf(path, "%s/%08x%08x.dgi", dir, (uint32_t) (key >> 32), (uint32_t) key);
+	return path;
+}
+
+// Recording
+
+struct libimage *libimage_new(struct program *prg, int filenum) {
+	struct libimage *img = calloc(1, sizeof(*img));
+
+	img->program = prg;
+	img->filenum = filenum;
+	return img;
+}
+
+void libimage_free(struct libimage *img) {
+	free(img->data);
+	free(img->wordsym);
+	free(img->predsym);
+	free(img);
+}
+
+void libimage_fail(struct libimage *img) {
+	img->failed = 1;
+}
+
+static void put8(struct libimage *img, uint8_t v) {
+	if(img->size >= img->nalloc) {
+		img->nalloc = img->nalloc * 2 + 4096;
+		img->data = realloc(img->data, img->nalloc);
+	}
+	img->data[img->size++] = v;
+}
+
+static void put16(struct libimage *img, uint16_t v) {
+	put8(img, v & 0xff);
+	put8(img, v >> 8);
+}
+
+static void put32(struct libimage *img, uint32_t v) {
+	put16(img, v & 0xffff);
+	put16(img, v >> 16);
+}
+
+static void put_line(struct libimage *img, line_t line) {
+	if(line && FILENUMPART(line) != img->filenum) {
+		img->failed = 1;
+	}
+	put32(img, LINEPART(line));
+}
+
+static struct libimage_sym *wordsym(struct libimage *img, struct word *w) {
+	int n;
+
+	if(w->word_id >= img->nalloc_wordsym) {
+		n = img->program->nword * 2 + 256;
+		img->wordsym = realloc(img->wordsym, n * sizeof(struct libimage_sym));
+		memset(img->wordsym + img->nalloc_wordsym, 0, (n - img->nalloc_wordsym) * sizeof(struct libimage_sym));
+		img->nalloc_wordsym = n;
+	}
+	return &img->wordsym[w->word_id];
+}
+
+static struct libimage_sym *predsym(struct libimage *img, struct predname *predname) {
+	int n;
+
+	if(predname->pred_id >= img->nalloc_predsym) {
+		n = img->program->npredicate * 2 + 64;
+		img->predsym = realloc(img->predsym, n * sizeof(struct libimage_sym));
+		memset(img->predsym + img->nalloc_predsym, 0, (n - img->nalloc_predsym) * sizeof(struct libimage_sym));
+		img->nalloc_predsym = n;
+	}
+	return &img->predsym[predname->pred_id];
+}
+
+void libimage_word(struct libimage *img, struct word *w) {
+	struct libimage_sym *sym = wordsym(img, w);
+	int i, len;
+
+	if(!sym->index) {
+		len = strlen(w->name);
+		put8(img, EV_WORD);
+		put16(img, len);
+		for(i = 0; i < len; i++) {
+			put8(img, w->name[i]);
+		}
+		sym->index = ++img->nword;
+	}
+}
+
+void libimage_fresh(struct libimage *img, struct word *w) {
+	struct libimage_sym *sym = wordsym(img, w);
+
+	assert(!sym->index);
+	put8(img, EV_FRESH);
+	sym->index = ++img->nword;
+}
+
+void libimage_pred(struct libimage *img, struct predname *predname) {
+	struct libimage_sym *sym = predsym(img, predname);
+	int i;
+
+	if(!sym->index) {
+		for(i = 0; i < predname->nword; i++) {
+			if(predname->words[i]) {
+				libimage_word(img, predname->words[i]);
+			}
+		}
+		put8(img, EV_PRED);
+		put16(img, predname->nword);
+		for(i = 0; i < predname->nword; i++) {
+			put32(img, predname->words[i]? wordsym(img, predname->words[i])->index : 0);
+		}
+		sym->index = ++img->npred;
+	}
+}
+
+static void word_event(struct libimage *img, int event, int symflag, struct word *w) {
+	struct libimage_sym *sym;
+
+	libimage_word(img, w);
+	sym = wordsym(img, w);
+	if(!(sym->flags & symflag)) {
+		sym->flags |= symflag;
+		put8(img, event);
+		put32(img, sym->index);
+	}
+}
+
+void libimage_tag(struct libimage *img, struct word *w) {
+	word_event(img, EV_TAG, SYMF_TAG, w);
+}
+
+void libimage_output(struct libimage *img, struct word *w) {
+	word_event(img, EV_OUTPUT, SYMF_OUTPUT, w);
+}
+
+void libimage_topic(struct libimage *img, struct word *w) {
+	libimage_word(img, w);
+	put8(img, EV_TOPIC);
+	put32(img, wordsym(img, w)->index);
+	img->have_topic = 1;
+}
+
+void libimage_star(struct libimage *img) {
+	// The current topic was inherited from a previous file.
+	if(!img->have_topic) {
+		img->failed = 1;
+	}
+}
+
+void libimage_mention(struct libimage *img, struct predname *predname, line_t line) {
+	struct libimage_sym *sym;
+
+	libimage_pred(img, predname);
+	sym = predsym(img, predname);
+	if(!(sym->flags & SYMF_MENTION)) {
+		sym->flags |= SYMF_MENTION;
+		put8(img, EV_MENTION);
+		put32(img, sym->index);
+		put_line(img, line);
+	}
+}
+
+// Everything a chain of nodes refers to must be mentioned before the chain is written.
+static void define_chain(struct libimage *img, struct astnode *an) {
+	int i;
+
+	for(; an; an = an->next_in_body) {
+		if(!an->closure) {
+			if(an->word) libimage_word(img, an->word);
+			if(an->predicate) libimage_pred(img, an->predicate);
+			for(i = 0; i < an->nchild; i++) {
+				define_chain(img, an->children[i]);
+			}
+		}
+	}
+}
+
+static void put_chain(struct libimage *img, struct astnode *an) {
+	int i;
+
+	for(; an; an = an->next_in_body) {
+		if(an->closure) {
+			// The captured variables are recomputed from the closure itself.
+			put8(img, NODE_CLOSURE);
+			put32(img, an->children[0]->value);
+			put_line(img, an->line);
+			put_line(img, an->children[0]->line);
+		} else {
+			put8(img, NODE_PLAIN);
+			put8(img, an->kind);
+			put8(img, an->subkind);
+			put16(img, an->nchild);
+			put_line(img, an->line);
+			put32(img, an->word? wordsym(img, an->word)->index : 0);
+			put32(img, an->value);
+			put32(img, an->predicate? predsym(img, an->predicate)->index : 0);
+			for(i = 0; i < an->nchild; i++) {
+				put_chain(img, an->children[i]);
+			}
+		}
+	}
+	put8(img, NODE_END);
+}
+
+void libimage_closure(struct libimage *img, struct astnode *body, struct astnode *an) {
+	define_chain(img, body);
+	put8(img, EV_CLOSURE);
+	put32(img, an->children[0]->value);
+	put_line(img, an->line);
+	put_line(img, an->children[0]->line);
+	put_chain(img, body);
+}
+
+void libimage_clause(struct libimage *img, struct clause *cl, int is_macro) {
+	int i;
+
+	libimage_pred(img, cl->predicate);
+	for(i = 0; i < cl->predicate->arity; i++) {
+		define_chain(img, cl->params[i]);
+	}
+	define_chain(img, cl->body);
+	put8(img, EV_CLAUSE);
+	put8(img, (is_macro? CLAUSEF_MACRO : 0) | (cl->negated? CLAUSEF_NEGATED : 0));
+	put32(img, predsym(img, cl->predicate)->index);
+	put_line(img, cl->line);
+	for(i = 0; i < cl->predicate->arity; i++) {
+		put_chain(img, cl->params[i]);
+	}
+	put_chain(img, cl->body);
+}
+
+void libimage_end(struct libimage *img, int wordcount, line_t line) {
+	put8(img, EV_END);
+	put32(img, wordcount);
+	put32(img, LINEPART(line));
+}
+
+static void put_header32(uint8_t *buf, uint32_t v) {
+	buf[0] = v & 0xff;
+	buf[1] = (v >> 8) & 0xff;
+	buf[2] = (v >> 16) & 0xff;
+	buf[3] = v >> 24;
+}
+
+void libimage_save(struct libimage *img, char *dir, uint64_t key) {
+	uint8_t header[LIBIMAGE_HEADERSIZE];
+	char *path;
+	FILE *f;
+	int ok;
+
+	if(img->failed) return;
+
+	memcpy(header, LIBIMAGE_MAGIC, 4);
+	put_header32(header + 4, LIBIMAGE_FORMAT);
+	put_header32(header + 8, key & 0xffffffff);
+	put_header32(header + 12, key >> 32);
+	put_header32(header + 16, img->size);
+	put_header32(header + 20, (uint32_t) fnv64(14695981039346656037ULL, img->data, img->size));
+
+	path = image_path(dir, key);
+	f = fopen(path, "wb");
+	if(!f) {
+		report(LVL_WARN, 0, "Failed to create library image \"%s\": %s", path, strerror(errno));
+		free(path);
+		return;
+	}
+	ok = fwrite(header, sizeof(header), 1, f) == 1
+		&& fwrite(img->data, img->size, 1, f) == 1;
+	if(fclose(f) || !ok) {
+		report(LVL_WARN, 0, "Failed to write library image \"%s\"", path);
+		remove(path);
+	} else {
+		report(LVL_INFO, 0, "Saved library image \"%s\" for \"%s\"", path, sourcefile[img->filenum]);
+	}
+	free(path);
+}
+
+// Loading
+
+struct loader {
+	struct program		*program;
+	int			filenum;
+	const uint8_t		*pos;
+	const uint8_t		*end;
+	int			bad;
+	struct word		**words;
+	uint32_t		nword;
+	uint32_t		nalloc_word;
+	struct predname		**preds;
+	uint32_t		npred;
+	uint32_t		nalloc_pred;
+	uint32_t		*closureids;	// pairs of (id when recorded, id now)
+	uint32_t		nclosure;
+};
+
+static uint32_t get8(struct loader *ld) {
+	if(ld->pos >= ld->end) {
+		ld->bad = 1;
+		return 0;
+	}
+	return *ld->pos++;
+}
+
+static uint32_t get16(struct loader *ld) {
+	uint32_t v = get8(ld);
+
+	return v | (get8(ld) << 8);
+}
+
+static uint32_t get32(struct loader *ld) {
+	uint32_t v = get16(ld);
+
+	return v | (get16(ld) << 16);
+}
+
+static line_t get_line(struct loader *ld) {
+	uint32_t v = get32(ld);
+
+	return v? MKLINE(ld->filenum, v) : 0;
+}
+
+static struct word *get_word(struct loader *ld) {
+	uint32_t i = get32(ld);
+
+	if(i > ld->nword) {
+		ld->bad = 1;
+		return 0;
+	}
+	return i? ld->words[i - 1] : 0;
+}
+
+static struct predname *get_pred(struct loader *ld) {
+	uint32_t i = get32(ld);
+
+	if(i > ld->npred) {
+		ld->bad = 1;
+		return 0;
+	}
+	return i? ld->preds[i - 1] : 0;
+}
+
+static void add_word(struct loader *ld, struct word *w) {
+	if(ld->nword >= ld->nalloc_word) {
+		ld->nalloc_word = ld->nword * 2 + 256;
+		ld->words = realloc(ld->words, ld->nalloc_word * sizeof(struct word *));
+	}
+	ld->words[ld->nword++] = w;
+}
+
+static void add_pred(struct loader *ld, struct predname *predname) {
+	if(ld->npred >= ld->nalloc_pred) {
+		ld->nalloc_pred = ld->npred * 2 + 64;
+		ld->preds = realloc(ld->preds, ld->nalloc_pred * sizeof(struct predname *));
+	}
+	ld->preds[ld->npred++] = predname;
+}
+
+static struct astnode *get_closure(struct loader *ld, struct arena *arena) {
+	uint32_t id, i;
+	line_t line, orig_line;
+
+	id = get32(ld);
+	line = get_line(ld);
+	orig_line = get_line(ld);
+	for(i = 0; i < ld->nclosure; i++) {
+		if(ld->closureids[2 * i] == id) {
+			// The closure already exists, so this only computes its value.
+			return make_closure(
+				ld->program,
+				ld->program->closurebodies[ld->closureids[2 * i + 1]],
+				line,
+				orig_line,
+				arena);
+		}
+	}
+	ld->bad = 1;
+	return 0;
+}
+
+static struct astnode *get_chain(struct loader *ld, struct arena *arena) {
+	struct astnode *first = 0, **dest = &first, *an;
+	int kind, subkind, nchild, i;
+	line_t line;
+
+	for(;;) {
+		switch(get8(ld)) {
+		case NODE_PLAIN:
+			kind = get8(ld);
+			subkind = get8(ld);
+			nchild = get16(ld);
+			line = get_line(ld);
+			an = mkast(kind, nchild, arena, line);
+			an->subkind = subkind;
+			an->word = get_word(ld);
+			an->value = (int32_t) get32(ld);
+			an->predicate = get_pred(ld);
+			for(i = 0; i < nchild; i++) {
+				an->children[i] = get_chain(ld, arena);
+			}
+			break;
+		case NODE_CLOSURE:
+			an = get_closure(ld, arena);
+			break;
+		default:
+			ld->bad = 1;
+			// fallthrough
+		case NODE_END:
+			an = 0;
+			break;
+		}
+		if(!an || ld->bad) break;
+		*dest = an;
+		dest = &an->next_in_body;
+	}
+
+	return first;
+}
+
+static int replay(struct loader *ld, struct lexer *lexer, struct clause ***clause_dest_ptr) {
+	struct program *prg = ld->program;
+	struct word *w, *words[64];
+	struct predname *predname;
+	struct predicate *pred;
+	struct clause *cl;
+	struct astnode *body, *an;
+	char name[1024];
+	uint32_t i, n, id, flags;
+	line_t line, orig_line;
+
+	while(!ld->bad) {
+		switch(get8(ld)) {
+		case EV_WORD:
+			n = get16(ld);
+			if(n >= sizeof(name)) return 0;
+			for(i = 0; i < n; i++) {
+				name[i] = get8(ld);
+			}
+			name[n] = 0;
+			add_word(ld, find_word(prg, name));
+			break;
+		case EV_FRESH:
+			add_word(ld, fresh_word(prg));
+			break;
+		case EV_PRED:
+			n = get16(ld);
+			if(n > sizeof(words) / sizeof(*words)) return 0;
+			for(i = 0; i < n; i++) {
+				words[i] = get_word(ld);
+			}
+			if(ld->bad) return 0;
+			add_pred(ld, find_predicate(prg, n, words));
+			break;
+		case EV_TAG:
+			if((w = get_word(ld))) {
+				create_worldobj(prg, w);
+			}
+			break;
+		case EV_OUTPUT:
+			if((w = get_word(ld))) {
+				w->flags |= WORDF_OUTPUT;
+			}
+			break;
+		case EV_TOPIC:
+			if((w = get_word(ld))) {
+				w->flags |= WORDF_TOPIC;
+				parse_set_topic(w);
+			}
+			break;
+		case EV_MENTION:
+			predname = get_pred(ld);
+			line = get_line(ld);
+			if(predname) {
+				predname->pred->flags |= PREDF_MENTIONED_IN_QUERY;
+				if(!predname->pred->invoked_at_line) {
+					predname->pred->invoked_at_line = line;
+				}
+			}
+			break;
+		case EV_CLOSURE:
+			id = get32(ld);
+			line = get_line(ld);
+			orig_line = get_line(ld);
+			body = get_chain(ld, &lexer->temp_arena);
+			if(ld->bad) return 0;
+			an = make_closure(prg, body, line, orig_line, &lexer->temp_arena);
+			ld->closureids = realloc(ld->closureids, (ld->nclosure + 1) * 2 * sizeof(uint32_t));
+			ld->closureids[2 * ld->nclosure] = id;
+			ld->closureids[2 * ld->nclosure + 1] = an->children[0]->value;
+			ld->nclosure++;
+			break;
+		case EV_CLAUSE:
+			flags = get8(ld);
+			predname = get_pred(ld);
+			line = get_line(ld);
+			if(!predname) return 0;
+			cl = mkclause(predname->pred);
+			cl->line = line;
+			for(i = 0; i < predname->arity; i++) {
+				cl->params[i] = get_chain(ld, cl->arena);
+			}
+			cl->body = get_chain(ld, cl->arena);
+			if(ld->bad) return 0;
+			if(flags & CLAUSEF_MACRO) {
+				if(!accesspred_valid_def(cl, prg)) return 0;
+				pred = predname->pred;
+				pred->nmacrodef++;
+				pred->macrodefs = realloc(pred->macrodefs, pred->nmacrodef * sizeof(struct clause *));
+				pred->macrodefs[pred->nmacrodef - 1] = cl;
+				pred->flags |= PREDF_MACRO;
+			} else {
+				cl->negated = !!(flags & CLAUSEF_NEGATED);
+				if(predname->builtin == BI_LIB_VERSION) {
+					lexer->lib_file = ld->filenum;
+				}
+				**clause_dest_ptr = cl;
+				*clause_dest_ptr = &cl->next_in_source;
+			}
+			break;
+		case EV_END:
+			lexer->wordcount = get32(ld);
+			line = get32(ld);
+			if(ld->bad) return 0;
+			report(LVL_INFO, 0, "Word count for \"%s\": %d", sourcefile[ld->filenum], lexer->wordcount);
+			if(lexer->lib_file != ld->filenum) {
+				lexer->totallines += line;
+			}
+			lexer->totalwords += lexer->wordcount;
+			return 1;
+		default:
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+static uint32_t get_header32(const uint8_t *buf) {
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+// Returns 1 if the image was loaded, 0 if there is no usable image (and
+// nothing has been changed), or -1 on error.
+int libimage_load(struct lexer *lexer, char *dir, uint64_t key, int filenum, struct clause ***clause_dest_ptr) {
+	struct loader ld = {0};
+	uint8_t header[LIBIMAGE_HEADERSIZE], *data;
+	char *path;
+	FILE *f;
+	uint32_t size;
+	int success;
+
+	path = image_path(dir, key);
+	f = fopen(path, "rb");
+	if(!f) {
+		free(path);
+		return 0;
+	}
+	if(fread(header, sizeof(header), 1, f) != 1
+	|| memcmp(header, LIBIMAGE_MAGIC, 4)
+	|| get_header32(header + 4) != LIBIMAGE_FORMAT
+	|| get_header32(header + 8) != (key & 0xffffffff)
+	|| get_header32(header + 12) != (key >> 32)) {
+		fclose(f);
+		free(path);
+		return 0;
+	}
+	size = get_header32(header + 16);
+	data = malloc(size? size : 1);
+	if((size && fread(data, size, 1, f) != 1)
+	|| get_header32(header + 20) != (uint32_t) fnv64(14695981039346656037ULL, data, size)) {
+		// Probably still being written by another process.
+		fclose(f);
+		free(data);
+		free(path);
+		return 0;
+	}
+	fclose(f);
+
+	ld.program = lexer->program;
+	ld.filenum = filenum;
+	ld.pos = data;
+	ld.end = data + size;
+	lexer->wordcount = 0;
+	success = replay(&ld, lexer, clause_dest_ptr);
+	if(success) {
+		report(LVL_INFO, 0, "Loaded library image \"%s\" for \"%s\"", path, sourcefile[filenum]);
+	} else {
+		report(LVL_ERR, 0, "Library image \"%s\" is corrupt. Please delete it.", path);
+	}
+
+	free(ld.words);
+	free(ld.preds);
+	free(ld.closureids);
+	free(data);
+	free(path);
+	return success? 1 : -1;
+}
@@ -0,0 +1,26 @@
+// A library image holds the parsed form of a source file, so that unchanged
+// files (typically the standard library) need not be lexed and parsed again.
+// Images are stored in a cache directory, named after a hash of the source.
+
+struct libimage;
+
+uint64_t libimage_key(const uint8_t *src, size_t size);
+
+struct libimage *libimage_new(struct program *prg, int filenum);
+void libimage_free(struct libimage *img);
+void libimage_save(struct libimage *img, char *dir, uint64_t key);
+int libimage_load(struct lexer *lexer, char *dir, uint64_t key, int filenum, struct clause ***clause_dest_ptr);
+
+// Called by the parser while an image is being recorded.
+void libimage_fail(struct libimage *img);
+void libimage_word(struct libimage *img, struct word *w);
+void libimage_fresh(struct libimage *img, struct word *w);
+void libimage_pred(struct libimage *img, struct predname *predname);
+void libimage_tag(struct libimage *img, struct word *w);
+void libimage_output(struct libimage *img, struct word *w);
+void libimage_topic(struct libimage *img, struct word *w);
+void libimage_star(struct libimage *img);
+void libimage_mention(struct libimage *img, struct predname *predname, line_t line);
+void libimage_closure(struct libimage *img, struct astnode *body, struct astnode *an);
+void libimage_clause(struct libimage *img, struct clause *cl, int is_macro);
+void libimage_end(struct libimage *img, int wordcount, line_t line);
@@ -12,6 +12,7 @@
 #include "report.h"
 #include "unicode.h"
 #include "accesspred.h"
+#include "libimage.h"
 
 #define MAXWORDLENGTH 256
 #define MAXRULEWORDS 32
@@ -41,6 +42,38 @@ static int valid_varname_char(uint8_t ch) {
 		|| ch == '-';
 }
 
+// Symbol lookups made while parsing a file are noted in its library image, if
+// one is being recorded, so that loading the image repeats them in order.
+
+static struct word *lex_word(struct lexer *lexer, char *name) {
+	struct word *w = find_word(lexer->program, name);
+
+	if(lexer->image) libimage_word(lexer->image, w);
+	return w;
+}
+
+static struct word *lex_fresh_word(struct lexer *lexer) {
+	struct word *w = fresh_word(lexer->program);
+
+	if(lexer->image) libimage_fresh(lexer->image, w);
+	return w;
+}
+
+static struct predname *lex_predicate(struct lexer *lexer, int nword, struct word **words) {
+	struct predname *predname = find_predicate(lexer->program, nword, words);
+
+	if(lexer->image) libimage_pred(lexer->image, predname);
+	return predname;
+}
+
+static void mention_predicate(struct lexer *lexer, struct predname *predname) {
+	predname->pred->flags |= PREDF_MENTIONED_IN_QUERY;
+	if(!predname->pred->invoked_at_line) {
+		predname->pred->invoked_at_line = line;
+	}
+	if(lexer->image) libimage_mention(lexer->image, predname, line);
+}
+
 // With such a small array, it's easier just to unroll the loop
 static void rotate_unicode_escape(struct lexer *lexer) {
 	lexer->unicode_escape[0] = lexer->unicode_escape[1];
@@ -51,7 +84,30 @@ static void rotate_unicode_escape(struct lexer *lexer) {
 
 static void lexer_ungetc(char ch, struct lexer *lexer);
 
-static int lexer_getc(struct lexer *lexer) {
+// Nothing stashed by lexer_ungetc or pending from a Unicode escape
+#define LEXER_PLAIN(lexer) \
+	(!(lexer)->unicode_escape[0] && !(lexer)->ungetbackslash && !(lexer)->ungetcbuf && !(lexer)->string)
+
+#define LEXER_NEXTBYTE(lexer) \
+	((lexer)->filepos < (lexer)->fileend? *(lexer)->filepos++ : EOF)
+
+static int lexer_getc_slow(struct lexer *lexer);
+
+static inline int lexer_getc(struct lexer *lexer) {
+	int ch;
+
+	// Fast path for ordinary characters straight from the source buffer
+	if(lexer->filepos < lexer->fileend && LEXER_PLAIN(lexer)) {
+		ch = *lexer->filepos;
+		if((ch >= 0x20 && ch != '\\' && ch != 0x7f) || ch == '\n') {
+			lexer->filepos++;
+			return ch;
+		}
+	}
+	return lexer_getc_slow(lexer);
+}
+
+static int lexer_getc_slow(struct lexer *lexer) {
 	int ch;
 	uint32_t unichar;
 	
@@ -108,19 +164,19 @@ static int lexer_getc(struct lexer *lexer) {
 			lexer->string = 0;
 		}
 	}
-	if(lexer->file) {
-		ch = fgetc(lexer->file);
+	if(lexer->filepos < lexer->fileend) {
+		ch = *lexer->filepos++;
 		// This is where we check for the new Unicode escapes
 		if(ch == '\\') {
-			ch = fgetc(lexer->file);
+			ch = LEXER_NEXTBYTE(lexer);
 			if(ch == 'x') {
 				unichar = 0;
-				if(fgetc(lexer->file) != '{') {
+				if(LEXER_NEXTBYTE(lexer) != '{') {
 					report(LVL_ERR, line, "Unicode escape syntax is \\x{...}; the braces are required");
 					exit(1);
 				}
 				for(;;) {
-					ch = fgetc(lexer->file);
+					ch = LEXER_NEXTBYTE(lexer);
 					if(ch == '}') break;
 					unichar <<= 4;
 					if(ch >= '0' && ch <= '9') {
@@ -145,7 +201,9 @@ static int lexer_getc(struct lexer *lexer) {
 				ch = lexer->unicode_escape[0]; // Serve the first byte of it as normal
 				rotate_unicode_escape(lexer);
 			} else {
-				lexer_ungetc(ch, lexer); // Unget the character after the backslash
+				if(ch != EOF) {
+					lexer_ungetc(ch, lexer); // Unget the character after the backslash
+				}
 				ch = '\\';
 			}
 		}
@@ -155,11 +213,11 @@ static int lexer_getc(struct lexer *lexer) {
 		|| ch == 12 // Form feed: requested by users to break pages in emacs
 		|| ch == 13
 		|| (ch >= 0x20 && ch < 0x7f)
-		|| ch >= 0x80
-		|| ch == EOF) {
+		|| ch >= 0x80) {
 			return ch;
 		} else {
 			report(LVL_WARN, line, "Ignoring control character 0x%02x in source code file", ch);
+			if(lexer->image) libimage_fail(lexer->image);
 		}
 	}
 	return EOF;
@@ -172,10 +230,47 @@ static void lexer_ungetc(char ch, struct lexer *lexer) {
 	}
 	if(lexer->ungetcbuf) {
 		report(LVL_WARN, line, "Lexer stashed char '%c' being replaced by '%c'", lexer->ungetcbuf, ch);
+		if(lexer->image) libimage_fail(lexer->image);
 	}
 	lexer->ungetcbuf = ch;
 }
 
+// Skip a run of whitespace directly in the source buffer
+static void skip_blanks(struct lexer *lexer) {
+	const uint8_t *pos = lexer->filepos, *end = lexer->fileend;
+
+	if(!LEXER_PLAIN(lexer)) return;
+	for(; pos < end; pos++) {
+		if(*pos == '\n') {
+			column = 0;
+			line++;
+		} else if(*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\f') {
+			column++;
+		} else {
+			break;
+		}
+	}
+	lexer->filepos = pos;
+}
+
+// Skip the body of a comment up to (but not including) the newline,
+// leaving anything that needs a closer look to lexer_getc
+static void skip_comment(struct lexer *lexer) {
+	const uint8_t *pos = lexer->filepos, *end;
+
+	if(!LEXER_PLAIN(lexer)) return;
+	if(!(end = memchr(pos, '\n', lexer->fileend - pos))) {
+		end = lexer->fileend;
+	}
+	while(pos < end
+	&& (*pos >= 0x20 || *pos == '\t' || *pos == '\r' || *pos == '\f')
+	&& *pos != '\\'
+	&& *pos != 0x7f) {
+		pos++;
+	}
+	lexer->filepos = pos;
+}
+
 // We have to watch for one particular multi-byte construction often enough that it's useful to have a macro for it
 #define NBSP_TO_SPACE() \
 	/* The only non-ASCII character we watch for here is the NBSP, because it's easily copied by accident and hard to catch when it happens */ \
@@ -208,6 +303,7 @@ static int next_token(struct lexer *lexer, int parsemode) {
 	}
 
 	for(;;) {
+		skip_blanks(lexer);
 		ch = lexer_getc(lexer);
 		column++;
 		
@@ -302,9 +398,10 @@ static int next_token(struct lexer *lexer, int parsemode) {
 							}
 						}
 					}
-					lexer->word = find_word(lexer->program, buf);
+					lexer->word = lex_word(lexer, buf);
 					if(lexer->kind == TOK_TAG) {
 						create_worldobj(lexer->program, lexer->word);
+						if(lexer->image) libimage_tag(lexer->image, lexer->word);
 					}
 					return 1 + at_start;
 				}
@@ -336,6 +433,7 @@ static int next_token(struct lexer *lexer, int parsemode) {
 			ch = lexer_getc(lexer);
 			column++;
 			if(ch == '%') {
+				skip_comment(lexer);
 				do {
 					ch = lexer_getc(lexer);
 					if(ch == EOF) return 0;
@@ -350,7 +448,7 @@ static int next_token(struct lexer *lexer, int parsemode) {
 				buf[pos++] = '%';
 				buf[pos] = 0;
 				lexer->kind = TOK_BAREWORD;
-				lexer->word = find_word(lexer->program, buf);
+				lexer->word = lex_word(lexer, buf);
 				return 1 + at_start;
 			}
 		} else {
@@ -372,7 +470,7 @@ static int next_token(struct lexer *lexer, int parsemode) {
 				buf[0] = ch;
 				buf[1] = 0;
 				lexer->kind = TOK_BAREWORD;
-				lexer->word = find_word(lexer->program, buf);
+				lexer->word = lex_word(lexer, buf);
 				ch = lexer_getc(lexer);
 				if(ch != EOF) {
 					if(!strchr("\n\r\t ()[]{}~%*|", ch)) {
@@ -489,14 +587,14 @@ static int next_token(struct lexer *lexer, int parsemode) {
 						return 0;
 					}
 					lexer->kind = TOK_BAREWORD;
-					lexer->word = find_word(lexer->program, buf);
+					lexer->word = lex_word(lexer, buf);
 				} else {
 					lexer->kind = TOK_INTEGER;
 					lexer->value = val;
 				}
 			} else {
 				lexer->kind = TOK_BAREWORD;
-				lexer->word = find_word(lexer->program, buf);
+				lexer->word = lex_word(lexer, buf);
 			}
 			return 1 + at_start;
 		}
@@ -609,7 +707,7 @@ static struct astnode *parse_rule_head(struct astnode **nested_rules, int *nnest
 		}
 	}
 	assert(j == nparam);
-	an->predicate = find_predicate(lexer->program, n, words);
+	an->predicate = lex_predicate(lexer, n, words);
 	assert(an->predicate->arity == nparam);
 
 	return an;
@@ -670,7 +768,7 @@ static struct astnode *parse_rule(struct lexer *lexer, struct arena *arena) {
 		}
 	}
 	assert(j == nparam);
-	an->predicate = find_predicate(lexer->program, n, words);
+	an->predicate = lex_predicate(lexer, n, words);
 	assert(an->predicate->arity == nparam);
 
 	return an;
@@ -829,10 +927,61 @@ static struct astnode *parse_if(struct lexer *lexer, struct arena *arena) {
 	return ifnode;
 }
 
+// Builds the value of a closure expression: a pair of the closure id and the
+// variables it captures. The closure is created the first time its body is seen.
+struct astnode *make_closure(struct program *prg, struct astnode *body, line_t line, line_t orig_line, struct arena *arena) {
+	struct astnode *an, *sub;
+	struct predname *predname;
+	struct clause *cl;
+	int i, id, have_arg, did_create;
+
+	id = find_closurebody(prg, body, &did_create);
+	an = mkast(AN_PAIR, 2, arena, line);
+	an->closure = 1;
+	an->children[0] = mkast(AN_INTEGER, 0, arena, orig_line);
+	an->children[0]->value = id;
+	an->children[1] = mkast(AN_EMPTY_LIST, 0, arena, orig_line);
+	predname = find_builtin(prg, BI_INVOKE_CLOSURE);
+	if(did_create) {
+		cl = mkclause(predname->pred);
+		cl->line = orig_line;
+		cl->params[0] = mkast(AN_INTEGER, 0, cl->arena, orig_line);
+		cl->params[0]->value = id;
+		cl->params[1] = mkast(AN_EMPTY_LIST, 0, cl->arena, orig_line); // placeholder
+		cl->params[2] = mkast(AN_VARIABLE, 0, cl->arena, orig_line);
+		cl->params[2]->word = find_word(prg, "");
+		cl->body = deepcopy_astnode(body, cl->arena, 0);
+		add_clause(cl, predname->pred);
+		analyse_clause(prg, cl, 0);
+		assert(cl == predname->pred->clauses[id]);
+	} else {
+		cl = predname->pred->clauses[id];
+	}
+	have_arg = 0;
+	for(i = 0; i < cl->nvar; i++) {
+		if(!strcmp(cl->varnames[i]->name, "_")) {
+			have_arg = 1;
+		} else {
+			sub = an->children[1];
+			an->children[1] = mkast(AN_PAIR, 2, cl->arena, orig_line);
+			an->children[1]->children[0] = mkast(AN_VARIABLE, 0, cl->arena, orig_line);
+			an->children[1]->children[0]->word = cl->varnames[i];
+			an->children[1]->children[1] = sub;
+		}
+	}
+	if(did_create) {
+		cl->params[1] = deepcopy_astnode(an->children[1], cl->arena, 0);
+		if(have_arg) {
+			cl->params[2]->word = find_word(prg, "_");
+		}
+	}
+
+	return an;
+}
+
 static struct astnode *parse_expr(int parsemode, struct lexer *lexer, struct arena *arena) {
 	struct astnode *an, *sub, *sub2, **dest, *body;
-	int i, id, have_arg, did_create;
-	struct clause *cl;
+	int i;
 	struct predname *predname;
 	line_t orig_line;
 
@@ -854,6 +1003,7 @@ static struct astnode *parse_expr(int parsemode, struct lexer *lexer, struct are
 			&& (isalnum(lexer->word->name[0]) || lexer->word->name[1])) {
 				lexer->wordcount++;
 				lexer->word->flags |= WORDF_OUTPUT;
+				if(lexer->image) libimage_output(lexer->image, lexer->word);
 			}
 		}
 		an->word = lexer->word;
@@ -880,10 +1030,7 @@ static struct astnode *parse_expr(int parsemode, struct lexer *lexer, struct are
 			return 0;
 		}
 		an->subkind = RULE_MULTI;
-		an->predicate->pred->flags |= PREDF_MENTIONED_IN_QUERY;
-		if(!an->predicate->pred->invoked_at_line) {
-			an->predicate->pred->invoked_at_line = line;
-		}
+		mention_predicate(lexer, an->predicate);
 		break;
 	case TOK_NOSPACE:
 		an = mkast(AN_RULE, 0, arena, line);
@@ -895,6 +1042,7 @@ static struct astnode *parse_expr(int parsemode, struct lexer *lexer, struct are
 			lexer->errorflag = 1;
 			return 0;
 		}
+		if(lexer->image) libimage_star(lexer->image);
 		an = mkast(AN_TAG, 0, arena, line);
 		an->word = starword;
 		break;
@@ -927,7 +1075,7 @@ static struct astnode *parse_expr(int parsemode, struct lexer *lexer, struct are
 				sub->children[0]->subkind = RULE_MULTI;
 				sub->children[0]->predicate = find_builtin(lexer->program, BI_OBJECT);
 				sub->children[0]->children[0] = mkast(AN_VARIABLE, 0, arena, line);
-				sub->children[0]->children[0]->word = fresh_word(lexer->program);
+				sub->children[0]->children[0]->word = lex_fresh_word(lexer);
 				sub->children[0]->next_in_body = an;
 				an->children[0]->children[0] = deepcopy_astnode(sub->children[0]->children[0], arena, 0);
 				an = mkast(AN_EXHAUST, 1, arena, line);
@@ -1243,7 +1391,7 @@ static struct astnode *parse_expr(int parsemode, struct lexer *lexer, struct are
 			an->children[0]->predicate = find_builtin(lexer->program, BI_RESOLVERESOURCE);
 			an->children[0]->children[0] = sub;
 			an->children[0]->children[1] = mkast(AN_VARIABLE, 0, arena, line);
-			an->children[0]->children[1]->word = fresh_word(lexer->program);
+			an->children[0]->children[1]->word = lex_fresh_word(lexer);
 			sub = mkast(AN_LINK_RES, 2, arena, line);
 			an->children[0]->next_in_body = sub;
 			sub->children[0] = mkast(AN_VARIABLE, 0, arena, line);
@@ -1282,10 +1430,7 @@ static struct astnode *parse_expr(int parsemode, struct lexer *lexer, struct are
 			an = parse_if(lexer, arena);
 			if(!an) return 0;
 		} else {
-			an->predicate->pred->flags |= PREDF_MENTIONED_IN_QUERY;
-			if(!an->predicate->pred->invoked_at_line) {
-				an->predicate->pred->invoked_at_line = line;
-			}
+			mention_predicate(lexer, an->predicate);
 		}
 		break;
 	case '{':
@@ -1341,45 +1486,8 @@ static struct astnode *parse_expr(int parsemode, struct lexer *lexer, struct are
 				dest = &sub->next_in_body;
 			}
 			body = fold_disjunctions(body, lexer, arena);
-			id = find_closurebody(lexer->program, body, &did_create);
-			an = mkast(AN_PAIR, 2, arena, line);
-			an->children[0] = mkast(AN_INTEGER, 0, arena, orig_line);
-			an->children[0]->value = id;
-			an->children[1] = mkast(AN_EMPTY_LIST, 0, arena, orig_line);
-			predname = find_builtin(lexer->program, BI_INVOKE_CLOSURE);
-			if(did_create) {
-				cl = mkclause(predname->pred);
-				cl->line = orig_line;
-				cl->params[0] = mkast(AN_INTEGER, 0, cl->arena, orig_line);
-				cl->params[0]->value = id;
-				cl->params[1] = mkast(AN_EMPTY_LIST, 0, cl->arena, orig_line); // placeholder
-				cl->params[2] = mkast(AN_VARIABLE, 0, cl->arena, orig_line);
-				cl->params[2]->word = find_word(lexer->program, "");
-				cl->body = deepcopy_astnode(body, cl->arena, 0);
-				add_clause(cl, predname->pred);
-				analyse_clause(lexer->program, cl, 0);
-				assert(cl == predname->pred->clauses[id]);
-			} else {
-				cl = predname->pred->clauses[id];
-			}
-			have_arg = 0;
-			for(i = 0; i < cl->nvar; i++) {
-				if(!strcmp(cl->varnames[i]->name, "_")) {
-					have_arg = 1;
-				} else {
-					sub = an->children[1];
-					an->children[1] = mkast(AN_PAIR, 2, cl->arena, orig_line);
-					an->children[1]->children[0] = mkast(AN_VARIABLE, 0, cl->arena, orig_line);
-					an->children[1]->children[0]->word = cl->varnames[i];
-					an->children[1]->children[1] = sub;
-				}
-			}
-			if(did_create) {
-				cl->params[1] = deepcopy_astnode(an->children[1], cl->arena, 0);
-				if(have_arg) {
-					cl->params[2]->word = find_word(lexer->program, "_");
-				}
-			}
+			an = make_closure(lexer->program, body, line, orig_line, arena);
+			if(lexer->image) libimage_closure(lexer->image, body, an);
 		}
 		break;
 	case '~':
@@ -1404,10 +1512,7 @@ static struct astnode *parse_expr(int parsemode, struct lexer *lexer, struct are
 				return 0;
 			}
 			an->kind = AN_NEG_RULE;
-			an->predicate->pred->flags |= PREDF_MENTIONED_IN_QUERY;
-			if(!an->predicate->pred->invoked_at_line) {
-				an->predicate->pred->invoked_at_line = line;
-			}
+			mention_predicate(lexer, an->predicate);
 		} else {
 			an = mkast(AN_NEG_BLOCK, 1, arena, line);
 			dest = &an->children[0];
@@ -1523,10 +1628,7 @@ static struct astnode *parse_expr_nested(
 			return 0;
 		}
 		if(negated) an->kind = AN_NEG_RULE;
-		an->predicate->pred->flags |= PREDF_MENTIONED_IN_QUERY;
-		if(!an->predicate->pred->invoked_at_line) {
-			an->predicate->pred->invoked_at_line = line;
-		}
+		mention_predicate(lexer, an->predicate);
 		if(*nnested >= MAXNESTEDEXPR) {
 			report(LVL_ERR, an->line, "Too many nested expressions in rule head.");
 			lexer->errorflag = 1;
@@ -1542,7 +1644,7 @@ static struct astnode *parse_expr_nested(
 		if(an->children[0]->kind == AN_VARIABLE) {
 			var = an->children[0];
 			if(!var->word->name[0]) {
-				var->word = fresh_word(lexer->program);
+				var->word = lex_fresh_word(lexer);
 			}
 			nested_rules[(*nnested)++] = an;
 			an = mkast(AN_VARIABLE, 0, arena, line);
@@ -1638,7 +1740,7 @@ static struct astnode *parse_expr_nested(
 			} while(look_ahead_for_slash(lexer));
 			*dest = mkast(AN_EMPTY_LIST, 0, arena, an->line);
 			var = mkast(AN_VARIABLE, 0, arena, list->line);
-			var->word = fresh_word(lexer->program);
+			var->word = lex_fresh_word(lexer);
 			an = mkast(AN_RULE, 2, arena, list->line);
 			an->subkind = RULE_MULTI;
 			an->predicate = find_builtin(lexer->program, BI_IS_ONE_OF);
@@ -1652,6 +1754,10 @@ static struct astnode *parse_expr_nested(
 	}
 }
 
+void parse_set_topic(struct word *w) {
+	starword = w;
+}
+
 int parse_file(struct lexer *lexer, int filenum, struct clause ***clause_dest_ptr) {
 	struct clause *clause;
 	struct predicate *pred;
@@ -1671,6 +1777,7 @@ int parse_file(struct lexer *lexer, int filenum, struct clause ***clause_dest_pt
 		if(lexer->kind == TOK_TAG) {
 			starword = lexer->word;
 			lexer->word->flags |= WORDF_TOPIC; // Was used as topic
+			if(lexer->image) libimage_topic(lexer->image, lexer->word);
 			status = next_token(lexer, PMODE_RULE);
 			if(lexer->errorflag) return 0;
 			if(status == 1) {
@@ -1694,6 +1801,7 @@ int parse_file(struct lexer *lexer, int filenum, struct clause ***clause_dest_pt
 			}
 			clause = parse_clause(1, lexer);
 			if(!clause) return 0;
+			if(lexer->image) libimage_clause(lexer->image, clause, 1);
 			if(!accesspred_valid_def(clause, lexer->program)) return 0;
 			pred = clause->predicate->pred;
 			pred->nmacrodef++;
@@ -1738,9 +1846,12 @@ int parse_file(struct lexer *lexer, int filenum, struct clause ***clause_dest_pt
 			}
 			**clause_dest_ptr = clause;
 			*clause_dest_ptr = &clause->next_in_source;
+			if(lexer->image) libimage_clause(lexer->image, clause, 0);
 		}
 	}
 
+	if(lexer->image) libimage_end(lexer->image, lexer->wordcount, line);
+
 	report(LVL_INFO, 0, "Word count for \"%s\": %d", sourcefile[filenum], lexer->wordcount);
 
 	if(lexer->lib_file != filenum) {
@@ -58,7 +58,9 @@ enum {
 
 struct lexer {
 	struct program		*program;
-	FILE			*file;
+	const uint8_t		*filepos;	// source file, read into memory
+	const uint8_t		*fileend;
+	struct libimage		*image;	// being recorded for the current file
 	const uint8_t		*string;
 	uint8_t			ungetbackslash;
 	uint8_t			ungetcbuf;
@@ -76,4 +78,6 @@ struct lexer {
 };
 
 int parse_file(struct lexer *lexer, int filenum, struct clause ***clause_dest_ptr);
+void parse_set_topic(struct word *w);
+struct astnode *make_closure(struct program *prg, struct astnode *body, line_t line, line_t orig_line, struct arena *arena);
 struct astnode *parse_injected_query(struct lexer *lexer, struct predicate *pred);
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+
+#if !defined(_WIN32) && !defined(POOL_NO_THREADS)
+#define POOL_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "arena.h"
+#include "pool.h"
+
+#define MAXTHREAD 64
+
+struct pool {
+	int			njob;
+	int			next;
+	void			(*worker)(struct pool *pool, void *arg);
+	void			*arg;
+#ifdef POOL_THREADS
+	long			arena_bytes;	// allocated by the spawned threads
+	pthread_mutex_t		mutex;
+#endif
+};
+
+int pool_next(struct pool *pool) {
+	int i;
+
+#ifdef POOL_THREADS
+	pthread_mutex_lock(&pool->mutex);
+	i = pool->next++;
+	pthread_mutex_unlock(&pool->mutex);
+#else
+	i = pool->next++;
+#endif
+	return (i < pool->njob)? i : -1;
+}
+
+#ifdef POOL_THREADS
+
+static void *pool_thread(void *arg) {
+	struct pool *pool = arg;
+
+	pool->worker(pool, pool->arg);
+	pthread_mutex_lock(&pool->mutex);
+	pool->arena_bytes += arena_bytes_allocated;
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+static int pool_nthread(int njob, int min_job_per_thread) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(n > njob / min_job_per_thread) n = njob / min_job_per_thread;
+	if(n > MAXTHREAD) n = MAXTHREAD;
+	return (n < 1)? 1 : n;
+}
+
+#endif
+
+// Returns the number of threads that took part.
+
+int pool_run(int njob, int min_job_per_thread, void (*worker)(struct pool *pool, void *arg), void *arg) {
+	struct pool pool = {njob, 0, worker, arg};
+#ifdef POOL_THREADS
+	int nthread = pool_nthread(njob, min_job_per_thread);
+	pthread_t threads[nthread];
+	int i;
+
+	pthread_mutex_init(&pool.mutex, 0);
+	for(i = 1; i < nthread; i++) {
+		if(pthread_create(&threads[i], 0, pool_thread, &pool)) {
+			nthread = i;
+			break;
+		}
+	}
+	worker(&pool, arg);
+	for(i = 1; i < nthread; i++) {
+		pthread_join(threads[i], 0);
+	}
+	pthread_mutex_destroy(&pool.mutex);
+	arena_bytes_allocated += pool.arena_bytes;
+
+	return nthread;
+#else
+	worker(&pool, arg);
+
+	return 1;
+#endif
+}
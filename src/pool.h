@@ -0,0 +1,10 @@
+// A work pool runs a batch of independent jobs on all available cores. The
+// calling thread does its share of the work. Each thread calls the worker
+// function once, and the worker claims job numbers with pool_next until it
+// returns -1. Builds without thread support run the worker on the calling
+// thread only.
+
+struct pool;
+
+int pool_run(int njob, int min_job_per_thread, void (*worker)(struct pool *pool, void *arg), void *arg);
+int pool_next(struct pool *pool);
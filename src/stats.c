@@ -0,0 +1,222 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "arena.h"
+#include "ast.h"
+#include "compile.h"
+#include "report.h"
+#include "stats.h"
+
+#define MAXPHASE 32
+
+struct stats_phase {
+	const char		*name;
+	double			seconds;
+	long			bytes;
+	int			nitem;
+};
+
+struct stats_pred {
+	struct predname		*predname;
+	int			ninstr;
+	int			nroutine;
+};
+
+int stats_flags;
+char *stats_json_fname;
+
+static struct stats_phase phases[MAXPHASE];
+static int nphase;
+static const char *current;
+static double current_start;
+static long current_bytes;
+
+static double now() {
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int stats_option(int opt, char *arg) {
+	switch(opt) {
+	case STATS_OPT_TIMINGS:
+		stats_flags |= STATSF_TIMINGS;
+		return 1;
+	case STATS_OPT_PREDICATES:
+		stats_flags |= STATSF_PREDICATES;
+		return 1;
+	case STATS_OPT_JSON:
+		stats_json_fname = strdup(arg);
+		return 1;
+	}
+
+	return 0;
+}
+
+void stats_usage() {
+	fprintf(stderr, "--timings               Report time, memory and item counts per compiler phase.\n");
+	fprintf(stderr, "--stats                 Report the number of instructions per predicate.\n");
+	fprintf(stderr, "--stats-json FILE       Also save these reports to FILE, in JSON format.\n");
+}
+
+void stats_reset() {
+	nphase = 0;
+	current = 0;
+}
+
+void stats_begin(const char *name) {
+	if(stats_flags || stats_json_fname) {
+		assert(!current);
+		current = name;
+		current_bytes = arena_bytes_allocated;
+		current_start = now();
+	}
+}
+
+void stats_end(int nitem) {
+	int i;
+
+	if(current) {
+		for(i = 0; i < nphase; i++) {
+			if(phases[i].name == current) break;
+		}
+		if(i == nphase) {
+			if(nphase == MAXPHASE) {
+				current = 0;
+				return;
+			}
+			memset(&phases[nphase++], 0, sizeof(struct stats_phase));
+			phases[i].name = current;
+		}
+		phases[i].seconds += now() - current_start;
+		phases[i].bytes += arena_bytes_allocated - current_bytes;
+		phases[i].nitem += nitem;
+		current = 0;
+	}
+}
+
+static int count_instructions(struct predicate *pred, int *nroutine) {
+	int i, n = 0;
+
+	for(i = 0; i < pred->nroutine; i++) {
+		n += pred->routines[i].ninstr;
+	}
+	*nroutine += pred->nroutine;
+
+	return n;
+}
+
+static int cmp_stats_pred(const void *a, const void *b) {
+	const struct stats_pred *aa = a, *bb = b;
+
+	if(aa->ninstr != bb->ninstr) {
+		return bb->ninstr - aa->ninstr;
+	}
+	return strcmp(aa->predname->printed_name, bb->predname->printed_name);
+}
+
+static void json_string(FILE *f, const char *str) {
+	fputc('"', f);
+	for(; *str; str++) {
+		if(*str == '"' || *str == '\\') {
+			fprintf(f, "\\%c", *str);
+		} else if((uint8_t) *str < 0x20) {
+			fprintf(f, "\\u%04x", (uint8_t) *str);
+		} else {
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static void save_json(struct stats_pred *preds, int npred) {
+	FILE *f;
+	int i;
+
+	f = fopen(stats_json_fname, "w");
+	if(!f) {
+		report(LVL_ERR, 0, "Failed to create \"%s\".", stats_json_fname);
+		return;
+	}
+
+	fprintf(f, "{\n\t\"phases\": [");
+	for(i = 0; i < nphase; i++) {
+		fprintf(f, "%s\n\t\t{\"name\": ", i? "," : "");
+		json_string(f, phases[i].name);
+		fprintf(f, ", \"ms\": %.3f, \"bytes\": %ld, \"items\": %d}",
+			phases[i].seconds * 1000,
+			phases[i].bytes,
+			phases[i].nitem);
+	}
+	fprintf(f, "\n\t],\n\t\"predicates\": [");
+	for(i = 0; i < npred; i++) {
+		fprintf(f, "%s\n\t\t{\"name\": ", i? "," : "");
+		json_string(f, preds[i].predname->printed_name);
+		fprintf(f, ", \"routines\": %d, \"instructions\": %d}",
+			preds[i].nroutine,
+			preds[i].ninstr);
+	}
+	fprintf(f, "\n\t]\n}\n");
+	fclose(f);
+}
+
+void stats_report(struct program *prg) {
+	struct stats_pred *preds;
+	int i, npred = 0, ninstr = 0, nroutine = 0;
+	double seconds = 0;
+	long bytes = 0;
+
+	if(stats_flags & STATSF_TIMINGS) {
+		fprintf(stderr, "%-28s %10s %12s %8s\n", "Phase", "ms", "Arena bytes", "Items");
+		for(i = 0; i < nphase; i++) {
+			fprintf(stderr, "%-28s %10.3f %12ld %8d\n",
+				phases[i].name,
+				phases[i].seconds * 1000,
+				phases[i].bytes,
+				phases[i].nitem);
+			seconds += phases[i].seconds;
+			bytes += phases[i].bytes;
+		}
+		fprintf(stderr, "%-28s %10.3f %12ld\n", "Total", seconds * 1000, bytes);
+	}
+
+	if(!(stats_flags & STATSF_PREDICATES) && !stats_json_fname) {
+		return;
+	}
+
+	preds = malloc(prg->npredicate * sizeof(struct stats_pred));
+	for(i = 0; i < prg->npredicate; i++) {
+		if(prg->predicates[i]->pred->nroutine) {
+			preds[npred].predname = prg->predicates[i];
+			preds[npred].nroutine = 0;
+			preds[npred].ninstr = count_instructions(prg->predicates[i]->pred, &preds[npred].nroutine);
+			ninstr += preds[npred].ninstr;
+			nroutine += preds[npred].nroutine;
+			npred++;
+		}
+	}
+	qsort(preds, npred, sizeof(struct stats_pred), cmp_stats_pred);
+
+	if(stats_flags & STATSF_PREDICATES) {
+		fprintf(stderr, "%8s %8s  %s\n", "Instrs", "Routines", "Predicate");
+		for(i = 0; i < npred; i++) {
+			fprintf(stderr, "%8d %8d  %s\n",
+				preds[i].ninstr,
+				preds[i].nroutine,
+				preds[i].predname->printed_name);
+		}
+		fprintf(stderr, "%8d %8d  Total (%d predicates)\n", ninstr, nroutine, npred);
+	}
+
+	if(stats_json_fname) {
+		save_json(preds, npred);
+	}
+
+	free(preds);
+}
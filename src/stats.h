@@ -0,0 +1,27 @@
+// Compiler instrumentation for --timings and --stats. Each phase of the
+// compiler is bracketed by stats_begin and stats_end, which record its wall
+// time, the number of bytes allocated from arenas, and a phase-specific item
+// count. The report is printed to stderr, and optionally saved as JSON.
+
+#define STATSF_TIMINGS		1
+#define STATSF_PREDICATES	2
+
+// getopt_long codes for the long-only options
+#define STATS_OPT_TIMINGS	0x100
+#define STATS_OPT_PREDICATES	0x101
+#define STATS_OPT_JSON		0x102
+
+#define STATS_LONGOPTS \
+	{"timings", 0, 0, STATS_OPT_TIMINGS}, \
+	{"stats", 0, 0, STATS_OPT_PREDICATES}, \
+	{"stats-json", 1, 0, STATS_OPT_JSON}
+
+extern int stats_flags;
+extern char *stats_json_fname;
+
+int stats_option(int opt, char *arg);
+void stats_usage(void);
+void stats_reset(void);
+void stats_begin(const char *name);
+void stats_end(int nitem);
+void stats_report(struct program *prg);